@@ -0,0 +1,109 @@
+#ifndef RESULT_RECORDER_HPP_
+#define RESULT_RECORDER_HPP_
+#include "shared_state.h"
+#include "globaltimer.hpp"
+#include "comm.hpp"
+#include "spsc_queue.hpp"
+#include <atomic>
+
+enum class ResultKind : uint8_t {
+	TimeLevelStats,  // stats of time level index
+	ReceiveLatency,  // ticks from CPU1 sending a packet of time level index to receiving it
+	T0Sample,        // ticks measured by T0DataProcess, index is the T0Metric
+	Trace            // stamps of a packet of time level index
+};
+
+struct ResultRecord {
+	ResultKind kind;
+	uint8_t index;
+	int64_t ticks;
+	union {
+		SharedState_TimeLevelStats stats;  // TimeLevelStats only
+		PacketTrace trace;                 // Trace only
+	};
+};
+
+/* Results of one measuring thread on their way to the aggregator thread.
+ *
+ * Adding a result only fills a preallocated slot of an SpscQueue, so the
+ * bookkeeping of StatsProcessing and T0DataProcess doesn't run between
+ * receiving a packet and sending the next command. If the aggregator falls
+ * behind the result is dropped and counted instead of blocking.
+ */
+class ResultRecorder {
+public:
+	/* 8192 records are ~0.4 s of the T0 thread at 20 kHz, ~1.4 MB with
+	 * 168 byte records
+	 */
+	static constexpr size_t CAPACITY = 8192;
+
+	void AddStats(Target target, const SharedState_TimeLevelStats& stats) {
+		if (ResultRecord* record = queue.BeginPush()) {
+			record->kind = ResultKind::TimeLevelStats;
+			record->index = (uint8_t)target;
+			record->stats = stats;
+			queue.EndPush();
+		}
+		else {
+			Overflow();
+		}
+	}
+
+	void AddReceiveLatency(Target target, global_timer::duration latency) {
+		Add(ResultKind::ReceiveLatency, (uint8_t)target, latency.count());
+	}
+
+	void AddT0Sample(uint8_t metric, int64_t ticks) {
+		Add(ResultKind::T0Sample, metric, ticks);
+	}
+
+	void AddTrace(Target target, const PacketTrace& trace) {
+		if (ResultRecord* record = queue.BeginPush()) {
+			record->kind = ResultKind::Trace;
+			record->index = (uint8_t)target;
+			record->trace = trace;
+			queue.EndPush();
+		}
+		else {
+			Overflow();
+		}
+	}
+
+	/* Aggregator: calls sink(const ResultRecord&) for the queued records,
+	 * returns how many there were
+	 */
+	template<typename Sink>
+	size_t Drain(Sink&& sink) {
+		size_t count = 0;
+		while (const ResultRecord* record = queue.Front()) {
+			sink(*record);
+			queue.Pop();
+			++count;
+		}
+		return count;
+	}
+
+	uint64_t Overflows() const { return overflows.load(std::memory_order_relaxed); }
+
+private:
+	void Add(ResultKind kind, uint8_t index, int64_t ticks) {
+		if (ResultRecord* record = queue.BeginPush()) {
+			record->kind = kind;
+			record->index = index;
+			record->ticks = ticks;
+			queue.EndPush();
+		}
+		else {
+			Overflow();
+		}
+	}
+
+	void Overflow() {
+		overflows.store(overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	SpscQueue<ResultRecord, CAPACITY> queue;
+	std::atomic<uint64_t> overflows{0};
+};
+
+#endif  // RESULT_RECORDER_HPP_
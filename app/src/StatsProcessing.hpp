@@ -2,36 +2,88 @@
 #define STATS_PROCESSING_HPP_
 #include "shared_state.h"
 #include "globaltimer.hpp"
+#include "latency_histogram.hpp"
+#include "result_file.hpp"
+#include "comm.hpp"
+#include <algorithm>
 #include <array>
-#include <vector>
 #include <fstream>
-#include <numeric>
 #include <iostream>
+#include <sstream>
 
+/* Statistics of one time level. Every metric goes to a LatencyHistogram, so
+ * the memory doesn't grow with the length of the run. The samples themselves
+ * are only kept for the last rawSampleWindow iterations and packets, 0 keeps
+ * none.
+ */
 class StatsProcessing {
 public:
-	StatsProcessing(size_t reserve = 0) {
-		if (reserve > 0) {
-			iterationNumbers.reserve(reserve);
-			timeLevelDurations.reserve(reserve);
-			timeLevelStartTimes.reserve(reserve);
-			sentPacketLatencies.reserve(reserve);
-			sendTimes.reserve(reserve);
-			receivePacketLatencies.reserve(reserve);
-		}
+	StatsProcessing(size_t rawSampleWindow = 0) {
+		SetRawSampleWindow(rawSampleWindow);
+	}
+	
+	/* Drops the raw samples kept so far */
+	void SetRawSampleWindow(size_t rawSampleWindow) {
+		iterations.Resize(rawSampleWindow);
+		sentPacketLatencies.Resize(rawSampleWindow);
+		receivePacketLatencies.Resize(rawSampleWindow);
 	}
 	
 	void Add(const SharedState_TimeLevelStats& stats);
 	void AddReceivePacketLatency(global_timer::duration dur);
+	/* Splits the path of a received packet into the steps between its stamps */
+	void AddTrace(const PacketTrace& trace);
 	
+	/* Histogram summaries */
 	void WriteCSV(const std::string& fileName);
+	/* The raw samples as a result_file.hpp file, none unless rawSampleWindow > 0 */
+	void WriteSamples(const std::string& fileName);
 private:
-	std::vector<uint32_t> iterationNumbers;
-	std::vector<global_timer::time_point> timeLevelStartTimes;
-	std::vector<uint32_t> timeLevelDurations;
-	std::vector<uint32_t> sentPacketLatencies;
-	std::vector<uint32_t> sendTimes;
-	std::vector<global_timer::duration> receivePacketLatencies;
+	/* Mean period of the time level, the rate the samples are expected at */
+	global_timer::duration Period() const;
+	
+	/* Records to ticks from stamp from to stamp to if the trace has both */
+	static void RecordStep(LatencyHistogram& histogram, const PacketTrace& trace,
+	                       PacketTrace::Stamp from, uint32_t fromTicks, PacketTrace::Stamp to, uint32_t toTicks);
+	
+
+	struct Iteration {
+		uint32_t number;
+		global_timer::time_point startTime;
+		uint32_t duration;
+	};
+	
+	LatencyHistogram durationHistogram;
+	LatencyHistogram startIntervalHistogram;
+	LatencyHistogram sentPacketLatencyHistogram;
+	LatencyHistogram sendTimeHistogram;
+	LatencyHistogram receivePacketLatencyHistogram;
+	
+	/* Steps of the traced packets: in the ring before the doorbell, doorbell
+	 * to interrupt, interrupt to the reader running, copy, and the ring
+	 * before the reader whether or not it waited for an interrupt
+	 */
+	LatencyHistogram traceCommitToSgiHistogram;
+	LatencyHistogram traceSgiToIrqHistogram;
+	LatencyHistogram traceIrqToDequeueHistogram;
+	LatencyHistogram traceCopyHistogram;
+	LatencyHistogram traceCommitToDequeueHistogram;
+	uint64_t tracedPackets = 0;
+	
+	SampleWindow<Iteration> iterations;
+	SampleWindow<uint32_t> sentPacketLatencies;
+	SampleWindow<global_timer::duration> receivePacketLatencies;
+	
+	/* For the expected start times and the mean period */
+	uint32_t firstIterationNumber = 0;
+	uint32_t lastIterationNumber = 0;
+	global_timer::time_point firstStartTime;
+	global_timer::time_point lastStartTime;
+	uint64_t iterationCount = 0;
+	
+	/* Running sums of the send times, in ns */
+	double sendTimeSumNs = 0.0;
+	double sendTimeSquareSumNs = 0.0;
 	
 	int64_t iterationNumber = -1;
 	uint32_t totalDroppedPackets = 0;
@@ -58,91 +110,158 @@ void StatsProcessing::Add(const SharedState_TimeLevelStats &stats)
 			}
 			prevStartTimeLow = startTimeLow;
 			
-			iterationNumbers.push_back(stats.iterationNumber - i);
-			timeLevelStartTimes.push_back(global_timer::time_point(global_timer::duration(((uint64_t)startTimeHigh << 32u) + startTimeLow)));
-			timeLevelDurations.push_back(stats.timeLevelDurations[i]);
+			Iteration iteration;
+			iteration.number = stats.iterationNumber - i;
+			iteration.startTime = global_timer::time_point(global_timer::duration(((uint64_t)startTimeHigh << 32u) + startTimeLow));
+			iteration.duration = stats.timeLevelDurations[i];
+			
+			if (iterationCount == 0) {
+				firstIterationNumber = iteration.number;
+				firstStartTime = iteration.startTime;
+			}
+			else {
+				/* Spans the missed iterations too, so a stall shows as a long interval */
+				startIntervalHistogram.Record((iteration.startTime - lastStartTime).count());
+			}
+			lastIterationNumber = iteration.number;
+			lastStartTime = iteration.startTime;
+			++iterationCount;
+			
+			durationHistogram.Record(iteration.duration);
+			iterations.Push(iteration);
 		}
 		
 		if (lastCommandPacketId != stats.commandPacketId) {
 			lastCommandPacketId = stats.commandPacketId;
-			sentPacketLatencies.push_back(stats.commandPacketLatency);
+			sentPacketLatencyHistogram.Record(stats.commandPacketLatency);
+			sentPacketLatencies.Push(stats.commandPacketLatency);
 		}
 		
 		iterationNumber = stats.iterationNumber;
 		totalDroppedPackets = stats.totalDroppedPackets;
 		
-		sendTimes.push_back(stats.lastPacketSendTime);
+		double sendTimeNs = std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(
+		            global_timer::duration(stats.lastPacketSendTime)).count();
+		sendTimeSumNs += sendTimeNs;
+		sendTimeSquareSumNs += sendTimeNs * sendTimeNs;
+		sendTimeHistogram.Record(stats.lastPacketSendTime);
 	}
 }
 
 void StatsProcessing::AddReceivePacketLatency(global_timer::duration dur)
 {
-	receivePacketLatencies.push_back(dur);
+	receivePacketLatencyHistogram.Record(dur.count() > 0 ? dur.count() : 0);
+	receivePacketLatencies.Push(dur);
+}
+
+void StatsProcessing::AddTrace(const PacketTrace& trace)
+{
+	++tracedPackets;
+	RecordStep(traceCommitToSgiHistogram, trace, PacketTrace::Commit, trace.commit, PacketTrace::Sgi, trace.sgi);
+	RecordStep(traceSgiToIrqHistogram, trace, PacketTrace::Sgi, trace.sgi, PacketTrace::Irq, trace.irq);
+	RecordStep(traceIrqToDequeueHistogram, trace, PacketTrace::Irq, trace.irq, PacketTrace::Dequeue, trace.dequeue);
+	RecordStep(traceCopyHistogram, trace, PacketTrace::Dequeue, trace.dequeue, PacketTrace::Copy, trace.copy);
+	RecordStep(traceCommitToDequeueHistogram, trace, PacketTrace::Commit, trace.commit, PacketTrace::Dequeue, trace.dequeue);
+}
+
+void StatsProcessing::RecordStep(LatencyHistogram& histogram, const PacketTrace& trace,
+                                 PacketTrace::Stamp from, uint32_t fromTicks, PacketTrace::Stamp to, uint32_t toTicks)
+{
+	if (!trace.Has(from | to)) {
+		return;
+	}
+	
+	/* Stamps are the low 32 bits of the timer, the difference survives the wrap */
+	int32_t ticks = (int32_t)(toTicks - fromTicks);
+	histogram.Record(ticks > 0 ? ticks : 0);
 }
 
 void StatsProcessing::WriteCSV(const std::string &fileName)
 {
-	std::ofstream out(fileName);
+	/* Built in memory so the lines can be counted from what is written */
+	std::ostringstream out;
     std::cout << "Writing CSV " << fileName << std::endl;
 	
-	global_timer::duration avgSendTime = std::accumulate(
-	            sendTimes.begin(),
-	            sendTimes.end(),
-	            global_timer::duration(0),
-	            [&](global_timer::duration sum, uint32_t dur) {
-	        return sum + global_timer::duration(dur);
-	}) / sendTimes.size();
-	
-	uint32_t sendTimeVarianceNs = std::accumulate(sendTimes.begin(), sendTimes.end(),
-	                int64_t(0),
-	                [&](int64_t sum, uint32_t dur){
-	        
-        int64_t diff = std::chrono::duration_cast<std::chrono::nanoseconds>(global_timer::duration(dur) - avgSendTime).count();
-        return sum + diff * diff;
-    }) / sendTimes.size();
-	
-	global_timer::duration recordDuration = timeLevelStartTimes.back() - timeLevelStartTimes.front();
-	
-	auto expectedStartTime = [&](uint32_t iteration) {
-		return global_timer::time_point(recordDuration * iteration / iterationNumbers.back());
-	};
+	const double nsPerTick = 1e9 * global_timer::period::num / global_timer::period::den;
+	
+	uint64_t sendCount = sendTimeHistogram.Count();
+	double avgSendTimeNs = sendCount > 0 ? sendTimeSumNs / sendCount : 0.0;
+	double sendTimeVarianceNs = sendCount > 0 ? sendTimeSquareSumNs / sendCount - avgSendTimeNs * avgSendTimeNs : 0.0;
+	
+	global_timer::duration period = Period();
 	
-	out << "send_time_avg_ns\t" << std::chrono::duration_cast<std::chrono::nanoseconds>(avgSendTime).count() << '\n';
-	out << "send_time_variance_ns\t" << sendTimeVarianceNs << '\n';
+	out << "send_time_avg_ns\t" << (int64_t)avgSendTimeNs << '\n';
+	out << "send_time_variance_ns\t" << (uint32_t)sendTimeVarianceNs << '\n';
 	out << "dropped_packets\t" << totalDroppedPackets << '\n';
 	out << "missed_stats\t" << totalMissedStats << '\n';
+	out << "iterations\t" << iterationCount << '\n';
+	out << "period_ns\t" << std::chrono::duration_cast<std::chrono::nanoseconds>(period).count() << '\n';
+	out << "traced_packets\t" << tracedPackets << '\n';
+	
+	/* The corrected views add the samples a stall of the time level hid */
+	LatencyHistogram durationCorrected, receivePacketLatencyCorrected;
+	durationCorrected.AddCorrected(durationHistogram, period.count());
+	receivePacketLatencyCorrected.AddCorrected(receivePacketLatencyHistogram, period.count());
+	
+	out << '\n';
+	WriteHistogramSummaryHeader(out);
+	WriteHistogramSummary(out, "duration", durationHistogram, nsPerTick);
+	WriteHistogramSummary(out, "duration_corrected", durationCorrected, nsPerTick);
+	WriteHistogramSummary(out, "start_interval", startIntervalHistogram, nsPerTick);
+	WriteHistogramSummary(out, "send_time", sendTimeHistogram, nsPerTick);
+	WriteHistogramSummary(out, "send_latency", sentPacketLatencyHistogram, nsPerTick);
+	WriteHistogramSummary(out, "receive_latency", receivePacketLatencyHistogram, nsPerTick);
+	WriteHistogramSummary(out, "receive_latency_corrected", receivePacketLatencyCorrected, nsPerTick);
 	
-	out << "\niteration\tstart_time(ns)\texpected_start_time(ns)\tstart_time_expectation_offset(ns)\tduration(ns)\n";
-	
-	for (size_t i = 0; i < iterationNumbers.size(); ++i) {
-		auto startTimeNs= std::chrono::duration_cast<std::chrono::nanoseconds>(timeLevelStartTimes[i] - timeLevelStartTimes.front());
-		auto expectedStartTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(expectedStartTime(iterationNumbers[i]).time_since_epoch());
-		out << iterationNumbers[i] << '\t'
-		    << startTimeNs.count() << '\t'
-		    << expectedStartTimeNs.count() << '\t'
-		    << (startTimeNs - expectedStartTimeNs).count() << '\t'
-		    << std::chrono::duration_cast<std::chrono::nanoseconds>(global_timer::duration(timeLevelDurations[i])).count()
-		    << '\n';
+	if (tracedPackets > 0) {
+		WriteHistogramSummary(out, "trace_commit_to_sgi", traceCommitToSgiHistogram, nsPerTick);
+		WriteHistogramSummary(out, "trace_sgi_to_irq", traceSgiToIrqHistogram, nsPerTick);
+		WriteHistogramSummary(out, "trace_irq_to_dequeue", traceIrqToDequeueHistogram, nsPerTick);
+		WriteHistogramSummary(out, "trace_copy", traceCopyHistogram, nsPerTick);
+		WriteHistogramSummary(out, "trace_commit_to_dequeue", traceCommitToDequeueHistogram, nsPerTick);
 	}
 	
+	const std::string text = out.str();
+	std::ofstream(fileName) << text;
+	std::cout << "Written " << std::count(text.begin(), text.end(), '\n') << " lines" << std::endl;
+}
+
+void StatsProcessing::WriteSamples(const std::string &fileName)
+{
+	std::cout << "Writing samples " << fileName << std::endl;
 	
-	out << "\n\n\n";
-	out << "send_latencies(ns)\treceive_latencies(ns)\n";
+	global_timer::duration period = Period();
+	ResultFileWriter writer(global_timer::period::num, global_timer::period::den);
 	
-	size_t latencyCountMax = std::max(receivePacketLatencies.size(), sentPacketLatencies.size());
+	writer.AddU32("iteration", ResultUnit::Count, iterations.Size(), [&](size_t i) {
+		return iterations[i].number;
+	});
+	writer.AddI64("start_time", ResultUnit::Ticks, iterations.Size(), [&](size_t i) {
+		return (iterations[i].startTime - firstStartTime).count();
+	});
+	writer.AddI64("expected_start_time", ResultUnit::Ticks, iterations.Size(), [&](size_t i) {
+		return (period * (iterations[i].number - firstIterationNumber)).count();
+	});
+	writer.AddI64("start_time_expectation_offset", ResultUnit::Ticks, iterations.Size(), [&](size_t i) {
+		return (iterations[i].startTime - firstStartTime - period * (iterations[i].number - firstIterationNumber)).count();
+	});
+	writer.AddU32("duration", ResultUnit::Ticks, iterations.Size(), [&](size_t i) {
+		return iterations[i].duration;
+	});
+	writer.AddU32("send_latencies", ResultUnit::Ticks, sentPacketLatencies.Size(), [&](size_t i) {
+		return sentPacketLatencies[i];
+	});
+	writer.AddI64("receive_latencies", ResultUnit::Ticks, receivePacketLatencies.Size(), [&](size_t i) {
+		return receivePacketLatencies[i].count();
+	});
 	
-	for (size_t i = 0; i < latencyCountMax; ++i) {
-		if (i < receivePacketLatencies.size()) {
-			out << std::chrono::duration_cast<std::chrono::nanoseconds>(receivePacketLatencies[i]).count();
-		}
-		out << '\t';
-		if (i < sentPacketLatencies.size()) {
-			out << std::chrono::duration_cast<std::chrono::nanoseconds>(global_timer::duration(sentPacketLatencies[i])).count();
-		}
-		out << '\n';
-	}
-    
-    std::cout << "Written " << (6 + iterationNumbers.size() + 4 + latencyCountMax) << " lines" << std::endl;
+	writer.Write(fileName);
+}
+
+global_timer::duration StatsProcessing::Period() const
+{
+	uint32_t iterationSpan = lastIterationNumber - firstIterationNumber;
+	return iterationSpan > 0 ? (lastStartTime - firstStartTime) / iterationSpan : global_timer::duration(0);
 }
 
 
@@ -1,29 +1,80 @@
-#include "comm.hpp"
-#include "openamp.hpp"
+#include "comm_backends.hpp"
 #include "globaltimer.hpp"
+#include "event_loop.hpp"
 #include "shared_state.h"
 #include <iostream>
 #include <thread>
 #include "StatsProcessing.hpp"
 #include "t0dataprocess.hpp"
+#include "ResultRecorder.hpp"
 #include <atomic>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
 
 #define ITERATION_LIMIT (20000 * 10)  // ~10s
 
-static void Test(CommInterface& comm);
-static void TestShm(CommInterface& comm);
+template<typename Comm> static int Run(Comm& comm);
+template<typename Comm> static void Test(Comm& comm);
+template<typename Comm> static void TestShm(Comm& comm);
 
-static StatsProcessing t0Stats{ITERATION_LIMIT * 11 / 10}, t1Stats{ITERATION_LIMIT / 3}, t2Stats{ITERATION_LIMIT / 18};
+static StatsProcessing t0Stats, t1Stats, t2Stats;
+
+/* T0 cycles to run, DIPPA_ITERATIONS overrides ITERATION_LIMIT for soak runs */
+static uint64_t f_iterationLimit = ITERATION_LIMIT;
+/* Samples of each metric written to .bin files next to the histogram CSV
+ * files, DIPPA_RAW_SAMPLES. None by default so the memory doesn't grow with
+ * the run.
+ */
+static size_t f_rawSampleWindow = 0;
+/* Packets are received with TryReceiveTraced and ReceiveT0Traced and the
+ * steps of their paths added to the statistics, DIPPA_TRACE. T1 and T2 only
+ * with EventLoop, T0 not in the shm modes; the CPU1 stamps need the trace
+ * property on the tunnels.
+ */
+static bool f_trace = false;
 
 static std::atomic_bool f_running{true};
+/* Set by the main thread when it stops receiving */
+static std::atomic_bool f_receiveFinished{false};
+
+template<typename Comm> static void T0Thread(Comm& comm, T0DataProcess<Comm>& t0DataProcess);
+template<typename Comm> static void T0ThreadShm(Comm& comm, T0DataProcess<Comm>& t0DataProcess);
+template<typename Comm> static void Aggregate(T0DataProcess<Comm>& t0DataProcess);
 
-static void T0Thread(CommInterface& comm);
-static void T0ThreadShm(CommInterface& comm);
+/* Results of the T0 thread and of the main thread (T1, T2 and T0 of the
+ * shm modes), folded into the statistics by the aggregator thread. Static
+ * so that the queues aren't on a stack and stay cache line aligned.
+ */
+static ResultRecorder f_t0Results, f_mainResults;
+static std::atomic_bool f_aggregating{true};
+
+/* The aggregator only has to keep up on average. It runs at the lowest
+ * priority, and sleeps this long when the queues are empty.
+ */
+static constexpr int AGGREGATOR_NICE = 10;
+static constexpr std::chrono::milliseconds AGGREGATOR_SLEEP(1);
 
 static bool f_useShm = false;
+static bool f_useSnapshot = false;
+static ShmWait f_shmWait = ShmWait::Busy;
+static std::string f_shmWaitName = "busy";
 static std::string f_nameSuffix;
 
+/* Spinning of the hybrid wait, a bit less than half of the T0 cycle */
+static constexpr std::chrono::microseconds HYBRID_SPIN_TIME(20);
+
+/* Receiving with select() and ReceiveAny/ReceiveT1OrT2 instead of EventLoop,
+ * to compare the two
+ */
+static bool f_useSelect = false;
+
+/* Packets read from one channel before the other ready channels get a turn */
+static constexpr int RECEIVE_BATCH = 8;
+/* EventLoop wakes up this often to see that the T0 thread has finished */
+static constexpr int EVENT_LOOP_TIMEOUT_MS = 100;
+
 static bool f_withWorkload = false;
 
 static void Workload() {
@@ -51,11 +102,32 @@ static void Workload() {
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3) {
-        std::cerr << "Expecting 2 parameters";
+    if (argc < 3 || argc > 5) {
+        std::cerr << "Expecting 2 to 4 parameters: <interface> <mode> [busy|hybrid|block] [epoll|select]" << std::endl;
+        std::cerr << "hybrid and block sleep until CPU1 notifies, with the shm interface they poll its doorbell every 20 us" << std::endl;
+        std::cerr << "Environment: DIPPA_ITERATIONS=<T0 cycles> DIPPA_RAW_SAMPLES=<samples kept for the .bin files> DIPPA_TRACE=1" << std::endl;
         return 1;
     }
     
+    if (const char* iterations = getenv("DIPPA_ITERATIONS")) {
+        f_iterationLimit = strtoull(iterations, nullptr, 10);
+        std::cerr << "Running " << f_iterationLimit << " T0 cycles" << std::endl;
+    }
+    
+    if (const char* rawSamples = getenv("DIPPA_RAW_SAMPLES")) {
+        f_rawSampleWindow = strtoull(rawSamples, nullptr, 10);
+        std::cerr << "Keeping the last " << f_rawSampleWindow << " raw samples" << std::endl;
+    }
+    
+    if (const char* trace = getenv("DIPPA_TRACE")) {
+        f_trace = strcmp(trace, "0") != 0;
+    }
+    
+    /* T1 runs every 4th and T2 every 20th T0 cycle */
+    t0Stats.SetRawSampleWindow(f_rawSampleWindow);
+    t1Stats.SetRawSampleWindow(f_rawSampleWindow / 4);
+    t2Stats.SetRawSampleWindow(f_rawSampleWindow / 20);
+    
 #ifdef IPC_TUNNEL_CACHED
     f_nameSuffix += "-cached";
 #endif
@@ -66,49 +138,168 @@ int main(int argc, char *argv[])
         std::cerr << "Transferring T0 variable data using shared memory" << std::endl;
     }
     
-    if (strcmp(argv[2], "shm_w") == 0 || strcmp(argv[2], "w") == 0) {
+    if (strcmp(argv[2], "snap") == 0 || strcmp(argv[2], "snap_w") == 0) {
+        f_useShm = true;
+        f_useSnapshot = true;
+        f_nameSuffix += "-snapshot";
+        std::cerr << "Transferring T0 variable data using the shared memory snapshot channel" << std::endl;
+    }
+    
+    if (strcmp(argv[2], "shm_w") == 0 || strcmp(argv[2], "snap_w") == 0 || strcmp(argv[2], "w") == 0) {
         f_withWorkload = true;
         f_nameSuffix += "-work";
         std::cerr << "Running workload between T0 cycles" << std::endl;
     }
     
-    auto comm = CreateFromArgs(argc, argv);
-    if (!comm) {
+    const char* waitName = argc >= 4 ? argv[3] : "busy";
+    f_shmWaitName = waitName;
+    if (strcmp(waitName, "hybrid") == 0) {
+        f_shmWait = ShmWait::Hybrid;
+        f_nameSuffix += "-hybrid";
+    }
+    else if (strcmp(waitName, "block") == 0) {
+        f_shmWait = ShmWait::Block;
+        f_nameSuffix += "-block";
+    }
+    else if (strcmp(waitName, "busy") != 0) {
+        std::cerr << "Unknown wait strategy " << waitName << std::endl;
+        return 1;
+    }
+    
+    if (f_shmWait != ShmWait::Busy) {
+        if (!f_useSnapshot) {
+            std::cerr << "Only the snapshot channel can notify, use snap or snap_w with " << waitName << std::endl;
+            return 1;
+        }
+        std::cerr << "Waiting for T0 variable data with the " << waitName << " strategy" << std::endl;
+    }
+    
+    const char* loopName = argc == 5 ? argv[4] : "epoll";
+    if (strcmp(loopName, "select") == 0) {
+        f_useSelect = true;
+        f_nameSuffix += "-select";
+        std::cerr << "Receiving with select() instead of EventLoop" << std::endl;
+    }
+    else if (strcmp(loopName, "epoll") != 0) {
+        std::cerr << "Unknown receive loop " << loopName << std::endl;
         return 1;
     }
     
-    comm->Initialize(!f_useShm);
+    if (f_trace) {
+        f_nameSuffix += "-trace";
+        std::cerr << "Tracing the received packets" << (f_useSelect ? ", not T1 and T2 with select()" : "")
+                  << (f_useShm ? ", not T0 from shared memory" : "") << std::endl;
+    }
+    
+    return WithCommFromArgs(argc, argv, [&](auto& comm) {
+        return Run(comm);
+    });
+}
+
+/* Instantiated once per backend so the hot loops call it directly */
+template<typename Comm>
+static int Run(Comm& comm)
+{
+    comm.Initialize(!f_useShm);
     
     if (f_useShm) {
-        if (!comm->MapT0SharedMemory()) {
+        if (f_useSnapshot ? !comm.MapT0Snapshot() : !comm.MapT0SharedMemory()) {
             std::cerr << "Requested to use shared memory but it can't be mmapped" << std::endl;
             return 1;
         }
-        
+    }
+    
+    T0DataProcess<Comm> t0DataProcess(comm, f_rawSampleWindow, f_useSnapshot);
+    t0DataProcess.SetRecorder(&f_t0Results);
+    std::thread aggregator([&](){
+        Aggregate(t0DataProcess);
+    });
+    
+    if (f_useShm) {
+        t0DataProcess.SetWaitStrategyName(f_shmWaitName);
         std::thread t0Thread([&](){
-            T0ThreadShm(*comm);
+            T0ThreadShm(comm, t0DataProcess);
         });
         
-        TestShm(*comm);
+        TestShm(comm);
         t0Thread.join();
     }
     else {
         std::thread t0Thread([&](){
-            T0Thread(*comm);
+            T0Thread(comm, t0DataProcess);
         });
         
-        Test(*comm);
+        Test(comm);
         t0Thread.join();
     }
-
-    t0Stats.WriteCSV("benchmark-main-" + comm->GetInterfaceName() + f_nameSuffix + "-t0.csv");
-    t1Stats.WriteCSV("benchmark-main-" + comm->GetInterfaceName() + f_nameSuffix + "-t1.csv");
-    t2Stats.WriteCSV("benchmark-main-" + comm->GetInterfaceName() + f_nameSuffix + "-t2.csv");
+    
+    f_aggregating = false;
+    aggregator.join();
+    
+    uint64_t overflows = f_t0Results.Overflows() + f_mainResults.Overflows();
+    if (overflows > 0) {
+        std::cerr << "Aggregator fell behind, dropped " << f_t0Results.Overflows() << " results of the T0 thread and "
+                  << f_mainResults.Overflows() << " of the main thread" << std::endl;
+    }
+    
+    std::cerr << "Writing results" << std::endl;
+    t0DataProcess.SetDroppedResults(overflows);
+    std::string fileName = "benchmark-main-" + comm.GetInterfaceName() + f_nameSuffix;
+    t0DataProcess.WriteCSV(fileName + "-variable-update.csv");
+    t0Stats.WriteCSV(fileName + "-t0.csv");
+    t1Stats.WriteCSV(fileName + "-t1.csv");
+    t2Stats.WriteCSV(fileName + "-t2.csv");
+    
+    /* Convert with resultconv */
+    if (f_rawSampleWindow > 0) {
+        t0DataProcess.WriteSamples(fileName + "-variable-update.bin");
+        t0Stats.WriteSamples(fileName + "-t0.bin");
+        t1Stats.WriteSamples(fileName + "-t1.bin");
+        t2Stats.WriteSamples(fileName + "-t2.bin");
+    }
     return 0;
 }
 
-static void T0Thread(CommInterface& comm) {
-    T0DataProcess t0DataProcess(comm, ITERATION_LIMIT * 10ull / 9);
+/* Folds the results of the recorders into the statistics until
+ * f_aggregating is cleared, then drains what is left
+ */
+template<typename Comm>
+static void Aggregate(T0DataProcess<Comm>& t0DataProcess)
+{
+    /* 0 is the calling thread on Linux */
+    setpriority(PRIO_PROCESS, 0, AGGREGATOR_NICE);
+    
+    StatsProcessing* stats[] = {&t0Stats, &t1Stats, &t2Stats};
+    auto fold = [&](const ResultRecord& record) {
+        switch (record.kind) {
+        case ResultKind::TimeLevelStats:
+            stats[record.index]->Add(record.stats);
+            break;
+        case ResultKind::ReceiveLatency:
+            stats[record.index]->AddReceivePacketLatency(global_timer::duration(record.ticks));
+            break;
+        case ResultKind::T0Sample:
+            t0DataProcess.AddSample((T0Metric)record.index, record.ticks);
+            break;
+        case ResultKind::Trace:
+            stats[record.index]->AddTrace(record.trace);
+            break;
+        }
+    };
+    
+    bool aggregating = true;
+    while (aggregating) {
+        /* Read before draining, so the last round sees all the results */
+        aggregating = f_aggregating;
+        size_t count = f_t0Results.Drain(fold) + f_mainResults.Drain(fold);
+        if (count == 0 && aggregating) {
+            std::this_thread::sleep_for(AGGREGATOR_SLEEP);
+        }
+    }
+}
+
+template<typename Comm>
+static void T0Thread(Comm& comm, T0DataProcess<Comm>& t0DataProcess) {
     uint8_t buf[0x1500];
     
     // Send start packet so the actual scheduling starts.
@@ -116,15 +307,24 @@ static void T0Thread(CommInterface& comm) {
     // Linux side starts
     while (!comm.Send(Target::T0, buf, 1)) {}
     
-    for (int i = 0; i < ITERATION_LIMIT; ++i) {
-        size_t receivedBytes = comm.ReceiveT0(buf, sizeof(buf));
+    for (uint64_t i = 0; i < f_iterationLimit; ++i) {
+        PacketTrace trace;
+        if (f_trace) {
+            comm.ReceiveT0Traced(buf, sizeof(buf), trace);
+        }
+        else {
+            comm.ReceiveT0(buf, sizeof(buf));
+        }
         auto receiveTime = global_timer::now();
 
         const SharedState_T0DataPacket* packet = reinterpret_cast<const SharedState_T0DataPacket*>(buf);
         auto sendTime = global_timer::time_point(global_timer::duration(packet->timestamp));
         t0DataProcess.HandleNewVariableData(packet->variables);
-        t0Stats.AddReceivePacketLatency(receiveTime - sendTime);
-        t0Stats.Add(packet->stats);
+        f_t0Results.AddReceiveLatency(Target::T0, receiveTime - sendTime);
+        f_t0Results.AddStats(Target::T0, packet->stats);
+        if (f_trace) {
+            f_t0Results.AddTrace(Target::T0, trace);
+        }
         
         auto workStart = global_timer::now();
         if (f_withWorkload) Workload();
@@ -133,28 +333,30 @@ static void T0Thread(CommInterface& comm) {
         t0DataProcess.AddWorkDuration(workEnd - workStart);
     }
     
+    t0DataProcess.SaveThreadCpuTime();
     f_running = false;
-    std::cerr << "T0 thread finished. Writing results" << std::endl;
-    t0DataProcess.WriteCSV("benchmark-main-" + comm.GetInterfaceName() + f_nameSuffix + "-variable-update.csv");
+    std::cerr << "T0 thread finished" << std::endl;
 
+    /* CPU1 stops sending on the shutdown command, so the main thread has
+     * to see f_running first or it waits for a packet forever
+     */
+    while (!f_receiveFinished) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
     t0DataProcess.SendShutdownCommand();
 }
 
-static void T0ThreadShm(CommInterface& comm) {
-    T0DataProcess t0DataProcess(comm, ITERATION_LIMIT * 10ull / 9);
-    
-    
+template<typename Comm>
+static void T0ThreadShm(Comm& comm, T0DataProcess<Comm>& t0DataProcess) {
     uint8_t dummyPacket;
     // Send start packet so the actual scheduling starts.
     // This is to avoid baremetal side filling ring buffers and dropping packets before
     // Linux side starts
     while (!comm.Send(Target::T0, &dummyPacket, 1)) {}
 
-    for (int i = 0; i < ITERATION_LIMIT; ++i) {
+    for (uint64_t i = 0; i < f_iterationLimit; ++i) {
         
-        while (!t0DataProcess.UpdateVariablesFromShm()) {
-            // Polling shared memory
-        }
+        t0DataProcess.WaitVariablesFromShm(f_shmWait, HYBRID_SPIN_TIME);
         auto workStart = global_timer::now();
 
         if (f_withWorkload) Workload();
@@ -164,14 +366,64 @@ static void T0ThreadShm(CommInterface& comm) {
         t0DataProcess.AddWorkDuration(workEnd - workStart);
     }
     
+    t0DataProcess.SaveThreadCpuTime();
     f_running = false;
-    std::cerr << "T0 thread finished. Writing results" << std::endl;
-    t0DataProcess.WriteCSV("benchmark-main-" + comm.GetInterfaceName() + f_nameSuffix + "-variable-update.csv");
+    std::cerr << "T0 thread finished" << std::endl;
 
+    /* CPU1 stops sending on the shutdown command, so the main thread has
+     * to see f_running first or it waits for a packet forever
+     */
+    while (!f_receiveFinished) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
     t0DataProcess.SendShutdownCommand();
 }
 
-static void Test(CommInterface& comm)
+/* Registers channels first..T2 with the channel number as the priority, so
+ * T0 goes first. Returns false if the interface can't wait for all of them
+ * with an EventLoop.
+ */
+template<typename Comm>
+static bool OpenEventLoop(Comm& comm, EventLoop& loop, Target first)
+{
+    if (f_useSelect || !loop.Open()) {
+        return false;
+    }
+    
+    for (int i = (int)first; i < 3; ++i) {
+        if (!loop.Add(comm.GetReceiveFd((Target)i), i, i)) {
+            std::cerr << comm.GetInterfaceName() << " has no receive descriptors for EventLoop, using ReceiveAny" << std::endl;
+            loop.Close();
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+/* Drains the ready channels, RECEIVE_BATCH packets at a time */
+template<typename Comm, typename Handler>
+static void ReceiveReady(Comm& comm, EventLoop& loop, uint8_t* buf, size_t size, Handler& handlePacket)
+{
+    loop.RunOnce(EVENT_LOOP_TIMEOUT_MS, [&](int id) {
+        Target t = (Target)id;
+        for (int n = 0; n < RECEIVE_BATCH; ++n) {
+            PacketTrace trace;
+            size_t received = f_trace ? comm.TryReceiveTraced(t, buf, size, trace) : comm.TryReceive(t, buf, size);
+            if (received == 0) {
+                return true;
+            }
+            handlePacket(t, buf, received);
+            if (f_trace) {
+                f_mainResults.AddTrace(t, trace);
+            }
+        }
+        return false;
+    });
+}
+
+template<typename Comm>
+static void Test(Comm& comm)
 {
     uint8_t buf[0x1500];
     
@@ -180,28 +432,36 @@ static void Test(CommInterface& comm)
     uint32_t t1PacketId = 0;
     uint32_t t2PacketId = 0;
     
+    EventLoop loop;
+    bool useLoop = OpenEventLoop(comm, loop, Target::T1);
+    
+    auto handlePacket = [&](Target t, const uint8_t* buf, size_t) {
+        auto receiveTime = global_timer::now();
+        if (t == Target::T1) {
+            auto packet = reinterpret_cast<const SharedState_T1DataPacket*>(buf);
+            f_mainResults.AddStats(Target::T1, packet->stats);
+            
+            auto sendTime = global_timer::time_point(global_timer::duration(packet->timestamp));
+            f_mainResults.AddReceiveLatency(Target::T1, receiveTime - sendTime);
+            t1Received = true;
+        }
+        else if (t == Target::T2) {
+            auto packet = reinterpret_cast<const SharedState_T2DataPacket*>(buf);
+            f_mainResults.AddStats(Target::T2, packet->stats);
+            
+            auto sendTime = global_timer::time_point(global_timer::duration(packet->timestamp));
+            f_mainResults.AddReceiveLatency(Target::T2, receiveTime - sendTime);
+            t2Received = true;
+        }
+    };
+    
     while(f_running) {
-        comm.ReceiveT1OrT2(buf, sizeof(buf), [&](Target t, const uint8_t* buf, size_t size) {
-            auto receiveTime = global_timer::now();
-            if (t == Target::T1) {
-                auto packet = reinterpret_cast<const SharedState_T1DataPacket*>(buf);
-                t1Stats.Add(packet->stats);
-                
-                auto sendTime = global_timer::time_point(global_timer::duration(packet->timestamp));
-                t1Stats.AddReceivePacketLatency(
-                            receiveTime - sendTime);
-                t1Received = true;
-            }
-            else if (t == Target::T2) {
-                auto packet = reinterpret_cast<const SharedState_T2DataPacket*>(buf);
-                t2Stats.Add(packet->stats);
-                
-                auto sendTime = global_timer::time_point(global_timer::duration(packet->timestamp));
-                t2Stats.AddReceivePacketLatency(
-                            receiveTime - sendTime);
-                t2Received = true;
-            }
-        });
+        if (useLoop) {
+            ReceiveReady(comm, loop, buf, sizeof(buf), handlePacket);
+        }
+        else {
+            comm.ReceiveT1OrT2(buf, sizeof(buf), handlePacket);
+        }
         
         if (t1Received) {
             SharedState_T1CommandPacket cmd;
@@ -220,9 +480,12 @@ static void Test(CommInterface& comm)
             t2Received = false;
         }
     }
+    
+    f_receiveFinished = true;
 }
 
-static void TestShm(CommInterface& comm)
+template<typename Comm>
+static void TestShm(Comm& comm)
 {
     uint8_t buf[0x1500];
     
@@ -231,36 +494,43 @@ static void TestShm(CommInterface& comm)
     uint32_t t1PacketId = 0;
     uint32_t t2PacketId = 0;
     
-    while(f_running) {
-        comm.ReceiveAny(buf, sizeof(buf), [&](Target t, const uint8_t* buf, size_t size) {
-            auto receiveTime = global_timer::now();
-            if (t == Target::T0) {
-                auto packet = reinterpret_cast<const SharedState_T0ShmDataPacket*>(buf);
-                t0Stats.Add(packet->stats);
-                
-                auto sendTime = global_timer::time_point(global_timer::duration(packet->timestamp));
-                t0Stats.AddReceivePacketLatency(
-                            receiveTime - sendTime);
-            }
-            else if (t == Target::T1) {
-                auto packet = reinterpret_cast<const SharedState_T1DataPacket*>(buf);
-                t1Stats.Add(packet->stats);
+    EventLoop loop;
+    bool useLoop = OpenEventLoop(comm, loop, Target::T0);
+    
+    auto handlePacket = [&](Target t, const uint8_t* buf, size_t) {
+        auto receiveTime = global_timer::now();
+        if (t == Target::T0) {
+            auto packet = reinterpret_cast<const SharedState_T0ShmDataPacket*>(buf);
+            f_mainResults.AddStats(Target::T0, packet->stats);
+            
+            auto sendTime = global_timer::time_point(global_timer::duration(packet->timestamp));
+            f_mainResults.AddReceiveLatency(Target::T0, receiveTime - sendTime);
+        }
+        else if (t == Target::T1) {
+            auto packet = reinterpret_cast<const SharedState_T1DataPacket*>(buf);
+            f_mainResults.AddStats(Target::T1, packet->stats);
 
-                auto sendTime = global_timer::time_point(global_timer::duration(packet->timestamp));
-                t1Stats.AddReceivePacketLatency(
-                            receiveTime - sendTime);
-                t1Received = true;
-            }
-            else if (t == Target::T2) {
-                auto packet = reinterpret_cast<const SharedState_T2DataPacket*>(buf);
-                t2Stats.Add(packet->stats);
+            auto sendTime = global_timer::time_point(global_timer::duration(packet->timestamp));
+            f_mainResults.AddReceiveLatency(Target::T1, receiveTime - sendTime);
+            t1Received = true;
+        }
+        else if (t == Target::T2) {
+            auto packet = reinterpret_cast<const SharedState_T2DataPacket*>(buf);
+            f_mainResults.AddStats(Target::T2, packet->stats);
 
-                auto sendTime = global_timer::time_point(global_timer::duration(packet->timestamp));
-                t2Stats.AddReceivePacketLatency(
-                            receiveTime - sendTime);
-                t2Received = true;
-            }
-        });
+            auto sendTime = global_timer::time_point(global_timer::duration(packet->timestamp));
+            f_mainResults.AddReceiveLatency(Target::T2, receiveTime - sendTime);
+            t2Received = true;
+        }
+    };
+    
+    while(f_running) {
+        if (useLoop) {
+            ReceiveReady(comm, loop, buf, sizeof(buf), handlePacket);
+        }
+        else {
+            comm.ReceiveAny(buf, sizeof(buf), handlePacket);
+        }
         
         if (t1Received) {
             SharedState_T1CommandPacket cmd;
@@ -279,4 +549,6 @@ static void TestShm(CommInterface& comm)
             t2Received = false;
         }
     }
+    
+    f_receiveFinished = true;
 }
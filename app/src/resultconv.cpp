@@ -0,0 +1,158 @@
+#include "result_file.hpp"
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/* Converts a result file of dippa_app to text on the host.
+ *
+ *   resultconv <file.bin> [output|-] [--csv]
+ *
+ * Writes a TSV file next to the input (or CSV with --csv, - is stdout), one
+ * column per result column. Tick columns are converted to nanoseconds.
+ */
+
+static constexpr size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+/* Longest cell: an int64_t and the separator */
+static constexpr size_t MAX_CELL_SIZE = 24;
+
+class BufferedOutput {
+public:
+	explicit BufferedOutput(FILE* file) : file(file), buffer(OUTPUT_BUFFER_SIZE) {}
+	~BufferedOutput() { Flush(); }
+
+	/* Room for at least MAX_CELL_SIZE characters */
+	char* Reserve() {
+		if (buffer.size() - used < MAX_CELL_SIZE) Flush();
+		return buffer.data() + used;
+	}
+	void Commit(char* end) { used = end - buffer.data(); }
+
+	void Write(const std::string& text) {
+		for (char c : text) {
+			char* p = Reserve();
+			*p = c;
+			Commit(p + 1);
+		}
+	}
+
+	bool Flush() {
+		if (used > 0 && fwrite(buffer.data(), 1, used, file) != used) {
+			failed = true;
+		}
+		used = 0;
+		return !failed;
+	}
+
+private:
+	FILE* file;
+	std::vector<char> buffer;
+	size_t used = 0;
+	bool failed = false;
+};
+
+/* ticks * tickNum / tickDen seconds in ns, split so that it can't overflow */
+static int64_t TicksToNs(int64_t ticks, uint32_t tickNum, uint32_t tickDen)
+{
+	const int64_t nsNum = (int64_t)tickNum * 1000000000;
+	return ticks / tickDen * nsNum + ticks % tickDen * nsNum / tickDen;
+}
+
+int main(int argc, char *argv[])
+{
+	bool csv = false;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--csv") == 0) {
+			csv = true;
+		}
+		else {
+			paths.push_back(argv[i]);
+		}
+	}
+
+	if (paths.empty() || paths.size() > 2) {
+		fprintf(stderr, "Expecting <file.bin> [output|-] [--csv]\n");
+		return 1;
+	}
+
+	ResultFileReader reader;
+	if (!reader.Open(paths[0])) {
+		return 1;
+	}
+
+	std::string outputPath;
+	if (paths.size() == 2) {
+		outputPath = paths[1];
+	}
+	else {
+		outputPath = paths[0];
+		size_t dot = outputPath.rfind('.');
+		if (dot != std::string::npos && outputPath.find('/', dot) == std::string::npos) {
+			outputPath.erase(dot);
+		}
+		outputPath += csv ? ".csv" : ".tsv";
+	}
+
+	FILE* file = outputPath == "-" ? stdout : fopen(outputPath.c_str(), "wb");
+	if (!file) {
+		perror(("Opening " + outputPath + " failed").c_str());
+		return 1;
+	}
+
+	const char separator = csv ? ',' : '\t';
+	const ResultFileHeader& header = reader.Header();
+	uint64_t rowCount = 0;
+	bool failed = false;
+	{
+		BufferedOutput out(file);
+
+		for (uint32_t c = 0; c < header.columnCount; ++c) {
+			const ResultColumnHeader& column = reader.Column(c);
+			if (c > 0) out.Write(std::string(1, separator));
+			out.Write(std::string(column.name, strnlen(column.name, sizeof(column.name))));
+			if (column.unit == ResultUnit::Ticks) out.Write("(ns)");
+			if (column.rows > rowCount) rowCount = column.rows;
+		}
+		out.Write("\n");
+
+		for (uint64_t row = 0; row < rowCount; ++row) {
+			for (uint32_t c = 0; c < header.columnCount; ++c) {
+				const ResultColumnHeader& column = reader.Column(c);
+				char* p = out.Reserve();
+				if (c > 0) *p++ = separator;
+
+				if (row < column.rows) {
+					int64_t value = column.type == ResultType::U32
+					        ? static_cast<const uint32_t*>(reader.ColumnData(c))[row]
+					        : static_cast<const int64_t*>(reader.ColumnData(c))[row];
+					if (column.unit == ResultUnit::Ticks) {
+						value = TicksToNs(value, header.tickNum, header.tickDen);
+					}
+					p = std::to_chars(p, p + MAX_CELL_SIZE - 1, value).ptr;
+				}
+				out.Commit(p);
+			}
+			char* p = out.Reserve();
+			*p = '\n';
+			out.Commit(p + 1);
+		}
+
+		failed = !out.Flush();
+		if (failed) {
+			perror(("Writing " + outputPath + " failed").c_str());
+		}
+	}
+
+	if (file != stdout && fclose(file) != 0) {
+		failed = true;
+	}
+	if (failed) {
+		return 1;
+	}
+
+	fprintf(stderr, "Written %llu rows of %u columns to %s\n",
+	        (unsigned long long)rowCount, header.columnCount, outputPath.c_str());
+	return 0;
+}
@@ -1,40 +1,100 @@
 #include "shared_state.h"
+#include "ipc_snapshot.h"
 #include "comm.hpp"
 #include "globaltimer.hpp"
+#include "latency_histogram.hpp"
+#include "ResultRecorder.hpp"
+#include "result_file.hpp"
+#include <algorithm>
 #include <array>
 #include <cstring>
 #include <fstream>
-#include <vector>
 #include <iostream>
+#include <sstream>
+#include <time.h>
 
+/* How the T0 thread waits for the next variables in the shared memory */
+enum class ShmWait {
+	Busy,    // Spins on the shared memory
+	Hybrid,  // Spins for a while, then sleeps until CPU1 notifies
+	Block    // Sleeps until CPU1 notifies
+};
+
+/* The samples T0DataProcess measures */
+enum class T0Metric : uint8_t {
+	CommandSendDelay,      // sending a variable update command to CPU1 handling it
+	ActionResultDelay,     // sending a variable update command to seeing its result
+	WorkDuration,
+	ShmCopyTimeBaremetal,
+	ShmBlockTimeLinux,
+	VarDataDelay,
+	ShmWaitTime
+};
+
+/* Comm is a backend class of comm_backends.hpp so the calls to it are
+ * resolved at compile time, or CommInterface
+ */
+template<typename Comm = CommInterface>
 class T0DataProcess {
 public:
-	T0DataProcess(CommInterface& comm, size_t reserve = 0) : comm(comm) {
-		shm = (SharedState_T0SharedMemory*)comm.MapT0SharedMemory();
+	/* useSnapshot reads the T0 variables from the snapshot channel of the
+	 * -snapshot firmware builds instead of the seqlock. The samples are
+	 * recorded to histograms, the last rawSampleWindow of them are also kept
+	 * for WriteSamples.
+	 */
+	T0DataProcess(Comm& comm, size_t rawSampleWindow = 0, bool useSnapshot = false) : comm(comm) {
+		if (useSnapshot) {
+			snapshot = comm.MapT0Snapshot();
+		}
+		else {
+			shm = (SharedState_T0SharedMemory*)comm.MapT0SharedMemory();
+		}
         
-        if (reserve > 0) {
-            varUpdateDelaysBuf.reserve(reserve);
-            varUpdateSeenDelayBuf.reserve(reserve);
-            workDurations.reserve(reserve);
-            if (shm) {
-                shmUpdateTimes.reserve(reserve);
-                shmVarDataDelays.reserve(reserve);
-                shmUpdateTimesLinux.reserve(reserve);
-            }
-            
+        varUpdateDelays.samples.Resize(rawSampleWindow);
+        varUpdateSeenDelays.samples.Resize(rawSampleWindow);
+        workDurations.samples.Resize(rawSampleWindow);
+        if (HasShm()) {
+            shmUpdateTimes.samples.Resize(rawSampleWindow);
+            shmVarDataDelays.samples.Resize(rawSampleWindow);
+            shmUpdateTimesLinux.samples.Resize(rawSampleWindow);
+            shmWaitTimes.samples.Resize(rawSampleWindow);
         }
 	}
 	
-	bool HasShm() const { return shm != nullptr; }
+	bool HasShm() const { return shm != nullptr || snapshot != nullptr; }
 	
 	bool UpdateVariablesFromShm();
+	bool UpdateVariablesFromSnapshot();
+	
+	/* Returns after new variables have been read. Hybrid and Block arm a
+	 * notification of the snapshot channel and sleep in comm.WaitT0Event,
+	 * without the snapshot they spin like Busy.
+	 */
+	void WaitVariablesFromShm(ShmWait wait, std::chrono::microseconds spinTime);
 	
 	void HandleNewVariableData(const SharedState_Variables& vars);
-    void AddWorkDuration(global_timer::duration d) { workDurations.push_back(d.count()); }
+    void AddWorkDuration(global_timer::duration d) { RecordSample(T0Metric::WorkDuration, d.count()); }
+	
+	/* Queues the samples to recorder instead of adding them to the histograms
+	 * on the measuring thread. The thread draining recorder passes them on to
+	 * AddSample.
+	 */
+	void SetRecorder(ResultRecorder* recorder) { this->recorder = recorder; }
+	void AddSample(T0Metric metric, int64_t ticks) { MetricFor(metric).Add(ticks); }
+	
+	/* The CPU time of the calling thread is written to the CSV */
+	void SaveThreadCpuTime();
+	/* Results the recorders had to drop, written to the CSV */
+	void SetDroppedResults(uint64_t count) { droppedResults = count; }
 	
 	void SendRandomVariableUpdate();
 	
+	/* Written to the CSV to tell the wait strategies apart */
+	void SetWaitStrategyName(const std::string& name) { waitStrategyName = name; }
+	/* Histogram summaries */
 	void WriteCSV(const std::string& fileName);
+	/* The raw samples as a result_file.hpp file, none unless rawSampleWindow > 0 */
+	void WriteSamples(const std::string& fileName);
     
     void SendShutdownCommand();
 private:
@@ -43,19 +103,57 @@ private:
 		return (randomSeed>>16) & 0x7FFF;
 	}
 	
-	CommInterface& comm;
+	Comm& comm;
+	ResultRecorder* recorder = nullptr;
+	
+	/* One measured delay in global timer ticks */
+	struct Metric {
+		LatencyHistogram histogram;
+		SampleWindow<int64_t> samples;
+		
+		void Add(int64_t ticks) {
+			if (ticks < 0) ticks = 0;
+			histogram.Record(ticks);
+			samples.Push(ticks);
+		}
+	};
 	
 	// Delay between sending variable update command and baremetal side handling that
-	std::vector<uint32_t> varUpdateDelaysBuf;
+	Metric varUpdateDelays;
 	
 	// Delay between sending variable update command and seeing results it causes
-	std::vector<uint32_t> varUpdateSeenDelayBuf;
-    std::vector<uint32_t> shmUpdateTimes;
-    std::vector<uint32_t> shmVarDataDelays;
-    std::vector<uint32_t> shmUpdateTimesLinux;
-    std::vector<uint32_t> workDurations;
+	Metric varUpdateSeenDelays;
+    Metric shmUpdateTimes;
+    Metric shmVarDataDelays;
+    Metric shmUpdateTimesLinux;
+    Metric shmWaitTimes;
+    Metric workDurations;
+    
+    Metric& MetricFor(T0Metric metric);
+    void RecordSample(T0Metric metric, int64_t ticks) {
+        if (recorder) {
+            recorder->AddT0Sample((uint8_t)metric, ticks);
+        }
+        else {
+            AddSample(metric, ticks);
+        }
+    }
+    
+    int64_t threadCpuTimeMs = -1;
+    uint64_t droppedResults = 0;
+    
+    /* For the mean T0 period of the coordinated omission correction */
+    global_timer::time_point firstVariableTime;
+    global_timer::time_point lastVariableTime;
+    uint64_t variableCount = 0;
+    
+    std::string waitStrategyName = "busy";
+    /* Sleeps ended by a notification of CPU1, timeouts aren't counted */
+    uint32_t shmSleepCounter = 0;
 	
 	SharedState_T0SharedMemory* shm = nullptr;
+	IpcSnapshot_t* snapshot = nullptr;
+	uint32_t snapshotSequence = 0;
 	uint32_t handledPacketId = 0;
 	
 	uint32_t packetIdCounter = 1;
@@ -69,8 +167,13 @@ private:
     uint32_t shmPrevCounter = 0;
 };
 
-bool T0DataProcess::UpdateVariablesFromShm()
+template<typename Comm>
+bool T0DataProcess<Comm>::UpdateVariablesFromShm()
 {
+    if (snapshot) {
+        return UpdateVariablesFromSnapshot();
+    }
+
     SharedState_Variables vars;
     uint32_t prevUpdateTime;
 	uint64_t timestamp;
@@ -103,24 +206,106 @@ bool T0DataProcess::UpdateVariablesFromShm()
     
     shmPrevCounter = startVal;
     auto updateEnd = global_timer::now();
-    if (prevUpdateTime > 0) shmUpdateTimes.push_back(prevUpdateTime);
-    shmUpdateTimesLinux.push_back((updateEnd - updateStart).count());
-    shmVarDataDelays.push_back((updateEnd - global_timer::time_point(global_timer::duration(timestamp))).count());
+    if (prevUpdateTime > 0) RecordSample(T0Metric::ShmCopyTimeBaremetal, prevUpdateTime);
+    RecordSample(T0Metric::ShmBlockTimeLinux, (updateEnd - updateStart).count());
+    RecordSample(T0Metric::VarDataDelay, (updateEnd - global_timer::time_point(global_timer::duration(timestamp))).count());
     HandleNewVariableData(vars);
     return true;
 }
 
-void T0DataProcess::HandleNewVariableData(const SharedState_Variables &vars)
+/* Same measurements as UpdateVariablesFromShm. Never waits for CPU1, the
+ * latest snapshot is copied once.
+ */
+template<typename Comm>
+bool T0DataProcess<Comm>::UpdateVariablesFromSnapshot()
+{
+    auto updateStart = global_timer::now();
+
+    const SharedState_T0Snapshot* latest = reinterpret_cast<const SharedState_T0Snapshot*>(
+                IPC_SNAPSHOT_BeginRead(snapshot, &snapshotSequence));
+    /* No new values */
+    if (!latest) return false;
+
+    SharedState_T0Snapshot copy = *latest;
+    IPC_SNAPSHOT_EndRead(snapshot);
+
+    auto updateEnd = global_timer::now();
+    if (copy.prevUpdateTime > 0) RecordSample(T0Metric::ShmCopyTimeBaremetal, copy.prevUpdateTime);
+    RecordSample(T0Metric::ShmBlockTimeLinux, (updateEnd - updateStart).count());
+    RecordSample(T0Metric::VarDataDelay, (updateEnd - global_timer::time_point(global_timer::duration(copy.timestamp))).count());
+    HandleNewVariableData(copy.vars);
+    return true;
+}
+
+/* Upper bound of a sleep, in case a notification gets lost */
+static constexpr int SHM_WAIT_TIMEOUT_MS = 1;
+
+template<typename Comm>
+void T0DataProcess<Comm>::WaitVariablesFromShm(ShmWait wait, std::chrono::microseconds spinTime)
+{
+    auto waitStart = global_timer::now();
+    bool canSleep = snapshot != nullptr && wait != ShmWait::Busy;
+    bool updated = UpdateVariablesFromShm();
+    
+    if (!updated && !(canSleep && wait == ShmWait::Block)) {
+        auto spinEnd = std::chrono::steady_clock::now() + spinTime;
+        do {
+            updated = UpdateVariablesFromShm();
+        } while (!updated && (!canSleep || std::chrono::steady_clock::now() < spinEnd));
+    }
+    
+    while (!updated) {
+        /* False if CPU1 published after the last check, read it right away */
+        if (IPC_SNAPSHOT_ArmNotify(snapshot, snapshotSequence)) {
+            if (comm.WaitT0Event(SHM_WAIT_TIMEOUT_MS)) {
+                ++shmSleepCounter;
+            }
+        }
+        updated = UpdateVariablesFromShm();
+    }
+    
+    RecordSample(T0Metric::ShmWaitTime, (global_timer::now() - waitStart).count());
+}
+
+template<typename Comm>
+void T0DataProcess<Comm>::HandleNewVariableData(const SharedState_Variables &vars)
 {
 	auto now = global_timer::now();
+	if (variableCount++ == 0) firstVariableTime = now;
+	lastVariableTime = now;
+	
 	if (vars.lastSetPacketId != handledPacketId) {
-		varUpdateDelaysBuf.push_back(vars.lastSetReceiveTimestamp - vars.lastSetSendTimestamp);
-		varUpdateSeenDelayBuf.push_back((now - global_timer::time_point(global_timer::duration(vars.lastSetSendTimestamp))).count());
+		RecordSample(T0Metric::CommandSendDelay, vars.lastSetReceiveTimestamp - vars.lastSetSendTimestamp);
+		RecordSample(T0Metric::ActionResultDelay, (now - global_timer::time_point(global_timer::duration(vars.lastSetSendTimestamp))).count());
 		handledPacketId = vars.lastSetPacketId;
 	}
 }
 
-void T0DataProcess::SendRandomVariableUpdate()
+template<typename Comm>
+typename T0DataProcess<Comm>::Metric& T0DataProcess<Comm>::MetricFor(T0Metric metric)
+{
+	switch (metric) {
+	case T0Metric::CommandSendDelay: return varUpdateDelays;
+	case T0Metric::ActionResultDelay: return varUpdateSeenDelays;
+	case T0Metric::WorkDuration: return workDurations;
+	case T0Metric::ShmCopyTimeBaremetal: return shmUpdateTimes;
+	case T0Metric::ShmBlockTimeLinux: return shmUpdateTimesLinux;
+	case T0Metric::VarDataDelay: return shmVarDataDelays;
+	case T0Metric::ShmWaitTime: return shmWaitTimes;
+	}
+	return workDurations;
+}
+
+template<typename Comm>
+void T0DataProcess<Comm>::SaveThreadCpuTime()
+{
+	timespec cpuTime;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuTime);
+	threadCpuTimeMs = cpuTime.tv_sec * 1000 + cpuTime.tv_nsec / 1000000;
+}
+
+template<typename Comm>
+void T0DataProcess<Comm>::SendRandomVariableUpdate()
 {
 	constexpr int setVariableCount = 3;
 	
@@ -183,63 +368,84 @@ void T0DataProcess::SendRandomVariableUpdate()
 	}
 }
 
-void T0DataProcess::WriteCSV(const std::string &fileName)
+template<typename Comm>
+void T0DataProcess<Comm>::WriteCSV(const std::string &fileName)
 {
-	std::ofstream out(fileName);
+	/* Built in memory so the lines can be counted from what is written */
+	std::ostringstream out;
     std::cout << "Writing CSV " << fileName << std::endl;
 	
-    bool shmInUse = shmUpdateTimes.size() > 0;
+    const double nsPerTick = 1e9 * global_timer::period::num / global_timer::period::den;
+    bool shmInUse = shmUpdateTimes.histogram.Count() > 0;
     
-	out << "delayed_packets\t" << delayedPacketCounter << "\n\n";
-	out << "i\tcommand_send_delay(ns)\taction_result_delay(ns)\twork_duration(ns)\t";
+    /* Mean T0 period, the rate the variables are expected at */
+    global_timer::duration period(0);
+    if (variableCount > 1) {
+        period = (lastVariableTime - firstVariableTime) / (int64_t)(variableCount - 1);
+    }
     
+	out << "delayed_packets\t" << delayedPacketCounter << "\n";
+    out << "dropped_results\t" << droppedResults << "\n";
+    out << "t0_period(ns)\t" << std::chrono::duration_cast<std::chrono::nanoseconds>(period).count() << "\n";
     if (shmInUse) {
-        out << "\tshm_copy_time_baremetal(ns)\tshm_block_time_linux\tvar_data_delay(ns)";
+        out << "wait_strategy\t" << waitStrategyName << "\n";
+        out << "wait_sleeps\t" << shmSleepCounter << "\n";
+        out << "t0_thread_cpu_time(ms)\t" << threadCpuTimeMs << "\n";
     }
-    out << '\n';
-    
-    size_t resultMaxCount = std::max(varUpdateDelaysBuf.size(), shmVarDataDelays.size());
-    resultMaxCount = std::max(resultMaxCount, workDurations.size());
+    out << "\n";
     
+    /* The corrected views add the samples a stall of the T0 thread hid */
+    LatencyHistogram seenDelayCorrected;
+    seenDelayCorrected.AddCorrected(varUpdateSeenDelays.histogram, period.count());
     
-	for (size_t i = 0; i < resultMaxCount; ++i) {
-		out << i << '\t';
-        if (i < varUpdateDelaysBuf.size()) {
-            out << std::chrono::duration_cast<std::chrono::nanoseconds>(global_timer::duration(varUpdateDelaysBuf[i])).count() << '\t'
-                << std::chrono::duration_cast<std::chrono::nanoseconds>(global_timer::duration(varUpdateSeenDelayBuf[i])).count();
-        }
-        else {
-            out << '\t';
-        }
-        out << "\t";
-        
-        if (i < workDurations.size()) {
-            out << std::chrono::duration_cast<std::chrono::nanoseconds>(global_timer::duration(workDurations[i])).count();
-        }
-        out << '\t';
+    WriteHistogramSummaryHeader(out);
+    WriteHistogramSummary(out, "command_send_delay", varUpdateDelays.histogram, nsPerTick);
+    WriteHistogramSummary(out, "action_result_delay", varUpdateSeenDelays.histogram, nsPerTick);
+    WriteHistogramSummary(out, "action_result_delay_corrected", seenDelayCorrected, nsPerTick);
+    WriteHistogramSummary(out, "work_duration", workDurations.histogram, nsPerTick);
+    if (shmInUse) {
+        LatencyHistogram varDataDelayCorrected;
+        varDataDelayCorrected.AddCorrected(shmVarDataDelays.histogram, period.count());
         
-        if (shmInUse) {
-            if (i < shmUpdateTimes.size()) {
-                out << std::chrono::duration_cast<std::chrono::nanoseconds>(global_timer::duration(shmUpdateTimes[i])).count();
-            }
-            out << '\t';
-            
-            if (i < shmUpdateTimesLinux.size()) {
-                out << std::chrono::duration_cast<std::chrono::nanoseconds>(global_timer::duration(shmUpdateTimesLinux[i])).count();
-            }
-            out << '\t';
-            
-            if (i < shmVarDataDelays.size()) {
-                out << std::chrono::duration_cast<std::chrono::nanoseconds>(global_timer::duration(shmVarDataDelays[i])).count();
-            }
-        }
-        out << '\n';
+        WriteHistogramSummary(out, "shm_copy_time_baremetal", shmUpdateTimes.histogram, nsPerTick);
+        WriteHistogramSummary(out, "shm_block_time_linux", shmUpdateTimesLinux.histogram, nsPerTick);
+        WriteHistogramSummary(out, "var_data_delay", shmVarDataDelays.histogram, nsPerTick);
+        WriteHistogramSummary(out, "var_data_delay_corrected", varDataDelayCorrected, nsPerTick);
+        WriteHistogramSummary(out, "shm_wait_time_linux", shmWaitTimes.histogram, nsPerTick);
+    }
+    
+    const std::string text = out.str();
+    std::ofstream(fileName) << text;
+    std::cout << "Written " << std::count(text.begin(), text.end(), '\n') << " lines" << std::endl;
+}
+
+template<typename Comm>
+void T0DataProcess<Comm>::WriteSamples(const std::string &fileName)
+{
+    std::cout << "Writing samples " << fileName << std::endl;
+    
+    ResultFileWriter writer(global_timer::period::num, global_timer::period::den);
+    auto addMetric = [&](const char* name, const Metric& metric) {
+        writer.AddI64(name, ResultUnit::Ticks, metric.samples.Size(), [&](size_t i) {
+            return metric.samples[i];
+        });
+    };
+    
+    addMetric("command_send_delay", varUpdateDelays);
+    addMetric("action_result_delay", varUpdateSeenDelays);
+    addMetric("work_duration", workDurations);
+    if (shmUpdateTimes.histogram.Count() > 0) {
+        addMetric("shm_copy_time_baremetal", shmUpdateTimes);
+        addMetric("shm_block_time_linux", shmUpdateTimesLinux);
+        addMetric("var_data_delay", shmVarDataDelays);
+        addMetric("shm_wait_time_linux", shmWaitTimes);
     }
     
-    std::cout << "Written " << (resultMaxCount + 1) << " lines" << std::endl;
+    writer.Write(fileName);
 }
 
-void T0DataProcess::SendShutdownCommand()
+template<typename Comm>
+void T0DataProcess<Comm>::SendShutdownCommand()
 {
     SharedState_T0CommandPacket* packet = reinterpret_cast<SharedState_T0CommandPacket*>(
                 sendPacketBuffer.data());
@@ -0,0 +1,133 @@
+#include "globaltimer.hpp"
+#include "ipc_ring.hpp"
+#include "ipc_copy.h"
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstring>
+
+/* Compares the copy routines of include/ipc_copy.h against memcpy.
+ *
+ *   copybench              source and destination in normal cached memory
+ *   copybench <device>     destination in the shared buffer of the tunnel
+ *                          device, e.g. /dev/ipc_tunnel0, mapped the way the
+ *                          kernel module maps it
+ *
+ * Cycles are global timer ticks times two, the global timer runs at half of
+ * the CPU clock. On a development machine global_timer counts the same ticks
+ * from CLOCK_MONOTONIC_RAW, so the numbers are only comparable between the
+ * routines, not with the Zynq.
+ */
+
+static constexpr unsigned ITERATION_COUNT = 10000;
+static constexpr unsigned REPEAT_COUNT = 10;
+
+static uint16_t f_testedPacketSizes[] = {32, 64, 128, 256, 496 , 512, 1024, 2048};
+
+typedef void (*CopyFunc)(void* dst, const void* src, size_t size);
+
+static void Memcpy(void* dst, const void* src, size_t size)
+{
+    std::memcpy(dst, src, size);
+}
+
+struct Routine {
+    const char* name;
+    CopyFunc copy;
+};
+
+static const Routine f_routines[] = {
+    {"memcpy", &Memcpy},
+    {"words", &IPC_COPY_Words},
+    {"cached", &IPC_COPY_Cached},
+    {"write_combining", &IPC_COPY_WriteCombining},
+    {"strongly_ordered", &IPC_COPY_StronglyOrdered},
+};
+
+static uint8_t f_source[2048] __attribute__ ((aligned (64)));
+static uint8_t f_destination[2048] __attribute__ ((aligned (64)));
+
+/* Best of REPEAT_COUNT runs, cycles per copy */
+static double MeasureCycles(CopyFunc copy, uint8_t* dst, uint16_t size)
+{
+    global_timer::duration best = global_timer::duration::max();
+
+    for (unsigned r = 0; r < REPEAT_COUNT; ++r) {
+        global_timer::time_point start = global_timer::now();
+        for (unsigned i = 0; i < ITERATION_COUNT; ++i) {
+            copy(dst, f_source, size);
+            /* Keeps the compiler from dropping or merging the copies */
+            asm volatile("" : : "r"(dst) : "memory");
+        }
+        best = std::min(best, global_timer::now() - start);
+    }
+
+    return (double)best.count() * 2.0 / ITERATION_COUNT;
+}
+
+/* Byte by byte, memcmp may do unaligned loads which fault on strongly-ordered memory */
+static bool SameBytes(const volatile uint8_t* a, const uint8_t* b, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        if (a[i] != b[i]) return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t* dst = f_destination;
+    std::string memoryName = "cached";
+
+    IpcRing ring;
+    if (argc > 1) {
+        if (!ring.Open(argv[1], true)) {
+            std::cerr << "Failed to open " << argv[1] << std::endl;
+            return 1;
+        }
+        dst = ring.MapSharedBuffer();
+        if (!dst) {
+            std::cerr << argv[1] << " has no shared buffer" << std::endl;
+            return 1;
+        }
+        memoryName = "shared_buffer";
+    }
+
+    for (size_t i = 0; i < sizeof(f_source); ++i) {
+        f_source[i] = (uint8_t)i;
+    }
+
+    std::ofstream out_f("copybench-" + memoryName + ".csv");
+    out_f << "size";
+    std::cout << std::setw(6) << "size";
+    for (const Routine& routine : f_routines) {
+        out_f << "\t" << routine.name;
+        std::cout << std::setw(18) << routine.name;
+    }
+    out_f << std::endl;
+    std::cout << "   (bytes/cycle)" << std::endl;
+
+    for (uint16_t packetSize : f_testedPacketSizes) {
+        out_f << packetSize;
+        std::cout << std::setw(6) << packetSize;
+
+        for (const Routine& routine : f_routines) {
+            double cycles = MeasureCycles(routine.copy, dst, packetSize);
+            double bytesPerCycle = cycles > 0.0 ? packetSize / cycles : 0.0;
+
+            if (!SameBytes(dst, f_source, packetSize)) {
+                std::cerr << routine.name << " copied " << packetSize << " bytes wrong" << std::endl;
+                return 1;
+            }
+
+            out_f << "\t" << bytesPerCycle;
+            std::cout << std::setw(18) << std::fixed << std::setprecision(3) << bytesPerCycle;
+        }
+
+        out_f << std::endl;
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
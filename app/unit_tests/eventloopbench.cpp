@@ -0,0 +1,177 @@
+#include "event_loop.hpp"
+#include "globaltimer.hpp"
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
+
+/* Compares the receive loops of main.cpp without CPU1: select() like
+ * ReceiveAny and EventLoop. A writer thread sends global timer timestamps to
+ * three non-blocking pipes standing for T0-T2 at the rates of the tasks,
+ * the reader measures the time from the write to the handler.
+ *
+ *   eventloopbench    writes eventloopbench.csv with latency percentiles in ns
+ */
+
+static constexpr unsigned T0_PERIOD_US = 50;
+static constexpr unsigned T0_COUNT = 100000;
+
+/* Every T0 cycle writes T0, every 4th T1 and every 20th T2 like the firmware */
+static const unsigned f_multipliers[3] = {1, 4, 20};
+
+struct Pipes {
+	int read[3];
+	int write[3];
+};
+
+static bool OpenPipes(Pipes& pipes)
+{
+	for (int i = 0; i < 3; ++i) {
+		int fds[2];
+		if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+			perror("pipe2 failed");
+			return false;
+		}
+		pipes.read[i] = fds[0];
+		pipes.write[i] = fds[1];
+	}
+	return true;
+}
+
+static void ClosePipes(Pipes& pipes)
+{
+	for (int i = 0; i < 3; ++i) {
+		close(pipes.read[i]);
+		close(pipes.write[i]);
+	}
+}
+
+static void Writer(const Pipes& pipes, std::atomic_bool& done)
+{
+	global_timer::time_point next = global_timer::now();
+	const global_timer::duration period = std::chrono::duration_cast<global_timer::duration>(std::chrono::microseconds(T0_PERIOD_US));
+
+	for (unsigned cycle = 0; cycle < T0_COUNT; ++cycle) {
+		next += period;
+		while (global_timer::now() < next) {
+			std::this_thread::sleep_for(std::chrono::microseconds(5));
+		}
+
+		for (int i = 2; i >= 0; --i) {
+			if (cycle % f_multipliers[i] != 0) continue;
+			uint64_t stamp = global_timer::now().time_since_epoch().count();
+			if (write(pipes.write[i], &stamp, sizeof(stamp)) != sizeof(stamp)) {
+				/* Reader fell behind a whole pipe, counted as a missing sample */
+			}
+		}
+	}
+
+	done = true;
+}
+
+/* Reads one timestamp, false if the pipe is drained */
+static bool ReadStamp(int fd, std::vector<global_timer::duration>& latencies)
+{
+	uint64_t stamp;
+	if (read(fd, &stamp, sizeof(stamp)) != sizeof(stamp)) {
+		return false;
+	}
+
+	latencies.push_back(global_timer::now() - global_timer::time_point(global_timer::duration(stamp)));
+	return true;
+}
+
+static void ReceiveSelect(const Pipes& pipes, std::atomic_bool& done, std::vector<global_timer::duration>* latencies)
+{
+	int nfds = std::max({pipes.read[0], pipes.read[1], pipes.read[2]}) + 1;
+
+	while (!done) {
+		fd_set readFds;
+		FD_ZERO(&readFds);
+		for (int i = 0; i < 3; ++i) FD_SET(pipes.read[i], &readFds);
+
+		timeval timeout = {0, 100000};
+		if (select(nfds, &readFds, 0, 0, &timeout) <= 0) continue;
+
+		/* One packet per ready descriptor like IpcTunnel::ReceiveAny */
+		for (int i = 0; i < 3; ++i) {
+			if (FD_ISSET(pipes.read[i], &readFds)) {
+				ReadStamp(pipes.read[i], latencies[i]);
+			}
+		}
+	}
+}
+
+static void ReceiveEventLoop(const Pipes& pipes, std::atomic_bool& done, std::vector<global_timer::duration>* latencies)
+{
+	EventLoop loop;
+	if (!loop.Open()) return;
+	for (int i = 0; i < 3; ++i) {
+		loop.Add(pipes.read[i], i, i);
+	}
+
+	while (!done) {
+		loop.RunOnce(100, [&](int id) {
+			for (int n = 0; n < 8; ++n) {
+				if (!ReadStamp(pipes.read[id], latencies[id])) return true;
+			}
+			return false;
+		});
+	}
+}
+
+static global_timer::duration Percentile(std::vector<global_timer::duration>& sorted, double p)
+{
+	if (sorted.empty()) return global_timer::duration(0);
+	size_t index = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+	return sorted[index];
+}
+
+int main()
+{
+	static const double percentiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+	static const char* loopNames[] = {"select", "epoll"};
+
+	std::ofstream out_f("eventloopbench.csv");
+	out_f << "loop\tchannel\tcount\tp50\tp90\tp99\tp99.9\tmax" << std::endl;
+
+	for (int loopIndex = 0; loopIndex < 2; ++loopIndex) {
+		Pipes pipes;
+		if (!OpenPipes(pipes)) return 1;
+
+		std::vector<global_timer::duration> latencies[3];
+		for (int i = 0; i < 3; ++i) latencies[i].reserve(T0_COUNT / f_multipliers[i] + 1);
+
+		std::atomic_bool done{false};
+		std::thread writer(&Writer, std::cref(pipes), std::ref(done));
+		if (loopIndex == 0) {
+			ReceiveSelect(pipes, done, latencies);
+		}
+		else {
+			ReceiveEventLoop(pipes, done, latencies);
+		}
+		writer.join();
+		ClosePipes(pipes);
+
+		for (int i = 0; i < 3; ++i) {
+			std::sort(latencies[i].begin(), latencies[i].end());
+			out_f << loopNames[loopIndex] << "\tT" << i << "\t" << latencies[i].size();
+			std::cout << std::setw(7) << loopNames[loopIndex] << " T" << i << std::setw(8) << latencies[i].size();
+			for (double p : percentiles) {
+				int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Percentile(latencies[i], p)).count();
+				out_f << "\t" << ns;
+				std::cout << std::setw(10) << ns;
+			}
+			out_f << std::endl;
+			std::cout << "  ns (p50 p90 p99 p99.9 max)" << std::endl;
+		}
+	}
+
+	return 0;
+}
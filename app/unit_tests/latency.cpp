@@ -1,8 +1,8 @@
-#include "comm.hpp"
-#include "openamp.hpp"
+#include "comm_backends.hpp"
 #include "globaltimer.hpp"
 #include <iostream>
 #include <algorithm>
+#include <array>
 #include <numeric>
 #include <cmath>
 
@@ -10,23 +10,23 @@
 #include <thread>
 #include <fstream>
 
-static void DoTest(CommInterface& comm);
+template<typename Comm> static void DoTest(Comm& comm);
+template<typename Comm> static void DoBusyPollTest(Comm& comm);
+template<typename Comm> static void SendShutdown(Comm& comm);
 
 int main(int argc, char *argv[])
 {
-    auto comm = CreateFromArgs(argc, argv);
-    if (!comm) {
-        return 1;
-    }
-    
-    if (!comm->Initialize(true)) {
-        std::cerr << "Failed to initialize communication" << std::endl;
-        return 1;
-    }
-
-    DoTest(*comm);
+    return WithCommFromArgs(argc, argv, [&](auto& comm) {
+        if (!comm.Initialize(true)) {
+            std::cerr << "Failed to initialize communication" << std::endl;
+            return 1;
+        }
 
-    return 0;
+        DoTest(comm);
+        DoBusyPollTest(comm);
+        SendShutdown(comm);
+        return 0;
+    });
 }
 
 
@@ -40,28 +40,39 @@ static int64_t latencyVarianceNs(IT begin, IT end, decltype(*begin) avg) {
     }) / (end - begin);
 }
 
-static void DoTest(CommInterface& comm)
+static constexpr unsigned ITERATION_COUNT = 500;
+static constexpr size_t PACKET_SIZE_COUNT = 8;
+
+static const uint16_t f_testedPacketSizes[PACKET_SIZE_COUNT] = {32, 64, 128, 256, 496 , 512, 1024, 2048};
+static const unsigned f_testedBusyPollBudgets[] = {0, 5, 10, 20, 50, 100, 200, 500};
+
+struct LatencyResults {
+    std::array<std::chrono::nanoseconds, PACKET_SIZE_COUNT> l2bLatencies;
+    std::array<int64_t, PACKET_SIZE_COUNT> l2bLatencyVars;
+    std::array<std::chrono::nanoseconds, PACKET_SIZE_COUNT> b2lLatencies;
+    std::array<int64_t, PACKET_SIZE_COUNT> b2lLatencyVars;
+    std::array<std::chrono::nanoseconds, PACKET_SIZE_COUNT> readDurations;
+    std::array<int64_t, PACKET_SIZE_COUNT> readDurationVars;
+    size_t packetSizeCount;
+};
+
+/* Runs the latency test for every packet size. Baremetal side moves to the
+ * next step when it receives CONTROL_FLAG_NEXT so every run except the first
+ * one starts with it.
+ */
+template<typename Comm>
+static void RunLatencyTest(Comm& comm, bool& firstRun, LatencyResults& results)
 {
-    constexpr unsigned ITERATION_COUNT = 500;
-    
     uint8_t packetBuffer alignas(8) [2048];
-    uint16_t testedPacketSizes[] = {32, 64, 128, 256, 496 , 512, 1024, 2048};
-    
-    std::array<std::chrono::nanoseconds, 8> l2bLatencies;
-    std::array<int64_t, 8> l2bLatencyVars;
-    std::array<std::chrono::nanoseconds, 8> b2lLatencies;
-    std::array<int64_t, 8> b2lLatencyVars;
-    std::array<std::chrono::nanoseconds, 8> readDurations;
-    std::array<int64_t, 8> readDurationVars;
 
     size_t packetSizeIdx = 0;
     
-    for (uint16_t packetSize : testedPacketSizes) {
+    for (uint16_t packetSize : f_testedPacketSizes) {
         if (packetSize > comm.GetMaxPacketSize(Target::T0)) break;
         
         std::cout << "Testing packet size " << packetSize << " bytes" << std::endl;
         
-        if (packetSizeIdx > 0) {
+        if (!firstRun) {
             LinuxToBaremetal req;
             req.control_flags = CONTROL_FLAG_NEXT;
             req.send_timestamp = global_timer::now().time_since_epoch().count();
@@ -69,6 +80,7 @@ static void DoTest(CommInterface& comm)
             
             std::this_thread::sleep_for(std::chrono::microseconds(5000));
         }
+        firstRun = false;
 
         std::array<global_timer::duration, ITERATION_COUNT> linuxToBaremetalLatencies;
         std::array<global_timer::duration, ITERATION_COUNT> baremetalToLinuxLatencies;
@@ -130,28 +142,87 @@ static void DoTest(CommInterface& comm)
         int64_t linuxReadDurationVarianceNs =
                 latencyVarianceNs(linuxReadDurations.begin(), linuxReadDurations.end(), linuxReadDuration);
         
-        l2bLatencies[packetSizeIdx] = std::chrono::duration_cast<std::chrono::nanoseconds>(linuxToBaremetalLatency);
-        b2lLatencies[packetSizeIdx] = std::chrono::duration_cast<std::chrono::nanoseconds>(baremetalToLinuxLatency);
-        readDurations[packetSizeIdx] = std::chrono::duration_cast<std::chrono::nanoseconds>(linuxReadDuration);
+        results.l2bLatencies[packetSizeIdx] = std::chrono::duration_cast<std::chrono::nanoseconds>(linuxToBaremetalLatency);
+        results.b2lLatencies[packetSizeIdx] = std::chrono::duration_cast<std::chrono::nanoseconds>(baremetalToLinuxLatency);
+        results.readDurations[packetSizeIdx] = std::chrono::duration_cast<std::chrono::nanoseconds>(linuxReadDuration);
         
-        l2bLatencyVars[packetSizeIdx] = linuxToBaremetalLatencyVarianceNs;
-        b2lLatencyVars[packetSizeIdx] = baremetalToLinuxLatencyVariance;
-        readDurationVars[packetSizeIdx] = linuxReadDurationVarianceNs;
+        results.l2bLatencyVars[packetSizeIdx] = linuxToBaremetalLatencyVarianceNs;
+        results.b2lLatencyVars[packetSizeIdx] = baremetalToLinuxLatencyVariance;
+        results.readDurationVars[packetSizeIdx] = linuxReadDurationVarianceNs;
         
         ++packetSizeIdx;
     }
-    LinuxToBaremetal req;
-    req.control_flags = CONTROL_FLAG_SHUTDOWN;
-    req.send_timestamp = global_timer::now().time_since_epoch().count();
-    while (!comm.Send(Target::T0, reinterpret_cast<const uint8_t*>(&req), sizeof(LinuxToBaremetal))) {}
+    
+    results.packetSizeCount = packetSizeIdx;
+}
+
+static void WriteResultRow(std::ostream& out, const LatencyResults& results, size_t i)
+{
+    out << f_testedPacketSizes[i] << "\t";
+    out << results.l2bLatencies[i].count() << "\t" << results.l2bLatencyVars[i] << "\t";
+    out << results.b2lLatencies[i].count() << "\t" << results.b2lLatencyVars[i] << "\t";
+    out << results.readDurations[i].count() << "\t" << results.readDurationVars[i];
+}
+
+static bool f_firstRun = true;
+
+template<typename Comm>
+static void DoTest(Comm& comm)
+{
+    LatencyResults results;
+    RunLatencyTest(comm, f_firstRun, results);
 
     std::ofstream out("latency-" + comm.GetInterfaceName() + ".csv");
     out << "packet_size\tl2b_latency\tl2b_latency_var\tb2l_latency\tb2l_latency_var\tl_read_dur\tl_read_dur_var\n";
     
-    for (size_t i = 0; i < packetSizeIdx; ++i) {
-        out << testedPacketSizes[i] << "\t";
-        out << l2bLatencies[i].count() << "\t" << l2bLatencyVars[i] << "\t";
-        out <<  b2lLatencies[i].count() << "\t" << b2lLatencyVars[i] << "\t";
-        out << readDurations[i].count() << "\t" << readDurationVars[i] << "\n";
+    for (size_t i = 0; i < results.packetSizeCount; ++i) {
+        WriteResultRow(out, results, i);
+        out << "\n";
     }
 }
+
+/* Repeats the test for every busy-poll budget */
+template<typename Comm>
+static void DoBusyPollTest(Comm& comm)
+{
+    if (!comm.SetBusyPoll(std::chrono::microseconds(0))) {
+        std::cout << comm.GetInterfaceName() << " doesn't support busy-polling" << std::endl;
+        return;
+    }
+    
+    std::ofstream out("latency-busypoll-" + comm.GetInterfaceName() + ".csv");
+    out << "busy_poll_us\tpacket_size\tl2b_latency\tl2b_latency_var\tb2l_latency\tb2l_latency_var\tl_read_dur\tl_read_dur_var"
+           "\tspin_ns\thits\tmisses\n";
+    
+    for (unsigned budget : f_testedBusyPollBudgets) {
+        std::cout << "Testing busy-poll budget " << budget << " us" << std::endl;
+        comm.SetBusyPoll(std::chrono::microseconds(budget));
+        
+        BusyPollStats before{};
+        comm.GetBusyPollStats(Target::T0, before);
+        
+        LatencyResults results;
+        RunLatencyTest(comm, f_firstRun, results);
+        
+        BusyPollStats after{};
+        comm.GetBusyPollStats(Target::T0, after);
+        
+        /* Spin statistics are for the whole run over all packet sizes */
+        for (size_t i = 0; i < results.packetSizeCount; ++i) {
+            out << budget << "\t";
+            WriteResultRow(out, results, i);
+            out << "\t" << (after.spinNs - before.spinNs)
+                << "\t" << (after.hits - before.hits)
+                << "\t" << (after.misses - before.misses) << "\n";
+        }
+    }
+}
+
+template<typename Comm>
+static void SendShutdown(Comm& comm)
+{
+    LinuxToBaremetal req;
+    req.control_flags = CONTROL_FLAG_SHUTDOWN;
+    req.send_timestamp = global_timer::now().time_since_epoch().count();
+    while (!comm.Send(Target::T0, reinterpret_cast<const uint8_t*>(&req), sizeof(LinuxToBaremetal))) {}
+}
@@ -1,8 +1,8 @@
-#include "comm.hpp"
-#include "openamp.hpp"
+#include "comm_backends.hpp"
 #include "globaltimer.hpp"
 #include <iostream>
 #include <algorithm>
+#include <array>
 #include <numeric>
 #include <cmath>
 
@@ -11,23 +11,21 @@
 #include <fstream>
 #include <iomanip>
 
-static void DoTest(CommInterface& comm);
+template<typename Comm> static void DoTest(Comm& comm);
+template<typename Comm> static void DoBatchTest(Comm& comm);
 
 int main(int argc, char *argv[])
 {
-    auto comm = CreateFromArgs(argc, argv);
-    if (!comm) {
-        return 1;
-    }
-    
-    if (!comm->Initialize(true)) {
-        std::cerr << "Failed to initialize communication" << std::endl;
-        return 1;
-    }
-
-    DoTest(*comm);
+    return WithCommFromArgs(argc, argv, [&](auto& comm) {
+        if (!comm.Initialize(true)) {
+            std::cerr << "Failed to initialize communication" << std::endl;
+            return 1;
+        }
 
-    return 0;
+        DoTest(comm);
+        DoBatchTest(comm);
+        return 0;
+    });
 }
 static constexpr unsigned ITERATION_COUNT = 10000;
 static constexpr unsigned REPEAT_COUNT = 10;
@@ -49,11 +47,17 @@ static int64_t latencyVarianceNs(IT begin, IT end, decltype(*begin) avg) {
 
 static uint8_t f_buffer[1024 * 16] __attribute__ ((aligned (8)));
 
-static void DoTest(CommInterface& comm)
+template<typename Comm>
+static void DoTest(Comm& comm)
 {
     std::ofstream out_f("throughput-" + comm.GetInterfaceName() + ".csv");
-
     
+    /* Mean throughput per packet size. Interface name includes the memory
+     * mode of ipc_tunnel so runs with different modes can be put side by side.
+     */
+    std::ofstream summary_f("throughput-summary-" + comm.GetInterfaceName() + ".csv");
+    summary_f << "packet_size\tl_to_b(MB/s)\tb_to_l(MB/s)\n";
+
     for (uint16_t packetSize : f_testedPacketSizes) {
         std::array<global_timer::duration, REPEAT_COUNT> baremetalToLinuxReceiveTime;
         std::array<global_timer::duration, REPEAT_COUNT> linuxToBaremetalReceiveTime;
@@ -115,6 +119,12 @@ static void DoTest(CommInterface& comm)
             }
         }
 
+        double l2bMean = std::accumulate(l2bPacketThroughput.begin(), l2bPacketThroughput.end(), 0.0) / REPEAT_COUNT * packetSize / 1e6;
+        double b2lMean = std::accumulate(b2lPacketThroughput.begin(), b2lPacketThroughput.end(), 0.0) / REPEAT_COUNT * packetSize / 1e6;
+        std::cout << comm.GetInterfaceName() << " packet size " << packetSize
+                  << ": l_to_b " << l2bMean << " MB/s, b_to_l " << b2lMean << " MB/s" << std::endl;
+        summary_f << packetSize << '\t' << l2bMean << '\t' << b2lMean << '\n';
+
         out_f << std::setprecision(20);
         
         out_f << "packet_size\t" << packetSize << "\n";
@@ -179,3 +189,117 @@ static void DoTest(CommInterface& comm)
         out_f << '\n';
     }
 }
+
+static constexpr unsigned MAX_BATCH_SIZE = 64;
+static constexpr unsigned BATCH_BUFFER_SIZE = 2048;
+
+static unsigned f_testedBatchSizes[] = {1, 2, 4, 8, 16, 32, 64};
+static uint8_t f_batchBuffers[MAX_BATCH_SIZE][BATCH_BUFFER_SIZE] __attribute__ ((aligned (8)));
+
+/* Same protocol as DoTest but packets are moved with SendBatch/ReceiveBatch.
+ * Reports the cost of a single packet for each batch size.
+ */
+template<typename Comm>
+static void DoBatchTest(Comm& comm)
+{
+    std::ofstream out_f("throughput-batch-" + comm.GetInterfaceName() + ".csv");
+    out_f << std::setprecision(20);
+    
+    PacketView views[MAX_BATCH_SIZE];
+    PacketBuffer bufs[MAX_BATCH_SIZE];
+    
+    for (uint16_t packetSize : f_testedPacketSizes) {
+        if (packetSize > comm.GetMaxPacketSize(Target::T0) || packetSize > BATCH_BUFFER_SIZE) break;
+        
+        out_f << "packet_size\t" << packetSize << "\n";
+        out_f << "batch_size\tl_to_b_send_cost(ns/packet)\tb_to_l_receive_cost(ns/packet)"
+                 "\tl_to_b_packet_throughput(packets/s)\tb_to_l_packet_throughput(packets/s)\n";
+        
+        for (unsigned batchSize : f_testedBatchSizes) {
+            std::cout << "Testing batch throughput with packet size " << packetSize
+                      << " and batch size " << batchSize << std::endl;
+            
+            std::array<double, REPEAT_COUNT> sendCost;
+            std::array<double, REPEAT_COUNT> receiveCost;
+            std::array<double, REPEAT_COUNT> b2lPacketThroughput;
+            std::array<double, REPEAT_COUNT> l2bPacketThroughput;
+            
+            for (unsigned r = 0; r < REPEAT_COUNT; ++r) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                {  // phase = 0
+                    global_timer::duration sendTime{};
+                    unsigned i = 0;
+                    while (i < ITERATION_COUNT) {
+                        unsigned count = std::min(batchSize, ITERATION_COUNT - i);
+                        for (unsigned b = 0; b < count; ++b) {
+                            LinuxToBaremetal* req = reinterpret_cast<LinuxToBaremetal*>(f_batchBuffers[b]);
+                            req->control_flags = (i + b + 1 == ITERATION_COUNT) ? CONTROL_FLAG_NEXT : 0;
+                            req->send_timestamp = global_timer::now().time_since_epoch().count();
+                            req->packet_id = i + b;
+                            views[b].data = f_batchBuffers[b];
+                            views[b].size = packetSize;
+                        }
+                        
+                        unsigned sent = 0;
+                        while (sent < count) {
+                            auto start = global_timer::now();
+                            sent += comm.SendBatch(Target::T0, views + sent, count - sent);
+                            sendTime += global_timer::now() - start;
+                        }
+                        i += count;
+                    }
+                    sendCost[r] = std::chrono::duration<double, std::nano>(sendTime).count() / ITERATION_COUNT;
+                }
+                {  // phase = 1
+                    global_timer::duration receiveTime{};
+                    global_timer::time_point firstPacketReceiveTime{};
+                    global_timer::time_point lastPacketReceiveTime;
+                    unsigned i = 0;
+                    while (i < ITERATION_COUNT) {
+                        for (unsigned b = 0; b < batchSize; ++b) {
+                            bufs[b].data = f_batchBuffers[b];
+                            bufs[b].size = BATCH_BUFFER_SIZE;
+                        }
+                        
+                        auto start = global_timer::now();
+                        size_t received = comm.ReceiveBatch(Target::T0, bufs, std::min(batchSize, ITERATION_COUNT - i));
+                        lastPacketReceiveTime = global_timer::now();
+                        receiveTime += lastPacketReceiveTime - start;
+                        
+                        if (i == 0 && received > 0) firstPacketReceiveTime = lastPacketReceiveTime;
+                        i += received;
+                    }
+                    
+                    receiveCost[r] = std::chrono::duration<double, std::nano>(receiveTime).count() / ITERATION_COUNT;
+                    auto receiveDuration = std::chrono::duration<double>(lastPacketReceiveTime - firstPacketReceiveTime).count();
+                    b2lPacketThroughput[r] = (ITERATION_COUNT - 1) / receiveDuration;
+                }
+                {  // phase = 2
+                    LinuxToBaremetal req;
+                    req.control_flags = CONTROL_FLAG_NEXT;
+                    req.send_timestamp = global_timer::now().time_since_epoch().count();
+                    req.packet_id = 0xFFFFFFFF;
+                    while (!comm.Send(Target::T0, reinterpret_cast<const uint8_t*>(&req), sizeof(LinuxToBaremetal))) {}
+                    
+                    comm.ReceiveT0(f_buffer, sizeof(f_buffer));
+                    BaremetalToLinux* resp = reinterpret_cast<BaremetalToLinux*>(f_buffer);
+                    
+                    global_timer::duration l2bReceiveTime(resp->linux_to_baremetal_latency);
+                    l2bPacketThroughput[r] = (ITERATION_COUNT - 1) / std::chrono::duration<double>(l2bReceiveTime).count();
+                }
+            }
+            
+            auto avg = [](const std::array<double, REPEAT_COUNT>& values) {
+                return std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+            };
+            
+            out_f << batchSize
+                  << "\t" << avg(sendCost)
+                  << "\t" << avg(receiveCost)
+                  << "\t" << avg(l2bPacketThroughput)
+                  << "\t" << avg(b2lPacketThroughput) << "\n";
+        }
+        
+        out_f << '\n';
+    }
+}
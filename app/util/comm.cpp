@@ -1,13 +1,83 @@
 #include "comm.hpp"
 #include "ipc_tunnel.hpp"
+#include "ipc_tunnel_user.hpp"
+#include "ipc_tunnel_shm.hpp"
 #include "openamp.hpp"
 #include <cstring>
 #include <iostream>
 
+size_t CommInterface::SendBatch(Target t, const PacketView* packets, size_t count)
+{
+	size_t sent = 0;
+	while (sent < count && Send(t, packets[sent].data, packets[sent].size)) {
+		++sent;
+	}
+	
+	return sent;
+}
+
+size_t CommInterface::ReceiveBatch(Target t, PacketBuffer* packets, size_t count)
+{
+	/* Only T0 can be read from a specific channel through the generic interface */
+	if (t != Target::T0 || count == 0) {
+		return 0;
+	}
+	
+	size_t received = ReceiveT0(packets[0].data, packets[0].size);
+	if (received == 0) {
+		return 0;
+	}
+	
+	packets[0].size = received;
+	return 1;
+}
+
+int CommInterface::GetReceiveFd(Target)
+{
+	return -1;
+}
+
+size_t CommInterface::TryReceive(Target, uint8_t*, size_t)
+{
+	return 0;
+}
+
+size_t CommInterface::TryReceiveTraced(Target t, uint8_t* buf, size_t size, PacketTrace& trace)
+{
+	trace.valid = 0;
+	return TryReceive(t, buf, size);
+}
+
+size_t CommInterface::ReceiveT0Traced(uint8_t* data, size_t bufSize, PacketTrace& trace)
+{
+	trace.valid = 0;
+	return ReceiveT0(data, bufSize);
+}
+
+bool CommInterface::SetBusyPoll(std::chrono::microseconds)
+{
+	return false;
+}
+
+bool CommInterface::GetBusyPollStats(Target, BusyPollStats&)
+{
+	return false;
+}
+
+IpcSnapshot_s* CommInterface::MapT0Snapshot()
+{
+	return reinterpret_cast<IpcSnapshot_s*>(MapT0SharedMemory());
+}
+
+bool CommInterface::WaitT0Event(int)
+{
+	return false;
+}
+
 std::unique_ptr<CommInterface> CreateFromArgs(int argc, char *argv[])
 {
 	if (argc < 2) {
-		std::cerr << "Expecting \"amp\", \"ipc_ocm\" or \"ipc_ddr\" as a parameter" << std::endl;
+		std::cerr << "Expecting \"amp\", \"ipc_ocm\", \"ipc_ddr\", \"ipc_ocm_user\", \"ipc_ddr_user\" or \"shm\" as a parameter" << std::endl;
 		return nullptr;
 	}
 	
@@ -20,7 +90,16 @@ std::unique_ptr<CommInterface> CreateFromArgs(int argc, char *argv[])
 	if (std::strcmp(argv[1], "ipc_ddr") == 0) {
 		return std::unique_ptr<CommInterface>(new IpcTunnel(IpcTunnel::Memory::DDR));
 	}
+	if (std::strcmp(argv[1], "ipc_ocm_user") == 0) {
+		return std::unique_ptr<CommInterface>(new IpcTunnelUser(IpcTunnel::Memory::OCM));
+	}
+	if (std::strcmp(argv[1], "ipc_ddr_user") == 0) {
+		return std::unique_ptr<CommInterface>(new IpcTunnelUser(IpcTunnel::Memory::DDR));
+	}
+	if (std::strcmp(argv[1], "shm") == 0) {
+		return std::unique_ptr<CommInterface>(new IpcTunnelShm());
+	}
 	
-	std::cerr << "Expecting \"amp\", \"ipc_ocm\" or \"ipc_ddr\" as a parameter" << std::endl;
+	std::cerr << "Expecting \"amp\", \"ipc_ocm\", \"ipc_ddr\", \"ipc_ocm_user\", \"ipc_ddr_user\" or \"shm\" as a parameter" << std::endl;
 	return nullptr;
 }
@@ -4,6 +4,7 @@
 #include <string>
 #include <memory>
 #include <functional>
+#include <chrono>
 
 enum class Target {
     T0 = 0,
@@ -11,6 +12,51 @@ enum class Target {
     T2 = 2
 };
 
+/* Packet of a SendBatch call */
+struct PacketView {
+    const uint8_t* data;
+    size_t size;
+};
+
+/* Packet of a ReceiveBatch call. size is the size of the buffer and it is
+ * replaced with the size of the received packet.
+ */
+struct PacketBuffer {
+    uint8_t* data;
+    size_t size;
+};
+
+struct IpcSnapshot_s;
+
+struct BusyPollStats {
+    uint64_t spinNs;
+    uint32_t hits;
+    uint32_t misses;
+};
+
+/* Global timer stamps (low 32 bits) of the path of a received packet, same
+ * as struct ipc_tunnel_trace of the kernel module. A stamp was only taken
+ * if its bit is set in valid.
+ */
+struct PacketTrace {
+    enum Stamp : uint32_t {
+        Commit = 1,   // CPU1 finished writing the packet
+        Sgi = 2,      // CPU1 rang the doorbell
+        Irq = 4,      // doorbell interrupt was handled
+        Dequeue = 8,  // packet was taken from the ring
+        Copy = 16     // payload was copied to the buffer
+    };
+
+    uint32_t commit;
+    uint32_t sgi;
+    uint32_t irq;
+    uint32_t dequeue;
+    uint32_t copy;
+    uint32_t valid;
+
+    bool Has(uint32_t stamps) const { return (valid & stamps) == stamps; }
+};
+
 class CommInterface {
 public:
     virtual ~CommInterface() {}
@@ -21,12 +67,53 @@ public:
 
     virtual size_t ReceiveT0(uint8_t* data, size_t bufSize) = 0;
 
+    /* Both return the number of packets moved. Default implementations
+     * move the packets one by one.
+     */
+    virtual size_t SendBatch(Target t, const PacketView* packets, size_t count);
+    virtual size_t ReceiveBatch(Target t, PacketBuffer* packets, size_t count);
+
     virtual void ReceiveAny(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb) = 0;
     virtual void ReceiveT1OrT2(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb) = 0;
     
+    /* Descriptor for EventLoop that becomes readable when packets arrive on
+     * t after TryReceive has returned 0. -1 if the interface has none, use
+     * ReceiveAny or ReceiveT1OrT2 then.
+     */
+    virtual int GetReceiveFd(Target t);
+    /* Reads one packet of t without waiting, 0 if there is none */
+    virtual size_t TryReceive(Target t, uint8_t* buf, size_t size);
+    /* Same as TryReceive and the stamps of the packet. Default
+     * implementation takes none.
+     */
+    virtual size_t TryReceiveTraced(Target t, uint8_t* buf, size_t size, PacketTrace& trace);
+    /* Same as ReceiveT0 and the stamps of the packet. Default
+     * implementation takes none.
+     */
+    virtual size_t ReceiveT0Traced(uint8_t* data, size_t bufSize, PacketTrace& trace);
+    
     virtual uint16_t GetMaxPacketSize(Target t) const = 0;
     
+    /* Time receiving spins before sleeping. Returns false if the interface
+     * doesn't support busy-polling.
+     */
+    virtual bool SetBusyPoll(std::chrono::microseconds budget);
+    virtual bool GetBusyPollStats(Target t, BusyPollStats& stats);
+    
     virtual uint8_t* MapT0SharedMemory() = 0;
+
+    /* Latest-value channel of include/ipc_snapshot.h written by the
+     * -snapshot firmware builds. Default implementation places it at the
+     * start of the T0 shared memory like VARIANT_T0Snapshot does.
+     */
+    virtual IpcSnapshot_s* MapT0Snapshot();
+
+    /* Sleeps until CPU1 notifies T0 without a packet, e.g. for a snapshot
+     * armed with IPC_SNAPSHOT_ArmNotify, or timeoutMs passes. Wakeups may be
+     * spurious, check for the data again. Returns true if notified, false on
+     * timeout or if the interface can't wait for notifications.
+     */
+    virtual bool WaitT0Event(int timeoutMs);
 };
 
 std::unique_ptr<CommInterface> CreateFromArgs(int argc, char *argv[]);
@@ -0,0 +1,58 @@
+#ifndef DIPPA_COMM_BACKENDS_HPP
+#define DIPPA_COMM_BACKENDS_HPP
+
+#include "comm.hpp"
+#include "ipc_tunnel.hpp"
+#include "ipc_tunnel_user.hpp"
+#include "ipc_tunnel_shm.hpp"
+#include "openamp.hpp"
+#include <cstring>
+#include <iostream>
+
+/* Compile-time backend selection for the benchmarks.
+ *
+ * Through CreateFromArgs every Send and Receive of a hot loop is a virtual
+ * call. WithCommFromArgs constructs the backend named by argv[1] and calls f
+ * with a reference to the concrete class instead. The backends are final, so
+ * the calls are resolved at compile time and the ring fast path can be
+ * inlined into the benchmark, which is instantiated once per backend:
+ *
+ *   return WithCommFromArgs(argc, argv, [&](auto& comm) { return Run(comm); });
+ *
+ * Returns what f returns, or 1 if the interface name is unknown.
+ */
+template<typename Function>
+int WithCommFromArgs(int argc, char *argv[], Function&& f)
+{
+	if (argc >= 2) {
+		if (std::strcmp(argv[1], "amp") == 0) {
+			OpenAMPComm comm;
+			return f(comm);
+		}
+		if (std::strcmp(argv[1], "ipc_ocm") == 0) {
+			IpcTunnel comm(IpcTunnel::Memory::OCM);
+			return f(comm);
+		}
+		if (std::strcmp(argv[1], "ipc_ddr") == 0) {
+			IpcTunnel comm(IpcTunnel::Memory::DDR);
+			return f(comm);
+		}
+		if (std::strcmp(argv[1], "ipc_ocm_user") == 0) {
+			IpcTunnelUser comm(IpcTunnel::Memory::OCM);
+			return f(comm);
+		}
+		if (std::strcmp(argv[1], "ipc_ddr_user") == 0) {
+			IpcTunnelUser comm(IpcTunnel::Memory::DDR);
+			return f(comm);
+		}
+		if (std::strcmp(argv[1], "shm") == 0) {
+			IpcTunnelShm comm;
+			return f(comm);
+		}
+	}
+
+	std::cerr << "Expecting \"amp\", \"ipc_ocm\", \"ipc_ddr\", \"ipc_ocm_user\", \"ipc_ddr_user\" or \"shm\" as a parameter" << std::endl;
+	return 1;
+}
+
+#endif  // DIPPA_COMM_BACKENDS_HPP
@@ -0,0 +1,91 @@
+#include "event_loop.hpp"
+#include <unistd.h>
+#include <cstdio>
+
+EventLoop::~EventLoop()
+{
+	Close();
+}
+
+bool EventLoop::Open()
+{
+	Close();
+
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd < 0) {
+		perror("epoll_create1 failed");
+		return false;
+	}
+
+	return true;
+}
+
+void EventLoop::Close()
+{
+	if (epollFd >= 0) {
+		close(epollFd);
+		epollFd = -1;
+	}
+
+	channelCount = 0;
+	pendingCount = 0;
+}
+
+bool EventLoop::Add(int fd, int id, int priority)
+{
+	if (epollFd < 0 || fd < 0 || channelCount == MAX_CHANNELS) {
+		return false;
+	}
+
+	/* Insertion keeps channels sorted, equal priorities in the order added */
+	int index = channelCount;
+	while (index > 0 && channels[index - 1].priority > priority) {
+		channels[index] = channels[index - 1];
+		--index;
+	}
+
+	/* Packets may already be waiting and epoll only reports new ones */
+	channels[index].fd = fd;
+	channels[index].id = id;
+	channels[index].priority = priority;
+	channels[index].pending = true;
+	++channelCount;
+	++pendingCount;
+
+	epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.fd = fd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		perror("EPOLL_CTL_ADD failed");
+		for (int i = index; i < channelCount - 1; ++i) {
+			channels[i] = channels[i + 1];
+		}
+		--channelCount;
+		--pendingCount;
+		return false;
+	}
+
+	return true;
+}
+
+bool EventLoop::Wait(int timeoutMs)
+{
+	epoll_event events[MAX_CHANNELS];
+
+	int readyCount = epoll_wait(epollFd, events, MAX_CHANNELS, timeoutMs);
+	if (readyCount < 0) {
+		/* Signals only cut the wait short */
+		return errno == EINTR;
+	}
+
+	for (int e = 0; e < readyCount; ++e) {
+		for (int i = 0; i < channelCount; ++i) {
+			if (channels[i].fd == events[e].data.fd && !channels[i].pending) {
+				channels[i].pending = true;
+				++pendingCount;
+			}
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,89 @@
+#ifndef UTIL_EVENT_LOOP_HPP_
+#define UTIL_EVENT_LOOP_HPP_
+
+#include <cstdint>
+#include <cerrno>
+#include <sys/epoll.h>
+
+/* Waits for several receive channels with one persistent epoll set.
+ *
+ * Descriptors are edge-triggered: epoll only reports a channel again after
+ * new packets arrive, so the handler must read until the channel would block
+ * (e.g. CommInterface::TryReceive returns 0). A handler may stop earlier by
+ * returning false; the channel is then run again on the next RunOnce without
+ * waiting.
+ *
+ * Ready channels are run in priority order, lowest value first, so T0 is
+ * always handled before T1 and T2 when several are ready.
+ *
+ * The handler is a template parameter instead of a std::function so that
+ * the call is direct and can be inlined.
+ */
+class EventLoop {
+public:
+	static constexpr int MAX_CHANNELS = 8;
+
+	EventLoop() = default;
+	~EventLoop();
+
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+
+	bool Open();
+	void Close();
+
+	/* Handler gets id when fd is ready */
+	bool Add(int fd, int id, int priority);
+
+	/* Waits up to timeoutMs (-1 is forever) unless a channel is still pending,
+	 * then calls handler(id) for every ready channel. handler returns true when
+	 * the channel has been drained. Returns the number of handler calls or -1
+	 * on error.
+	 */
+	template<typename Handler>
+	int RunOnce(int timeoutMs, Handler&& handler);
+
+private:
+	struct Channel {
+		int fd;
+		int id;
+		int priority;
+		bool pending;
+	};
+
+	/* Marks the channels epoll reports as pending, returns false on error */
+	bool Wait(int timeoutMs);
+
+	int epollFd = -1;
+
+	/* Sorted by priority */
+	Channel channels[MAX_CHANNELS];
+	int channelCount = 0;
+	int pendingCount = 0;
+};
+
+template<typename Handler>
+int EventLoop::RunOnce(int timeoutMs, Handler&& handler)
+{
+	if (!Wait(pendingCount > 0 ? 0 : timeoutMs)) {
+		return -1;
+	}
+
+	int calls = 0;
+	for (int i = 0; i < channelCount; ++i) {
+		Channel& channel = channels[i];
+		if (!channel.pending) {
+			continue;
+		}
+
+		++calls;
+		if (handler(channel.id)) {
+			channel.pending = false;
+			--pendingCount;
+		}
+	}
+
+	return calls;
+}
+
+#endif  // UTIL_EVENT_LOOP_HPP_
@@ -3,12 +3,16 @@
 #include <sys/ioctl.h>
 #include <sys/fcntl.h>
 #include <unistd.h>
-#include <cassert>
+#include <time.h>
+#include <cstdio>
 
 #define MAP_SIZE 4096UL
 #define MAP_MASK (MAP_SIZE - 1)
 
 #define GLOBAL_TIMER_PHYS_ADDR 0xF8F00200U
+
+/* CPU clock, the global timer runs at half of it */
+#define CPU_CLOCK_HZ 666666687ull
 namespace {
 
 static volatile uint32_t* globalTimerRegs = 0;
@@ -16,28 +20,50 @@ static volatile uint32_t* globalTimerRegs = 0;
 class InitGlobalTimerHelper {
 public:
     InitGlobalTimerHelper() {
+#ifdef __arm__
         memfd = open("/dev/mem", O_RDWR | O_SYNC);
-        assert(memfd >= 0);
+        if (memfd < 0) {
+            perror("Opening /dev/mem failed, global_timer uses CLOCK_MONOTONIC_RAW");
+            return;
+        }
 
         mappedAddress = mmap(0, MAP_SIZE, PROT_READ, MAP_SHARED, memfd, GLOBAL_TIMER_PHYS_ADDR & ~MAP_MASK);
+        if (mappedAddress == MAP_FAILED) {
+            perror("Mapping the global timer failed, global_timer uses CLOCK_MONOTONIC_RAW");
+            mappedAddress = 0;
+            return;
+        }
 
         globalTimerRegs = (uint32_t*)((uint8_t*)mappedAddress + (GLOBAL_TIMER_PHYS_ADDR & MAP_MASK));
+#endif
     }
 
     ~InitGlobalTimerHelper() {
-        munmap(mappedAddress, MAP_SIZE);
-        close(memfd);
+        if (mappedAddress) munmap(mappedAddress, MAP_SIZE);
+        if (memfd >= 0) close(memfd);
     }
 
     int memfd  = -1;
     void* mappedAddress = 0;
 } s_init;
 
+/* Same ticks as XTime_GetTime of the simulated CPU1 in sim/bsp/xtime_l.h */
+static uint64_t MonotonicRawTicks()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ((uint64_t)ts.tv_sec * CPU_CLOCK_HZ + (uint64_t)ts.tv_nsec * CPU_CLOCK_HZ / 1000000000ull) / 2;
+}
+
 }
 
 
 global_timer::time_point global_timer::now()
 {
+    if (!globalTimerRegs) {
+        return time_point(duration(MonotonicRawTicks()));
+    }
+
     uint32_t high, low;
     do
     {
@@ -0,0 +1,496 @@
+#include "ipc_ring.hpp"
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstdio>
+#include <algorithm>
+#include "ipc-tunnel-ioctl.h"
+#include "ipc_copy.h"
+
+/* Must match struct ControlHeader of the kernel module */
+struct IpcRing::ControlHeader {
+	uint32_t cpu0WriteIndex;
+	uint32_t cpu0ReadIndex;
+	uint32_t cpu0Magic;
+	uint32_t cpu0Version;
+	uint32_t cpu0ReadEventIndex;
+	uint32_t cpu0SendStreamRingSize;
+	uint32_t cpu0ReceiveStreamRingSize;
+
+	uint32_t padding1[1];
+
+	uint32_t cpu1WriteIndex;
+	uint32_t cpu1ReadIndex;
+	uint32_t cpu1Magic;
+	uint32_t cpu1Version;
+	uint32_t cpu1NotifySent;
+	uint32_t cpu1NotifySuppressed;
+	uint32_t cpu1SendStreamRingSize;
+	uint32_t cpu1ReceiveStreamRingSize;
+};
+
+struct PacketHeader {
+	uint32_t packetSize;
+	/* Write index of the packet in overwrite rings, commit time in trace rings */
+	uint32_t sequence;
+};
+
+static_assert(sizeof(PacketHeader) == 8, "PacketHeader must match the kernel module");
+
+static uint32_t StreamRecordSize(size_t packetSize)
+{
+	return (sizeof(PacketHeader) + packetSize + (IPC_TUNNEL_STREAM_RECORD_ALIGNMENT - 1u)) & ~(IPC_TUNNEL_STREAM_RECORD_ALIGNMENT - 1u);
+}
+
+static uint32_t LoadAcquire(const uint32_t* ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static void StoreRelease(uint32_t* ptr, uint32_t value)
+{
+	__atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+IpcRing::~IpcRing()
+{
+	Close();
+}
+
+void* IpcRing::Map(uint32_t offset, size_t size)
+{
+	void* ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+	if (ptr == MAP_FAILED) {
+		perror("mmap failed");
+		return nullptr;
+	}
+
+	return ptr;
+}
+
+bool IpcRing::Open(const std::string& devName, bool nonBlocking)
+{
+	Close();
+
+	fd = open(devName.c_str(), O_RDWR | (nonBlocking ? O_NONBLOCK : 0));
+	if (fd < 0) {
+		perror("open failed");
+		return false;
+	}
+
+	ipc_tunnel_layout layout;
+	if (ioctl(fd, IPC_TUNNEL_IOC_GET_LAYOUT, &layout) != 0) {
+		perror("IPC_TUNNEL_IOC_GET_LAYOUT failed");
+		Close();
+		return false;
+	}
+
+	if (layout.magic != IPC_TUNNEL_MAGIC || layout.version != IPC_TUNNEL_LAYOUT_VERSION) {
+		fprintf(stderr, "ipc_tunnel layout version %u, expected %u\n", layout.version, IPC_TUNNEL_LAYOUT_VERSION);
+		Close();
+		return false;
+	}
+
+	if (layout.flags & IPC_TUNNEL_LAYOUT_CACHE_MAINTAINED) {
+		fprintf(stderr, "%s is cache-maintained, its rings can't be mapped to user space\n", devName.c_str());
+		Close();
+		return false;
+	}
+
+	headerMapSize = layout.control_header_map_size;
+	headerMap = (uint8_t*)Map(IPC_TUNNEL_MMAP_CONTROL_HEADER, headerMapSize);
+	sendMapSize = layout.send.map_size;
+	sendMap = (uint8_t*)Map(IPC_TUNNEL_MMAP_SEND_RING, sendMapSize);
+	receiveMapSize = layout.receive.map_size;
+	receiveMap = (uint8_t*)Map(IPC_TUNNEL_MMAP_RECEIVE_RING, receiveMapSize);
+
+	if (!headerMap || !sendMap || !receiveMap) {
+		Close();
+		return false;
+	}
+
+	header = reinterpret_cast<ControlHeader*>(headerMap + layout.control_header_offset);
+
+	sendRing = sendMap + layout.send.offset;
+	sendSlotSize = layout.send.slot_size;
+	sendSlotCount = layout.send.slot_count;
+	sendMaxPacketSize = layout.send.max_packet_size;
+	sendStream = layout.send.flags & IPC_TUNNEL_RING_STREAM;
+	sendOverwrite = layout.send.flags & IPC_TUNNEL_RING_OVERWRITE;
+
+	receiveRing = receiveMap + layout.receive.offset;
+	receiveSlotSize = layout.receive.slot_size;
+	receiveSlotCount = layout.receive.slot_count;
+	receiveStream = layout.receive.flags & IPC_TUNNEL_RING_STREAM;
+	receiveOverwrite = layout.receive.flags & IPC_TUNNEL_RING_OVERWRITE;
+	receiveTraced = layout.receive.flags & IPC_TUNNEL_RING_TRACE;
+	cachedRings = layout.flags & IPC_TUNNEL_LAYOUT_CACHED;
+
+	sharedMapSize = layout.shared_buffer_size;
+	peerVerified = false;
+	overwritten = 0;
+
+	return true;
+}
+
+bool IpcRing::Attach(const ipc_tunnel_layout& layout, uint8_t* controlHeader, uint8_t* sendRing, uint8_t* receiveRing, uint8_t* sharedBuffer)
+{
+	Close();
+
+	attached = true;
+	header = reinterpret_cast<ControlHeader*>(controlHeader);
+
+	this->sendRing = sendRing;
+	sendSlotSize = layout.send.slot_size;
+	sendSlotCount = layout.send.slot_count;
+	sendMaxPacketSize = layout.send.max_packet_size;
+	sendStream = layout.send.flags & IPC_TUNNEL_RING_STREAM;
+	sendOverwrite = layout.send.flags & IPC_TUNNEL_RING_OVERWRITE;
+
+	this->receiveRing = receiveRing;
+	receiveSlotSize = layout.receive.slot_size;
+	receiveSlotCount = layout.receive.slot_count;
+	receiveStream = layout.receive.flags & IPC_TUNNEL_RING_STREAM;
+	receiveOverwrite = layout.receive.flags & IPC_TUNNEL_RING_OVERWRITE;
+	receiveTraced = layout.receive.flags & IPC_TUNNEL_RING_TRACE;
+	cachedRings = layout.flags & IPC_TUNNEL_LAYOUT_CACHED;
+
+	sharedMap = sharedBuffer;
+	sharedMapSize = layout.shared_buffer_size;
+	peerVerified = false;
+	overwritten = 0;
+
+	header->cpu0WriteIndex = 0;
+	header->cpu0ReadIndex = 0;
+	header->cpu0ReadEventIndex = 0;
+	header->cpu0SendStreamRingSize = sendStream ? sendSlotSize * sendSlotCount : 0;
+	header->cpu0ReceiveStreamRingSize = receiveStream ? receiveSlotSize * receiveSlotCount : 0;
+	header->cpu0Version = IPC_TUNNEL_LAYOUT_VERSION;
+	StoreRelease(&header->cpu0Magic, IPC_TUNNEL_MAGIC);
+
+	return true;
+}
+
+void IpcRing::Close()
+{
+	if (!attached) {
+		if (headerMap) munmap(headerMap, headerMapSize);
+		if (sendMap) munmap(sendMap, sendMapSize);
+		if (receiveMap) munmap(receiveMap, receiveMapSize);
+		if (sharedMap) munmap(sharedMap, sharedMapSize);
+	}
+
+	attached = false;
+	headerMap = sendMap = receiveMap = sharedMap = nullptr;
+	header = nullptr;
+
+	if (eventFd >= 0) {
+		close(eventFd);
+		eventFd = -1;
+	}
+
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+}
+
+/* Same rules as check_peer_layout in the kernel module */
+bool IpcRing::CheckPeer()
+{
+	if (peerVerified) {
+		return true;
+	}
+
+	uint32_t magic = LoadAcquire(&header->cpu1Magic);
+	if (magic != IPC_TUNNEL_MAGIC || header->cpu1Version != IPC_TUNNEL_LAYOUT_VERSION) {
+		return false;
+	}
+
+	uint32_t sendStreamRingSize = sendStream ? sendSlotSize * sendSlotCount : 0;
+	uint32_t receiveStreamRingSize = receiveStream ? receiveSlotSize * receiveSlotCount : 0;
+	if (header->cpu1SendStreamRingSize != sendStreamRingSize || header->cpu1ReceiveStreamRingSize != receiveStreamRingSize) {
+		return false;
+	}
+
+	/* CPU1 resets the indices when it initializes the tunnel */
+	writeIndex = header->cpu0WriteIndex;
+	readIndex = header->cpu0ReadIndex;
+	cachedCpu1ReadIndex = LoadAcquire(&header->cpu1ReadIndex);
+	cachedCpu1WriteIndex = LoadAcquire(&header->cpu1WriteIndex);
+	peerVerified = true;
+	return true;
+}
+
+IpcRing::Span IpcRing::BeginRead()
+{
+	if (!CheckPeer()) {
+		return {nullptr, 0};
+	}
+
+	for (;;) {
+		if (readIndex == cachedCpu1WriteIndex) {
+			/* Looks empty, check if CPU1 has written something since last time */
+			cachedCpu1WriteIndex = LoadAcquire(&header->cpu1WriteIndex);
+
+			if (readIndex == cachedCpu1WriteIndex) {
+				return {nullptr, 0};
+			}
+		}
+
+		if (receiveOverwrite && cachedCpu1WriteIndex - readIndex > receiveSlotCount) {
+			/* Oldest packets have already been overwritten */
+			overwritten += cachedCpu1WriteIndex - receiveSlotCount - readIndex;
+			readIndex = cachedCpu1WriteIndex - receiveSlotCount;
+		}
+
+		if (!receiveStream) {
+			uint8_t* slot = receiveRing + receiveSlotSize * (readIndex & (receiveSlotCount - 1u));
+			PacketHeader* packet = reinterpret_cast<PacketHeader*>(slot);
+
+			if (receiveOverwrite && !IsSlotValid(slot, readIndex)) {
+				/* CPU1 is writing to the slot right now */
+				++overwritten;
+				++readIndex;
+				cachedCpu1WriteIndex = LoadAcquire(&header->cpu1WriteIndex);
+				continue;
+			}
+
+			size_t size = std::min<size_t>(packet->packetSize, receiveSlotSize - sizeof(PacketHeader));
+
+			nextReadIndex = readIndex + 1;
+			return {slot + sizeof(PacketHeader), size};
+		}
+
+		uint32_t ringSize = receiveSlotSize * receiveSlotCount;
+		uint32_t offset = readIndex & (ringSize - 1u);
+		PacketHeader* packet = reinterpret_cast<PacketHeader*>(receiveRing + offset);
+
+		if (packet->packetSize != IPC_TUNNEL_STREAM_PADDING) {
+			size_t size = std::min<size_t>(packet->packetSize, ringSize - offset - sizeof(PacketHeader));
+
+			nextReadIndex = readIndex + StreamRecordSize(packet->packetSize);
+			return {receiveRing + offset + sizeof(PacketHeader), size};
+		}
+
+		/* Skip the padding at the end of the ring right away, CPU1 may be
+		 * waiting for the space
+		 */
+		readIndex += ringSize - offset;
+		StoreRelease(&header->cpu0ReadIndex, readIndex);
+	}
+}
+
+bool IpcRing::EndRead()
+{
+	bool intact = true;
+
+	if (receiveOverwrite) {
+		uint8_t* slot = receiveRing + receiveSlotSize * ((nextReadIndex - 1u) & (receiveSlotCount - 1u));
+		if (!IsSlotValid(slot, nextReadIndex - 1u)) {
+			++overwritten;
+			intact = false;
+		}
+	}
+
+	readIndex = nextReadIndex;
+	StoreRelease(&header->cpu0ReadIndex, readIndex);
+	return intact;
+}
+
+bool IpcRing::GetCommitTicks(const Span& packet, uint32_t& ticks) const
+{
+	if (!receiveTraced) {
+		return false;
+	}
+
+	ticks = reinterpret_cast<const PacketHeader*>(packet.data - sizeof(PacketHeader))->sequence;
+	return true;
+}
+
+/* Same seqlock check as overwrite_slot_valid in the kernel module */
+bool IpcRing::IsSlotValid(const uint8_t* slot, uint32_t index) const
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&reinterpret_cast<const PacketHeader*>(slot)->sequence, __ATOMIC_RELAXED) == index;
+}
+
+bool IpcRing::HasSendSpace(uint32_t amount, uint32_t capacity)
+{
+	if (writeIndex - cachedCpu1ReadIndex + amount > capacity) {
+		/* Looks full, check if CPU1 has consumed something since last time */
+		cachedCpu1ReadIndex = LoadAcquire(&header->cpu1ReadIndex);
+
+		if (writeIndex - cachedCpu1ReadIndex + amount > capacity) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+IpcRing::Span IpcRing::BeginWrite(size_t size)
+{
+	if (!CheckPeer() || size > sendMaxPacketSize) {
+		return {nullptr, 0};
+	}
+
+	if (!sendStream) {
+		/* Overwrite rings are never full, the oldest unread packet is given up */
+		if (!sendOverwrite && !HasSendSpace(1, sendSlotCount)) {
+			return {nullptr, 0};
+		}
+
+		uint8_t* slot = sendRing + sendSlotSize * (writeIndex & (sendSlotCount - 1u));
+		if (sendOverwrite) {
+			/* Sequence before the payload, see IsSlotValid */
+			__atomic_store_n(&reinterpret_cast<PacketHeader*>(slot)->sequence, writeIndex, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		}
+		return {slot + sizeof(PacketHeader), size};
+	}
+
+	uint32_t ringSize = sendSlotSize * sendSlotCount;
+	uint32_t recordSize = StreamRecordSize(size);
+	uint32_t tail = ringSize - (writeIndex & (ringSize - 1u));
+
+	if (recordSize > tail) {
+		/* Same as the kernel module: padding is published on its own so
+		 * CPU1 can skip it while the record still waits for space
+		 */
+		if (!HasSendSpace(tail, ringSize)) {
+			return {nullptr, 0};
+		}
+
+		reinterpret_cast<PacketHeader*>(sendRing + (writeIndex & (ringSize - 1u)))->packetSize = IPC_TUNNEL_STREAM_PADDING;
+		writeIndex += tail;
+		StoreRelease(&header->cpu0WriteIndex, writeIndex);
+	}
+
+	if (!HasSendSpace(recordSize, ringSize)) {
+		return {nullptr, 0};
+	}
+
+	return {sendRing + (writeIndex & (ringSize - 1u)) + sizeof(PacketHeader), size};
+}
+
+void IpcRing::EndWrite(size_t size)
+{
+	if (!sendStream) {
+		uint8_t* slot = sendRing + sendSlotSize * (writeIndex & (sendSlotCount - 1u));
+		reinterpret_cast<PacketHeader*>(slot)->packetSize = size;
+
+		writeIndex += 1;
+	}
+	else {
+		uint32_t ringSize = sendSlotSize * sendSlotCount;
+		reinterpret_cast<PacketHeader*>(sendRing + (writeIndex & (ringSize - 1u)))->packetSize = size;
+
+		writeIndex += StreamRecordSize(size);
+	}
+
+	StoreRelease(&header->cpu0WriteIndex, writeIndex);
+}
+
+bool IpcRing::WaitReadable(std::chrono::microseconds spinTime, int timeoutMs)
+{
+	auto spinStart = std::chrono::steady_clock::now();
+	auto spinEnd = spinStart + spinTime;
+	auto now = spinStart;
+	bool found = false;
+	do {
+		if (BeginRead()) {
+			found = true;
+			break;
+		}
+		now = std::chrono::steady_clock::now();
+	} while (now < spinEnd);
+
+	waitStats.spinNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - spinStart).count();
+	if (found) {
+		waitStats.hits++;
+		return true;
+	}
+	waitStats.misses++;
+
+	/* Kernel reloads the published read index before checking the ring
+	 * and sets the read event index before sleeping
+	 */
+	pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	int ret = poll(&pfd, 1, timeoutMs);
+	if (ret <= 0 || (pfd.revents & POLLERR)) {
+		return false;
+	}
+
+	return (bool)BeginRead();
+}
+
+void IpcRing::ArmReadEvent()
+{
+	/* Same as publish_read_event_index in the kernel module */
+	StoreRelease(&header->cpu0ReadEventIndex, readIndex);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+bool IpcRing::WaitEvent(int timeoutMs)
+{
+	if (eventFd < 0) {
+		if (fd < 0) {
+			return false;
+		}
+
+		eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (eventFd < 0) {
+			perror("eventfd failed");
+			return false;
+		}
+
+		__s32 registeredFd = eventFd;
+		if (ioctl(fd, IPC_TUNNEL_IOC_SET_EVENTFD, &registeredFd) != 0) {
+			perror("IPC_TUNNEL_IOC_SET_EVENTFD failed");
+			close(eventFd);
+			eventFd = -1;
+			return false;
+		}
+	}
+
+	pollfd pfd;
+	pfd.fd = eventFd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, timeoutMs) <= 0) {
+		return false;
+	}
+
+	/* Clears the count, every notification before this one is handled */
+	eventfd_t count;
+	eventfd_read(eventFd, &count);
+	return true;
+}
+
+uint8_t* IpcRing::MapSharedBuffer()
+{
+	if (sharedMap) return sharedMap;
+	if (sharedMapSize == 0) return nullptr;
+
+	sharedMap = (uint8_t*)Map(IPC_TUNNEL_MMAP_SHARED_BUFFER, sharedMapSize);
+	return sharedMap;
+}
+
+void IpcRing::Copy(void* dst, const void* src, size_t size) const
+{
+	if (cachedRings) {
+		IPC_COPY_Cached(dst, src, size);
+	}
+	else {
+		IPC_COPY_WriteCombining(dst, src, size);
+	}
+}
@@ -0,0 +1,155 @@
+#ifndef UTIL_IPC_RING_HPP_
+#define UTIL_IPC_RING_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <string>
+
+struct ipc_tunnel_layout;
+
+/* User space implementation of the ipc_tunnel ring protocol (layout v7).
+ *
+ * Control header and both rings of /dev/ipc_tunnelN are mapped to the process
+ * so packets are read and written without system calls or copies.
+ * The file descriptor is only used for waiting with poll().
+ *
+ * Ring must not be used through read()/write() at the same time.
+ */
+class IpcRing {
+public:
+	struct WaitStats {
+		uint64_t spinNs = 0;
+		uint32_t hits = 0;
+		uint32_t misses = 0;
+	};
+
+	struct Span {
+		uint8_t* data;
+		size_t size;
+
+		explicit operator bool() const { return data != nullptr; }
+	};
+
+	IpcRing() = default;
+	~IpcRing();
+
+	IpcRing(const IpcRing&) = delete;
+	IpcRing& operator=(const IpcRing&) = delete;
+
+	bool Open(const std::string& devName, bool nonBlocking);
+	/* Uses a tunnel placed in memory the caller has already mapped instead of
+	 * a device. Offsets and map sizes of the layout are ignored. Stamps the
+	 * CPU0 half of the control header like the kernel module does when it
+	 * places the tunnel. There is no file descriptor to poll.
+	 */
+	bool Attach(const ipc_tunnel_layout& layout, uint8_t* controlHeader, uint8_t* sendRing, uint8_t* receiveRing, uint8_t* sharedBuffer);
+	void Close();
+
+	int GetFd() const { return fd; }
+	size_t GetMaxPacketSize() const { return sendMaxPacketSize; }
+
+	/* Returns the next received packet or an empty span if there is none.
+	 * Packet stays in the ring until EndRead. EndRead returns false if CPU1
+	 * overwrote the packet while it was being read, which only happens with
+	 * overwrite rings (IPC_TUNNEL_RING_OVERWRITE). Packet is consumed anyway.
+	 */
+	Span BeginRead();
+	bool EndRead();
+
+	/* Global timer (low 32 bits) when CPU1 committed packet, a span of
+	 * BeginRead before its EndRead. Returns false if the receive ring isn't
+	 * traced (IPC_TUNNEL_RING_TRACE).
+	 */
+	bool GetCommitTicks(const Span& packet, uint32_t& ticks) const;
+
+	/* Returns space for a packet of up to size bytes or an empty span if the
+	 * ring is full. Packet is sent with EndWrite, size must not grow.
+	 */
+	Span BeginWrite(size_t size);
+	void EndWrite(size_t size);
+
+	/* Spins for spinTime checking the receive ring and then sleeps in poll().
+	 * Returns false on timeout or error.
+	 */
+	bool WaitReadable(std::chrono::microseconds spinTime, int timeoutMs = -1);
+	const WaitStats& GetWaitStats() const { return waitStats; }
+
+	/* Packets of an overwrite receive ring lost to CPU1 before they were read */
+	uint32_t GetOverwrittenCount() const { return overwritten; }
+
+	/* Asks CPU1 to notify when the next packet arrives. Check the ring once
+	 * more after this before sleeping, like the kernel module does.
+	 */
+	void ArmReadEvent();
+
+	/* Sleeps in poll() until the next notify interrupt of the tunnel, with or
+	 * without a packet, or timeout. The eventfd is registered with
+	 * IPC_TUNNEL_IOC_SET_EVENTFD on first use. Returns true if notified,
+	 * false on timeout or if the tunnel has no device or the module doesn't
+	 * support it.
+	 */
+	bool WaitEvent(int timeoutMs);
+
+	/* Shared buffer of the tunnel, mapped on first use */
+	uint8_t* MapSharedBuffer();
+
+	/* Copies a payload to or from a span of this ring with the copy routine
+	 * of include/ipc_copy.h that matches how the rings are mapped.
+	 */
+	void Copy(void* dst, const void* src, size_t size) const;
+
+private:
+	struct ControlHeader;
+
+	bool CheckPeer();
+	bool HasSendSpace(uint32_t amount, uint32_t capacity);
+	bool IsSlotValid(const uint8_t* slot, uint32_t index) const;
+
+	void* Map(uint32_t offset, size_t size);
+
+	int fd = -1;
+	int eventFd = -1;
+	bool attached = false;
+
+	ControlHeader* header = nullptr;
+
+	uint8_t* headerMap = nullptr;
+	size_t headerMapSize = 0;
+	uint8_t* sendMap = nullptr;
+	size_t sendMapSize = 0;
+	uint8_t* receiveMap = nullptr;
+	size_t receiveMapSize = 0;
+	uint8_t* sharedMap = nullptr;
+	size_t sharedMapSize = 0;
+
+	uint8_t* sendRing = nullptr;
+	uint32_t sendSlotSize = 0;
+	uint32_t sendSlotCount = 0;
+	uint32_t sendMaxPacketSize = 0;
+	bool sendStream = false;
+	bool sendOverwrite = false;
+
+	uint8_t* receiveRing = nullptr;
+	uint32_t receiveSlotSize = 0;
+	uint32_t receiveSlotCount = 0;
+	bool receiveStream = false;
+	bool receiveOverwrite = false;
+	bool receiveTraced = false;
+
+	/* IPC_TUNNEL_LAYOUT_CACHED, otherwise rings are mapped write-combining */
+	bool cachedRings = false;
+
+	/* Same bookkeeping as in the kernel module */
+	uint32_t writeIndex = 0;
+	uint32_t readIndex = 0;
+	uint32_t nextReadIndex = 0;
+	uint32_t cachedCpu1ReadIndex = 0;
+	uint32_t cachedCpu1WriteIndex = 0;
+	bool peerVerified = false;
+	uint32_t overwritten = 0;
+
+	WaitStats waitStats;
+};
+
+#endif  // UTIL_IPC_RING_HPP_
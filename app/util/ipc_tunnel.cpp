@@ -4,8 +4,12 @@
 #include <errno.h>
 #include <stdint.h>
 #include <unistd.h>
-
-static constexpr size_t T0_SHM_SIZE = 0x1000;
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <algorithm>
+#include <cstdio>
+#include "ipc-tunnel-ioctl.h"
 
 IpcTunnel::IpcTunnel(IpcTunnel::Memory mem) :
     mem(mem)
@@ -16,7 +20,11 @@ IpcTunnel::IpcTunnel(IpcTunnel::Memory mem) :
 IpcTunnel::~IpcTunnel()
 {
     if (shm) {
-        munmap(shm, T0_SHM_SIZE);
+        munmap(shm, shmSize);
+    }
+    
+    if (t0EventFd >= 0) {
+        close(t0EventFd);
     }
     
     for (int i = 0; i < 3; ++i) {
@@ -28,12 +36,17 @@ IpcTunnel::~IpcTunnel()
 
 std::string IpcTunnel::GetInterfaceName()
 {
-    return std::string("IpcTunnel") + (mem == Memory::OCM ? "OCM" : "DDR");
+    std::string name = std::string("IpcTunnel") + (mem == Memory::OCM ? "OCM" : "DDR");
+    if (!memoryMode.empty()) {
+        name += "-" + memoryMode;
+    }
+    return name;
 }
 
 bool IpcTunnel::Initialize(bool blockT0)
 {
     int devIndex = mem == Memory::OCM ? 0 : 3;
+    this->blockT0 = blockT0;
 
     for (int i = 0; i < 3; ++i) {
         std::string devName("/dev/ipc_tunnel");
@@ -44,7 +57,35 @@ bool IpcTunnel::Initialize(bool blockT0)
     
     nfds = (fds[1] > fds[2] ? fds[1] : fds[2]) + 1;
     
-    return fds[0] > 0 && fds[1] > 0 && fds[2] > 0;
+    if (fds[0] <= 0 || fds[1] <= 0 || fds[2] <= 0) {
+        return false;
+    }
+    
+    for (int i = 0; i < 3; ++i) {
+        ipc_tunnel_layout layout;
+        if (ioctl(fds[i], IPC_TUNNEL_IOC_GET_LAYOUT, &layout) != 0) {
+            perror("IPC_TUNNEL_IOC_GET_LAYOUT failed");
+            return false;
+        }
+        
+        maxPacketSizes[i] = layout.send.max_packet_size;
+        if (i == 0) {
+            shmSize = layout.shared_buffer_size;
+            
+            /* Benchmark results of the memory modes are told apart by the name */
+            if (layout.flags & IPC_TUNNEL_LAYOUT_CACHED) {
+                memoryMode = "cached";
+            }
+            else if (layout.flags & IPC_TUNNEL_LAYOUT_CACHE_MAINTAINED) {
+                memoryMode = "maintained";
+            }
+            else {
+                memoryMode = "uncached";
+            }
+        }
+    }
+    
+    return true;
 }
 
 bool IpcTunnel::Send(Target t, const uint8_t *data, size_t size)
@@ -62,6 +103,66 @@ size_t IpcTunnel::ReceiveT0(uint8_t* data, size_t bufSize)
     return 0;
 }
 
+size_t IpcTunnel::SendBatch(Target t, const PacketView* packets, size_t count)
+{
+    ipc_tunnel_packet descs[IPC_TUNNEL_MAX_BATCH];
+    size_t sent = 0;
+    
+    while (sent < count) {
+        uint32_t chunk = std::min<size_t>(count - sent, IPC_TUNNEL_MAX_BATCH);
+        for (uint32_t i = 0; i < chunk; ++i) {
+            descs[i].data = reinterpret_cast<uintptr_t>(packets[sent + i].data);
+            descs[i].size = packets[sent + i].size;
+            descs[i].flags = 0;
+        }
+        
+        ipc_tunnel_batch batch;
+        batch.packets = reinterpret_cast<uintptr_t>(descs);
+        batch.count = chunk;
+        batch.flags = 0;
+        
+        int moved = ioctl(fds[(int)t], IPC_TUNNEL_IOC_WRITE_BATCH, &batch);
+        if (moved <= 0) {
+            break;
+        }
+        
+        sent += moved;
+        if ((uint32_t)moved < chunk) {
+            break;
+        }
+    }
+    
+    return sent;
+}
+
+size_t IpcTunnel::ReceiveBatch(Target t, PacketBuffer* packets, size_t count)
+{
+    ipc_tunnel_packet descs[IPC_TUNNEL_MAX_BATCH];
+    uint32_t chunk = std::min<size_t>(count, IPC_TUNNEL_MAX_BATCH);
+    
+    for (uint32_t i = 0; i < chunk; ++i) {
+        descs[i].data = reinterpret_cast<uintptr_t>(packets[i].data);
+        descs[i].size = packets[i].size;
+        descs[i].flags = 0;
+    }
+    
+    ipc_tunnel_batch batch;
+    batch.packets = reinterpret_cast<uintptr_t>(descs);
+    batch.count = chunk;
+    batch.flags = 0;
+    
+    int moved = ioctl(fds[(int)t], IPC_TUNNEL_IOC_READ_BATCH, &batch);
+    if (moved <= 0) {
+        return 0;
+    }
+    
+    for (int i = 0; i < moved; ++i) {
+        packets[i].size = descs[i].size;
+    }
+    
+    return moved;
+}
+
 void IpcTunnel::ReceiveAny(uint8_t *buf, size_t size, const std::function<void (Target, const uint8_t *, size_t)> &receiveCb)
 {
     fd_set read_fds;
@@ -117,18 +218,109 @@ void IpcTunnel::ReceiveT1OrT2(uint8_t* buf, size_t size, const std::function<voi
     }
 }
 
+int IpcTunnel::GetReceiveFd(Target t)
+{
+    /* A blocking read can't tell that the ring is drained */
+    if (t == Target::T0 && blockT0) {
+        return -1;
+    }
+    
+    return fds[(int)t];
+}
+
+/* A read that finds the ring empty makes the module ask CPU1 to notify the
+ * next packet before it returns EAGAIN, so the descriptor becomes readable
+ * again for an edge-triggered EventLoop
+ */
+size_t IpcTunnel::TryReceive(Target t, uint8_t* buf, size_t size)
+{
+    ssize_t readBytes = read(fds[(int)t], buf, size);
+    if (readBytes > 0) {
+        return readBytes;
+    }
+    
+    return 0;
+}
+
+static_assert(PacketTrace::Commit == IPC_TUNNEL_TRACE_COMMIT && PacketTrace::Sgi == IPC_TUNNEL_TRACE_SGI
+              && PacketTrace::Irq == IPC_TUNNEL_TRACE_IRQ && PacketTrace::Dequeue == IPC_TUNNEL_TRACE_DEQUEUE
+              && PacketTrace::Copy == IPC_TUNNEL_TRACE_COPY, "PacketTrace must match the kernel module");
+
+size_t IpcTunnel::TryReceiveTraced(Target t, uint8_t* buf, size_t size, PacketTrace& trace)
+{
+    if (!traceSupported) {
+        trace.valid = 0;
+        return TryReceive(t, buf, size);
+    }
+    
+    ipc_tunnel_traced_read read;
+    read.data = reinterpret_cast<uintptr_t>(buf);
+    read.size = size;
+    read.reserved = 0;
+    
+    int readBytes = ioctl(fds[(int)t], IPC_TUNNEL_IOC_READ_TRACED, &read);
+    if (readBytes < 0) {
+        if (errno == ENOTTY || errno == EOPNOTSUPP) {
+            perror("IPC_TUNNEL_IOC_READ_TRACED failed, packets aren't traced");
+            traceSupported = false;
+            return TryReceiveTraced(t, buf, size, trace);
+        }
+        return 0;
+    }
+    
+    trace.commit = read.trace.commit;
+    trace.sgi = read.trace.sgi;
+    trace.irq = read.trace.irq;
+    trace.dequeue = read.trace.dequeue;
+    trace.copy = read.trace.copy;
+    trace.valid = read.trace.valid;
+    return readBytes;
+}
+
+/* The ioctl waits like read() when T0 is opened blocking */
+size_t IpcTunnel::ReceiveT0Traced(uint8_t* data, size_t bufSize, PacketTrace& trace)
+{
+    return TryReceiveTraced(Target::T0, data, bufSize, trace);
+}
+
 uint16_t IpcTunnel::GetMaxPacketSize(Target t) const
 {
-    static constexpr uint16_t sizes[3] = { 0x780, 0x780, 0x1200 };
+    return maxPacketSizes[(int)t];
+}
+
+bool IpcTunnel::SetBusyPoll(std::chrono::microseconds budget)
+{
+    __u32 usecs = budget.count();
+    
+    for (int i = 0; i < 3; ++i) {
+        if (ioctl(fds[i], IPC_TUNNEL_IOC_SET_BUSY_POLL, &usecs) != 0) {
+            perror("IPC_TUNNEL_IOC_SET_BUSY_POLL failed");
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool IpcTunnel::GetBusyPollStats(Target t, BusyPollStats& stats)
+{
+    ipc_tunnel_busy_poll_stats kstats;
+    if (ioctl(fds[(int)t], IPC_TUNNEL_IOC_GET_BUSY_POLL_STATS, &kstats) != 0) {
+        return false;
+    }
     
-    return sizes[(int)t];
+    stats.spinNs = kstats.spin_ns;
+    stats.hits = kstats.hits;
+    stats.misses = kstats.misses;
+    return true;
 }
 
 uint8_t *IpcTunnel::MapT0SharedMemory()
 {
     if (shm) return shm;
+    if (shmSize == 0) return nullptr;
     
-    uint8_t* ptr = (uint8_t*)mmap(0, T0_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    uint8_t* ptr = (uint8_t*)mmap(0, shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
     if (ptr == MAP_FAILED) {
         perror("mmap failed");
         return nullptr;
@@ -137,3 +329,36 @@ uint8_t *IpcTunnel::MapT0SharedMemory()
     shm = ptr;
     return shm;
 }
+
+/* Same as IpcRing::WaitEvent */
+bool IpcTunnel::WaitT0Event(int timeoutMs)
+{
+    if (t0EventFd < 0) {
+        t0EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (t0EventFd < 0) {
+            perror("eventfd failed");
+            return false;
+        }
+        
+        __s32 registeredFd = t0EventFd;
+        if (ioctl(fds[0], IPC_TUNNEL_IOC_SET_EVENTFD, &registeredFd) != 0) {
+            perror("IPC_TUNNEL_IOC_SET_EVENTFD failed");
+            close(t0EventFd);
+            t0EventFd = -1;
+            return false;
+        }
+    }
+    
+    pollfd pfd;
+    pfd.fd = t0EventFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    
+    if (poll(&pfd, 1, timeoutMs) <= 0) {
+        return false;
+    }
+    
+    eventfd_t count;
+    eventfd_read(t0EventFd, &count);
+    return true;
+}
@@ -17,20 +17,45 @@ public:
     bool Initialize(bool blockT0) override;
     bool Send(Target t, const uint8_t* data, size_t size) override;
     size_t ReceiveT0(uint8_t* data, size_t bufSize) override;
+    
+    size_t SendBatch(Target t, const PacketView* packets, size_t count) override;
+    size_t ReceiveBatch(Target t, PacketBuffer* packets, size_t count) override;
 
     void ReceiveAny(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb) override;
     void ReceiveT1OrT2(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb) override;
+    int GetReceiveFd(Target t) override;
+    size_t TryReceive(Target t, uint8_t* buf, size_t size) override;
+    size_t TryReceiveTraced(Target t, uint8_t* buf, size_t size, PacketTrace& trace) override;
+    size_t ReceiveT0Traced(uint8_t* data, size_t bufSize, PacketTrace& trace) override;
     
     uint16_t GetMaxPacketSize(Target t) const override;
     
+    bool SetBusyPoll(std::chrono::microseconds budget) override;
+    bool GetBusyPollStats(Target t, BusyPollStats& stats) override;
+    
     virtual uint8_t* MapT0SharedMemory() override;
+    bool WaitT0Event(int timeoutMs) override;
 private:
 	Memory mem;
 	
-	int fds[3];
+	int fds[3] = {-1, -1, -1};
     int nfds;
+    bool blockT0 = false;
+    
+    /* Registered to the T0 tunnel on first WaitT0Event */
+    int t0EventFd = -1;
     
     uint8_t* shm = 0;
+    size_t shmSize = 0;
+    
+    /* Read from the kernel module, the geometry comes from the device tree */
+    uint16_t maxPacketSizes[3] = { 0, 0, 0 };
+    
+    /* Memory mode of the T0 rings: cached, uncached or maintained */
+    std::string memoryMode;
+    
+    /* Cleared if the module can't trace, TryReceiveTraced reads then */
+    bool traceSupported = true;
 };
 
 
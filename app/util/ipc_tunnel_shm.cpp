@@ -0,0 +1,441 @@
+#include "ipc_tunnel_shm.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "ipc-tunnel-ioctl.h"
+#include "ipc_tunnel_sim.h"
+
+/* Default time spent spinning on the rings before sleeping */
+static constexpr std::chrono::microseconds DEFAULT_SPIN_TIME(20);
+
+/* Sleep between doorbell checks after the spin budget has run out */
+static constexpr long DOORBELL_POLL_INTERVAL_NS = 20000;
+
+#define DESCRIPTOR_MAGIC 0x49504344u  /* "IPCD" */
+#define DESCRIPTOR_VERSION 4u
+
+/* SGI of the ipc-tunnel device tree node, only recorded in the simulation */
+#define DOORBELL_SGI 14u
+
+/* Must match struct Doorbell of the kernel module */
+struct Doorbell {
+	uint32_t cpu0Acked;
+	uint32_t cpu0Raised;
+	uint32_t padding1[6];
+
+	uint32_t cpu1Raised;
+	uint32_t cpu1Acked;
+	uint32_t cpu1RaisedTicks;
+	uint32_t padding2[5];
+};
+
+/* Must match struct TunnelDescriptor of the kernel module */
+struct TunnelDescriptor {
+	uint32_t controlHeaderAddress;
+	uint32_t sendBufferAddress;
+	uint32_t receiveBufferAddress;
+	uint32_t sharedBufferAddress;
+	uint32_t sharedBufferSize;
+
+	uint32_t sendMaxPacketSize;
+	uint32_t sendBufferedPacketCount;
+	uint32_t receiveMaxPacketSize;
+	uint32_t receiveBufferedPacketCount;
+
+	uint32_t sendStreamRingSize;
+	uint32_t receiveStreamRingSize;
+
+	/* Never cache-maintained, the firmware of the simulation is built cached */
+	uint32_t flags;
+
+	uint32_t reserved[4];
+};
+
+/* Must match struct DescriptorBlock of the kernel module */
+struct IpcTunnelShm::DescriptorBlock {
+	Doorbell doorbell;
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t tunnelCount;
+	uint32_t doorbellSgi;
+	uint32_t cpu1DoorbellSgi;
+	uint32_t cpu1UrgentSgi;
+	uint32_t padding[2];
+
+	TunnelDescriptor tunnels[3];
+};
+
+static_assert(sizeof(TunnelDescriptor) == 64, "TunnelDescriptor must match the kernel module");
+
+/* TunnelDescriptor flags */
+#define TUNNEL_DESCRIPTOR_SEND_OVERWRITE 2u
+#define TUNNEL_DESCRIPTOR_RECEIVE_OVERWRITE 4u
+
+/* Same tunnels as T0-T2 of ipc-tunnel.dtsi */
+struct TunnelGeometry {
+	uint32_t sendMaxPacketSize;
+	uint32_t sendPacketCount;
+	uint32_t receiveMaxPacketSize;
+	uint32_t receivePacketCount;
+	uint32_t sendStreamRingSize;
+	uint32_t receiveStreamRingSize;
+	uint32_t sharedBufferSize;
+	/* send-overwrite and receive-overwrite properties, slot rings only */
+	bool sendOverwrite;
+	bool receiveOverwrite;
+};
+
+static const TunnelGeometry TUNNELS[3] = {
+	{ 0x780, 2, 0x780, 2, 0, 0, 0x1000, false, false },
+	{ 0x780, 4, 0x780, 4, 0x2000, 0x2000, 0, false, false },
+	{ 0x1200, 2, 0x1200, 2, 0x2000, 0x2000, 0x3000, false, false }
+};
+
+/* Firmware is built with IPC_TUNNEL_CACHED, slots are aligned to 32 bytes (cache line size) */
+static uint32_t SlotSize(uint32_t maxPacketSize)
+{
+	return (maxPacketSize + 8u + 31u) & ~31u;
+}
+
+static uint32_t Align(uint32_t value, uint32_t alignment)
+{
+	return (value + alignment - 1u) & ~(alignment - 1u);
+}
+
+IpcTunnelShm::IpcTunnelShm() :
+    spinTime(DEFAULT_SPIN_TIME)
+{
+
+}
+
+IpcTunnelShm::~IpcTunnelShm()
+{
+    DestroySegment();
+}
+
+std::string IpcTunnelShm::GetInterfaceName()
+{
+    return "IpcTunnelShm";
+}
+
+bool IpcTunnelShm::CreateSegment()
+{
+    /* Segment of a previous run that wasn't shut down */
+    shm_unlink(IPC_TUNNEL_SIM_SHM_NAME);
+
+    int fd = shm_open(IPC_TUNNEL_SIM_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror("shm_open failed");
+        return false;
+    }
+
+    if (ftruncate(fd, IPC_TUNNEL_SIM_SIZE) != 0) {
+        perror("ftruncate failed");
+        close(fd);
+        shm_unlink(IPC_TUNNEL_SIM_SHM_NAME);
+        return false;
+    }
+
+    void* ptr = mmap(0, IPC_TUNNEL_SIM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        perror("mmap failed");
+        shm_unlink(IPC_TUNNEL_SIM_SHM_NAME);
+        return false;
+    }
+
+    segment = (uint8_t*)ptr;
+    descriptors = reinterpret_cast<DescriptorBlock*>(segment + IPC_TUNNEL_SIM_DESCRIPTOR_OFFSET);
+    return true;
+}
+
+void IpcTunnelShm::DestroySegment()
+{
+    if (!segment) {
+        return;
+    }
+
+    for (IpcRing& ring : rings) {
+        ring.Close();
+    }
+
+    /* Same as unloading the module: CPU1 stops finding the tunnels */
+    __atomic_store_n(&descriptors->magic, 0u, __ATOMIC_RELEASE);
+
+    munmap(segment, IPC_TUNNEL_SIM_SIZE);
+    shm_unlink(IPC_TUNNEL_SIM_SHM_NAME);
+    segment = nullptr;
+    descriptors = nullptr;
+}
+
+bool IpcTunnelShm::PlaceTunnel(int i, uint32_t& offset)
+{
+    const TunnelGeometry& geometry = TUNNELS[i];
+    TunnelDescriptor& desc = descriptors->tunnels[i];
+
+    uint32_t sendSlotSize = SlotSize(geometry.sendMaxPacketSize);
+    uint32_t receiveSlotSize = SlotSize(geometry.receiveMaxPacketSize);
+    uint32_t sendRingSize = geometry.sendStreamRingSize ? geometry.sendStreamRingSize : sendSlotSize * geometry.sendPacketCount;
+    uint32_t receiveRingSize = geometry.receiveStreamRingSize ? geometry.receiveStreamRingSize : receiveSlotSize * geometry.receivePacketCount;
+
+    uint32_t controlHeaderOffset = Align(offset, 64);
+    uint32_t sendOffset = Align(controlHeaderOffset + 64, 64);
+    uint32_t receiveOffset = Align(sendOffset + sendRingSize, 64);
+    uint32_t sharedOffset = Align(receiveOffset + receiveRingSize, 4096);
+    offset = geometry.sharedBufferSize ? sharedOffset + geometry.sharedBufferSize : receiveOffset + receiveRingSize;
+
+    if (offset > IPC_TUNNEL_SIM_SIZE) {
+        fprintf(stderr, "Tunnel %d doesn't fit in the shared memory segment\n", i);
+        return false;
+    }
+
+    ipc_tunnel_layout layout;
+    std::memset(&layout, 0, sizeof(layout));
+    layout.magic = IPC_TUNNEL_MAGIC;
+    layout.version = IPC_TUNNEL_LAYOUT_VERSION;
+    layout.flags = IPC_TUNNEL_LAYOUT_CACHED;
+    layout.shared_buffer_size = geometry.sharedBufferSize;
+
+    if (geometry.sendStreamRingSize) {
+        layout.send.slot_size = IPC_TUNNEL_STREAM_RECORD_ALIGNMENT;
+        layout.send.slot_count = geometry.sendStreamRingSize / IPC_TUNNEL_STREAM_RECORD_ALIGNMENT;
+        layout.send.flags = IPC_TUNNEL_RING_STREAM;
+    }
+    else {
+        layout.send.slot_size = sendSlotSize;
+        layout.send.slot_count = geometry.sendPacketCount;
+        layout.send.flags = geometry.sendOverwrite ? IPC_TUNNEL_RING_OVERWRITE : 0;
+    }
+    layout.send.max_packet_size = geometry.sendMaxPacketSize;
+
+    if (geometry.receiveStreamRingSize) {
+        layout.receive.slot_size = IPC_TUNNEL_STREAM_RECORD_ALIGNMENT;
+        layout.receive.slot_count = geometry.receiveStreamRingSize / IPC_TUNNEL_STREAM_RECORD_ALIGNMENT;
+        layout.receive.flags = IPC_TUNNEL_RING_STREAM;
+    }
+    else {
+        layout.receive.slot_size = receiveSlotSize;
+        layout.receive.slot_count = geometry.receivePacketCount;
+        layout.receive.flags = geometry.receiveOverwrite ? IPC_TUNNEL_RING_OVERWRITE : 0;
+    }
+    layout.receive.max_packet_size = geometry.receiveMaxPacketSize;
+
+    rings[i].Attach(layout,
+                    segment + controlHeaderOffset,
+                    segment + sendOffset,
+                    segment + receiveOffset,
+                    geometry.sharedBufferSize ? segment + sharedOffset : nullptr);
+
+    /* Addresses of the segment as the simulated CPU1 maps it */
+    desc.controlHeaderAddress = IPC_TUNNEL_SIM_BASE + controlHeaderOffset;
+    desc.sendBufferAddress = IPC_TUNNEL_SIM_BASE + sendOffset;
+    desc.receiveBufferAddress = IPC_TUNNEL_SIM_BASE + receiveOffset;
+    desc.sharedBufferAddress = geometry.sharedBufferSize ? IPC_TUNNEL_SIM_BASE + sharedOffset : 0;
+    desc.sharedBufferSize = geometry.sharedBufferSize;
+    desc.sendMaxPacketSize = geometry.sendMaxPacketSize;
+    desc.sendBufferedPacketCount = geometry.sendPacketCount;
+    desc.receiveMaxPacketSize = geometry.receiveMaxPacketSize;
+    desc.receiveBufferedPacketCount = geometry.receivePacketCount;
+    desc.sendStreamRingSize = geometry.sendStreamRingSize;
+    desc.receiveStreamRingSize = geometry.receiveStreamRingSize;
+    desc.flags = (layout.send.flags & IPC_TUNNEL_RING_OVERWRITE ? TUNNEL_DESCRIPTOR_SEND_OVERWRITE : 0)
+               | (layout.receive.flags & IPC_TUNNEL_RING_OVERWRITE ? TUNNEL_DESCRIPTOR_RECEIVE_OVERWRITE : 0);
+    return true;
+}
+
+bool IpcTunnelShm::Initialize(bool blockT0)
+{
+    this->blockT0 = blockT0;
+
+    if (!CreateSegment()) {
+        return false;
+    }
+
+    uint32_t offset = IPC_TUNNEL_SIM_TUNNEL_OFFSET;
+    for (int i = 0; i < 3; ++i) {
+        if (!PlaceTunnel(i, offset)) {
+            DestroySegment();
+            return false;
+        }
+    }
+
+    descriptors->version = DESCRIPTOR_VERSION;
+    descriptors->tunnelCount = 3;
+    descriptors->doorbellSgi = DOORBELL_SGI;
+    __atomic_store_n(&descriptors->magic, DESCRIPTOR_MAGIC, __ATOMIC_RELEASE);
+
+    printf("Published the tunnels in %s, start the simulated CPU1 now\n", IPC_TUNNEL_SIM_SHM_NAME);
+    return true;
+}
+
+bool IpcTunnelShm::Send(Target t, const uint8_t* data, size_t size)
+{
+    IpcRing& ring = rings[(int)t];
+    if (size == 0 || size > ring.GetMaxPacketSize()) {
+        return false;
+    }
+
+    IpcRing::Span slot = ring.BeginWrite(size);
+    if (!slot) {
+        return false;
+    }
+
+    ring.Copy(slot.data, data, size);
+    ring.EndWrite(size);
+    return true;
+}
+
+bool IpcTunnelShm::PollDoorbell(uint32_t bits, int timeoutMs)
+{
+    Doorbell& doorbell = descriptors->doorbell;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    timespec interval;
+    interval.tv_sec = 0;
+    interval.tv_nsec = DOORBELL_POLL_INTERVAL_NS;
+
+    for (;;) {
+        uint32_t raised = __atomic_load_n(&doorbell.cpu1Raised, __ATOMIC_ACQUIRE);
+        uint32_t acked = __atomic_load_n(&doorbell.cpu0Acked, __ATOMIC_RELAXED);
+        uint32_t pending = (raised ^ acked) & bits;
+        if (pending) {
+            /* Toggle bits: acking flips the pending ones to match cpu1Raised */
+            __atomic_fetch_xor(&doorbell.cpu0Acked, pending, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        if (timeoutMs >= 0 && std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+
+        nanosleep(&interval, nullptr);
+    }
+}
+
+size_t IpcTunnelShm::ReceiveT0(uint8_t* data, size_t bufSize)
+{
+    IpcRing& ring = rings[0];
+
+    IpcRing::Span packet = ring.BeginRead();
+    if (!packet && blockT0) {
+        auto spinEnd = std::chrono::steady_clock::now() + spinTime;
+        do {
+            packet = ring.BeginRead();
+        } while (!packet && std::chrono::steady_clock::now() < spinEnd);
+
+        while (!packet) {
+            ring.ArmReadEvent();
+            packet = ring.BeginRead();
+            if (!packet) {
+                PollDoorbell(1u << 0, -1);
+                packet = ring.BeginRead();
+            }
+        }
+    }
+
+    if (!packet) {
+        return 0;
+    }
+
+    /* If read buffer is smaller than the package, part of the data is lost */
+    size_t size = std::min(packet.size, bufSize);
+    ring.Copy(data, packet.data, size);
+    if (!ring.EndRead()) {
+        /* Overwritten by CPU1 while it was copied, take the next one */
+        return ReceiveT0(data, bufSize);
+    }
+    return size;
+}
+
+bool IpcTunnelShm::ReceiveFrom(int i, uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb)
+{
+    IpcRing::Span packet = rings[i].BeginRead();
+    if (!packet) {
+        return false;
+    }
+
+    size_t readBytes = std::min(packet.size, size);
+    rings[i].Copy(buf, packet.data, readBytes);
+    if (!rings[i].EndRead()) {
+        /* Overwritten by CPU1 while it was copied */
+        return ReceiveFrom(i, buf, size, receiveCb);
+    }
+
+    receiveCb((Target)i, buf, readBytes);
+    return true;
+}
+
+void IpcTunnelShm::ReceiveFromAny(int first, uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb)
+{
+    auto spinEnd = std::chrono::steady_clock::now() + spinTime;
+    do {
+        bool received = false;
+        for (int i = first; i < 3; ++i) {
+            received |= ReceiveFrom(i, buf, size, receiveCb);
+        }
+
+        if (received) {
+            return;
+        }
+    } while (std::chrono::steady_clock::now() < spinEnd);
+
+    for (;;) {
+        for (int i = first; i < 3; ++i) {
+            rings[i].ArmReadEvent();
+        }
+
+        bool received = false;
+        for (int i = first; i < 3; ++i) {
+            received |= ReceiveFrom(i, buf, size, receiveCb);
+        }
+
+        if (received) {
+            return;
+        }
+
+        uint32_t bits = ((1u << 3) - 1u) & ~((1u << first) - 1u);
+        if (t0Waiting.load(std::memory_order_relaxed)) {
+            /* The T0 doorbell is acked by WaitT0Event */
+            bits &= ~(1u << 0);
+        }
+        PollDoorbell(bits, -1);
+    }
+}
+
+void IpcTunnelShm::ReceiveAny(uint8_t *buf, size_t size, const std::function<void (Target, const uint8_t *, size_t)> &receiveCb)
+{
+    ReceiveFromAny(0, buf, size, receiveCb);
+}
+
+void IpcTunnelShm::ReceiveT1OrT2(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb)
+{
+    ReceiveFromAny(1, buf, size, receiveCb);
+}
+
+uint16_t IpcTunnelShm::GetMaxPacketSize(Target t) const
+{
+    return rings[(int)t].GetMaxPacketSize();
+}
+
+bool IpcTunnelShm::SetBusyPoll(std::chrono::microseconds budget)
+{
+    spinTime = budget;
+    return true;
+}
+
+uint8_t *IpcTunnelShm::MapT0SharedMemory()
+{
+    return rings[0].MapSharedBuffer();
+}
+
+bool IpcTunnelShm::WaitT0Event(int timeoutMs)
+{
+    t0Waiting.store(true, std::memory_order_relaxed);
+    return PollDoorbell(1u << 0, timeoutMs);
+}
@@ -0,0 +1,71 @@
+#ifndef UTIL_IPC_TUNNEL_SHM_HPP_
+#define UTIL_IPC_TUNNEL_SHM_HPP_
+
+#include <atomic>
+
+#include "comm.hpp"
+#include "ipc_ring.hpp"
+
+/* Tunnels T0-T2 in a POSIX shared memory segment instead of the memory of
+ * the ipc_tunnel module. Takes the place of the kernel module: lays out the
+ * control headers and rings with the same rules, publishes the descriptor
+ * block and acks the doorbell. Peer is the firmware built for the host in
+ * sim/, which must be started after Initialize.
+ *
+ * There is no interrupt to sleep on: receiving spins for a while and then
+ * polls the doorbell with short sleeps. The hybrid and block wait
+ * strategies are polling here too, only with a coarser interval.
+ */
+class IpcTunnelShm final : public CommInterface {
+public:
+	IpcTunnelShm();
+	~IpcTunnelShm();
+
+    std::string GetInterfaceName() override;
+    bool Initialize(bool blockT0) override;
+    bool Send(Target t, const uint8_t* data, size_t size) override;
+    size_t ReceiveT0(uint8_t* data, size_t bufSize) override;
+
+    void ReceiveAny(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb) override;
+    void ReceiveT1OrT2(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb) override;
+
+    uint16_t GetMaxPacketSize(Target t) const override;
+
+    bool SetBusyPoll(std::chrono::microseconds budget) override;
+
+    virtual uint8_t* MapT0SharedMemory() override;
+    /* Polls the doorbell bit of T0, see PollDoorbell. From the first call on
+     * ReceiveAny leaves that bit to it.
+     */
+    bool WaitT0Event(int timeoutMs) override;
+private:
+    struct DescriptorBlock;
+
+    bool CreateSegment();
+    void DestroySegment();
+    /* Places tunnel i after offset like place_tunnel of the kernel module */
+    bool PlaceTunnel(int i, uint32_t& offset);
+
+    /* Copies one packet from ring i to buf and calls receiveCb */
+    bool ReceiveFrom(int i, uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb);
+    void ReceiveFromAny(int first, uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb);
+
+    /* Sleeps DOORBELL_POLL_INTERVAL_NS between checks until CPU1 has rung the
+     * doorbell of one of the tunnels in bits or timeoutMs has passed (-1 is
+     * no timeout). Only acks those bits, so the T0 and the T1/T2 receivers
+     * don't take each other's doorbells. Their rings must be armed.
+     */
+    bool PollDoorbell(uint32_t bits, int timeoutMs);
+
+	bool blockT0 = false;
+	std::chrono::microseconds spinTime;
+	/* Set by WaitT0Event, so each doorbell bit has a single acking thread */
+	std::atomic<bool> t0Waiting{false};
+
+	uint8_t* segment = nullptr;
+	DescriptorBlock* descriptors = nullptr;
+
+	IpcRing rings[3];
+};
+
+#endif  // UTIL_IPC_TUNNEL_SHM_HPP_
@@ -0,0 +1,237 @@
+#include "ipc_tunnel_user.hpp"
+#include "globaltimer.hpp"
+#include <poll.h>
+#include <cstring>
+#include <algorithm>
+
+/* Default time spent spinning on the rings before sleeping in poll() */
+static constexpr std::chrono::microseconds DEFAULT_SPIN_TIME(20);
+
+IpcTunnelUser::IpcTunnelUser(IpcTunnel::Memory mem) :
+    mem(mem),
+    spinTime(DEFAULT_SPIN_TIME)
+{
+    
+}
+
+std::string IpcTunnelUser::GetInterfaceName()
+{
+    return std::string("IpcTunnelUser") + (mem == IpcTunnel::Memory::OCM ? "OCM" : "DDR");
+}
+
+bool IpcTunnelUser::Initialize(bool blockT0)
+{
+    int devIndex = mem == IpcTunnel::Memory::OCM ? 0 : 3;
+    this->blockT0 = blockT0;
+    
+    for (int i = 0; i < 3; ++i) {
+        std::string devName("/dev/ipc_tunnel");
+        devName += std::to_string(devIndex + i);
+        if (!rings[i].Open(devName, true)) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool IpcTunnelUser::Send(Target t, const uint8_t* data, size_t size)
+{
+    IpcRing& ring = rings[(int)t];
+    if (size == 0 || size > ring.GetMaxPacketSize()) {
+        return false;
+    }
+    
+    IpcRing::Span slot = ring.BeginWrite(size);
+    if (!slot) {
+        return false;
+    }
+    
+    ring.Copy(slot.data, data, size);
+    ring.EndWrite(size);
+    return true;
+}
+
+size_t IpcTunnelUser::ReceiveT0(uint8_t* data, size_t bufSize)
+{
+    IpcRing& ring = rings[0];
+    
+    IpcRing::Span packet = ring.BeginRead();
+    if (!packet && blockT0) {
+        while (!ring.WaitReadable(spinTime)) {}
+        packet = ring.BeginRead();
+    }
+    
+    if (!packet) {
+        return 0;
+    }
+    
+    /* If read buffer is smaller than the package, part of the data is lost */
+    size_t size = std::min(packet.size, bufSize);
+    ring.Copy(data, packet.data, size);
+    if (!ring.EndRead()) {
+        /* Overwritten by CPU1 while it was copied, take the next one */
+        return ReceiveT0(data, bufSize);
+    }
+    return size;
+}
+
+bool IpcTunnelUser::ReceiveFrom(int i, uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb)
+{
+    IpcRing::Span packet = rings[i].BeginRead();
+    if (!packet) {
+        return false;
+    }
+    
+    size_t readBytes = std::min(packet.size, size);
+    rings[i].Copy(buf, packet.data, readBytes);
+    if (!rings[i].EndRead()) {
+        /* Overwritten by CPU1 while it was copied */
+        return ReceiveFrom(i, buf, size, receiveCb);
+    }
+    
+    receiveCb((Target)i, buf, readBytes);
+    return true;
+}
+
+void IpcTunnelUser::ReceiveFromAny(int first, uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb)
+{
+    auto spinEnd = std::chrono::steady_clock::now() + spinTime;
+    do {
+        bool received = false;
+        for (int i = first; i < 3; ++i) {
+            received |= ReceiveFrom(i, buf, size, receiveCb);
+        }
+        
+        if (received) {
+            return;
+        }
+    } while (std::chrono::steady_clock::now() < spinEnd);
+    
+    pollfd pfds[3];
+    for (int i = first; i < 3; ++i) {
+        pfds[i - first].fd = rings[i].GetFd();
+        pfds[i - first].events = POLLIN;
+        pfds[i - first].revents = 0;
+    }
+    
+    int readyFds = poll(pfds, 3 - first, -1);
+    if (readyFds > 0) {
+        for (int i = first; i < 3; ++i) {
+            if (pfds[i - first].revents & POLLIN) {
+                ReceiveFrom(i, buf, size, receiveCb);
+            }
+        }
+    }
+}
+
+void IpcTunnelUser::ReceiveAny(uint8_t *buf, size_t size, const std::function<void (Target, const uint8_t *, size_t)> &receiveCb)
+{
+    ReceiveFromAny(0, buf, size, receiveCb);
+}
+
+void IpcTunnelUser::ReceiveT1OrT2(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb)
+{
+    ReceiveFromAny(1, buf, size, receiveCb);
+}
+
+int IpcTunnelUser::GetReceiveFd(Target t)
+{
+    return rings[(int)t].GetFd();
+}
+
+size_t IpcTunnelUser::TryReceive(Target t, uint8_t* buf, size_t size)
+{
+    IpcRing& ring = rings[(int)t];
+    
+    IpcRing::Span packet = ring.BeginRead();
+    if (!packet) {
+        /* Drained, CPU1 interrupts on the next packet and wakes the fd */
+        ring.ArmReadEvent();
+        packet = ring.BeginRead();
+        if (!packet) {
+            return 0;
+        }
+    }
+    
+    size_t readBytes = std::min(packet.size, size);
+    ring.Copy(buf, packet.data, readBytes);
+    if (!ring.EndRead()) {
+        /* Overwritten by CPU1 while it was copied */
+        return TryReceive(t, buf, size);
+    }
+    
+    return readBytes;
+}
+
+/* No interrupt on the way, only the ring is stamped */
+size_t IpcTunnelUser::TryReceiveTraced(Target t, uint8_t* buf, size_t size, PacketTrace& trace)
+{
+    IpcRing& ring = rings[(int)t];
+    
+    IpcRing::Span packet = ring.BeginRead();
+    if (!packet) {
+        ring.ArmReadEvent();
+        packet = ring.BeginRead();
+        if (!packet) {
+            return 0;
+        }
+    }
+    
+    trace.dequeue = (uint32_t)global_timer::now().time_since_epoch().count();
+    trace.valid = PacketTrace::Dequeue | PacketTrace::Copy;
+    if (ring.GetCommitTicks(packet, trace.commit)) {
+        trace.valid |= PacketTrace::Commit;
+    }
+    
+    size_t readBytes = std::min(packet.size, size);
+    ring.Copy(buf, packet.data, readBytes);
+    trace.copy = (uint32_t)global_timer::now().time_since_epoch().count();
+    if (!ring.EndRead()) {
+        /* Overwritten by CPU1 while it was copied */
+        return TryReceiveTraced(t, buf, size, trace);
+    }
+    
+    return readBytes;
+}
+
+size_t IpcTunnelUser::ReceiveT0Traced(uint8_t* data, size_t bufSize, PacketTrace& trace)
+{
+    size_t received = TryReceiveTraced(Target::T0, data, bufSize, trace);
+    while (received == 0 && blockT0) {
+        rings[0].WaitReadable(spinTime);
+        received = TryReceiveTraced(Target::T0, data, bufSize, trace);
+    }
+    
+    return received;
+}
+
+uint16_t IpcTunnelUser::GetMaxPacketSize(Target t) const
+{
+    return rings[(int)t].GetMaxPacketSize();
+}
+
+bool IpcTunnelUser::SetBusyPoll(std::chrono::microseconds budget)
+{
+    spinTime = budget;
+    return true;
+}
+
+bool IpcTunnelUser::GetBusyPollStats(Target t, BusyPollStats& stats)
+{
+    const IpcRing::WaitStats& ringStats = rings[(int)t].GetWaitStats();
+    stats.spinNs = ringStats.spinNs;
+    stats.hits = ringStats.hits;
+    stats.misses = ringStats.misses;
+    return true;
+}
+
+uint8_t *IpcTunnelUser::MapT0SharedMemory()
+{
+    return rings[0].MapSharedBuffer();
+}
+
+bool IpcTunnelUser::WaitT0Event(int timeoutMs)
+{
+    return rings[0].WaitEvent(timeoutMs);
+}
@@ -0,0 +1,46 @@
+#ifndef UTIL_IPC_TUNNEL_USER_HPP_
+#define UTIL_IPC_TUNNEL_USER_HPP_
+
+#include "comm.hpp"
+#include "ipc_tunnel.hpp"
+#include "ipc_ring.hpp"
+
+/* Same tunnels as IpcTunnel but the rings are accessed directly from user
+ * space with IpcRing. Receiving spins for a while before falling back to poll().
+ */
+class IpcTunnelUser final : public CommInterface {
+public:
+	IpcTunnelUser(IpcTunnel::Memory mem);
+	
+    std::string GetInterfaceName() override;
+    bool Initialize(bool blockT0) override;
+    bool Send(Target t, const uint8_t* data, size_t size) override;
+    size_t ReceiveT0(uint8_t* data, size_t bufSize) override;
+
+    void ReceiveAny(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb) override;
+    void ReceiveT1OrT2(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb) override;
+    int GetReceiveFd(Target t) override;
+    size_t TryReceive(Target t, uint8_t* buf, size_t size) override;
+    size_t TryReceiveTraced(Target t, uint8_t* buf, size_t size, PacketTrace& trace) override;
+    size_t ReceiveT0Traced(uint8_t* data, size_t bufSize, PacketTrace& trace) override;
+    
+    uint16_t GetMaxPacketSize(Target t) const override;
+    
+    bool SetBusyPoll(std::chrono::microseconds budget) override;
+    bool GetBusyPollStats(Target t, BusyPollStats& stats) override;
+    
+    virtual uint8_t* MapT0SharedMemory() override;
+    bool WaitT0Event(int timeoutMs) override;
+private:
+    /* Copies one packet from ring i to buf and calls receiveCb */
+    bool ReceiveFrom(int i, uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb);
+    void ReceiveFromAny(int first, uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb);
+    
+	IpcTunnel::Memory mem;
+	bool blockT0 = false;
+	std::chrono::microseconds spinTime;
+	
+	IpcRing rings[3];
+};
+
+#endif  // UTIL_IPC_TUNNEL_USER_HPP_
@@ -0,0 +1,120 @@
+#include "latency_histogram.hpp"
+#include <cmath>
+
+LatencyHistogram::LatencyHistogram(unsigned significantBits, uint64_t maxValue) :
+    significantBits(significantBits < 2 ? 2 : (significantBits > 30 ? 30 : significantBits)),
+    maxValue(maxValue)
+{
+	subBucketMask = (1ull << this->significantBits) - 1;
+	if (this->maxValue < subBucketMask) {
+		this->maxValue = subBucketMask;
+	}
+
+	countsLength = CountsIndex(this->maxValue) + 1;
+	/* () zeroes the counters */
+	counts.reset(new std::atomic<uint64_t>[countsLength]());
+}
+
+void LatencyHistogram::AddCorrected(const LatencyHistogram &other, uint64_t expectedInterval)
+{
+	for (size_t i = 0; i < other.countsLength; ++i) {
+		uint64_t count = other.counts[i].load(std::memory_order_relaxed);
+		if (count == 0) {
+			continue;
+		}
+
+		uint64_t value = other.HighestValueAt(i);
+		if (value > other.Max()) {
+			value = other.Max();
+		}
+
+		RecordCount(value, count);
+		if (expectedInterval == 0) {
+			continue;
+		}
+
+		for (uint64_t missed = value; missed >= 2 * expectedInterval; ) {
+			missed -= expectedInterval;
+			RecordCount(missed, count);
+		}
+	}
+}
+
+void LatencyHistogram::Reset()
+{
+	for (size_t i = 0; i < countsLength; ++i) {
+		counts[i].store(0, std::memory_order_relaxed);
+	}
+
+	totalCount.store(0, std::memory_order_relaxed);
+	totalSum.store(0, std::memory_order_relaxed);
+	minRecorded.store(UINT64_MAX, std::memory_order_relaxed);
+	maxRecorded.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Min() const
+{
+	return Count() > 0 ? minRecorded.load(std::memory_order_relaxed) : 0;
+}
+
+double LatencyHistogram::Mean() const
+{
+	uint64_t count = Count();
+	return count > 0 ? (double)totalSum.load(std::memory_order_relaxed) / count : 0.0;
+}
+
+uint64_t LatencyHistogram::ValueAtPercentile(double percent) const
+{
+	uint64_t count = Count();
+	if (count == 0) {
+		return 0;
+	}
+
+	if (percent > 100.0) percent = 100.0;
+	uint64_t countAtPercentile = (uint64_t)std::ceil(percent / 100.0 * count);
+	if (countAtPercentile == 0) countAtPercentile = 1;
+
+	uint64_t cumulative = 0;
+	for (size_t i = 0; i < countsLength; ++i) {
+		cumulative += counts[i].load(std::memory_order_relaxed);
+		if (cumulative >= countAtPercentile) {
+			/* Max is exact, the end of its bucket may not be */
+			uint64_t value = HighestValueAt(i);
+			return value < Max() ? value : Max();
+		}
+	}
+
+	/* A Record running on another thread got here first */
+	return Max();
+}
+
+uint64_t LatencyHistogram::LowestValueAt(size_t index) const
+{
+	size_t bucket = index >> (significantBits - 1);
+	bucket = bucket > 0 ? bucket - 1 : 0;
+	return (uint64_t)(index - (bucket << (significantBits - 1))) << bucket;
+}
+
+uint64_t LatencyHistogram::HighestValueAt(size_t index) const
+{
+	size_t bucket = index >> (significantBits - 1);
+	bucket = bucket > 0 ? bucket - 1 : 0;
+	return LowestValueAt(index) + (1ull << bucket) - 1;
+}
+
+void WriteHistogramSummaryHeader(std::ostream &out)
+{
+	out << "metric\tcount\tmin(ns)\tp50(ns)\tp90(ns)\tp99(ns)\tp99.9(ns)\tmax(ns)\tmean(ns)\n";
+}
+
+void WriteHistogramSummary(std::ostream &out, const char* name, const LatencyHistogram &histogram, double nsPerTick)
+{
+	static const double percentiles[] = {50.0, 90.0, 99.0, 99.9};
+
+	out << name << '\t' << histogram.Count() << '\t' << (uint64_t)(histogram.Min() * nsPerTick + 0.5);
+	for (double p : percentiles) {
+		out << '\t' << (uint64_t)(histogram.ValueAtPercentile(p) * nsPerTick + 0.5);
+	}
+	out << '\t' << (uint64_t)(histogram.Max() * nsPerTick + 0.5)
+	    << '\t' << (uint64_t)(histogram.Mean() * nsPerTick + 0.5) << '\n';
+}
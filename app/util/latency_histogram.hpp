@@ -0,0 +1,158 @@
+#ifndef UTIL_LATENCY_HISTOGRAM_HPP_
+#define UTIL_LATENCY_HISTOGRAM_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <ostream>
+
+/* Fixed-memory histogram of durations in the style of HdrHistogram.
+ *
+ * Values below 2^significantBits are counted exactly. Above that every power
+ * of two range is split into 2^(significantBits - 1) linear sub-buckets, so a
+ * value is off by less than 1 / 2^(significantBits - 1) of itself: with the
+ * default 10 bits 0.2 %, or 20 ns of a 10 us latency. Values above maxValue
+ * are counted as maxValue. All memory is allocated by the constructor; with
+ * the defaults it is about 100 kB however long the run is.
+ *
+ * Record is O(1): one count-leading-zeros for the bucket and a counter
+ * update. It must be called from one thread at a time, but the counters are
+ * relaxed atomics so another thread can read percentiles while it runs.
+ */
+class LatencyHistogram {
+public:
+	static constexpr unsigned DEFAULT_SIGNIFICANT_BITS = 10;
+	static constexpr uint64_t DEFAULT_MAX_VALUE = 0xFFFFFFFFull;
+
+	explicit LatencyHistogram(unsigned significantBits = DEFAULT_SIGNIFICANT_BITS,
+	                          uint64_t maxValue = DEFAULT_MAX_VALUE);
+
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+	void Record(uint64_t value) { RecordCount(value, 1); }
+	void RecordCount(uint64_t value, uint64_t count);
+
+	/* Adds the samples of other corrected for coordinated omission: a sample
+	 * of value v also records v - expectedInterval, v - 2 * expectedInterval,
+	 * ... down to expectedInterval. Those are the samples a measurement loop
+	 * expecting one sample every expectedInterval missed while it was stalled
+	 * for v. Costs v / expectedInterval per recorded bucket, so it is meant for
+	 * the reports, not the hot loops.
+	 */
+	void AddCorrected(const LatencyHistogram& other, uint64_t expectedInterval);
+
+	void Reset();
+
+	uint64_t Count() const { return totalCount.load(std::memory_order_relaxed); }
+	uint64_t Min() const;
+	uint64_t Max() const { return maxRecorded.load(std::memory_order_relaxed); }
+	double Mean() const;
+
+	/* Smallest recorded value that percent % of the samples are at or below,
+	 * rounded up to the end of its bucket. 0 if nothing has been recorded.
+	 */
+	uint64_t ValueAtPercentile(double percent) const;
+
+	/* Bytes of the counters */
+	size_t MemorySize() const { return countsLength * sizeof(counts[0]); }
+
+private:
+	size_t CountsIndex(uint64_t value) const;
+	/* Smallest and largest values counted at index */
+	uint64_t LowestValueAt(size_t index) const;
+	uint64_t HighestValueAt(size_t index) const;
+
+	unsigned significantBits;
+	uint64_t subBucketMask;
+	uint64_t maxValue;
+
+	size_t countsLength;
+	std::unique_ptr<std::atomic<uint64_t>[]> counts;
+
+	std::atomic<uint64_t> totalCount{0};
+	std::atomic<uint64_t> totalSum{0};
+	std::atomic<uint64_t> minRecorded{UINT64_MAX};
+	std::atomic<uint64_t> maxRecorded{0};
+};
+
+inline size_t LatencyHistogram::CountsIndex(uint64_t value) const
+{
+	/* Bucket 0 holds 0 .. 2^significantBits - 1, bucket b the values whose
+	 * highest bit is significantBits - 1 + b, in steps of 2^b
+	 */
+	unsigned bucket = 63 - __builtin_clzll(value | subBucketMask) - (significantBits - 1);
+	return ((size_t)bucket << (significantBits - 1)) + (size_t)(value >> bucket);
+}
+
+inline void LatencyHistogram::RecordCount(uint64_t value, uint64_t count)
+{
+	if (value > maxValue) {
+		value = maxValue;
+	}
+
+	/* Single writer, so plain loads and stores are enough and avoid the
+	 * exclusive monitor loops of atomic read-modify-writes on ARM
+	 */
+	std::atomic<uint64_t>& counter = counts[CountsIndex(value)];
+	counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+	totalCount.store(totalCount.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+	totalSum.store(totalSum.load(std::memory_order_relaxed) + value * count, std::memory_order_relaxed);
+
+	if (value < minRecorded.load(std::memory_order_relaxed)) {
+		minRecorded.store(value, std::memory_order_relaxed);
+	}
+	if (value > maxRecorded.load(std::memory_order_relaxed)) {
+		maxRecorded.store(value, std::memory_order_relaxed);
+	}
+}
+
+/* Writes count, min, p50, p90, p99, p99.9, max and mean of histogram as one
+ * tab separated row, converted from ticks to nanoseconds with nsPerTick
+ */
+void WriteHistogramSummaryHeader(std::ostream& out);
+void WriteHistogramSummary(std::ostream& out, const char* name, const LatencyHistogram& histogram, double nsPerTick);
+
+/* Keeps the last capacity samples for the .bin files of ResultFileWriter
+ * next to the histograms. The storage is allocated by Resize, so the memory
+ * stays bounded however long the run is. The capacity is 0 by default:
+ * nothing is kept unless the raw samples are asked for.
+ */
+template<typename T>
+class SampleWindow {
+public:
+	explicit SampleWindow(size_t capacity = 0) : samples(capacity) {}
+
+	/* Drops the samples kept so far */
+	void Resize(size_t capacity) {
+		samples.assign(capacity, T());
+		next = 0;
+		size = 0;
+	}
+
+	void Push(const T& sample) {
+		if (samples.empty()) return;
+		samples[next] = sample;
+		if (++next == samples.size()) next = 0;
+		if (size < samples.size()) ++size;
+	}
+
+	size_t Size() const { return size; }
+	size_t Capacity() const { return samples.size(); }
+
+	/* Oldest first */
+	const T& operator[](size_t i) const {
+		size_t index = (size < samples.size() ? 0 : next) + i;
+		if (index >= samples.size()) index -= samples.size();
+		return samples[index];
+	}
+
+private:
+	std::vector<T> samples;
+	size_t next = 0;
+	size_t size = 0;
+};
+
+#endif  // UTIL_LATENCY_HISTOGRAM_HPP_
@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #include <linux/rpmsg.h>
 #include <cstring>
+#include <algorithm>
 
 #include <iostream>
 
@@ -206,11 +207,18 @@ void OpenAMPComm::ReceiveAny(uint8_t* buf, size_t size, const std::function<void
 {
     fd_set fd_set_t1t2;
     FD_ZERO(&fd_set_t1t2);
+    FD_SET(fds[0], &fd_set_t1t2);
     FD_SET(fds[1], &fd_set_t1t2);
     FD_SET(fds[2], &fd_set_t1t2);
     
-    int readyFds = select(fds[2] + 1, &fd_set_t1t2, 0, 0, 0);
+    int readyFds = select(std::max(fds[0], fds[2]) + 1, &fd_set_t1t2, 0, 0, 0);
     if (readyFds > 0) {
+        if (FD_ISSET(fds[0], &fd_set_t1t2)) {
+            ssize_t readBytes = read(fds[0], buf, size);
+            if (readBytes > 0) {
+                receiveCb(Target::T0, buf, readBytes);
+            }
+        }
         if (FD_ISSET(fds[1], &fd_set_t1t2)) {
             ssize_t readBytes = read(fds[1], buf, size);
             if (readBytes > 0) {
@@ -250,6 +258,28 @@ void OpenAMPComm::ReceiveT1OrT2(uint8_t* buf, size_t size, const std::function<v
     }
 }
 
+int OpenAMPComm::GetReceiveFd(Target t)
+{
+    int fd = fds[(int)t];
+    
+    /* A blocking read can't tell that the endpoint is drained */
+    if (fd < 0 || (fcntl(fd, F_GETFL) & O_NONBLOCK) == 0) {
+        return -1;
+    }
+    
+    return fd;
+}
+
+size_t OpenAMPComm::TryReceive(Target t, uint8_t* buf, size_t size)
+{
+    ssize_t readBytes = read(fds[(int)t], buf, size);
+    if (readBytes > 0) {
+        return readBytes;
+    }
+    
+    return 0;
+}
+
 uint16_t OpenAMPComm::GetMaxPacketSize(Target t) const
 {
     (void)t;
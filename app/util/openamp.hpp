@@ -15,6 +15,8 @@ public:
     
     void ReceiveAny(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb) override;
     void ReceiveT1OrT2(uint8_t* buf, size_t size, const std::function<void(Target, const uint8_t*, size_t)>& receiveCb) override;
+    int GetReceiveFd(Target t) override;
+    size_t TryReceive(Target t, uint8_t* buf, size_t size) override;
     
 	uint16_t GetMaxPacketSize(Target t) const override;
     
@@ -0,0 +1,127 @@
+#include "result_file.hpp"
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void* ResultFileWriter::AddColumn(const char* name, ResultType type, ResultUnit unit, size_t rows)
+{
+	size_t valueSize = type == ResultType::U32 ? sizeof(uint32_t) : sizeof(int64_t);
+
+	columns.emplace_back();
+	Column& column = columns.back();
+	std::memset(&column.header, 0, sizeof(column.header));
+	std::strncpy(column.header.name, name, sizeof(column.header.name) - 1);
+	column.header.type = type;
+	column.header.unit = unit;
+	column.header.rows = rows;
+	column.data.resize((rows * valueSize + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+	return column.data.data();
+}
+
+bool ResultFileWriter::Write(const std::string& fileName) const
+{
+	ResultFileHeader header;
+	std::memcpy(header.magic, RESULT_FILE_MAGIC, sizeof(header.magic));
+	header.version = RESULT_FILE_VERSION;
+	header.columnCount = columns.size();
+	header.tickNum = tickNum;
+	header.tickDen = tickDen;
+
+	/* Headers are a multiple of 8 bytes and so is the data of a column, so
+	 * every column stays aligned
+	 */
+	std::vector<ResultColumnHeader> columnHeaders(columns.size());
+	uint64_t offset = sizeof(ResultFileHeader) + columns.size() * sizeof(ResultColumnHeader);
+	for (size_t i = 0; i < columns.size(); ++i) {
+		columnHeaders[i] = columns[i].header;
+		columnHeaders[i].offset = offset;
+		offset += columns[i].data.size() * sizeof(uint64_t);
+	}
+
+	/* Columns go straight from their vectors to the file, past the stream buffer */
+	std::ofstream out(fileName, std::ios::binary);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(columnHeaders.data()), columnHeaders.size() * sizeof(ResultColumnHeader));
+	for (const Column& column : columns) {
+		out.write(reinterpret_cast<const char*>(column.data.data()), column.data.size() * sizeof(uint64_t));
+	}
+	out.flush();
+
+	if (!out) {
+		perror(("Writing " + fileName + " failed").c_str());
+		return false;
+	}
+	return true;
+}
+
+ResultFileReader::~ResultFileReader()
+{
+	Close();
+}
+
+bool ResultFileReader::Open(const std::string& fileName)
+{
+	Close();
+
+	int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(("Opening " + fileName + " failed").c_str());
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ResultFileHeader)) {
+		fprintf(stderr, "%s is not a result file\n", fileName.c_str());
+		close(fd);
+		return false;
+	}
+
+	void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		perror(("Mapping " + fileName + " failed").c_str());
+		return false;
+	}
+	data = static_cast<const uint8_t*>(mapped);
+	size = st.st_size;
+
+	const ResultFileHeader& header = Header();
+	if (std::memcmp(header.magic, RESULT_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+	        header.version != RESULT_FILE_VERSION || header.tickDen == 0) {
+		fprintf(stderr, "%s is not a version %u result file\n", fileName.c_str(), RESULT_FILE_VERSION);
+		Close();
+		return false;
+	}
+
+	if (sizeof(ResultFileHeader) + (uint64_t)header.columnCount * sizeof(ResultColumnHeader) > size) {
+		fprintf(stderr, "%s is truncated\n", fileName.c_str());
+		Close();
+		return false;
+	}
+
+	for (uint32_t i = 0; i < header.columnCount; ++i) {
+		const ResultColumnHeader& column = Column(i);
+		uint64_t valueSize = column.type == ResultType::U32 ? sizeof(uint32_t) : sizeof(int64_t);
+		if (column.type > ResultType::I64 || column.offset % 8 != 0 ||
+		        column.offset > size || column.rows > (size - column.offset) / valueSize) {
+			fprintf(stderr, "%s: column %u is outside the file\n", fileName.c_str(), i);
+			Close();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void ResultFileReader::Close()
+{
+	if (data) {
+		munmap(const_cast<uint8_t*>(data), size);
+		data = nullptr;
+		size = 0;
+	}
+}
@@ -0,0 +1,113 @@
+#ifndef UTIL_RESULT_FILE_HPP_
+#define UTIL_RESULT_FILE_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/* Binary columnar file of benchmark samples.
+ *
+ * The file is the ResultFileHeader, columnCount ResultColumnHeaders and the
+ * column data, each column starting at a multiple of 8 bytes. Everything is
+ * in the byte order of the writer (little endian on the Zynq and on x86), so
+ * a mapped file can be read as typed arrays without parsing. Columns in
+ * global timer ticks are stored as ticks; tickNum / tickDen is the length of
+ * a tick in seconds, std::ratio<2, 666666687> on the Zynq. resultconv turns
+ * the files into CSV or TSV with nanoseconds on the host.
+ */
+
+static constexpr char RESULT_FILE_MAGIC[8] = {'D', 'I', 'P', 'P', 'A', 'R', 'E', 'S'};
+static constexpr uint32_t RESULT_FILE_VERSION = 1;
+
+enum class ResultType : uint8_t {
+	U32 = 0,
+	I64 = 1
+};
+
+enum class ResultUnit : uint8_t {
+	Count = 0,  // plain number
+	Ticks = 1   // global timer ticks
+};
+
+struct ResultFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t columnCount;
+	uint32_t tickNum;
+	uint32_t tickDen;
+};
+
+struct ResultColumnHeader {
+	char name[40];
+	ResultType type;
+	ResultUnit unit;
+	uint8_t reserved[6];
+	uint64_t rows;
+	/* From the start of the file */
+	uint64_t offset;
+};
+
+static_assert(sizeof(ResultFileHeader) == 24, "ResultFileHeader layout");
+static_assert(sizeof(ResultColumnHeader) == 64, "ResultColumnHeader layout");
+
+/* Collects the columns in memory and writes the file with one write */
+class ResultFileWriter {
+public:
+	ResultFileWriter(uint32_t tickNum, uint32_t tickDen) : tickNum(tickNum), tickDen(tickDen) {}
+
+	/* Adds a column of rows values, get(i) returns value i */
+	template<typename Getter>
+	void AddU32(const char* name, ResultUnit unit, size_t rows, Getter&& get) {
+		uint32_t* data = static_cast<uint32_t*>(AddColumn(name, ResultType::U32, unit, rows));
+		for (size_t i = 0; i < rows; ++i) data[i] = get(i);
+	}
+
+	template<typename Getter>
+	void AddI64(const char* name, ResultUnit unit, size_t rows, Getter&& get) {
+		int64_t* data = static_cast<int64_t*>(AddColumn(name, ResultType::I64, unit, rows));
+		for (size_t i = 0; i < rows; ++i) data[i] = get(i);
+	}
+
+	/* Returns false and prints the error if the file can't be written */
+	bool Write(const std::string& fileName) const;
+
+private:
+	struct Column {
+		ResultColumnHeader header;
+		std::vector<uint64_t> data;  // uint64_t keeps the 8 byte alignment
+	};
+
+	/* Storage for rows values of type */
+	void* AddColumn(const char* name, ResultType type, ResultUnit unit, size_t rows);
+
+	uint32_t tickNum;
+	uint32_t tickDen;
+	std::vector<Column> columns;
+};
+
+/* Read only mapping of a result file */
+class ResultFileReader {
+public:
+	ResultFileReader() = default;
+	~ResultFileReader();
+
+	ResultFileReader(const ResultFileReader&) = delete;
+	ResultFileReader& operator=(const ResultFileReader&) = delete;
+
+	/* Maps and validates the file, prints the reason if it isn't valid */
+	bool Open(const std::string& fileName);
+	void Close();
+
+	const ResultFileHeader& Header() const { return *reinterpret_cast<const ResultFileHeader*>(data); }
+	const ResultColumnHeader& Column(uint32_t i) const {
+		return reinterpret_cast<const ResultColumnHeader*>(data + sizeof(ResultFileHeader))[i];
+	}
+	const void* ColumnData(uint32_t i) const { return data + Column(i).offset; }
+
+private:
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+};
+
+#endif  // UTIL_RESULT_FILE_HPP_
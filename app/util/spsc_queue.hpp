@@ -0,0 +1,71 @@
+#ifndef UTIL_SPSC_QUEUE_HPP_
+#define UTIL_SPSC_QUEUE_HPP_
+
+#include <cstddef>
+#include <atomic>
+
+/* Bounded queue from one producer thread to one consumer thread.
+ *
+ * The slots are part of the object, so nothing is allocated after it has
+ * been constructed. Give it static storage when it is large; before C++17
+ * new doesn't honour the alignment. The producer and consumer indices are on
+ * cache lines of their own and each side keeps a copy of the other's index,
+ * so a push or pop normally only touches its own line and the slot.
+ *
+ * Slots are written and read in place:
+ *
+ *   if (T* slot = queue.BeginPush()) { slot->x = ...; queue.EndPush(); }
+ *   while (const T* slot = queue.Front()) { use(*slot); queue.Pop(); }
+ */
+template<typename T, size_t Capacity>
+class SpscQueue {
+	static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+public:
+	static constexpr size_t CACHE_LINE = 64;
+
+	/* Producer: the free slot to fill, nullptr if the queue is full */
+	T* BeginPush() {
+		size_t tail = producerTail.load(std::memory_order_relaxed);
+		if (tail - cachedHead == Capacity) {
+			cachedHead = consumerHead.load(std::memory_order_acquire);
+			if (tail - cachedHead == Capacity) {
+				return nullptr;
+			}
+		}
+		return &slots[tail & (Capacity - 1)];
+	}
+
+	/* Producer: publishes the slot of BeginPush */
+	void EndPush() {
+		producerTail.store(producerTail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	/* Consumer: the oldest slot, nullptr if the queue is empty */
+	const T* Front() {
+		size_t head = consumerHead.load(std::memory_order_relaxed);
+		if (head == cachedTail) {
+			cachedTail = producerTail.load(std::memory_order_acquire);
+			if (head == cachedTail) {
+				return nullptr;
+			}
+		}
+		return &slots[head & (Capacity - 1)];
+	}
+
+	/* Consumer: frees the slot of Front */
+	void Pop() {
+		consumerHead.store(consumerHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+private:
+	/* Indices run freely and wrap with size_t, Capacity divides the range */
+	alignas(CACHE_LINE) std::atomic<size_t> producerTail{0};
+	size_t cachedHead = 0;
+
+	alignas(CACHE_LINE) std::atomic<size_t> consumerHead{0};
+	size_t cachedTail = 0;
+
+	alignas(CACHE_LINE) T slots[Capacity];
+};
+
+#endif  // UTIL_SPSC_QUEUE_HPP_
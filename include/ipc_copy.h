@@ -0,0 +1,206 @@
+#ifndef DIPPA_IPC_COPY_H_
+#define DIPPA_IPC_COPY_H_
+
+/* Copy routines for packet payloads, used by the firmware and the Linux
+ * applications. Pick the routine by the memory type of the ring side of the
+ * copy:
+ *
+ *   IPC_COPY_Cached            normal write-back memory (IPC_TUNNEL_CACHED)
+ *   IPC_COPY_WriteCombining    normal non-cacheable memory, rings of the
+ *                              uncached variants and their user space mappings
+ *   IPC_COPY_StronglyOrdered   strongly-ordered or device memory, every
+ *                              access goes to the bus on its own
+ *
+ * With NEON (-mfpu=neon-vfpv3) all three move 16 bytes per register with
+ * multi-register loads and stores. Without NEON they fall back to memcpy
+ * for cached memory and aligned word loops otherwise.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define IPC_COPY_NEON 1
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Aligned 32-bit word copy, bytes only at the ends. Never does unaligned
+ * accesses, which fault on strongly-ordered and device memory.
+ */
+static inline void IPC_COPY_Words(void* dst, const void* src, size_t size)
+{
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+
+    if ((((uintptr_t)d ^ (uintptr_t)s) & 3u) != 0) {
+        while (size--) *d++ = *s++;
+        return;
+    }
+
+    while (size > 0 && ((uintptr_t)d & 3u) != 0) {
+        *d++ = *s++;
+        --size;
+    }
+
+    uint32_t* dw = (uint32_t*)d;
+    const uint32_t* sw = (const uint32_t*)s;
+    while (size >= 16) {
+        uint32_t w0 = sw[0];
+        uint32_t w1 = sw[1];
+        uint32_t w2 = sw[2];
+        uint32_t w3 = sw[3];
+        dw[0] = w0;
+        dw[1] = w1;
+        dw[2] = w2;
+        dw[3] = w3;
+        dw += 4;
+        sw += 4;
+        size -= 16;
+    }
+    while (size >= 4) {
+        *dw++ = *sw++;
+        size -= 4;
+    }
+
+    d = (uint8_t*)dw;
+    s = (const uint8_t*)sw;
+    while (size--) *d++ = *s++;
+}
+
+#ifdef IPC_COPY_NEON
+
+/* 64 bytes per iteration, source prefetched three cache lines ahead */
+static inline void IPC_COPY_Cached(void* dst, const void* src, size_t size)
+{
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+
+    while (size >= 64) {
+        __builtin_prefetch(s + 96);
+        uint8x16_t q0 = vld1q_u8(s);
+        uint8x16_t q1 = vld1q_u8(s + 16);
+        uint8x16_t q2 = vld1q_u8(s + 32);
+        uint8x16_t q3 = vld1q_u8(s + 48);
+        vst1q_u8(d, q0);
+        vst1q_u8(d + 16, q1);
+        vst1q_u8(d + 32, q2);
+        vst1q_u8(d + 48, q3);
+        d += 64;
+        s += 64;
+        size -= 64;
+    }
+    while (size >= 16) {
+        vst1q_u8(d, vld1q_u8(s));
+        d += 16;
+        s += 16;
+        size -= 16;
+    }
+
+    memcpy(d, s, size);
+}
+
+/* Destination is aligned to 16 bytes first so every store fills a whole
+ * write buffer slot, then 64 bytes per iteration. No prefetch, it doesn't
+ * help non-cacheable sources.
+ */
+static inline void IPC_COPY_WriteCombining(void* dst, const void* src, size_t size)
+{
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+
+    if (size < 32) {
+        IPC_COPY_Words(d, s, size);
+        return;
+    }
+
+    size_t head = (16u - ((uintptr_t)d & 15u)) & 15u;
+    IPC_COPY_Words(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+    while (size >= 64) {
+        uint8x16_t q0 = vld1q_u8(s);
+        uint8x16_t q1 = vld1q_u8(s + 16);
+        uint8x16_t q2 = vld1q_u8(s + 32);
+        uint8x16_t q3 = vld1q_u8(s + 48);
+        vst1q_u8(d, q0);
+        vst1q_u8(d + 16, q1);
+        vst1q_u8(d + 32, q2);
+        vst1q_u8(d + 48, q3);
+        d += 64;
+        s += 64;
+        size -= 64;
+    }
+    while (size >= 16) {
+        vst1q_u8(d, vld1q_u8(s));
+        d += 16;
+        s += 16;
+        size -= 16;
+    }
+
+    IPC_COPY_Words(d, s, size);
+}
+
+/* Every access is a separate bus transaction, so as few and as wide as
+ * possible: 64-bit element loads and stores of 32 bytes. These need 8 byte
+ * aligned addresses on both sides, otherwise the word copy is used.
+ */
+static inline void IPC_COPY_StronglyOrdered(void* dst, const void* src, size_t size)
+{
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+
+    if ((((uintptr_t)d | (uintptr_t)s) & 7u) != 0) {
+        IPC_COPY_Words(d, s, size);
+        return;
+    }
+
+    while (size >= 32) {
+        uint64x2_t q0 = vld1q_u64((const uint64_t*)s);
+        uint64x2_t q1 = vld1q_u64((const uint64_t*)(s + 16));
+        vst1q_u64((uint64_t*)d, q0);
+        vst1q_u64((uint64_t*)(d + 16), q1);
+        d += 32;
+        s += 32;
+        size -= 32;
+    }
+    while (size >= 8) {
+        vst1_u64((uint64_t*)d, vld1_u64((const uint64_t*)s));
+        d += 8;
+        s += 8;
+        size -= 8;
+    }
+
+    IPC_COPY_Words(d, s, size);
+}
+
+#else
+
+static inline void IPC_COPY_Cached(void* dst, const void* src, size_t size)
+{
+    memcpy(dst, src, size);
+}
+
+static inline void IPC_COPY_WriteCombining(void* dst, const void* src, size_t size)
+{
+    IPC_COPY_Words(dst, src, size);
+}
+
+static inline void IPC_COPY_StronglyOrdered(void* dst, const void* src, size_t size)
+{
+    IPC_COPY_Words(dst, src, size);
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // DIPPA_IPC_COPY_H_
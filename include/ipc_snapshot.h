@@ -0,0 +1,172 @@
+#ifndef DIPPA_IPC_SNAPSHOT_H_
+#define DIPPA_IPC_SNAPSHOT_H_
+
+/* Latest-value channel between one writer and one reader on different CPUs,
+ * used by the firmware and the Linux applications.
+ *
+ * Three buffers: the latest complete snapshot, the one the reader is copying
+ * and one the writer fills. The writer never waits and the reader copies the
+ * latest snapshot once, without retrying the copy like a seqlock does.
+ *
+ * Each side only writes its own cache line and there is no atomic
+ * read-modify-write, which isn't available on all shared memory types:
+ *
+ *   latest   written by the writer: sequence << 2 | buffer of the latest
+ *            snapshot. Sequence 0 means nothing has been published yet.
+ *   reading  written by the reader: buffer it is copying, or
+ *            IPC_SNAPSHOT_NONE.
+ *
+ * The writer fills a buffer that is neither latest nor reading. The reader
+ * announces the buffer in reading and then checks that latest hasn't moved;
+ * both sides have a full barrier between their store and the load of the
+ * other word, so either the writer sees the announcement before it picks its
+ * next buffer or the reader sees the new latest and tries again.
+ *
+ * A reader that wants to sleep instead of polling arms a notification with
+ * IPC_SNAPSHOT_ArmNotify and EndWrite tells the writer when to send it. The
+ * same barriers cover notifyAfter, so a snapshot published while the reader
+ * arms is either seen by the reader or notified by the writer.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IPC_SNAPSHOT_CACHE_LINE 32u
+#define IPC_SNAPSHOT_NONE 3u
+/* notifyAfter of a reader that doesn't wait, never a sequence */
+#define IPC_SNAPSHOT_NO_NOTIFY 0xFFFFFFFFu
+
+typedef struct IpcSnapshot_s {
+    /* Writer's cache line */
+    volatile uint32_t latest;
+    /* Buffer being filled between BeginWrite and EndWrite */
+    uint32_t writing;
+    /* Size of each buffer, payload size rounded up to a cache line */
+    uint32_t bufferStride;
+    uint32_t _padding1[5];
+
+    /* Reader's cache line */
+    volatile uint32_t reading;
+    /* Sequence the reader has, it waits for the next one */
+    volatile uint32_t notifyAfter;
+    uint32_t _padding2[6];
+
+    /* Followed by three buffers of bufferStride bytes */
+} IpcSnapshot_t;
+
+/* Bytes of shared memory needed for a payload of payloadSize bytes */
+static inline uint32_t IPC_SNAPSHOT_Size(uint32_t payloadSize)
+{
+    uint32_t stride = (payloadSize + IPC_SNAPSHOT_CACHE_LINE - 1u) & ~(IPC_SNAPSHOT_CACHE_LINE - 1u);
+    return (uint32_t)sizeof(IpcSnapshot_t) + 3u * stride;
+}
+
+static inline uint8_t* IPC_SNAPSHOT_Buffer(IpcSnapshot_t* snapshot, uint32_t index)
+{
+    return (uint8_t*)snapshot + sizeof(IpcSnapshot_t) + index * snapshot->bufferStride;
+}
+
+/* Called by the writer before the reader starts */
+static inline void IPC_SNAPSHOT_Init(IpcSnapshot_t* snapshot, uint32_t payloadSize)
+{
+    snapshot->bufferStride = (payloadSize + IPC_SNAPSHOT_CACHE_LINE - 1u) & ~(IPC_SNAPSHOT_CACHE_LINE - 1u);
+    snapshot->writing = 0;
+    __atomic_store_n(&snapshot->reading, IPC_SNAPSHOT_NONE, __ATOMIC_RELAXED);
+    __atomic_store_n(&snapshot->notifyAfter, IPC_SNAPSHOT_NO_NOTIFY, __ATOMIC_RELAXED);
+    __atomic_store_n(&snapshot->latest, 0u, __ATOMIC_RELEASE);
+}
+
+/* Returns the buffer to fill with the next snapshot, never waits */
+static inline uint8_t* IPC_SNAPSHOT_BeginWrite(IpcSnapshot_t* snapshot)
+{
+    uint32_t latest = __atomic_load_n(&snapshot->latest, __ATOMIC_RELAXED) & 3u;
+    uint32_t reading = __atomic_load_n(&snapshot->reading, __ATOMIC_ACQUIRE);
+    uint32_t index = 0;
+
+    while (index == latest || index == reading) {
+        ++index;
+    }
+
+    snapshot->writing = index;
+    return IPC_SNAPSHOT_Buffer(snapshot, index);
+}
+
+/* Publishes the buffer of BeginWrite as the latest snapshot. Returns true if
+ * the reader armed a notification for it; the writer then notifies the
+ * reader's CPU, e.g. with VARIANT_NotifyChan0.
+ */
+static inline bool IPC_SNAPSHOT_EndWrite(IpcSnapshot_t* snapshot)
+{
+    uint32_t previous = __atomic_load_n(&snapshot->latest, __ATOMIC_RELAXED) >> 2;
+    uint32_t sequence = previous + 1u;
+
+    if ((sequence & 0x3FFFFFFFu) == 0) {
+        /* 0 is reserved for nothing published */
+        sequence = 1;
+    }
+
+    __atomic_store_n(&snapshot->latest, (sequence << 2) | snapshot->writing, __ATOMIC_RELEASE);
+    /* Pairs with the barriers of BeginRead and ArmNotify, see the top of the file */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&snapshot->notifyAfter, __ATOMIC_RELAXED) == previous;
+}
+
+/* Returns the latest snapshot if it is newer than *sequence and updates
+ * *sequence, NULL otherwise. Start with *sequence 0. Snapshot stays valid
+ * until EndRead.
+ */
+static inline const uint8_t* IPC_SNAPSHOT_BeginRead(IpcSnapshot_t* snapshot, uint32_t* sequence)
+{
+    uint32_t latest = __atomic_load_n(&snapshot->latest, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        if ((latest >> 2) == 0 || (latest >> 2) == *sequence) {
+            return NULL;
+        }
+
+        __atomic_store_n(&snapshot->reading, latest & 3u, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        uint32_t check = __atomic_load_n(&snapshot->latest, __ATOMIC_ACQUIRE);
+        if (check == latest) {
+            break;
+        }
+
+        /* Writer published in between and may be filling the announced buffer */
+        latest = check;
+    }
+
+    *sequence = latest >> 2;
+    return IPC_SNAPSHOT_Buffer(snapshot, latest & 3u);
+}
+
+/* Gives the buffer of BeginRead back to the writer */
+static inline void IPC_SNAPSHOT_EndRead(IpcSnapshot_t* snapshot)
+{
+    __atomic_store_n(&snapshot->reading, IPC_SNAPSHOT_NONE, __ATOMIC_RELEASE);
+}
+
+/* Asks the writer to notify the next snapshot after sequence, the one the
+ * reader got from BeginRead. Returns false if it has already been published;
+ * read it instead of sleeping. Once armed, the notification is sent for one
+ * snapshot only.
+ */
+static inline bool IPC_SNAPSHOT_ArmNotify(IpcSnapshot_t* snapshot, uint32_t sequence)
+{
+    __atomic_store_n(&snapshot->notifyAfter, sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return (__atomic_load_n(&snapshot->latest, __ATOMIC_ACQUIRE) >> 2) == sequence;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // DIPPA_IPC_SNAPSHOT_H_
@@ -0,0 +1,37 @@
+#ifndef DIPPA_IPC_TUNNEL_SIM_H_
+#define DIPPA_IPC_TUNNEL_SIM_H_
+
+/* Host simulation of the ipc_tunnel memory.
+ *
+ * CPU0 side (the "shm" CommInterface) creates a POSIX shared memory segment
+ * and lays out the tunnels in it like the kernel module lays them out in its
+ * memory-regions. The simulated CPU1 (sim/) maps the segment at
+ * IPC_TUNNEL_SIM_BASE so the addresses in the descriptors can be used as
+ * pointers by the unchanged firmware.
+ *
+ *     0x0000  GIC distributor, SGI writes of the firmware land here
+ *     0x1000  doorbell and descriptor block
+ *     0x2000  tunnels
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IPC_TUNNEL_SIM_SHM_NAME "/dippa_ipc_tunnel"
+
+#define IPC_TUNNEL_SIM_BASE 0x3f000000u
+#define IPC_TUNNEL_SIM_SIZE 0x100000u
+
+#define IPC_TUNNEL_SIM_GIC_OFFSET 0x0000u
+#define IPC_TUNNEL_SIM_DESCRIPTOR_OFFSET 0x1000u
+#define IPC_TUNNEL_SIM_TUNNEL_OFFSET 0x2000u
+
+/* Host core the simulated CPU1 runs on, last online core if not set */
+#define IPC_TUNNEL_SIM_CPU_ENV "IPC_TUNNEL_SIM_CPU"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // DIPPA_IPC_TUNNEL_SIM_H_
@@ -86,6 +86,16 @@ typedef struct {
 	SharedState_Variables vars;
 } SharedState_T0SharedMemory;
 
+/* Payload of the T0 snapshot channel, see ipc_snapshot.h. Replaces
+ * SharedState_T0SharedMemory in the -snapshot builds.
+ */
+typedef struct {
+	uint64_t timestamp;
+	uint32_t prevUpdateTime;
+	uint32_t padding1;
+	SharedState_Variables vars;
+} SharedState_T0Snapshot;
+
 
 typedef struct {
 	uint64_t timestamp;
@@ -0,0 +1,208 @@
+#ifndef IPC_TUNNEL_IOCTL_H_
+#define IPC_TUNNEL_IOCTL_H_
+
+/* Userspace interface of the ipc_tunnel module.
+ * Included both by the module and by the Linux applications.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define IPC_TUNNEL_IOC_MAGIC 0xC5
+
+/* Both sides stamp these into their own half of the control header.
+ * A side refuses to touch the rings until the other side has stamped
+ * a matching layout.
+ */
+#define IPC_TUNNEL_MAGIC 0x49504354u  /* "IPCT" */
+#define IPC_TUNNEL_LAYOUT_VERSION 7u
+
+/* Maximum number of packets moved by a single batch ioctl */
+#define IPC_TUNNEL_MAX_BATCH 64
+
+/* Describes a single packet in a batch.
+ * Read: size is the size of the buffer and is replaced with the size of the packet.
+ * Write: size is the size of the packet.
+ */
+struct ipc_tunnel_packet {
+    __u64 data;
+    __u32 size;
+    __u32 flags;
+};
+
+struct ipc_tunnel_batch {
+    /* Pointer to an array of struct ipc_tunnel_packet */
+    __u64 packets;
+    __u32 count;
+    __u32 flags;
+};
+
+/* Both return the number of packets moved.
+ *
+ * Read blocks until at least one packet is available unless the file is
+ * opened with O_NONBLOCK. Write moves as many packets as fit in the ring
+ * and returns 0 if the ring is full.
+ * Ring index is published once per call.
+ */
+#define IPC_TUNNEL_IOC_READ_BATCH  _IOWR(IPC_TUNNEL_IOC_MAGIC, 1, struct ipc_tunnel_batch)
+#define IPC_TUNNEL_IOC_WRITE_BATCH _IOW(IPC_TUNNEL_IOC_MAGIC, 2, struct ipc_tunnel_batch)
+
+/* mmap offsets of the tunnel memory regions.
+ * Offset 0 is the shared buffer of the tunnel. Other regions are mapped from
+ * the start of the page that contains them; the position of the region inside
+ * the mapping is reported by IPC_TUNNEL_IOC_GET_LAYOUT.
+ */
+#define IPC_TUNNEL_MMAP_SHARED_BUFFER  0x00000000u
+#define IPC_TUNNEL_MMAP_CONTROL_HEADER 0x10000000u
+#define IPC_TUNNEL_MMAP_SEND_RING      0x20000000u
+#define IPC_TUNNEL_MMAP_RECEIVE_RING   0x30000000u
+
+/* Rings are mapped as cached memory */
+#define IPC_TUNNEL_LAYOUT_CACHED 1u
+/* Rings are cacheable but not coherent with CPU1, the module cleans and
+ * invalidates the bytes of every packet. Rings can't be mapped to user space,
+ * use read/write or the batch ioctls.
+ */
+#define IPC_TUNNEL_LAYOUT_CACHE_MAINTAINED 2u
+
+/* Ring is a byte stream of variable length records instead of fixed size slots.
+ * Records are a packet header followed by the payload, aligned to
+ * IPC_TUNNEL_STREAM_RECORD_ALIGNMENT. A record that doesn't fit before the end
+ * of the ring is preceded by a padding record whose packet size is
+ * IPC_TUNNEL_STREAM_PADDING and which extends to the end of the ring.
+ * Ring indices count bytes instead of packets.
+ */
+#define IPC_TUNNEL_RING_STREAM 1u
+#define IPC_TUNNEL_STREAM_RECORD_ALIGNMENT 8u
+#define IPC_TUNNEL_STREAM_PADDING 0xFFFFFFFFu
+
+/* Slot ring keeps only the latest packets. The writer doesn't wait for the
+ * reader: it stores the write index of the packet in the sequence field of
+ * the packet header, then writes the payload, overwriting the oldest unread
+ * packet when the ring is full. A reader that finds more than slot_count
+ * packets in the ring skips to the oldest one still there. A slot whose
+ * sequence isn't the read index, before or after the payload is copied, has
+ * been overwritten and is skipped.
+ */
+#define IPC_TUNNEL_RING_OVERWRITE 2u
+
+/* Tunnel has the trace device tree property and the ring isn't an overwrite
+ * ring: CPU1 stores the low 32 bits of the global timer in the sequence
+ * field of every packet header just before it commits the packet. See
+ * IPC_TUNNEL_IOC_READ_TRACED. Receive ring only.
+ */
+#define IPC_TUNNEL_RING_TRACE 4u
+
+struct ipc_tunnel_ring_layout {
+    /* Offset of the first slot from the start of the mapping */
+    __u32 offset;
+    /* Size of the mapping, multiple of the page size */
+    __u32 map_size;
+    /* For stream rings slot_size is the record alignment and
+     * slot_size * slot_count is the size of the ring in bytes
+     */
+    __u32 slot_size;
+    __u32 slot_count;
+    __u32 max_packet_size;
+    __u32 flags;
+};
+
+struct ipc_tunnel_layout {
+    __u32 magic;
+    __u32 version;
+    __u32 flags;
+
+    __u32 control_header_offset;
+    __u32 control_header_map_size;
+
+    __u32 shared_buffer_size;
+
+    /* send is CPU0 -> CPU1 and receive is CPU1 -> CPU0 */
+    struct ipc_tunnel_ring_layout send;
+    struct ipc_tunnel_ring_layout receive;
+};
+
+#define IPC_TUNNEL_IOC_GET_LAYOUT _IOR(IPC_TUNNEL_IOC_MAGIC, 3, struct ipc_tunnel_layout)
+
+/* CPU1 -> CPU0 notification counters. sent and suppressed are maintained by CPU1,
+ * received counts the notify interrupts handled by the module.
+ */
+struct ipc_tunnel_notify_stats {
+    __u32 sent;
+    __u32 suppressed;
+    __u32 received;
+    __u32 reserved;
+};
+
+#define IPC_TUNNEL_IOC_GET_NOTIFY_STATS _IOR(IPC_TUNNEL_IOC_MAGIC, 4, struct ipc_tunnel_notify_stats)
+
+/* Busy-poll budget of the file in microseconds, similar to SO_BUSY_POLL.
+ * Blocking reads and poll spin on the receive ring for up to the budget
+ * before sleeping on the wait queue. 0 disables busy-polling.
+ * Default comes from the busy_poll_usecs module parameter.
+ */
+#define IPC_TUNNEL_IOC_SET_BUSY_POLL _IOW(IPC_TUNNEL_IOC_MAGIC, 5, __u32)
+#define IPC_TUNNEL_IOC_GET_BUSY_POLL _IOR(IPC_TUNNEL_IOC_MAGIC, 6, __u32)
+
+/* Spins that found a packet (hits), spins that ran out of budget (misses)
+ * and the total time spent spinning. Reset when the device is opened.
+ */
+struct ipc_tunnel_busy_poll_stats {
+    __u64 spin_ns;
+    __u32 hits;
+    __u32 misses;
+};
+
+#define IPC_TUNNEL_IOC_GET_BUSY_POLL_STATS _IOR(IPC_TUNNEL_IOC_MAGIC, 7, struct ipc_tunnel_busy_poll_stats)
+
+/* Eventfd signalled on every notify interrupt of the tunnel, also the ones
+ * that come without a packet, e.g. after CPU1 publishes a snapshot of
+ * include/ipc_snapshot.h the reader armed. User space can then wait for
+ * them in poll(). -1 removes it, closing the device does too.
+ */
+#define IPC_TUNNEL_IOC_SET_EVENTFD _IOW(IPC_TUNNEL_IOC_MAGIC, 8, __s32)
+
+/* Points of the CPU1 -> CPU0 path of one packet, low 32 bits of the global
+ * timer. Only the stamps whose bit is set in valid were taken:
+ *
+ *   commit   CPU1 finished writing the packet, IPC_TUNNEL_RING_TRACE rings
+ *   sgi      CPU1 raised the doorbell SGI that announced the packet
+ *   irq      doorbell interrupt handler of the module ran
+ *   dequeue  module took the packet from the ring
+ *   copy     payload was copied to user space
+ *
+ * sgi and irq are missing when the packet was read without waiting for an
+ * interrupt, or the last interrupt came before the packet was committed.
+ * When one interrupt served several tunnels, sgi is the doorbell CPU1 rang
+ * last, which may have been for another tunnel.
+ */
+#define IPC_TUNNEL_TRACE_COMMIT  1u
+#define IPC_TUNNEL_TRACE_SGI     2u
+#define IPC_TUNNEL_TRACE_IRQ     4u
+#define IPC_TUNNEL_TRACE_DEQUEUE 8u
+#define IPC_TUNNEL_TRACE_COPY    16u
+
+struct ipc_tunnel_trace {
+    __u32 commit;
+    __u32 sgi;
+    __u32 irq;
+    __u32 dequeue;
+    __u32 copy;
+    __u32 valid;
+};
+
+/* size is the size of the buffer and is replaced with the size of the packet */
+struct ipc_tunnel_traced_read {
+    __u64 data;
+    __u32 size;
+    __u32 reserved;
+    struct ipc_tunnel_trace trace;
+};
+
+/* Same as read() of one packet, and the stamps of its path. Returns the
+ * size of the packet, blocks like read() unless the file is opened with
+ * O_NONBLOCK. -EOPNOTSUPP if the module has no access to the global timer.
+ */
+#define IPC_TUNNEL_IOC_READ_TRACED _IOWR(IPC_TUNNEL_IOC_MAGIC, 9, struct ipc_tunnel_traced_read)
+
+#endif  // IPC_TUNNEL_IOCTL_H_
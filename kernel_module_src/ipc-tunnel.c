@@ -18,10 +18,23 @@
 #include <linux/uaccess.h>
 #include <linux/wait.h>
 #include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/device.h>
+#include <linux/bitops.h>
+#include <linux/kthread.h>
+#include <linux/dma-direction.h>
+#include <linux/eventfd.h>
+#include <linux/spinlock.h>
 
 #include <linux/of_address.h>
 #include <linux/of_device.h>
 #include <linux/of_platform.h>
+#include <linux/platform_device.h>
+
+#include "ipc-tunnel-ioctl.h"
 
 #define CLASS_NAME "ipc_tunnel"
 #define DEVICE_NAME "ipc_tunnel"
@@ -29,12 +42,105 @@
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Lassi Hämäläinen");
 MODULE_DESCRIPTION("CPU0 -> CPU1 IPC packet tunnel");
-MODULE_VERSION("0.3");
+MODULE_VERSION("0.10");
 
 /* Undefine this to use device memory type */
 #define USE_CACHED_MEMORY 1
 
-#define DEVICE_COUNT 6
+/* Define this (or pass -DIPC_TUNNEL_LOOPBACK in ccflags) to run without CPU1.
+ * Rings are allocated from kernel memory and a kernel thread plays the CPU1
+ * side of every tunnel, see the loopback peer below. Useful for testing and
+ * benchmarking the driver on any Linux machine.
+ */
+//#define IPC_TUNNEL_LOOPBACK 1
+
+#if defined(IPC_TUNNEL_LOOPBACK) && !defined(USE_CACHED_MEMORY)
+#error "Loopback peer requires USE_CACHED_MEMORY"
+#endif
+
+#ifndef USE_CACHED_MEMORY
+/* Cache maintenance of the cache-maintained tunnels */
+#include <asm/cacheflush.h>
+#include <asm/outercache.h>
+#endif
+
+/* All tunnels notify CPU0 through a single doorbell SGI, see struct Doorbell.
+ * SGI can be overridden with the doorbell-sgi property.
+ */
+#define DEFAULT_DOORBELL_SGI 14
+#define DOORBELL_CHANNELS 32
+
+/* SGIs raised on CPU1 after writing to tunnels with cpu1-notify and
+ * cpu1-urgent, overridden with cpu1-doorbell-sgi and cpu1-urgent-sgi.
+ * Firmware uses SGIs 1-3 for its own tasks.
+ */
+#define DEFAULT_CPU1_DOORBELL_SGI 4
+#define DEFAULT_CPU1_URGENT_SGI 5
+
+/* Zynq GIC distributor, CPU1 SGIs are raised through its software interrupt register */
+#define GIC_DISTRIBUTOR_ADDRESS 0xF8F01000
+#define GIC_SGI_TARGET_CPU1 (1u << (16 + 1))
+
+/* Different memory-regions the tunnels of one device can be placed in */
+#define MAX_RING_POOLS 4
+
+#define DESCRIPTOR_MAGIC 0x49504344u  /* "IPCD" */
+#define DESCRIPTOR_VERSION 4u
+
+/* CPU1 sets memory attributes per 1 MB section */
+#define CPU1_SECTION_SIZE 0x100000u
+
+/* Maximum busy-poll budget accepted from user space */
+#define MAX_BUSY_POLL_USECS 10000u
+
+static unsigned int busy_poll_usecs = 0;
+module_param(busy_poll_usecs, uint, 0644);
+MODULE_PARM_DESC(busy_poll_usecs, "Default busy-poll budget of blocking reads and poll in microseconds");
+
+/* Zynq global timer, used to timestamp the notify interrupts */
+#define GLOBAL_TIMER_ADDRESS 0xF8F00200
+#define GLOBAL_TIMER_NS_PER_TICK 3
+
+#define LATENCY_HIST_BUCKETS 32
+
+/* Counters are per CPU so updating them only touches local memory.
+ * They are summed when read through sysfs.
+ */
+struct TunnelStats {
+    u64 packets_sent;
+    u64 bytes_sent;
+    u64 packets_received;
+    u64 bytes_received;
+    u64 write_ring_full;
+    u64 write_too_big;
+    /* Packets of an overwrite receive ring that CPU1 reused before they were read */
+    u64 packets_overwritten;
+    u64 ipi_received;
+    u64 wakeups;
+    /* CPU1 doorbell of cpu1-notify tunnels, suppressed while still pending */
+    u64 cpu1_notify_sent;
+    u64 cpu1_notify_suppressed;
+
+    /* Occupancy as seen by CPU0 from its cached copies of CPU1's indices.
+     * Packets for slot rings and bytes for stream rings.
+     */
+    u32 peak_send_occupancy;
+    u32 peak_receive_occupancy;
+
+    /* Notify interrupt to read() return. Bucket 0 is 0 ns and bucket i
+     * is [2^(i-1), 2^i) ns.
+     */
+    u64 read_latency_hist[LATENCY_HIST_BUCKETS];
+};
+
+#define STAT_INC(tunnel, field) this_cpu_inc((tunnel)->stats->field)
+#define STAT_ADD(tunnel, field, value) this_cpu_add((tunnel)->stats->field, (value))
+#define STAT_PEAK(tunnel, field, value)                         \
+    do {                                                        \
+        if ((value) > this_cpu_read((tunnel)->stats->field)) {  \
+            this_cpu_write((tunnel)->stats->field, (value));    \
+        }                                                       \
+    } while (0)
 
 struct TunnelInstance {
     const struct TunnelConfig* config;
@@ -45,6 +151,51 @@ struct TunnelInstance {
     uint16_t send_packet_size;
     uint16_t receive_packet_size;
 
+    /* Size of the rings in bytes */
+    uint32_t send_ring_size;
+    uint32_t receive_ring_size;
+
+    /* Free running ring indices owned by CPU0. These mirror the values
+     * published in the control header so they never have to be read back.
+     */
+    uint32_t write_index;
+    uint32_t read_index;
+
+    /* Shadow copies of CPU1's indices. Refreshed from the control header
+     * only when the send ring looks full or the receive ring looks empty.
+     */
+    uint32_t cached_cpu1_read_index;
+    uint32_t cached_cpu1_write_index;
+
+    int peer_verified;
+
+    /* Rings are mapped to user space. The user space library moves the
+     * indices in the control header so the local copies must be reloaded
+     * before they are used.
+     */
+    int rings_mapped;
+
+    struct TunnelStats __percpu* stats;
+
+    /* Global timer value of the last notify interrupt not yet followed by a read */
+    uint32_t notify_ticks;
+    int notify_pending;
+    /* cpu1_raised_ticks of the doorbell when that interrupt was handled */
+    uint32_t notify_sgi_ticks;
+
+    /* Busy-poll budget of the open file. Tunnel can only be opened once
+     * so this is per file.
+     */
+    uint32_t busy_poll_usecs;
+    uint32_t busy_poll_hits;
+    uint32_t busy_poll_misses;
+    uint64_t busy_poll_spin_ns;
+
+    /* Signalled on every notify interrupt, set by IPC_TUNNEL_IOC_SET_EVENTFD.
+     * Lock protects it from the interrupt handler.
+     */
+    struct eventfd_ctx* notify_eventfd;
+    spinlock_t notify_eventfd_lock;
 
     dev_t dev;
     struct cdev c_dev;
@@ -54,6 +205,9 @@ struct TunnelInstance {
     wait_queue_head_t read_queue;
 };
 
+/* Read from the device tree when the driver is probed. Addresses are
+ * allocated from the memory-region of the tunnel.
+ */
 struct TunnelConfig {
     uint32_t control_header_address;
 
@@ -65,29 +219,173 @@ struct TunnelConfig {
     uint16_t receive_max_packet_size;
     uint16_t receive_buffered_packet_count;
 
+    /* Non-zero selects the stream ring mode with a ring of this many bytes.
+     * Must be a power of two. Buffered packet counts are then ignored.
+     */
+    uint32_t send_stream_ring_size;
+    uint32_t receive_stream_ring_size;
+
     uint32_t shared_buffer_address;
     uint32_t shared_buffer_size;
 
-    int cpu0_notify_ipi;
-
-    void (*cpu0_notify_ipi_handler)(void);
+    /* Rings are cacheable on both CPUs without coherency, the bytes of each
+     * packet are cleaned and invalidated explicitly. Only without
+     * USE_CACHED_MEMORY, where the rings are coherent anyway.
+     */
+    int cache_maintained;
+
+    /* Writer reuses the oldest unread slot instead of waiting for space,
+     * see IPC_TUNNEL_RING_OVERWRITE. Slot rings only.
+     */
+    int send_overwrite;
+    int receive_overwrite;
+
+    /* CPU1 is interrupted after packets are written to the send ring so it
+     * can handle them before its next tick. Urgent tunnels use their own
+     * SGI, which CPU1 runs at a higher priority.
+     */
+    int notify_cpu1;
+    int cpu1_urgent;
+
+    /* CPU1 stamps the packets it sends with the global timer, see
+     * IPC_TUNNEL_IOC_READ_TRACED
+     */
+    int trace;
 };
 
+/* Layout v7
+ *
+ * Indices are free running 32 bit packet counters. Slot of an index is
+ * index & (buffered_packet_count - 1) so the counts must be powers of two.
+ * Ring is empty when write == read and full when write - read == count,
+ * so every slot is usable.
+ *
+ * In the stream ring mode indices are byte counters and records are packed
+ * contiguously, see IPC_TUNNEL_RING_STREAM. Both sides stamp their stream
+ * ring sizes so a configuration mismatch is detected.
+ *
+ * cpu0_read_event_index works like the used event index of virtio:
+ * CPU1 raises the notify SGI only when its write index moves past it.
+ * CPU0 sets it to its read index before it goes to sleep, so no interrupts
+ * are sent while the reader is awake and draining the ring.
+ *
+ * Each side only writes its own cache line.
+ */
 struct ControlHeader {
     uint32_t cpu0_write_index;
     uint32_t cpu0_read_index;
+    uint32_t cpu0_magic;
+    uint32_t cpu0_version;
+    uint32_t cpu0_read_event_index;
+    uint32_t cpu0_send_stream_ring_size;
+    uint32_t cpu0_receive_stream_ring_size;
 
-    uint32_t _padding1[6];
+    uint32_t _padding1[1];
 
     volatile uint32_t cpu1_write_index;
     volatile uint32_t cpu1_read_index;
+    volatile uint32_t cpu1_magic;
+    volatile uint32_t cpu1_version;
+    volatile uint32_t cpu1_notify_sent;
+    volatile uint32_t cpu1_notify_suppressed;
+    volatile uint32_t cpu1_send_stream_ring_size;
+    volatile uint32_t cpu1_receive_stream_ring_size;
+};
+
+/* Doorbell shared by all tunnels
+ *
+ * Bit N belongs to tunnel N. CPU1 toggles the bit in cpu1_raised and raises
+ * DOORBELL_SGI; bits that differ between cpu1_raised and cpu0_acked are
+ * pending. CPU0 acknowledges everything it has seen by copying cpu1_raised
+ * to cpu0_acked and wakes the pending tunnels. CPU1 doesn't toggle a bit
+ * that is still pending so one interrupt serves all tunnels that became
+ * ready before the handler ran.
+ *
+ * cpu0_raised and cpu1_acked are the same for the other direction, used by
+ * the cpu1-notify tunnels. CPU1 acknowledges the bits of the tunnels it is
+ * about to drain.
+ *
+ * cpu1_raised_ticks is the global timer when CPU1 last raised the doorbell
+ * SGI for a trace tunnel.
+ *
+ * Each word has a single writer so no atomic read-modify-write is needed
+ * on the shared memory, which isn't available on device memory.
+ */
+struct Doorbell {
+    uint32_t cpu0_acked;
+    uint32_t cpu0_raised;
+    uint32_t _padding1[6];
+
+    volatile uint32_t cpu1_raised;
+    volatile uint32_t cpu1_acked;
+    volatile uint32_t cpu1_raised_ticks;
+    uint32_t _padding2[5];
+};
 
-    uint32_t _padding2[6];
+/* Geometry of one tunnel as seen by CPU1. send is CPU0 -> CPU1. */
+struct TunnelDescriptor {
+    uint32_t control_header_address;
+    uint32_t send_buffer_address;
+    uint32_t receive_buffer_address;
+    uint32_t shared_buffer_address;
+    uint32_t shared_buffer_size;
+
+    uint32_t send_max_packet_size;
+    uint32_t send_buffered_packet_count;
+    uint32_t receive_max_packet_size;
+    uint32_t receive_buffered_packet_count;
+
+    uint32_t send_stream_ring_size;
+    uint32_t receive_stream_ring_size;
+
+    uint32_t flags;
+
+    uint32_t _reserved[4];
+};
+
+/* TunnelDescriptor flags */
+#define TUNNEL_DESCRIPTOR_CACHE_MAINTAINED 1u
+#define TUNNEL_DESCRIPTOR_SEND_OVERWRITE 2u
+#define TUNNEL_DESCRIPTOR_RECEIVE_OVERWRITE 4u
+#define TUNNEL_DESCRIPTOR_NOTIFY_CPU1 8u
+#define TUNNEL_DESCRIPTOR_CPU1_URGENT 16u
+#define TUNNEL_DESCRIPTOR_TRACE 32u
+
+/* Placed at the reg address of the device tree node. CPU0 fills the
+ * descriptors when the driver is probed and stamps the magic last, CPU1
+ * waits for the magic and configures its side of the tunnels from the
+ * descriptors. Tunnel N uses doorbell bit N.
+ */
+struct DescriptorBlock {
+    struct Doorbell doorbell;
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tunnel_count;
+    uint32_t doorbell_sgi;
+    uint32_t cpu1_doorbell_sgi;
+    uint32_t cpu1_urgent_sgi;
+    uint32_t _padding[2];
+
+    struct TunnelDescriptor tunnels[0];
+};
+
+/* Allocation cursor of a memory-region. The region is identified by its
+ * start address, the reference to its node is dropped after lookup.
+ */
+struct RingPool {
+    phys_addr_t start;
+    phys_addr_t next;
+    phys_addr_t end;
 };
 
 struct PacketHeader {
     uint32_t packet_size;
-    uint32_t reserved_;
+    /* Write index of the packet in overwrite rings, global timer ticks of
+     * the commit in traced rings CPU1 sends on (see traces_receive_ring),
+     * unused otherwise
+     */
+    uint32_t sequence;
     uint64_t data[0];
 };
 
@@ -106,451 +404,2667 @@ extern int set_ipi_handler(int ipinr, void* handler, char* desc);
 extern void clear_ipi_handler(int ipinr);
 
 
-static void tunnel0_ipi_notify_handler(void);
-static void tunnel1_ipi_notify_handler(void);
-static void tunnel2_ipi_notify_handler(void);
-static void tunnel3_ipi_notify_handler(void);
-static void tunnel4_ipi_notify_handler(void);
-static void tunnel5_ipi_notify_handler(void);
+static struct TunnelInstance* tunnels = NULL;
+static struct TunnelConfig* tunnel_configs = NULL;
+static unsigned int tunnel_count = 0;
+static struct DescriptorBlock* descriptor_block = NULL;
+static struct Doorbell* doorbell = NULL;
+static uint32_t doorbell_acked = 0;
+static u32 doorbell_sgi = DEFAULT_DOORBELL_SGI;
+static u32 cpu1_doorbell_sgi = DEFAULT_CPU1_DOORBELL_SGI;
+static u32 cpu1_urgent_sgi = DEFAULT_CPU1_URGENT_SGI;
+/* Copy of cpu0_raised, which is shared by all tunnels and written from any writer */
+static uint32_t cpu1_doorbell_raised = 0;
+static DEFINE_SPINLOCK(cpu1_doorbell_lock);
+static void __iomem* gic_distributor = NULL;
+static struct class* device_class = NULL;
+static dev_t first_device_number;
+static void __iomem* global_timer = NULL;
 
+#ifdef USE_CACHED_MEMORY
+static uint32_t get_cpu0_write_index(struct ControlHeader* header)
+{
+    return header->cpu0_write_index;
+}
 
+static uint32_t get_cpu1_read_index(struct ControlHeader* header)
+{
+    return smp_load_acquire(&header->cpu1_read_index);
+}
 
-static const struct TunnelConfig tunnel_configs[DEVICE_COUNT] = {
-    {
-        .control_header_address = 0xFFFF0000,
-        .send_buffer_address = 0xFFFF0040,
-        .receive_buffer_address = 0xFFFF1100,
+static uint32_t get_cpu0_read_index(struct ControlHeader* header)
+{
+    return header->cpu0_read_index;
+}
 
-        .send_max_packet_size = 0x780,
-        .send_buffered_packet_count = 2,
-        .receive_max_packet_size = 0x780,
-        .receive_buffered_packet_count = 2,
+static uint32_t get_cpu1_write_index(struct ControlHeader* header)
+{
+    return smp_load_acquire(&header->cpu1_write_index);
+}
 
-        .shared_buffer_address = 0xFFFFE000,
-        .shared_buffer_size = 0x1000,
+static uint32_t get_cpu1_magic(struct ControlHeader* header)
+{
+    return smp_load_acquire(&header->cpu1_magic);
+}
 
-        .cpu0_notify_ipi = 14,
-        .cpu0_notify_ipi_handler = &tunnel0_ipi_notify_handler
-    },
-    {
-        .control_header_address = 0xFFFF3000,
-        .send_buffer_address = 0xFFFF3040,
-        .receive_buffer_address = 0xFFFF5100,
+static uint32_t get_cpu1_version(struct ControlHeader* header)
+{
+    return header->cpu1_version;
+}
 
-        .send_max_packet_size = 0x780,
-        .send_buffered_packet_count = 4,
-        .receive_max_packet_size = 0x780,
-        .receive_buffered_packet_count = 4,
+static uint32_t get_cpu1_send_stream_ring_size(struct ControlHeader* header)
+{
+    return header->cpu1_send_stream_ring_size;
+}
 
-        .shared_buffer_address = 0x0,
-        .shared_buffer_size = 0x0,
+static uint32_t get_cpu1_receive_stream_ring_size(struct ControlHeader* header)
+{
+    return header->cpu1_receive_stream_ring_size;
+}
 
-        .cpu0_notify_ipi = 13,
+static uint32_t get_doorbell_raised(struct Doorbell* bell)
+{
+    return smp_load_acquire(&bell->cpu1_raised);
+}
 
-        .cpu0_notify_ipi_handler = &tunnel1_ipi_notify_handler
-    },
-    {
-        .control_header_address = 0xFFFF7200,
-        .send_buffer_address = 0xFFFF7240,
-        .receive_buffer_address = 0xFFFF9800,
+static uint32_t get_doorbell_raised_ticks(struct Doorbell* bell)
+{
+    return READ_ONCE(bell->cpu1_raised_ticks);
+}
 
-        .send_max_packet_size = 0x1200,
-        .send_buffered_packet_count = 2,
-        .receive_max_packet_size = 0x1200,
-        .receive_buffered_packet_count = 2,
+static void set_doorbell_acked(struct Doorbell* bell, uint32_t acked)
+{
+    WRITE_ONCE(bell->cpu0_acked, acked);
+    /* Acknowledge must be visible before the woken readers check the rings */
+    smp_mb();
+}
 
-        .shared_buffer_address = 0xFFFFC000,
-        .shared_buffer_size = 0x3000,
+static uint32_t get_cpu1_doorbell_acked(struct Doorbell* bell)
+{
+    return smp_load_acquire(&bell->cpu1_acked);
+}
 
-        .cpu0_notify_ipi = 12,
+static void set_cpu1_doorbell_raised(struct Doorbell* bell, uint32_t raised)
+{
+    WRITE_ONCE(bell->cpu0_raised, raised);
+}
 
-        .cpu0_notify_ipi_handler = &tunnel2_ipi_notify_handler
-    },
-    {
-        .control_header_address = 0x3FFF0000,
-        .send_buffer_address = 0x3FFF0040,
-        .receive_buffer_address = 0x3FFF1100,
+static void write_descriptor_block(struct DescriptorBlock* block, const struct DescriptorBlock* header,
+                                   const struct TunnelDescriptor* descriptors, unsigned int count)
+{
+    smp_store_release(&block->magic, 0);
+    memcpy(block->tunnels, descriptors, count * sizeof(struct TunnelDescriptor));
+    block->version = header->version;
+    block->tunnel_count = header->tunnel_count;
+    block->doorbell_sgi = header->doorbell_sgi;
+    block->cpu1_doorbell_sgi = header->cpu1_doorbell_sgi;
+    block->cpu1_urgent_sgi = header->cpu1_urgent_sgi;
+    smp_store_release(&block->magic, header->magic);
+}
 
-        .send_max_packet_size = 0x780,
-        .send_buffered_packet_count = 2,
-        .receive_max_packet_size = 0x780,
-        .receive_buffered_packet_count = 2,
+static void set_cpu0_layout(struct ControlHeader* header, const struct TunnelConfig* config)
+{
+    header->cpu0_version = IPC_TUNNEL_LAYOUT_VERSION;
+    header->cpu0_send_stream_ring_size = config->send_stream_ring_size;
+    header->cpu0_receive_stream_ring_size = config->receive_stream_ring_size;
+    smp_store_release(&header->cpu0_magic, IPC_TUNNEL_MAGIC);
+}
 
-        .shared_buffer_address = 0x3FFFE000,
-        .shared_buffer_size = 0x1000,
+#else
 
-        .cpu0_notify_ipi = 11,
-        .cpu0_notify_ipi_handler = &tunnel3_ipi_notify_handler
-    },
-    {
-        .control_header_address = 0x3FFF3000,
-        .send_buffer_address = 0x3FFF3040,
-        .receive_buffer_address = 0x3FFF5100,
+static uint32_t get_cpu0_write_index(struct ControlHeader* header)
+{
+    return readl(&header->cpu0_write_index);
+}
 
-        .send_max_packet_size = 0x780,
-        .send_buffered_packet_count = 4,
-        .receive_max_packet_size = 0x780,
-        .receive_buffered_packet_count = 4,
+static uint32_t get_cpu1_read_index(struct ControlHeader* header)
+{
+    return readl(&header->cpu1_read_index);
+}
 
-        .shared_buffer_address = 0x0,
-        .shared_buffer_size = 0x0,
+static uint32_t get_cpu0_read_index(struct ControlHeader* header)
+{
+    return readl(&header->cpu0_read_index);
+}
 
-        .cpu0_notify_ipi = 10,
+static uint32_t get_cpu1_write_index(struct ControlHeader* header)
+{
+    return  readl(&header->cpu1_write_index);
+}
 
-        .cpu0_notify_ipi_handler = &tunnel4_ipi_notify_handler
-    },
-    {
-        .control_header_address = 0x3FFF7200,
-        .send_buffer_address = 0x3FFF7240,
-        .receive_buffer_address = 0x3FFF9800,
+static uint32_t get_cpu1_magic(struct ControlHeader* header)
+{
+    return readl(&header->cpu1_magic);
+}
 
-        .send_max_packet_size = 0x1200,
-        .send_buffered_packet_count = 2,
-        .receive_max_packet_size = 0x1200,
-        .receive_buffered_packet_count = 2,
+static uint32_t get_cpu1_version(struct ControlHeader* header)
+{
+    return readl(&header->cpu1_version);
+}
 
-        .shared_buffer_address = 0x3FFFC000,
-        .shared_buffer_size = 0x2000,
+static uint32_t get_cpu1_send_stream_ring_size(struct ControlHeader* header)
+{
+    return readl(&header->cpu1_send_stream_ring_size);
+}
 
-        .cpu0_notify_ipi = 9,
+static uint32_t get_cpu1_receive_stream_ring_size(struct ControlHeader* header)
+{
+    return readl(&header->cpu1_receive_stream_ring_size);
+}
 
-        .cpu0_notify_ipi_handler = &tunnel5_ipi_notify_handler
-    },
-};
+static uint32_t get_doorbell_raised(struct Doorbell* bell)
+{
+    return readl(&bell->cpu1_raised);
+}
 
+static uint32_t get_doorbell_raised_ticks(struct Doorbell* bell)
+{
+    return readl(&bell->cpu1_raised_ticks);
+}
 
+static void set_doorbell_acked(struct Doorbell* bell, uint32_t acked)
+{
+    writel(acked, &bell->cpu0_acked);
+    dsb();
+}
 
-static struct TunnelInstance tunnels[DEVICE_COUNT];
-static struct class* device_class = NULL;
-static dev_t first_device_number;
+static uint32_t get_cpu1_doorbell_acked(struct Doorbell* bell)
+{
+    return readl(&bell->cpu1_acked);
+}
 
-#ifdef USE_CACHED_MEMORY
-static uint32_t get_cpu0_write_index(struct ControlHeader* header)
+static void set_cpu1_doorbell_raised(struct Doorbell* bell, uint32_t raised)
 {
-    return header->cpu0_write_index;
+    writel(raised, &bell->cpu0_raised);
 }
 
-static uint32_t get_cpu1_read_index(struct ControlHeader* header)
+static void write_descriptor_block(struct DescriptorBlock* block, const struct DescriptorBlock* header,
+                                   const struct TunnelDescriptor* descriptors, unsigned int count)
 {
-    return smp_load_acquire(&header->cpu1_read_index);
+    writel(0, &block->magic);
+    dsb();
+    memcpy_toio(block->tunnels, descriptors, count * sizeof(struct TunnelDescriptor));
+    writel(header->version, &block->version);
+    writel(header->tunnel_count, &block->tunnel_count);
+    writel(header->doorbell_sgi, &block->doorbell_sgi);
+    writel(header->cpu1_doorbell_sgi, &block->cpu1_doorbell_sgi);
+    writel(header->cpu1_urgent_sgi, &block->cpu1_urgent_sgi);
+    dsb();
+    writel(header->magic, &block->magic);
 }
 
-static uint32_t get_cpu0_read_index(struct ControlHeader* header)
+static void set_cpu0_layout(struct ControlHeader* header, const struct TunnelConfig* config)
 {
-    return header->cpu0_read_index;
+    writel(IPC_TUNNEL_LAYOUT_VERSION, &header->cpu0_version);
+    writel(config->send_stream_ring_size, &header->cpu0_send_stream_ring_size);
+    writel(config->receive_stream_ring_size, &header->cpu0_receive_stream_ring_size);
+    dsb();
+    writel(IPC_TUNNEL_MAGIC, &header->cpu0_magic);
 }
 
-static uint32_t get_cpu1_write_index(struct ControlHeader* header)
+#endif
+
+/* Returns 0 when CPU1 has initialized the tunnel with the same layout,
+ * -EAGAIN if CPU1 hasn't initialized the tunnel yet and -EPROTO if CPU1
+ * uses a different layout.
+ */
+static int check_peer_layout(struct TunnelInstance* tunnel)
 {
-    return smp_load_acquire(&header->cpu1_write_index);
+    uint32_t magic;
+
+    if (likely(tunnel->peer_verified)) {
+        return 0;
+    }
+
+    magic = get_cpu1_magic(tunnel->control_header);
+    if (magic == 0) {
+        return -EAGAIN;
+    }
+
+    if (   magic != IPC_TUNNEL_MAGIC
+        || get_cpu1_version(tunnel->control_header) != IPC_TUNNEL_LAYOUT_VERSION) {
+        printk(KERN_ERR "CPU1_IPC_TUNNEL: CPU1 layout mismatch, magic 0x%x version %u, expected version %u\n",
+               magic,
+               get_cpu1_version(tunnel->control_header),
+               IPC_TUNNEL_LAYOUT_VERSION);
+        return -EPROTO;
+    }
+
+    if (   get_cpu1_send_stream_ring_size(tunnel->control_header) != tunnel->config->send_stream_ring_size
+        || get_cpu1_receive_stream_ring_size(tunnel->control_header) != tunnel->config->receive_stream_ring_size) {
+        printk(KERN_ERR "CPU1_IPC_TUNNEL: CPU1 stream ring sizes 0x%x/0x%x, expected 0x%x/0x%x\n",
+               get_cpu1_send_stream_ring_size(tunnel->control_header),
+               get_cpu1_receive_stream_ring_size(tunnel->control_header),
+               tunnel->config->send_stream_ring_size,
+               tunnel->config->receive_stream_ring_size);
+        return -EPROTO;
+    }
+
+    /* CPU1 resets the indices when it initializes the tunnel */
+    tunnel->write_index = get_cpu0_write_index(tunnel->control_header);
+    tunnel->read_index = get_cpu0_read_index(tunnel->control_header);
+    tunnel->cached_cpu1_read_index = get_cpu1_read_index(tunnel->control_header);
+    tunnel->cached_cpu1_write_index = get_cpu1_write_index(tunnel->control_header);
+    tunnel->peer_verified = 1;
+    return 0;
 }
 
-#else
+static void publish_read_index(struct TunnelInstance* tunnel);
+static void publish_write_index(struct TunnelInstance* tunnel);
 
-static uint32_t get_cpu0_write_index(struct ControlHeader* header)
+static uint32_t stream_record_size(uint32_t packet_size)
 {
-    return readl(&header->cpu0_write_index);
+    return (sizeof(struct PacketHeader) + packet_size + IPC_TUNNEL_STREAM_RECORD_ALIGNMENT - 1u)
+            & ~(IPC_TUNNEL_STREAM_RECORD_ALIGNMENT - 1u);
 }
 
-static uint32_t get_cpu1_read_index(struct ControlHeader* header)
+static struct PacketHeader* get_read_packet(struct TunnelInstance* tunnel, uint32_t read_index) {
+    uint32_t offset;
+
+    if (tunnel->config->receive_stream_ring_size) {
+        offset = read_index & (tunnel->receive_ring_size - 1u);
+    }
+    else {
+        offset = tunnel->receive_packet_size * (read_index & (tunnel->config->receive_buffered_packet_count - 1u));
+    }
+
+    return (struct PacketHeader*)(tunnel->receive_buffer + offset);
+}
+
+static struct PacketHeader* get_write_packet(struct TunnelInstance* tunnel, uint32_t write_index) {
+    uint32_t offset;
+
+    if (tunnel->config->send_stream_ring_size) {
+        offset = write_index & (tunnel->send_ring_size - 1u);
+    }
+    else {
+        offset = tunnel->send_packet_size * (write_index & (tunnel->config->send_buffered_packet_count - 1u));
+    }
+
+    return (struct PacketHeader*)(tunnel->send_buffer + offset);
+}
+
+#ifdef USE_CACHED_MEMORY
+static void clean_send_range(struct TunnelInstance* tunnel, const void* start, uint32_t size)
 {
-    return readl(&header->cpu1_read_index);
 }
 
-static uint32_t get_cpu0_read_index(struct ControlHeader* header)
+static void invalidate_receive_range(struct TunnelInstance* tunnel, const void* start, uint32_t size)
 {
-    return readl(&header->cpu0_read_index);
+}
+#else
+/* Rings of a cache-maintained tunnel are cacheable but not coherent with
+ * CPU1. What CPU0 writes is cleaned before the write index is published and
+ * what it reads is invalidated after the write index of CPU1 has been seen,
+ * the same maintenance dma_sync_single_for_device/cpu do. Only the bytes in
+ * use are maintained.
+ */
+static void clean_send_range(struct TunnelInstance* tunnel, const void* start, uint32_t size)
+{
+    phys_addr_t address;
+
+    if (!tunnel->config->cache_maintained) {
+        return;
+    }
+
+    address = tunnel->config->send_buffer_address + ((const uint8_t*)start - tunnel->send_buffer);
+    dmac_map_area(start, size, DMA_TO_DEVICE);
+    outer_clean_range(address, address + size);
 }
 
-static uint32_t get_cpu1_write_index(struct ControlHeader* header)
+static void invalidate_receive_range(struct TunnelInstance* tunnel, const void* start, uint32_t size)
 {
-    return  readl(&header->cpu1_write_index);
+    phys_addr_t address;
+
+    if (!tunnel->config->cache_maintained) {
+        return;
+    }
+
+    address = tunnel->config->receive_buffer_address + ((const uint8_t*)start - tunnel->receive_buffer);
+    outer_inv_range(address, address + size);
+    dmac_unmap_area(start, size, DMA_FROM_DEVICE);
 }
+#endif
 
+/* Orders the sequence number of an overwrite ring slot against its payload */
+#ifdef USE_CACHED_MEMORY
+#define sequence_barrier() smp_mb()
+#else
+#define sequence_barrier() dsb()
 #endif
 
-static struct PacketHeader* get_read_packet(struct TunnelInstance* tunnel, uint32_t read_index) {
-    return (struct PacketHeader*)(tunnel->receive_buffer + tunnel->receive_packet_size * read_index);
+/* Overwrite rings work like a seqlock per slot: the writer stores the write
+ * index of the packet in the header before it touches the payload, and the
+ * reader checks it both before and after copying the payload. A slot whose
+ * sequence isn't the read index has been reused by the writer.
+ */
+static void claim_overwrite_slot(struct TunnelInstance* tunnel, struct PacketHeader* header, uint32_t write_index)
+{
+    WRITE_ONCE(header->sequence, write_index);
+    clean_send_range(tunnel, header, sizeof(struct PacketHeader));
+    sequence_barrier();
 }
 
-static struct PacketHeader* get_write_packet(struct TunnelInstance* tunnel, uint32_t write_index) {
-    return (struct PacketHeader*)(tunnel->send_buffer + tunnel->send_packet_size * write_index);
+static int overwrite_slot_valid(struct TunnelInstance* tunnel, struct PacketHeader* header, uint32_t read_index)
+{
+    sequence_barrier();
+    invalidate_receive_range(tunnel, header, sizeof(struct PacketHeader));
+    return READ_ONCE(header->sequence) == read_index;
+}
+
+/* Called after the payload has been copied. Counts the packet as overwritten
+ * if CPU1 reused the slot in the meantime.
+ */
+static int packet_overwritten(struct TunnelInstance* tunnel, struct ReadPacket* packet)
+{
+    if (!tunnel->config->receive_overwrite
+        || overwrite_slot_valid(tunnel, packet->packet, packet->next_read_index - 1)) {
+        return 0;
+    }
+
+    STAT_INC(tunnel, packets_overwritten);
+    return 1;
 }
 
 static int try_get_read_packet(struct TunnelInstance* tunnel, struct ReadPacket* packet)
 {
-    uint32_t readIndex;
-    uint32_t cpu1WriteIndex;
-    readIndex = get_cpu0_read_index(tunnel->control_header);
-    cpu1WriteIndex = get_cpu1_write_index(tunnel->control_header);
+    uint32_t readIndex = tunnel->read_index;
+    uint32_t ring_size = tunnel->receive_ring_size;
+    uint32_t count;
+    struct PacketHeader* header;
+
+    for (;;) {
+        if (readIndex == tunnel->cached_cpu1_write_index) {
+            /* Looks empty, check if CPU1 has written something since last time */
+            tunnel->cached_cpu1_write_index = get_cpu1_write_index(tunnel->control_header);
+
+            if (readIndex == tunnel->cached_cpu1_write_index) {
+                return 0;
+            }
+        }
+
+        if (tunnel->config->receive_overwrite) {
+            count = tunnel->config->receive_buffered_packet_count;
+
+            if (tunnel->cached_cpu1_write_index - readIndex > count) {
+                /* Oldest packets have already been overwritten */
+                STAT_ADD(tunnel, packets_overwritten, tunnel->cached_cpu1_write_index - count - readIndex);
+                readIndex = tunnel->cached_cpu1_write_index - count;
+                tunnel->read_index = readIndex;
+            }
+
+            header = get_read_packet(tunnel, readIndex);
+            if (!overwrite_slot_valid(tunnel, header, readIndex)) {
+                /* CPU1 is writing to the slot right now */
+                STAT_INC(tunnel, packets_overwritten);
+                tunnel->read_index = ++readIndex;
+                tunnel->cached_cpu1_write_index = get_cpu1_write_index(tunnel->control_header);
+                continue;
+            }
+
+            packet->next_read_index = readIndex + 1;
+            break;
+        }
+
+        header = get_read_packet(tunnel, readIndex);
+        invalidate_receive_range(tunnel, header, sizeof(struct PacketHeader));
+
+        if (!tunnel->config->receive_stream_ring_size) {
+            packet->next_read_index = readIndex + 1;
+            break;
+        }
+
+        if (header->packet_size != IPC_TUNNEL_STREAM_PADDING) {
+            packet->next_read_index = readIndex + stream_record_size(header->packet_size);
+            break;
+        }
+
+        /* Skip the padding at the end of the ring. Published right away
+         * because CPU1 may be waiting for the space.
+         */
+        readIndex += ring_size - (readIndex & (ring_size - 1u));
+        tunnel->read_index = readIndex;
+        publish_read_index(tunnel);
+    }
+
+    packet->packet = header;
+    return 1;
+}
+
+/* True if amount slots or bytes can be written to the send ring */
+static int has_send_space(struct TunnelInstance* tunnel, uint32_t amount, uint32_t capacity)
+{
+    if (tunnel->write_index - tunnel->cached_cpu1_read_index + amount > capacity) {
+        /* Looks full, check if CPU1 has consumed something since last time */
+        tunnel->cached_cpu1_read_index = get_cpu1_read_index(tunnel->control_header);
+
+        if (tunnel->write_index - tunnel->cached_cpu1_read_index + amount > capacity) {
+            return 0;
+        }
+    }
 
-    if (readIndex != cpu1WriteIndex) {
-        packet->packet = get_read_packet(tunnel, readIndex);
+    return 1;
+}
+
+static int try_get_write_packet(struct TunnelInstance* tunnel, uint32_t size, struct WritePacket* packet)
+{
+    uint32_t ring_size = tunnel->send_ring_size;
+    uint32_t record_size;
+    uint32_t tail;
+    struct PacketHeader* padding;
+
+    if (!tunnel->config->send_stream_ring_size) {
+        if (tunnel->config->send_overwrite) {
+            /* Never full, the oldest unread packet is given up instead */
+            packet->packet = get_write_packet(tunnel, tunnel->write_index);
+            packet->next_write_index = tunnel->write_index + 1;
+            claim_overwrite_slot(tunnel, packet->packet, tunnel->write_index);
+            return 1;
+        }
 
-        if (++readIndex == tunnel->config->receive_buffered_packet_count) {
-            readIndex = 0;
+        if (!has_send_space(tunnel, 1, tunnel->config->send_buffered_packet_count)) {
+            return 0;
         }
 
-        packet->next_read_index = readIndex;
+        packet->packet = get_write_packet(tunnel, tunnel->write_index);
+        packet->next_write_index = tunnel->write_index + 1;
         return 1;
     }
 
-    return 0;
+    record_size = stream_record_size(size);
+    tail = ring_size - (tunnel->write_index & (ring_size - 1u));
+
+    if (record_size > tail) {
+        /* Record doesn't fit before the end of the ring. Pad the end and
+         * publish the padding so CPU1 can skip it even if the record
+         * itself doesn't fit yet.
+         */
+        if (!has_send_space(tunnel, tail, ring_size)) {
+            return 0;
+        }
+
+        padding = get_write_packet(tunnel, tunnel->write_index);
+        padding->packet_size = IPC_TUNNEL_STREAM_PADDING;
+        clean_send_range(tunnel, padding, sizeof(struct PacketHeader));
+        tunnel->write_index += tail;
+        publish_write_index(tunnel);
+    }
+
+    if (!has_send_space(tunnel, record_size, ring_size)) {
+        return 0;
+    }
+
+    packet->packet = get_write_packet(tunnel, tunnel->write_index);
+    packet->next_write_index = tunnel->write_index + record_size;
+    return 1;
+}
+
+static int has_readable_packet(struct TunnelInstance* tunnel)
+{
+    struct ReadPacket packet;
+
+    return try_get_read_packet(tunnel, &packet);
+}
+
+static void record_sent(struct TunnelInstance* tunnel, uint32_t size)
+{
+    STAT_INC(tunnel, packets_sent);
+    STAT_ADD(tunnel, bytes_sent, size);
+    STAT_PEAK(tunnel, peak_send_occupancy, tunnel->write_index - tunnel->cached_cpu1_read_index);
+}
+
+/* Called before the packet is consumed */
+static void record_received(struct TunnelInstance* tunnel, uint32_t size)
+{
+    STAT_INC(tunnel, packets_received);
+    STAT_ADD(tunnel, bytes_received, size);
+    STAT_PEAK(tunnel, peak_receive_occupancy, tunnel->cached_cpu1_write_index - tunnel->read_index);
 }
 
-static int try_get_write_packet(struct TunnelInstance* tunnel, struct WritePacket* packet)
+#ifdef IPC_TUNNEL_LOOPBACK
+/* No global timer outside Zynq, monotonic clock is scaled to its tick rate */
+static int has_notify_clock(void)
 {
-    uint32_t writeIndex;
-    uint32_t cpu1ReadIndex;
-    uint32_t nextWriteIndex;
+    return 1;
+}
+
+static uint32_t get_notify_clock_ticks(void)
+{
+    return (uint32_t)div_u64(ktime_get_ns(), GLOBAL_TIMER_NS_PER_TICK);
+}
+#else
+static int has_notify_clock(void)
+{
+    return global_timer != NULL;
+}
+
+static uint32_t get_notify_clock_ticks(void)
+{
+    return readl_relaxed(global_timer);
+}
+#endif
+
+/* CPU1 stamps the receive ring packets with their commit time. Overwrite
+ * rings need the sequence field for the write index.
+ */
+static int traces_receive_ring(const struct TunnelConfig* config)
+{
+    return config->trace && !config->receive_overwrite;
+}
 
-    writeIndex = get_cpu0_write_index(tunnel->control_header);
+/* Records the time from the last notify interrupt to the return of a read */
+static void record_read_latency(struct TunnelInstance* tunnel)
+{
+    uint64_t ns;
 
-    nextWriteIndex = writeIndex + 1;
-    if (nextWriteIndex == tunnel->config->send_buffered_packet_count) {
-        nextWriteIndex = 0;
+    if (!has_notify_clock() || !READ_ONCE(tunnel->notify_pending)) {
+        return;
     }
 
-    cpu1ReadIndex = get_cpu1_read_index(tunnel->control_header);
+    WRITE_ONCE(tunnel->notify_pending, 0);
+    ns = (uint64_t)(get_notify_clock_ticks() - READ_ONCE(tunnel->notify_ticks)) * GLOBAL_TIMER_NS_PER_TICK;
+    STAT_INC(tunnel, read_latency_hist[min_t(int, fls64(ns), LATENCY_HIST_BUCKETS - 1)]);
+}
+
+/* Reloads the local indices from the control header if the user space
+ * library may have moved them.
+ */
+static void sync_user_indices(struct TunnelInstance* tunnel)
+{
+    if (!tunnel->rings_mapped || !tunnel->peer_verified) {
+        return;
+    }
+
+    tunnel->write_index = get_cpu0_write_index(tunnel->control_header);
+    tunnel->read_index = get_cpu0_read_index(tunnel->control_header);
+}
+
+/* Consuming and producing packets only moves the local index.
+ * The index is made visible to CPU1 with publish_read_index/publish_write_index
+ * so a batch of packets costs a single store to the control header.
+ */
+static void consume_packet(struct TunnelInstance* tunnel, struct ReadPacket* packet) {
+    tunnel->read_index = packet->next_read_index;
+}
+
+static void produce_packet(struct TunnelInstance* tunnel, struct WritePacket* packet) {
+    tunnel->write_index = packet->next_write_index;
+}
+
+#ifdef USE_CACHED_MEMORY
+static void publish_read_index(struct TunnelInstance* tunnel) {
+    smp_store_release(&tunnel->control_header->cpu0_read_index, tunnel->read_index);
+}
+
+static void publish_write_index(struct TunnelInstance* tunnel) {
+    smp_store_release(&tunnel->control_header->cpu0_write_index, tunnel->write_index);
+}
+
+static void publish_read_event_index(struct TunnelInstance* tunnel) {
+    WRITE_ONCE(tunnel->control_header->cpu0_read_event_index, tunnel->read_index);
+    /* Event index store must be visible before the write index is read again */
+    smp_mb();
+}
+#else
+static void publish_read_index(struct TunnelInstance* tunnel) {
+    dsb();
+    writel(tunnel->read_index, &tunnel->control_header->cpu0_read_index);
+}
+
+static void publish_write_index(struct TunnelInstance* tunnel) {
+    dsb();
+    writel(tunnel->write_index, &tunnel->control_header->cpu0_write_index);
+}
+
+static void publish_read_event_index(struct TunnelInstance* tunnel) {
+    writel(tunnel->read_index, &tunnel->control_header->cpu0_read_event_index);
+    dsb();
+}
+#endif
+
+/* Used as the wait condition of readers. If the ring is empty CPU1 is asked
+ * to notify when it writes the next packet and the ring is checked again
+ * so a packet written in between isn't missed.
+ */
+static int try_get_read_packet_or_arm(struct TunnelInstance* tunnel, struct ReadPacket* packet)
+{
+    if (try_get_read_packet(tunnel, packet)) {
+        return 1;
+    }
+
+    publish_read_event_index(tunnel);
+    return try_get_read_packet(tunnel, packet);
+}
+
+static void mark_packet_as_read(struct TunnelInstance* tunnel, struct ReadPacket* packet) {
+    consume_packet(tunnel, packet);
+    publish_read_index(tunnel);
+}
+
+static void send_packet(struct TunnelInstance* tunnel, struct WritePacket* packet) {
+    produce_packet(tunnel, packet);
+    publish_write_index(tunnel);
+}
+
+/* Marks the tunnel pending in the CPU1 doorbell and raises the SGI of the
+ * tunnel on CPU1. Nothing is raised if the bit is still pending: CPU1
+ * hasn't acknowledged it yet and will see the new packets when it drains
+ * the tunnel. Call after the write index has been published.
+ */
+static void notify_cpu1(struct TunnelInstance* tunnel)
+{
+    uint32_t bit = 1u << (tunnel - tunnels);
+    unsigned long flags;
+    int pending;
+
+    if (!tunnel->config->notify_cpu1 || !gic_distributor) {
+        return;
+    }
+
+    /* Write index before cpu1_acked, pairs with the barrier of IPC_TUNNEL_AckNotify */
+    smp_mb();
+
+    spin_lock_irqsave(&cpu1_doorbell_lock, flags);
+    pending = ((cpu1_doorbell_raised ^ get_cpu1_doorbell_acked(doorbell)) & bit) != 0;
+    if (!pending) {
+        cpu1_doorbell_raised ^= bit;
+        set_cpu1_doorbell_raised(doorbell, cpu1_doorbell_raised);
+        /* writel orders the doorbell and the write index before the SGI */
+        writel((tunnel->config->cpu1_urgent ? cpu1_urgent_sgi : cpu1_doorbell_sgi) | GIC_SGI_TARGET_CPU1,
+               gic_distributor + GIC_DIST_SOFTINT);
+    }
+    spin_unlock_irqrestore(&cpu1_doorbell_lock, flags);
+
+    if (pending) {
+        STAT_INC(tunnel, cpu1_notify_suppressed);
+    }
+    else {
+        STAT_INC(tunnel, cpu1_notify_sent);
+    }
+}
+
+/* Spins on the receive ring for up to the busy-poll budget.
+ * Gives up early if the task should reschedule or has a signal pending.
+ */
+static int busy_poll_read_packet(struct TunnelInstance* tunnel, struct ReadPacket* packet)
+{
+    uint64_t start;
+    uint64_t now;
+    uint64_t end;
+    int found = 0;
+
+    if (tunnel->busy_poll_usecs == 0) {
+        return 0;
+    }
+
+    start = ktime_get_ns();
+    end = start + (uint64_t)tunnel->busy_poll_usecs * NSEC_PER_USEC;
+
+    do {
+        if (try_get_read_packet(tunnel, packet)) {
+            found = 1;
+            break;
+        }
+
+        cpu_relax();
+        now = ktime_get_ns();
+    } while (now < end && !need_resched() && !signal_pending(current));
+
+    tunnel->busy_poll_spin_ns += ktime_get_ns() - start;
+    if (found) {
+        tunnel->busy_poll_hits++;
+    }
+    else {
+        tunnel->busy_poll_misses++;
+    }
+
+    return found;
+}
+
+/* Waits until CPU1 has brought the tunnel up and the receive ring has a packet.
+ * Doesn't block if the file is non-blocking.
+ */
+static int wait_read_packet(struct TunnelInstance* tunnel, struct file* filep, struct ReadPacket* packet)
+{
+    int ret;
+
+    ret = check_peer_layout(tunnel);
+    if (ret == -EAGAIN && !(filep->f_flags & O_NONBLOCK)) {
+        /* CPU1 kicks the tunnel once it has initialized it */
+        if (wait_event_interruptible(tunnel->read_queue, (ret = check_peer_layout(tunnel)) != -EAGAIN) != 0) {
+            return -EINTR;
+        }
+    }
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    sync_user_indices(tunnel);
+
+    if (filep->f_flags & O_NONBLOCK) {
+        /* non-blocking IO. An empty ring is armed, so an edge-triggered
+         * poller that drains the ring gets the next packet notified.
+         */
+        if (!try_get_read_packet_or_arm(tunnel, packet)) {
+            /* No data in queue */
+            return -EAGAIN;
+        }
+    } else if (busy_poll_read_packet(tunnel, packet)) {
+        return 0;
+    } else if (wait_event_interruptible(tunnel->read_queue, try_get_read_packet_or_arm(tunnel, packet)) != 0) {
+        /* Waiting for data was interrupted */
+        return -EINTR;
+    }
+
+    return 0;
+}
+
+static int dev_open(struct inode* inodep, struct file* filep)
+{
+    int i;
+    struct TunnelInstance *tunnel = 0;
+
+    for (i = 0; i < tunnel_count; ++i)
+    {
+        if (inodep->i_cdev == &tunnels[i].c_dev)
+        {
+            tunnel = &tunnels[i];
+            break;
+        }
+    }
+
+    if (!tunnel) {
+        printk(KERN_ERR "Can't find chardev for inode\n");
+        return -EINVAL;
+    }
+
+    filep->private_data = tunnel;
+
+    printk(KERN_INFO "dev_open %p\n", (void*)tunnel);
+    if (tunnel->is_open)
+    {
+        return -EBUSY;
+    }
+
+    tunnel->is_open = 1;
+    tunnel->peer_verified = 0;
+    tunnel->rings_mapped = 0;
+
+    tunnel->busy_poll_usecs = min_t(uint32_t, READ_ONCE(busy_poll_usecs), MAX_BUSY_POLL_USECS);
+    tunnel->busy_poll_hits = 0;
+    tunnel->busy_poll_misses = 0;
+    tunnel->busy_poll_spin_ns = 0;
+
+    set_cpu0_layout(tunnel->control_header, tunnel->config);
+
+    printk(KERN_INFO "CPU1_IPC_TUNNEL Opened\n");
+    return 0;
+}
+
+static ssize_t dev_read(struct file* filep, char __user* buffer, size_t len, loff_t* offset)
+{
+    uint32_t rx = 0;
+    struct ReadPacket packet;
+    struct TunnelInstance* tunnel = (struct TunnelInstance*)filep->private_data;
+    int ret;
+
+    for (;;) {
+        ret = wait_read_packet(tunnel, filep, &packet);
+        if (ret != 0) {
+            return ret;
+        }
+
+        /* Read queue contains something */
+
+        rx = packet.packet->packet_size;
+        if (len < rx) {
+            /* If read buffer is smaller than the package, part of the data is lost */
+            rx = len;
+        }
+
+        invalidate_receive_range(tunnel, packet.packet->data, rx);
+        if (copy_to_user(buffer, packet.packet->data, rx) != 0) {
+            return -EFAULT;
+        }
+
+        if (!packet_overwritten(tunnel, &packet)) {
+            break;
+        }
+
+        /* Torn copy, try the next packet. The index is published, not
+         * only consumed: wait_read_packet reloads it from the control
+         * header when the rings are mapped to user space.
+         */
+        mark_packet_as_read(tunnel, &packet);
+    }
+
+    record_received(tunnel, rx);
+    mark_packet_as_read(tunnel, &packet);
+    record_read_latency(tunnel);
+
+    return (ssize_t)rx;
+}
+
+static ssize_t dev_write(struct file* filep, const char __user* buffer, size_t len, loff_t* offset)
+{
+    struct WritePacket write;
+    struct TunnelInstance* tunnel = (struct TunnelInstance*)filep->private_data;
+    int ret;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (!tunnel) {
+        return -EBADFD;
+    }
+
+    ret = check_peer_layout(tunnel);
+    if (ret == -EAGAIN) {
+        /* CPU1 isn't up yet, same as a full ring */
+        return 0;
+    }
+    else if (ret != 0) {
+        return ret;
+    }
+
+    sync_user_indices(tunnel);
+
+    if (len > tunnel->config->send_max_packet_size) {
+        /* Packet doesn't fit in the ring buffer */
+        STAT_INC(tunnel, write_too_big);
+        return -EFBIG;
+    }
+
+    if (try_get_write_packet(tunnel, len, &write)) {
+        if (copy_from_user(write.packet->data, buffer, len) != 0) {
+            return -EFAULT;
+        }
+
+        write.packet->packet_size = len;
+        clean_send_range(tunnel, write.packet, sizeof(struct PacketHeader) + len);
+
+        send_packet(tunnel, &write);
+        notify_cpu1(tunnel);
+        record_sent(tunnel, len);
+        return len;
+    }
+
+    STAT_INC(tunnel, write_ring_full);
+    return 0;
+}
+
+/* Descriptors are copied from user space in chunks to keep the stack usage small */
+#define BATCH_CHUNK 16
+
+static long ioctl_read_batch(struct TunnelInstance* tunnel, struct file* filep, unsigned long arg)
+{
+    struct ipc_tunnel_batch batch;
+    struct ipc_tunnel_packet descs[BATCH_CHUNK];
+    struct ipc_tunnel_packet __user* user_descs;
+    struct ReadPacket packet;
+    uint32_t moved = 0;
+    uint32_t chunk;
+    uint32_t filled;
+    uint32_t rx;
+    int have_packet;
+    int consumed = 0;
+    long ret = 0;
+
+    if (copy_from_user(&batch, (void __user*)arg, sizeof(batch)) != 0) {
+        return -EFAULT;
+    }
+
+    if (batch.count == 0) {
+        return 0;
+    }
+
+    if (batch.count > IPC_TUNNEL_MAX_BATCH) {
+        batch.count = IPC_TUNNEL_MAX_BATCH;
+    }
+
+    user_descs = u64_to_user_ptr(batch.packets);
+
+    /* Only the first packet is waited for */
+    ret = wait_read_packet(tunnel, filep, &packet);
+    if (ret != 0) {
+        return ret;
+    }
+    have_packet = 1;
+
+    while (moved < batch.count) {
+        chunk = min_t(uint32_t, batch.count - moved, BATCH_CHUNK);
+        if (copy_from_user(descs, user_descs + moved, chunk * sizeof(descs[0])) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+
+        filled = 0;
+        while (filled < chunk) {
+            if (!have_packet && !try_get_read_packet(tunnel, &packet)) {
+                break;
+            }
+            have_packet = 0;
+
+            rx = min_t(uint32_t, packet.packet->packet_size, descs[filled].size);
+            invalidate_receive_range(tunnel, packet.packet->data, rx);
+            if (copy_to_user(u64_to_user_ptr(descs[filled].data), packet.packet->data, rx) != 0) {
+                ret = -EFAULT;
+                break;
+            }
+
+            consume_packet(tunnel, &packet);
+            consumed = 1;
+
+            if (packet_overwritten(tunnel, &packet)) {
+                /* Torn copy, the next packet goes to the same descriptor */
+                continue;
+            }
+
+            descs[filled].size = rx;
+            record_received(tunnel, rx);
+            ++filled;
+        }
+
+        if (filled > 0 && copy_to_user(user_descs + moved, descs, filled * sizeof(descs[0])) != 0) {
+            ret = -EFAULT;
+        }
+
+        moved += filled;
+
+        if (ret != 0 || filled < BATCH_CHUNK) {
+            break;
+        }
+    }
+
+    /* Also when only torn packets were skipped, with mapped rings the
+     * index is reloaded from the control header
+     */
+    if (consumed) {
+        publish_read_index(tunnel);
+    }
+
+    if (moved > 0) {
+        record_read_latency(tunnel);
+        return moved;
+    }
+
+    return ret;
+}
+
+/* Interrupt stamps of the tunnel if they belong to the packet of trace,
+ * i.e. commit <= sgi <= irq <= dequeue. Must be called before
+ * record_read_latency clears notify_pending.
+ */
+static void trace_notify(struct TunnelInstance* tunnel, struct ipc_tunnel_trace* trace)
+{
+    uint32_t after = trace->dequeue;
+    uint32_t irq;
+    uint32_t sgi;
+
+    if (!READ_ONCE(tunnel->notify_pending)) {
+        /* Packet was found without waiting for an interrupt */
+        return;
+    }
+
+    irq = READ_ONCE(tunnel->notify_ticks);
+    if ((int32_t)(after - irq) < 0
+        || ((trace->valid & IPC_TUNNEL_TRACE_COMMIT) && (int32_t)(irq - trace->commit) < 0)) {
+        return;
+    }
+
+    trace->irq = irq;
+    trace->valid |= IPC_TUNNEL_TRACE_IRQ;
+
+    if (!tunnel->config->trace) {
+        return;
+    }
+
+    sgi = READ_ONCE(tunnel->notify_sgi_ticks);
+    if ((int32_t)(irq - sgi) < 0
+        || ((trace->valid & IPC_TUNNEL_TRACE_COMMIT) && (int32_t)(sgi - trace->commit) < 0)) {
+        return;
+    }
+
+    trace->sgi = sgi;
+    trace->valid |= IPC_TUNNEL_TRACE_SGI;
+}
+
+/* Same as dev_read, and the stamps of the packet */
+static long ioctl_read_traced(struct TunnelInstance* tunnel, struct file* filep, unsigned long arg)
+{
+    struct ipc_tunnel_traced_read read;
+    struct ipc_tunnel_trace* trace = &read.trace;
+    struct ReadPacket packet;
+    uint32_t rx;
+    int ret;
+
+    if (!has_notify_clock()) {
+        return -EOPNOTSUPP;
+    }
+
+    if (copy_from_user(&read, (void __user*)arg, sizeof(read)) != 0) {
+        return -EFAULT;
+    }
+
+    for (;;) {
+        ret = wait_read_packet(tunnel, filep, &packet);
+        if (ret != 0) {
+            return ret;
+        }
+
+        memset(trace, 0, sizeof(*trace));
+        trace->dequeue = get_notify_clock_ticks();
+        trace->valid = IPC_TUNNEL_TRACE_DEQUEUE;
+
+        /* Header was invalidated with the packet size */
+        if (traces_receive_ring(tunnel->config)) {
+            trace->commit = READ_ONCE(packet.packet->sequence);
+            trace->valid |= IPC_TUNNEL_TRACE_COMMIT;
+        }
+
+        rx = min_t(uint32_t, packet.packet->packet_size, read.size);
+        invalidate_receive_range(tunnel, packet.packet->data, rx);
+        if (copy_to_user(u64_to_user_ptr(read.data), packet.packet->data, rx) != 0) {
+            return -EFAULT;
+        }
+
+        if (!packet_overwritten(tunnel, &packet)) {
+            break;
+        }
+
+        /* Torn copy, try the next packet. The index is published, not
+         * only consumed: wait_read_packet reloads it from the control
+         * header when the rings are mapped to user space.
+         */
+        mark_packet_as_read(tunnel, &packet);
+    }
+
+    trace->copy = get_notify_clock_ticks();
+    trace->valid |= IPC_TUNNEL_TRACE_COPY;
+    trace_notify(tunnel, trace);
+
+    record_received(tunnel, rx);
+    mark_packet_as_read(tunnel, &packet);
+    record_read_latency(tunnel);
+
+    read.size = rx;
+    if (copy_to_user((void __user*)arg, &read, sizeof(read)) != 0) {
+        return -EFAULT;
+    }
+
+    return rx;
+}
+
+static long ioctl_write_batch(struct TunnelInstance* tunnel, unsigned long arg)
+{
+    struct ipc_tunnel_batch batch;
+    struct ipc_tunnel_packet descs[BATCH_CHUNK];
+    struct ipc_tunnel_packet __user* user_descs;
+    struct WritePacket write;
+    uint32_t moved = 0;
+    uint32_t chunk;
+    uint32_t i;
+    long ret;
+
+    if (copy_from_user(&batch, (void __user*)arg, sizeof(batch)) != 0) {
+        return -EFAULT;
+    }
+
+    if (batch.count > IPC_TUNNEL_MAX_BATCH) {
+        batch.count = IPC_TUNNEL_MAX_BATCH;
+    }
+
+    ret = check_peer_layout(tunnel);
+    if (ret == -EAGAIN) {
+        /* CPU1 isn't up yet, same as a full ring */
+        return 0;
+    }
+    else if (ret != 0) {
+        return ret;
+    }
+
+    sync_user_indices(tunnel);
+
+    user_descs = u64_to_user_ptr(batch.packets);
+
+    while (moved < batch.count) {
+        chunk = min_t(uint32_t, batch.count - moved, BATCH_CHUNK);
+        if (copy_from_user(descs, user_descs + moved, chunk * sizeof(descs[0])) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+
+        for (i = 0; i < chunk; ++i) {
+            if (descs[i].size == 0 || descs[i].size > tunnel->config->send_max_packet_size) {
+                /* Packet doesn't fit in the ring buffer */
+                STAT_INC(tunnel, write_too_big);
+                ret = -EFBIG;
+                break;
+            }
+
+            if (!try_get_write_packet(tunnel, descs[i].size, &write)) {
+                STAT_INC(tunnel, write_ring_full);
+                break;
+            }
+
+            if (copy_from_user(write.packet->data, u64_to_user_ptr(descs[i].data), descs[i].size) != 0) {
+                ret = -EFAULT;
+                break;
+            }
+
+            write.packet->packet_size = descs[i].size;
+            clean_send_range(tunnel, write.packet, sizeof(struct PacketHeader) + descs[i].size);
+            produce_packet(tunnel, &write);
+            record_sent(tunnel, descs[i].size);
+        }
+
+        moved += i;
+
+        if (ret != 0 || i < chunk) {
+            break;
+        }
+    }
+
+    if (moved > 0) {
+        publish_write_index(tunnel);
+        notify_cpu1(tunnel);
+        return moved;
+    }
+
+    return ret;
+}
+
+static void fill_ring_layout(struct ipc_tunnel_ring_layout* layout,
+                             uint32_t address,
+                             uint32_t slot_size,
+                             uint32_t slot_count,
+                             uint32_t stream_ring_size,
+                             uint32_t max_packet_size,
+                             int overwrite)
+{
+    if (stream_ring_size) {
+        slot_size = IPC_TUNNEL_STREAM_RECORD_ALIGNMENT;
+        slot_count = stream_ring_size / IPC_TUNNEL_STREAM_RECORD_ALIGNMENT;
+    }
+
+    layout->offset = offset_in_page(address);
+    layout->map_size = PAGE_ALIGN(layout->offset + slot_size * slot_count);
+    layout->slot_size = slot_size;
+    layout->slot_count = slot_count;
+    layout->max_packet_size = max_packet_size;
+    layout->flags = stream_ring_size ? IPC_TUNNEL_RING_STREAM : 0;
+    if (overwrite) {
+        layout->flags |= IPC_TUNNEL_RING_OVERWRITE;
+    }
+}
+
+static long ioctl_get_layout(struct TunnelInstance* tunnel, unsigned long arg)
+{
+    struct ipc_tunnel_layout layout;
+    const struct TunnelConfig* config = tunnel->config;
+
+    memset(&layout, 0, sizeof(layout));
+    layout.magic = IPC_TUNNEL_MAGIC;
+    layout.version = IPC_TUNNEL_LAYOUT_VERSION;
+#ifdef USE_CACHED_MEMORY
+    layout.flags = IPC_TUNNEL_LAYOUT_CACHED;
+#endif
+    if (config->cache_maintained) {
+        layout.flags |= IPC_TUNNEL_LAYOUT_CACHE_MAINTAINED;
+    }
+    layout.control_header_offset = offset_in_page(config->control_header_address);
+    layout.control_header_map_size = PAGE_ALIGN(layout.control_header_offset + sizeof(struct ControlHeader));
+    layout.shared_buffer_size = config->shared_buffer_size;
+
+    fill_ring_layout(&layout.send,
+                     config->send_buffer_address,
+                     tunnel->send_packet_size,
+                     config->send_buffered_packet_count,
+                     config->send_stream_ring_size,
+                     config->send_max_packet_size,
+                     config->send_overwrite);
+    fill_ring_layout(&layout.receive,
+                     config->receive_buffer_address,
+                     tunnel->receive_packet_size,
+                     config->receive_buffered_packet_count,
+                     config->receive_stream_ring_size,
+                     config->receive_max_packet_size,
+                     config->receive_overwrite);
+    if (traces_receive_ring(config)) {
+        layout.receive.flags |= IPC_TUNNEL_RING_TRACE;
+    }
+
+    if (copy_to_user((void __user*)arg, &layout, sizeof(layout)) != 0) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/* Sums a u64 counter of struct TunnelStats over all CPUs */
+static u64 sum_stat(struct TunnelInstance* tunnel, size_t offset)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        sum += *(u64*)((uint8_t*)per_cpu_ptr(tunnel->stats, cpu) + offset);
+    }
+
+    return sum;
+}
+
+static u32 max_stat(struct TunnelInstance* tunnel, size_t offset)
+{
+    u32 peak = 0;
+    u32 value;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        value = *(u32*)((uint8_t*)per_cpu_ptr(tunnel->stats, cpu) + offset);
+        if (value > peak) {
+            peak = value;
+        }
+    }
+
+    return peak;
+}
+
+static long ioctl_get_notify_stats(struct TunnelInstance* tunnel, unsigned long arg)
+{
+    struct ipc_tunnel_notify_stats stats;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.sent = READ_ONCE(tunnel->control_header->cpu1_notify_sent);
+    stats.suppressed = READ_ONCE(tunnel->control_header->cpu1_notify_suppressed);
+    stats.received = (__u32)sum_stat(tunnel, offsetof(struct TunnelStats, ipi_received));
+
+    if (copy_to_user((void __user*)arg, &stats, sizeof(stats)) != 0) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static long ioctl_set_busy_poll(struct TunnelInstance* tunnel, unsigned long arg)
+{
+    __u32 usecs;
+
+    if (get_user(usecs, (__u32 __user*)arg) != 0) {
+        return -EFAULT;
+    }
+
+    if (usecs > MAX_BUSY_POLL_USECS) {
+        return -EINVAL;
+    }
+
+    tunnel->busy_poll_usecs = usecs;
+    return 0;
+}
+
+static long ioctl_get_busy_poll_stats(struct TunnelInstance* tunnel, unsigned long arg)
+{
+    struct ipc_tunnel_busy_poll_stats stats;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.spin_ns = tunnel->busy_poll_spin_ns;
+    stats.hits = tunnel->busy_poll_hits;
+    stats.misses = tunnel->busy_poll_misses;
+
+    if (copy_to_user((void __user*)arg, &stats, sizeof(stats)) != 0) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/* Replaces the eventfd of the tunnel, NULL removes it */
+static void set_notify_eventfd(struct TunnelInstance* tunnel, struct eventfd_ctx* ctx)
+{
+    struct eventfd_ctx* old;
+    unsigned long flags;
+
+    spin_lock_irqsave(&tunnel->notify_eventfd_lock, flags);
+    old = tunnel->notify_eventfd;
+    tunnel->notify_eventfd = ctx;
+    spin_unlock_irqrestore(&tunnel->notify_eventfd_lock, flags);
+
+    if (old) {
+        eventfd_ctx_put(old);
+    }
+}
+
+static long ioctl_set_eventfd(struct TunnelInstance* tunnel, unsigned long arg)
+{
+    struct eventfd_ctx* ctx = NULL;
+    __s32 fd;
+
+    if (get_user(fd, (__s32 __user*)arg) != 0) {
+        return -EFAULT;
+    }
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx)) {
+            return PTR_ERR(ctx);
+        }
+    }
+
+    set_notify_eventfd(tunnel, ctx);
+    return 0;
+}
+
+static long dev_ioctl(struct file* filep, unsigned int cmd, unsigned long arg)
+{
+    struct TunnelInstance* tunnel = (struct TunnelInstance*)filep->private_data;
+
+    if (!tunnel) {
+        return -EBADFD;
+    }
+
+    switch (cmd) {
+    case IPC_TUNNEL_IOC_READ_BATCH:
+        return ioctl_read_batch(tunnel, filep, arg);
+    case IPC_TUNNEL_IOC_WRITE_BATCH:
+        return ioctl_write_batch(tunnel, arg);
+    case IPC_TUNNEL_IOC_GET_LAYOUT:
+        return ioctl_get_layout(tunnel, arg);
+    case IPC_TUNNEL_IOC_GET_NOTIFY_STATS:
+        return ioctl_get_notify_stats(tunnel, arg);
+    case IPC_TUNNEL_IOC_SET_BUSY_POLL:
+        return ioctl_set_busy_poll(tunnel, arg);
+    case IPC_TUNNEL_IOC_GET_BUSY_POLL:
+        return put_user(tunnel->busy_poll_usecs, (__u32 __user*)arg);
+    case IPC_TUNNEL_IOC_GET_BUSY_POLL_STATS:
+        return ioctl_get_busy_poll_stats(tunnel, arg);
+    case IPC_TUNNEL_IOC_SET_EVENTFD:
+        return ioctl_set_eventfd(tunnel, arg);
+    case IPC_TUNNEL_IOC_READ_TRACED:
+        return ioctl_read_traced(tunnel, filep, arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static unsigned int dev_poll(struct file* file, poll_table* wait)
+{
+    struct TunnelInstance* tunnel = (struct TunnelInstance*)file->private_data;
+    poll_wait(file, &tunnel->read_queue, wait);
+
+    if (check_peer_layout(tunnel) == -EPROTO) {
+        return POLLERR;
+    }
+
+    sync_user_indices(tunnel);
+
+    if (!tunnel->peer_verified) {
+        return 0;
+    }
+
+    if (!has_readable_packet(tunnel) && !poll_does_not_wait(wait)) {
+        struct ReadPacket packet;
+
+        /* Caller would sleep, spin first */
+        busy_poll_read_packet(tunnel, &packet);
+    }
+
+    /* Ask CPU1 to notify on the next packet before anything is reported:
+     * an edge-triggered caller only gets another event from the doorbell.
+     * Checked again after arming so a packet written in between isn't missed.
+     */
+    publish_read_event_index(tunnel);
+    if (has_readable_packet(tunnel)) {
+        /* there is readable data in the queue */
+        return POLLIN | POLLRDNORM;
+    }
+
+    return 0;
+}
+
+/* Maps the physical range [address, address + size) starting from the page
+ * that contains address.
+ */
+static int map_region(struct vm_area_struct *vma, unsigned long address, unsigned long size, pgprot_t prot)
+{
+    unsigned long physical_base = address & PAGE_MASK;
+    unsigned long physical_size = PAGE_ALIGN(offset_in_page(address) + size);
+    unsigned long virtual_size = vma->vm_end - vma->vm_start;
+
+    if (size == 0 || physical_size < virtual_size) {
+        return -EINVAL;
+    }
+
+    vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_page_prot = prot;
+
+    return remap_pfn_range(vma,
+                           vma->vm_start,
+                           physical_base >> PAGE_SHIFT,
+                           virtual_size,
+                           vma->vm_page_prot);
+}
+
+/* User space mappings use the same memory type as the kernel mappings */
+#ifdef IPC_TUNNEL_LOOPBACK
+static pgprot_t cached_page_prot(pgprot_t prot)
+{
+    /* Loopback rings are ordinary kernel memory, already cached */
+    return prot;
+}
+#else
+static pgprot_t cached_page_prot(pgprot_t prot)
+{
+    return __pgprot_modify(prot, L_PTE_MT_MASK, __PAGE_SHARED | L_PTE_MT_WRITEBACK);
+}
+#endif
+
+static pgprot_t ring_page_prot(pgprot_t prot)
+{
+#ifdef USE_CACHED_MEMORY
+    return cached_page_prot(prot);
+#else
+    return pgprot_writecombine(prot);
+#endif
+}
+
+static int map_shared_buffer(struct TunnelInstance* tunnel, struct vm_area_struct *vma)
+{
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+
+    unsigned long physical_base = tunnel->config->shared_buffer_address;
+    unsigned long physical_size = tunnel->config->shared_buffer_size;
+    unsigned long virtual_size = vma->vm_end - vma->vm_start;
+    unsigned long pfn = (physical_base + offset) >> PAGE_SHIFT;
+
+    if (offset >= physical_size || physical_size - offset < virtual_size) {
+        return -EINVAL;
+    }
+    vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+	
+#ifdef USE_CACHED_MEMORY
+    vma->vm_page_prot = cached_page_prot(vma->vm_page_prot);
+#else
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+#endif
+    return remap_pfn_range(vma,
+                           vma->vm_start,
+                           pfn,
+                           virtual_size,
+                           vma->vm_page_prot);
+}
+
+static int dev_mmap(struct file* filep, struct vm_area_struct *vma)
+{
+    struct TunnelInstance* tunnel = (struct TunnelInstance*)filep->private_data;
+    const struct TunnelConfig* config = tunnel->config;
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+    int ret;
+
+    /* Memory should be marked as SHARED (no COW if process is forked) */
+    if ((vma->vm_flags & VM_SHARED) == 0) {
+        return -EINVAL;
+    }
+
+    if (   config->cache_maintained
+        && (offset == IPC_TUNNEL_MMAP_SEND_RING || offset == IPC_TUNNEL_MMAP_RECEIVE_RING)) {
+        /* User space can't do the cache maintenance */
+        return -EOPNOTSUPP;
+    }
+
+    switch (offset) {
+    case IPC_TUNNEL_MMAP_CONTROL_HEADER:
+        /* Control header is always mapped as cached memory by the kernel */
+        ret = map_region(vma, config->control_header_address, sizeof(struct ControlHeader),
+                         cached_page_prot(vma->vm_page_prot));
+        break;
+    case IPC_TUNNEL_MMAP_SEND_RING:
+        ret = map_region(vma, config->send_buffer_address,
+                         tunnel->send_ring_size,
+                         ring_page_prot(vma->vm_page_prot));
+        break;
+    case IPC_TUNNEL_MMAP_RECEIVE_RING:
+        ret = map_region(vma, config->receive_buffer_address,
+                         tunnel->receive_ring_size,
+                         ring_page_prot(vma->vm_page_prot));
+        break;
+    default:
+        return map_shared_buffer(tunnel, vma);
+    }
+
+    if (ret == 0) {
+        tunnel->rings_mapped = 1;
+    }
+
+    return ret;
+}
+
+static int dev_release(struct inode* inodep, struct file* filep)
+{
+    struct TunnelInstance *tunnel = (struct TunnelInstance*)filep->private_data;
+    set_notify_eventfd(tunnel, NULL);
+    tunnel->is_open = 0;
+
+    printk(KERN_INFO "CPU1_IPC_TUNNEL Released\n");
+    return 0;
+}
+
+#define TUNNEL_STAT_ATTR(field)                                                     \
+static ssize_t field##_show(struct device* dev, struct device_attribute* attr, char* buf) \
+{                                                                                   \
+    struct TunnelInstance* tunnel = dev_get_drvdata(dev);                           \
+    return sprintf(buf, "%llu\n",                                                   \
+                   (unsigned long long)sum_stat(tunnel, offsetof(struct TunnelStats, field))); \
+}                                                                                   \
+static DEVICE_ATTR_RO(field)
+
+#define TUNNEL_PEAK_ATTR(field)                                                     \
+static ssize_t field##_show(struct device* dev, struct device_attribute* attr, char* buf) \
+{                                                                                   \
+    struct TunnelInstance* tunnel = dev_get_drvdata(dev);                           \
+    return sprintf(buf, "%u\n", max_stat(tunnel, offsetof(struct TunnelStats, field))); \
+}                                                                                   \
+static DEVICE_ATTR_RO(field)
+
+TUNNEL_STAT_ATTR(packets_sent);
+TUNNEL_STAT_ATTR(bytes_sent);
+TUNNEL_STAT_ATTR(packets_received);
+TUNNEL_STAT_ATTR(bytes_received);
+TUNNEL_STAT_ATTR(write_ring_full);
+TUNNEL_STAT_ATTR(write_too_big);
+TUNNEL_STAT_ATTR(packets_overwritten);
+TUNNEL_STAT_ATTR(ipi_received);
+TUNNEL_STAT_ATTR(wakeups);
+TUNNEL_STAT_ATTR(cpu1_notify_sent);
+TUNNEL_STAT_ATTR(cpu1_notify_suppressed);
+TUNNEL_PEAK_ATTR(peak_send_occupancy);
+TUNNEL_PEAK_ATTR(peak_receive_occupancy);
+
+/* One line per bucket: lower bound in ns and count */
+static ssize_t read_latency_hist_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct TunnelInstance* tunnel = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_HIST_BUCKETS; ++i) {
+        len += sprintf(buf + len, "%llu %llu\n",
+                       i == 0 ? 0ull : 1ull << (i - 1),
+                       (unsigned long long)sum_stat(tunnel, offsetof(struct TunnelStats, read_latency_hist[i])));
+    }
+
+    return len;
+}
+static DEVICE_ATTR_RO(read_latency_hist);
+
+static struct attribute* stats_attrs[] = {
+    &dev_attr_packets_sent.attr,
+    &dev_attr_bytes_sent.attr,
+    &dev_attr_packets_received.attr,
+    &dev_attr_bytes_received.attr,
+    &dev_attr_write_ring_full.attr,
+    &dev_attr_write_too_big.attr,
+    &dev_attr_packets_overwritten.attr,
+    &dev_attr_ipi_received.attr,
+    &dev_attr_wakeups.attr,
+    &dev_attr_cpu1_notify_sent.attr,
+    &dev_attr_cpu1_notify_suppressed.attr,
+    &dev_attr_peak_send_occupancy.attr,
+    &dev_attr_peak_receive_occupancy.attr,
+    &dev_attr_read_latency_hist.attr,
+    NULL
+};
+
+/* /sys/class/ipc_tunnel/ipc_tunnelN/stats/ */
+static const struct attribute_group stats_group = {
+    .name = "stats",
+    .attrs = stats_attrs,
+};
+
+static const struct attribute_group* tunnel_groups[] = {
+    &stats_group,
+    NULL
+};
+
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = dev_open,
+    .read = dev_read,
+    .write = dev_write,
+    .release = dev_release,
+    .poll = dev_poll,
+    .mmap = dev_mmap,
+    .unlocked_ioctl = dev_ioctl
+};
+
+static void tunnel_notify(struct TunnelInstance* tunnel, uint32_t sgi_ticks)
+{
+    STAT_INC(tunnel, ipi_received);
+
+    if (has_notify_clock()) {
+        WRITE_ONCE(tunnel->notify_ticks, get_notify_clock_ticks());
+        WRITE_ONCE(tunnel->notify_sgi_ticks, sgi_ticks);
+        WRITE_ONCE(tunnel->notify_pending, 1);
+    }
+
+    if (waitqueue_active(&tunnel->read_queue)) {
+        STAT_INC(tunnel, wakeups);
+    }
+
+    wake_up_interruptible(&tunnel->read_queue);
+
+    spin_lock(&tunnel->notify_eventfd_lock);
+    if (tunnel->notify_eventfd) {
+        eventfd_signal(tunnel->notify_eventfd, 1);
+    }
+    spin_unlock(&tunnel->notify_eventfd_lock);
+}
+
+/* Called when CPU1 raises DOORBELL_SGI. Wakes every tunnel whose doorbell
+ * bit is pending.
+ */
+static void doorbell_ipi_handler(void)
+{
+    uint32_t raised = get_doorbell_raised(doorbell);
+    /* Written before cpu1_raised, so it is at least as new as the bits */
+    uint32_t sgi_ticks = get_doorbell_raised_ticks(doorbell);
+    unsigned long pending = raised ^ doorbell_acked;
+    unsigned int channel;
+
+    doorbell_acked = raised;
+    set_doorbell_acked(doorbell, raised);
+
+    for_each_set_bit(channel, &pending, DOORBELL_CHANNELS) {
+        if (channel < tunnel_count) {
+            tunnel_notify(&tunnels[channel], sgi_ticks);
+        }
+    }
+}
+
+static int valid_stream_ring_size(uint32_t ring_size, uint32_t max_packet_size)
+{
+    if (ring_size == 0) {
+        return 1;
+    }
+
+    return is_power_of_2(ring_size) && stream_record_size(max_packet_size) <= ring_size;
+}
+
+static uint32_t tunnel_ring_size(uint32_t stream_ring_size, uint32_t packet_size, uint32_t packet_count)
+{
+    return stream_ring_size ? stream_ring_size : packet_size * packet_count;
+}
+
+#ifdef USE_CACHED_MEMORY
+/* Slot size is aligned to 32 bytes (cache line size) */
+static uint16_t tunnel_slot_size(uint16_t max_packet_size)
+{
+    return (max_packet_size + sizeof(struct PacketHeader) + 31) & ~31u;
+}
+#else
+/* Slot size is aligned to 64 bits */
+static uint16_t tunnel_slot_size(uint16_t max_packet_size)
+{
+    return (max_packet_size + sizeof(struct PacketHeader) + 7) & ~7u;
+}
+#endif
+
+static struct RingPool* get_ring_pool(struct device_node* region, struct RingPool* pools, int* pool_count)
+{
+    struct resource res;
+    int i;
+
+    if (of_address_to_resource(region, 0, &res) != 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < *pool_count; ++i) {
+        if (pools[i].start == res.start) {
+            return &pools[i];
+        }
+    }
+
+    if (*pool_count == MAX_RING_POOLS) {
+        return NULL;
+    }
+
+    pools[i].start = res.start;
+    pools[i].next = res.start;
+    pools[i].end = res.start + resource_size(&res);
+    *pool_count += 1;
+    return &pools[i];
+}
+
+static int allocate_from_pool(struct RingPool* pool, uint32_t size, uint32_t align, uint32_t* address)
+{
+    phys_addr_t start = ALIGN(pool->next, align);
+
+    if (start + size > pool->end) {
+        return -ENOMEM;
+    }
+
+    pool->next = start + size;
+    *address = start;
+    return 0;
+}
+
+/* Allocates the control header, rings and shared buffer of a tunnel from the pool.
+ * Rings start on their own cache lines, shared buffer is mapped to user space.
+ * Rings of a cache-maintained tunnel get 1 MB sections of their own so CPU1
+ * can map them cacheable without touching the control headers.
+ */
+static int place_tunnel(struct TunnelConfig* config, struct RingPool* pool)
+{
+    uint32_t ring_align = config->cache_maintained ? CPU1_SECTION_SIZE : 64;
+    int ret;
+
+    ret = allocate_from_pool(pool, sizeof(struct ControlHeader), 64, &config->control_header_address);
+    if (!ret) {
+        ret = allocate_from_pool(pool,
+                                 tunnel_ring_size(config->send_stream_ring_size,
+                                                  tunnel_slot_size(config->send_max_packet_size),
+                                                  config->send_buffered_packet_count),
+                                 ring_align,
+                                 &config->send_buffer_address);
+    }
+    if (!ret) {
+        ret = allocate_from_pool(pool,
+                                 tunnel_ring_size(config->receive_stream_ring_size,
+                                                  tunnel_slot_size(config->receive_max_packet_size),
+                                                  config->receive_buffered_packet_count),
+                                 64,
+                                 &config->receive_buffer_address);
+    }
+    if (!ret && config->cache_maintained) {
+        pool->next = ALIGN(pool->next, CPU1_SECTION_SIZE);
+    }
+    if (!ret && config->shared_buffer_size) {
+        ret = allocate_from_pool(pool, config->shared_buffer_size, PAGE_SIZE, &config->shared_buffer_address);
+    }
+
+    return ret;
+}
+
+/* Reads a tunnel node and places its control header, rings and shared buffer
+ * in the memory-region of the node:
+ *
+ *     tunnel1 {
+ *         memory-region = <&ipc_tunnel_ocm>;
+ *         send-max-packet-size = <0x780>;
+ *         send-packet-count = <4>;
+ *         receive-max-packet-size = <0x780>;
+ *         receive-packet-count = <4>;
+ *         send-stream-ring-size = <0x2000>;      (optional)
+ *         receive-stream-ring-size = <0x2000>;   (optional)
+ *         shared-buffer-size = <0x1000>;         (optional)
+ *         cache-maintained;                      (optional)
+ *         receive-overwrite;                     (optional)
+ *         cpu1-notify;                           (optional)
+ *         cpu1-urgent;                           (optional)
+ *         trace;                                 (optional)
+ *     };
+ *
+ * Tunnels are numbered in the order of the nodes.
+ *
+ * cache-maintained maps the rings cacheable on both CPUs and keeps them
+ * consistent with cache maintenance by address range instead of using
+ * non-cacheable memory. Helps large packets in DDR. The rings can't be mapped
+ * to user space then. Ignored with USE_CACHED_MEMORY.
+ *
+ * send-overwrite and receive-overwrite make the ring keep only the latest
+ * packets: when it is full the writer overwrites the oldest unread packet
+ * instead of failing, and the reader skips and counts what it lost. Meant
+ * for state and telemetry where only the newest value matters. Slot rings
+ * only.
+ *
+ * cpu1-notify interrupts CPU1 after every write, so commands are handled
+ * right away instead of on the next tick of the task reading the tunnel.
+ * cpu1-urgent does the same with an SGI CPU1 runs above its T1 task.
+ *
+ * trace makes CPU1 stamp the packets it sends and the doorbells it raises
+ * with the global timer, read back with IPC_TUNNEL_IOC_READ_TRACED. Costs
+ * CPU1 a timer read per packet. The commit stamp uses the sequence field
+ * of the packet header, so receive-overwrite rings only get the others.
+ */
+static int parse_tunnel_config(struct device_node* node, struct TunnelConfig* config,
+                               struct RingPool* pools, int* pool_count)
+{
+    u32 send_max_packet_size;
+    u32 receive_max_packet_size;
+    u32 send_packet_count = 1;
+    u32 receive_packet_count = 1;
+    u32 send_stream_ring_size = 0;
+    u32 receive_stream_ring_size = 0;
+    u32 shared_buffer_size = 0;
+    struct device_node* region;
+    struct RingPool* pool;
+    int ret = 0;
+
+    if (   of_property_read_u32(node, "send-max-packet-size", &send_max_packet_size)
+        || of_property_read_u32(node, "receive-max-packet-size", &receive_max_packet_size)) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: %s: max packet sizes are required\n", node->name);
+        return -EINVAL;
+    }
+
+    of_property_read_u32(node, "send-packet-count", &send_packet_count);
+    of_property_read_u32(node, "receive-packet-count", &receive_packet_count);
+    of_property_read_u32(node, "send-stream-ring-size", &send_stream_ring_size);
+    of_property_read_u32(node, "receive-stream-ring-size", &receive_stream_ring_size);
+    of_property_read_u32(node, "shared-buffer-size", &shared_buffer_size);
+
+    if (   send_max_packet_size == 0 || send_max_packet_size > 0xFFFF - sizeof(struct PacketHeader) - 31
+        || receive_max_packet_size == 0 || receive_max_packet_size > 0xFFFF - sizeof(struct PacketHeader) - 31
+        || send_packet_count > 0xFFFF || receive_packet_count > 0xFFFF) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: %s: invalid packet size or count\n", node->name);
+        return -EINVAL;
+    }
+
+    config->send_max_packet_size = send_max_packet_size;
+    config->send_buffered_packet_count = send_packet_count;
+    config->receive_max_packet_size = receive_max_packet_size;
+    config->receive_buffered_packet_count = receive_packet_count;
+    config->send_stream_ring_size = send_stream_ring_size;
+    config->receive_stream_ring_size = receive_stream_ring_size;
+    config->shared_buffer_size = PAGE_ALIGN(shared_buffer_size);
+    config->shared_buffer_address = 0;
+    config->cache_maintained = 0;
+    config->send_overwrite = of_property_read_bool(node, "send-overwrite");
+    config->receive_overwrite = of_property_read_bool(node, "receive-overwrite");
+    config->cpu1_urgent = of_property_read_bool(node, "cpu1-urgent");
+    config->notify_cpu1 = config->cpu1_urgent || of_property_read_bool(node, "cpu1-notify");
+    config->trace = of_property_read_bool(node, "trace");
+
+    if (   (config->send_overwrite && send_stream_ring_size)
+        || (config->receive_overwrite && receive_stream_ring_size)) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: %s: overwrite requires a slot ring\n", node->name);
+        return -EINVAL;
+    }
+
+    if (of_property_read_bool(node, "cache-maintained")) {
+#ifdef USE_CACHED_MEMORY
+        printk(KERN_INFO "CPU1_IPC_TUNNEL: %s: rings are coherent, cache-maintained ignored\n", node->name);
+#else
+        config->cache_maintained = 1;
+#endif
+    }
+
+    region = of_parse_phandle(node, "memory-region", 0);
+    if (!region) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: %s: memory-region is required\n", node->name);
+        return -EINVAL;
+    }
+
+    pool = get_ring_pool(region, pools, pool_count);
+    of_node_put(region);
+    if (!pool) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: %s: invalid memory-region\n", node->name);
+        return -EINVAL;
+    }
+
+    ret = place_tunnel(config, pool);
+    if (ret) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: %s: tunnel doesn't fit in its memory-region\n", node->name);
+    }
+
+    return ret;
+}
+
+static void publish_descriptors(void)
+{
+    struct DescriptorBlock header;
+    struct TunnelDescriptor* descriptors;
+    int i;
+
+    descriptors = kcalloc(tunnel_count, sizeof(struct TunnelDescriptor), GFP_KERNEL);
+    if (!descriptors) {
+        return;
+    }
+
+    for (i = 0; i < tunnel_count; ++i) {
+        descriptors[i].control_header_address = tunnel_configs[i].control_header_address;
+        descriptors[i].send_buffer_address = tunnel_configs[i].send_buffer_address;
+        descriptors[i].receive_buffer_address = tunnel_configs[i].receive_buffer_address;
+        descriptors[i].shared_buffer_address = tunnel_configs[i].shared_buffer_address;
+        descriptors[i].shared_buffer_size = tunnel_configs[i].shared_buffer_size;
+        descriptors[i].send_max_packet_size = tunnel_configs[i].send_max_packet_size;
+        descriptors[i].send_buffered_packet_count = tunnel_configs[i].send_buffered_packet_count;
+        descriptors[i].receive_max_packet_size = tunnel_configs[i].receive_max_packet_size;
+        descriptors[i].receive_buffered_packet_count = tunnel_configs[i].receive_buffered_packet_count;
+        descriptors[i].send_stream_ring_size = tunnel_configs[i].send_stream_ring_size;
+        descriptors[i].receive_stream_ring_size = tunnel_configs[i].receive_stream_ring_size;
+        descriptors[i].flags = 0;
+        if (tunnel_configs[i].cache_maintained) {
+            descriptors[i].flags |= TUNNEL_DESCRIPTOR_CACHE_MAINTAINED;
+        }
+        if (tunnel_configs[i].send_overwrite) {
+            descriptors[i].flags |= TUNNEL_DESCRIPTOR_SEND_OVERWRITE;
+        }
+        if (tunnel_configs[i].receive_overwrite) {
+            descriptors[i].flags |= TUNNEL_DESCRIPTOR_RECEIVE_OVERWRITE;
+        }
+        if (tunnel_configs[i].notify_cpu1) {
+            descriptors[i].flags |= TUNNEL_DESCRIPTOR_NOTIFY_CPU1;
+        }
+        if (tunnel_configs[i].cpu1_urgent) {
+            descriptors[i].flags |= TUNNEL_DESCRIPTOR_CPU1_URGENT;
+        }
+        if (tunnel_configs[i].trace) {
+            descriptors[i].flags |= TUNNEL_DESCRIPTOR_TRACE;
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = DESCRIPTOR_MAGIC;
+    header.version = DESCRIPTOR_VERSION;
+    header.tunnel_count = tunnel_count;
+    header.doorbell_sgi = doorbell_sgi;
+    header.cpu1_doorbell_sgi = cpu1_doorbell_sgi;
+    header.cpu1_urgent_sgi = cpu1_urgent_sgi;
+
+    write_descriptor_block(descriptor_block, &header, descriptors, tunnel_count);
+    kfree(descriptors);
+}
+
+/* Device tree node:
+ *
+ *     ipc-tunnel@fffff000 {
+ *         compatible = "dippa,ipc-tunnel";
+ *         reg = <0xfffff000 0xc00>;   (doorbell and descriptor block)
+ *         doorbell-sgi = <14>;        (optional)
+ *         cpu1-doorbell-sgi = <4>;    (optional)
+ *         cpu1-urgent-sgi = <5>;      (optional)
+ *
+ *         tunnel0 { ... };            (see parse_tunnel_config)
+ *     };
+ */
+static int read_device_tree(struct platform_device* pdev, struct resource* block_res)
+{
+    struct device_node* child;
+    struct RingPool pools[MAX_RING_POOLS];
+    int pool_count = 0;
+    int ret;
+    int i;
+
+    if (of_address_to_resource(pdev->dev.of_node, 0, block_res) != 0) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: reg of the descriptor block is required\n");
+        return -EINVAL;
+    }
+
+    doorbell_sgi = DEFAULT_DOORBELL_SGI;
+    of_property_read_u32(pdev->dev.of_node, "doorbell-sgi", &doorbell_sgi);
+    cpu1_doorbell_sgi = DEFAULT_CPU1_DOORBELL_SGI;
+    of_property_read_u32(pdev->dev.of_node, "cpu1-doorbell-sgi", &cpu1_doorbell_sgi);
+    cpu1_urgent_sgi = DEFAULT_CPU1_URGENT_SGI;
+    of_property_read_u32(pdev->dev.of_node, "cpu1-urgent-sgi", &cpu1_urgent_sgi);
+
+    if (cpu1_doorbell_sgi > 15 || cpu1_urgent_sgi > 15) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: CPU1 SGIs must be 0-15\n");
+        return -EINVAL;
+    }
+
+    tunnel_count = of_get_child_count(pdev->dev.of_node);
+    if (tunnel_count == 0 || tunnel_count > DOORBELL_CHANNELS) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: 1 to %d tunnels are supported\n", DOORBELL_CHANNELS);
+        return -EINVAL;
+    }
+
+    if (sizeof(struct DescriptorBlock) + tunnel_count * sizeof(struct TunnelDescriptor) > resource_size(block_res)) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: descriptor block is too small for %u tunnels\n", tunnel_count);
+        return -EINVAL;
+    }
+
+    tunnel_configs = devm_kcalloc(&pdev->dev, tunnel_count, sizeof(struct TunnelConfig), GFP_KERNEL);
+    tunnels = devm_kcalloc(&pdev->dev, tunnel_count, sizeof(struct TunnelInstance), GFP_KERNEL);
+    if (!tunnel_configs || !tunnels) {
+        return -ENOMEM;
+    }
+
+    i = 0;
+    for_each_available_child_of_node(pdev->dev.of_node, child) {
+        if (i == tunnel_count) {
+            of_node_put(child);
+            break;
+        }
+
+        ret = parse_tunnel_config(child, &tunnel_configs[i], pools, &pool_count);
+        if (ret) {
+            of_node_put(child);
+            return ret;
+        }
+
+        ++i;
+    }
+    tunnel_count = i;
+
+    return 0;
+}
+
+#ifdef IPC_TUNNEL_LOOPBACK
+/* Loopback peer
+ *
+ * A kernel thread plays the CPU1 side of every tunnel with the same protocol
+ * as the firmware (variants/ipc-tunnel-v3/ipc_tunnel.c): it stamps its half
+ * of the layout, moves its own indices and rings the doorbell. The doorbell
+ * handler is called directly in place of the SGI.
+ *
+ *     echo    packets written by CPU0 are sent back on the receive ring
+ *     sink    packets written by CPU0 are dropped
+ *     source  loopback_packet_size byte packets are sent loopback_rate times
+ *             per second on every tunnel, packets written by CPU0 are dropped
+ */
+enum LoopbackMode {
+    LOOPBACK_ECHO,
+    LOOPBACK_SINK,
+    LOOPBACK_SOURCE,
+};
+
+static char* loopback_mode = "echo";
+module_param(loopback_mode, charp, 0444);
+MODULE_PARM_DESC(loopback_mode, "Loopback peer mode: echo, sink or source");
+
+static unsigned int loopback_rate = 1000;
+module_param(loopback_rate, uint, 0444);
+MODULE_PARM_DESC(loopback_rate, "Packets per second sent on each tunnel in the source mode");
+
+static unsigned int loopback_packet_size = 64;
+module_param(loopback_packet_size, uint, 0444);
+MODULE_PARM_DESC(loopback_packet_size, "Size of the packets sent in the source mode");
+
+static unsigned int loopback_poll_usecs = 50;
+module_param(loopback_poll_usecs, uint, 0444);
+MODULE_PARM_DESC(loopback_poll_usecs, "Sleep of the idle loopback peer in microseconds, 0 spins like the firmware");
+
+static int loopback_cpu = -1;
+module_param(loopback_cpu, int, 0444);
+MODULE_PARM_DESC(loopback_cpu, "CPU the loopback peer is bound to, -1 for any");
+
+static bool loopback_overwrite = false;
+module_param(loopback_overwrite, bool, 0444);
+MODULE_PARM_DESC(loopback_overwrite, "Receive slot rings of the loopback tunnels overwrite the oldest packet when full");
+
+static bool loopback_trace = false;
+module_param(loopback_trace, bool, 0444);
+MODULE_PARM_DESC(loopback_trace, "Loopback peer stamps the packets it sends like the trace property");
+
+/* Packets moved on one tunnel before the next tunnel gets its turn */
+#define LOOPBACK_BUDGET 64
+
+/* Same tunnels as ipc-tunnel.dtsi except that the DDR stream rings are
+ * smaller so every tunnel fits in a single page allocation.
+ */
+static const struct TunnelConfig loopback_topology[] = {
+    /* T0 */
+    { .send_max_packet_size = 0x780, .send_buffered_packet_count = 2,
+      .receive_max_packet_size = 0x780, .receive_buffered_packet_count = 2,
+      .shared_buffer_size = 0x1000 },
+    /* T1 */
+    { .send_max_packet_size = 0x780, .send_buffered_packet_count = 4,
+      .receive_max_packet_size = 0x780, .receive_buffered_packet_count = 4,
+      .send_stream_ring_size = 0x2000, .receive_stream_ring_size = 0x2000 },
+    /* T2 */
+    { .send_max_packet_size = 0x1200, .send_buffered_packet_count = 2,
+      .receive_max_packet_size = 0x1200, .receive_buffered_packet_count = 2,
+      .send_stream_ring_size = 0x2000, .receive_stream_ring_size = 0x2000,
+      .shared_buffer_size = 0x3000 },
+    /* T0, DDR */
+    { .send_max_packet_size = 0x780, .send_buffered_packet_count = 2,
+      .receive_max_packet_size = 0x780, .receive_buffered_packet_count = 2,
+      .shared_buffer_size = 0x1000 },
+    /* T1, DDR */
+    { .send_max_packet_size = 0x780, .send_buffered_packet_count = 4,
+      .receive_max_packet_size = 0x780, .receive_buffered_packet_count = 4,
+      .send_stream_ring_size = 0x40000, .receive_stream_ring_size = 0x40000 },
+    /* T2, DDR */
+    { .send_max_packet_size = 0x1200, .send_buffered_packet_count = 2,
+      .receive_max_packet_size = 0x1200, .receive_buffered_packet_count = 2,
+      .send_stream_ring_size = 0x40000, .receive_stream_ring_size = 0x40000,
+      .shared_buffer_size = 0x2000 },
+};
+
+/* CPU1 side of a tunnel, same bookkeeping as IpcTunnel_t of the firmware.
+ * Peer reads the send ring and writes the receive ring.
+ */
+struct LoopbackPeer {
+    struct TunnelInstance* tunnel;
+    unsigned int channel;
+
+    uint32_t write_index;
+    uint32_t read_index;
+    uint32_t cached_cpu0_read_index;
+    uint32_t cached_cpu0_write_index;
+    uint32_t notify_sent;
+    uint32_t notify_suppressed;
+
+    /* Source mode */
+    ktime_t next_send;
+    uint32_t sequence;
+    uint64_t dropped;
+};
+
+/* Payload of the source mode packets, truncated to the packet size */
+struct LoopbackSourcePacket {
+    uint64_t timestamp_ns;
+    uint32_t sequence;
+    uint32_t reserved;
+};
+
+/* Kernel memory that stands in for a memory-region */
+struct LoopbackRegion {
+    void* memory;
+    size_t size;
+};
+
+static enum LoopbackMode loopback_peer_mode = LOOPBACK_ECHO;
+static struct LoopbackPeer loopback_peers[ARRAY_SIZE(loopback_topology)];
+/* Descriptor block and one region per tunnel */
+static struct LoopbackRegion loopback_regions[ARRAY_SIZE(loopback_topology) + 1];
+static struct task_struct* loopback_thread = NULL;
+
+/* Descriptors carry 32 bit physical addresses so the memory must be below 4 GB */
+static int loopback_allocate_region(struct LoopbackRegion* region, size_t size, struct RingPool* pool)
+{
+    phys_addr_t start;
+
+    region->size = PAGE_ALIGN(size);
+    region->memory = alloc_pages_exact(region->size, GFP_KERNEL | GFP_DMA32 | __GFP_ZERO);
+    if (!region->memory) {
+        return -ENOMEM;
+    }
+
+    start = virt_to_phys(region->memory);
+    if (upper_32_bits(start + region->size - 1)) {
+        free_pages_exact(region->memory, region->size);
+        region->memory = NULL;
+        return -ENOMEM;
+    }
+
+    pool->start = start;
+    pool->next = start;
+    pool->end = start + region->size;
+    return 0;
+}
+
+static void loopback_free_memory(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(loopback_regions); ++i) {
+        if (loopback_regions[i].memory) {
+            free_pages_exact(loopback_regions[i].memory, loopback_regions[i].size);
+            loopback_regions[i].memory = NULL;
+        }
+    }
+}
+
+/* Upper bound of what place_tunnel allocates, including the alignment */
+static size_t loopback_tunnel_size(const struct TunnelConfig* config)
+{
+    size_t size = ALIGN(sizeof(struct ControlHeader), 64);
+
+    size += ALIGN(tunnel_ring_size(config->send_stream_ring_size,
+                                   tunnel_slot_size(config->send_max_packet_size),
+                                   config->send_buffered_packet_count), 64);
+    size += ALIGN(tunnel_ring_size(config->receive_stream_ring_size,
+                                   tunnel_slot_size(config->receive_max_packet_size),
+                                   config->receive_buffered_packet_count), 64);
+    if (config->shared_buffer_size) {
+        size += PAGE_SIZE + config->shared_buffer_size;
+    }
+
+    return size;
+}
+
+/* Replaces read_device_tree. Tunnels are placed in kernel memory instead of
+ * the memory-regions.
+ */
+static int loopback_read_topology(struct platform_device* pdev, struct resource* block_res)
+{
+    struct RingPool pool;
+    int ret;
+    int i;
+
+    if (sysfs_streq(loopback_mode, "echo")) {
+        loopback_peer_mode = LOOPBACK_ECHO;
+    }
+    else if (sysfs_streq(loopback_mode, "sink")) {
+        loopback_peer_mode = LOOPBACK_SINK;
+    }
+    else if (sysfs_streq(loopback_mode, "source")) {
+        loopback_peer_mode = LOOPBACK_SOURCE;
+    }
+    else {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: unknown loopback_mode %s\n", loopback_mode);
+        return -EINVAL;
+    }
+
+    if (loopback_peer_mode == LOOPBACK_SOURCE && (loopback_rate == 0 || loopback_packet_size == 0)) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: source mode requires loopback_rate and loopback_packet_size\n");
+        return -EINVAL;
+    }
+
+    doorbell_sgi = DEFAULT_DOORBELL_SGI;
+    tunnel_count = ARRAY_SIZE(loopback_topology);
+
+    tunnel_configs = devm_kcalloc(&pdev->dev, tunnel_count, sizeof(struct TunnelConfig), GFP_KERNEL);
+    tunnels = devm_kcalloc(&pdev->dev, tunnel_count, sizeof(struct TunnelInstance), GFP_KERNEL);
+    if (!tunnel_configs || !tunnels) {
+        return -ENOMEM;
+    }
+
+    ret = loopback_allocate_region(&loopback_regions[0],
+                                   sizeof(struct DescriptorBlock) + tunnel_count * sizeof(struct TunnelDescriptor),
+                                   &pool);
+    if (ret) {
+        return ret;
+    }
+
+    memset(block_res, 0, sizeof(*block_res));
+    block_res->start = pool.next;
+    block_res->end = pool.end - 1;
+    block_res->flags = IORESOURCE_MEM;
+
+    for (i = 0; i < tunnel_count; ++i) {
+        tunnel_configs[i] = loopback_topology[i];
+        tunnel_configs[i].shared_buffer_size = PAGE_ALIGN(loopback_topology[i].shared_buffer_size);
+        tunnel_configs[i].receive_overwrite = loopback_overwrite && !loopback_topology[i].receive_stream_ring_size;
+        tunnel_configs[i].trace = loopback_trace;
+
+        ret = loopback_allocate_region(&loopback_regions[i + 1], loopback_tunnel_size(&tunnel_configs[i]), &pool);
+        if (!ret) {
+            ret = place_tunnel(&tunnel_configs[i], &pool);
+        }
+        if (ret) {
+            printk(KERN_ALERT "CPU1_IPC_TUNNEL: failed to allocate loopback tunnel %d\n", i);
+            return ret;
+        }
+    }
+
+    printk(KERN_INFO "CPU1_IPC_TUNNEL: loopback peer in %s mode\n", loopback_mode);
+    return 0;
+}
+
+/* Same as IPC_TUNNEL_Init of the firmware. Memory is zeroed when it is
+ * allocated so the indices already start from 0.
+ */
+static void loopback_init_peer(struct LoopbackPeer* peer, struct TunnelInstance* tunnel, unsigned int channel)
+{
+    struct ControlHeader* control = tunnel->control_header;
+
+    peer->tunnel = tunnel;
+    peer->channel = channel;
+    peer->write_index = 0;
+    peer->read_index = 0;
+    peer->cached_cpu0_read_index = 0;
+    peer->cached_cpu0_write_index = 0;
+    peer->notify_sent = 0;
+    peer->notify_suppressed = 0;
+    peer->next_send = ktime_get();
+    peer->sequence = 0;
+    peer->dropped = 0;
+
+    WRITE_ONCE(control->cpu1_send_stream_ring_size, tunnel->config->send_stream_ring_size);
+    WRITE_ONCE(control->cpu1_receive_stream_ring_size, tunnel->config->receive_stream_ring_size);
+    WRITE_ONCE(control->cpu1_version, IPC_TUNNEL_LAYOUT_VERSION);
+    smp_store_release(&control->cpu1_magic, IPC_TUNNEL_MAGIC);
+}
+
+static int loopback_try_read(struct LoopbackPeer* peer, struct ReadPacket* packet)
+{
+    struct TunnelInstance* tunnel = peer->tunnel;
+    uint32_t ring_size = tunnel->send_ring_size;
+    struct PacketHeader* header;
+
+    for (;;) {
+        if (peer->read_index == peer->cached_cpu0_write_index) {
+            peer->cached_cpu0_write_index = smp_load_acquire(&tunnel->control_header->cpu0_write_index);
+
+            if (peer->read_index == peer->cached_cpu0_write_index) {
+                return 0;
+            }
+        }
+
+        if (!tunnel->config->send_stream_ring_size) {
+            header = (struct PacketHeader*)(tunnel->send_buffer
+                     + tunnel->send_packet_size * (peer->read_index & (tunnel->config->send_buffered_packet_count - 1u)));
+            packet->next_read_index = peer->read_index + 1;
+            break;
+        }
+
+        header = (struct PacketHeader*)(tunnel->send_buffer + (peer->read_index & (ring_size - 1u)));
+        if (header->packet_size != IPC_TUNNEL_STREAM_PADDING) {
+            packet->next_read_index = peer->read_index + stream_record_size(header->packet_size);
+            break;
+        }
 
-    if (nextWriteIndex != cpu1ReadIndex) {
-        packet->next_write_index = nextWriteIndex;
-        packet->packet = get_write_packet(tunnel, writeIndex);
-        return 1;
+        peer->read_index += ring_size - (peer->read_index & (ring_size - 1u));
+        smp_store_release(&tunnel->control_header->cpu1_read_index, peer->read_index);
     }
 
-    return 0;
+    packet->packet = header;
+    return 1;
 }
 
-#ifdef USE_CACHED_MEMORY
-static void mark_packet_as_read(struct TunnelInstance* tunnel, struct ReadPacket* packet) {
-    smp_store_release(&tunnel->control_header->cpu0_read_index, packet->next_read_index);
+static void loopback_mark_read(struct LoopbackPeer* peer, struct ReadPacket* packet)
+{
+    peer->read_index = packet->next_read_index;
+    smp_store_release(&peer->tunnel->control_header->cpu1_read_index, peer->read_index);
 }
 
-static void send_packet(struct TunnelInstance* tunnel, struct WritePacket* packet) {
-    smp_store_release(&tunnel->control_header->cpu0_write_index, packet->next_write_index);
-}
-#else
-static void mark_packet_as_read(struct TunnelInstance* tunnel, struct ReadPacket* packet) {
-    dsb();
-    writel(packet->next_read_index, &tunnel->control_header->cpu0_read_index);
-}
+static int loopback_has_space(struct LoopbackPeer* peer, uint32_t amount, uint32_t capacity)
+{
+    if (peer->write_index - peer->cached_cpu0_read_index + amount > capacity) {
+        peer->cached_cpu0_read_index = smp_load_acquire(&peer->tunnel->control_header->cpu0_read_index);
 
-static void send_packet(struct TunnelInstance* tunnel, struct WritePacket* packet) {
-    dsb();
-    writel(packet->next_write_index, &tunnel->control_header->cpu0_write_index);
-}
-#endif
+        if (peer->write_index - peer->cached_cpu0_read_index + amount > capacity) {
+            return 0;
+        }
+    }
 
+    return 1;
+}
 
-static int dev_open(struct inode* inodep, struct file* filep)
+static int loopback_try_write(struct LoopbackPeer* peer, uint32_t size, struct WritePacket* packet)
 {
-    int i;
-    struct TunnelInstance *tunnel = 0;
+    struct TunnelInstance* tunnel = peer->tunnel;
+    uint32_t ring_size = tunnel->receive_ring_size;
+    uint32_t record_size;
+    uint32_t tail;
+    struct PacketHeader* padding;
+
+    if (!tunnel->config->receive_stream_ring_size) {
+        if (!tunnel->config->receive_overwrite
+            && !loopback_has_space(peer, 1, tunnel->config->receive_buffered_packet_count)) {
+            return 0;
+        }
 
-    for (i = 0; i < DEVICE_COUNT; ++i)
-    {
-        if (inodep->i_cdev == &tunnels[i].c_dev)
-        {
-            tunnel = &tunnels[i];
-            break;
+        packet->packet = (struct PacketHeader*)(tunnel->receive_buffer
+                         + tunnel->receive_packet_size * (peer->write_index & (tunnel->config->receive_buffered_packet_count - 1u)));
+        packet->next_write_index = peer->write_index + 1;
+        if (tunnel->config->receive_overwrite) {
+            WRITE_ONCE(packet->packet->sequence, peer->write_index);
+            smp_mb();
         }
+        return 1;
     }
 
-    if (!tunnel) {
-        printk(KERN_ERR "Can't find chardev for inode\n");
-        return -EINVAL;
-    }
+    record_size = stream_record_size(size);
+    tail = ring_size - (peer->write_index & (ring_size - 1u));
 
-    filep->private_data = tunnel;
+    if (record_size > tail) {
+        if (!loopback_has_space(peer, tail, ring_size)) {
+            return 0;
+        }
 
-    printk(KERN_INFO "dev_open %p\n", (void*)tunnel);
-    if (tunnel->is_open)
-    {
-        return -EBUSY;
+        padding = (struct PacketHeader*)(tunnel->receive_buffer + (peer->write_index & (ring_size - 1u)));
+        padding->packet_size = IPC_TUNNEL_STREAM_PADDING;
+        peer->write_index += tail;
+        smp_store_release(&tunnel->control_header->cpu1_write_index, peer->write_index);
     }
 
-    tunnel->is_open = 1;
+    if (!loopback_has_space(peer, record_size, ring_size)) {
+        return 0;
+    }
 
-    printk(KERN_INFO "CPU1_IPC_TUNNEL Opened\n");
-    return 0;
+    packet->packet = (struct PacketHeader*)(tunnel->receive_buffer + (peer->write_index & (ring_size - 1u)));
+    packet->next_write_index = peer->write_index + record_size;
+    return 1;
 }
 
-static ssize_t dev_read(struct file* filep, char __user* buffer, size_t len, loff_t* offset)
+/* Same as RingDoorbell of the firmware. The handler runs with interrupts
+ * disabled as it would when called from the SGI.
+ */
+static int loopback_ring_doorbell(struct LoopbackPeer* peer)
 {
-    uint32_t rx = 0;
-    struct ReadPacket packet;
-    struct TunnelInstance* tunnel = (struct TunnelInstance*)filep->private_data;
+    uint32_t bit = 1u << peer->channel;
+    uint32_t raised = READ_ONCE(doorbell->cpu1_raised);
+    unsigned long flags;
 
-    if (filep->f_flags & O_NONBLOCK) {
-        /* non-blocking IO */
+    if ((raised ^ READ_ONCE(doorbell->cpu0_acked)) & bit) {
+        return 0;
+    }
 
-        if (!try_get_read_packet(tunnel, &packet)) {
-            /* No data in queue */
-            return -EAGAIN;
-        }
-    } else if (wait_event_interruptible(tunnel->read_queue, try_get_read_packet(tunnel, &packet)) != 0) {
-        /* Waiting for data was interrupted */
-        return -EINTR;
+    if (peer->tunnel->config->trace) {
+        WRITE_ONCE(doorbell->cpu1_raised_ticks, get_notify_clock_ticks());
     }
+    smp_store_release(&doorbell->cpu1_raised, raised ^ bit);
 
-    /* Read queue contains something */
+    local_irq_save(flags);
+    doorbell_ipi_handler();
+    local_irq_restore(flags);
+    return 1;
+}
 
-    rx = packet.packet->packet_size;
-    if (len < rx) {
-        /* If read buffer is smaller than the package, part of the data is lost */
-        rx = len;
-    }
+/* Same as SendPacket of the firmware */
+static void loopback_send(struct LoopbackPeer* peer, struct WritePacket* packet)
+{
+    struct ControlHeader* control = peer->tunnel->control_header;
+    uint32_t old_index = peer->write_index;
+    uint32_t event_index;
 
-    if (copy_to_user(buffer, packet.packet->data, rx) != 0) {
-        return -EFAULT;
+    if (traces_receive_ring(peer->tunnel->config)) {
+        WRITE_ONCE(packet->packet->sequence, get_notify_clock_ticks());
     }
 
-    mark_packet_as_read(tunnel, &packet);
+    peer->write_index = packet->next_write_index;
+    smp_store_release(&control->cpu1_write_index, peer->write_index);
 
-    return (ssize_t)rx;
+    /* Write index must be visible before the event index is read.
+     * Pairs with publish_read_event_index.
+     */
+    smp_mb();
+    event_index = READ_ONCE(control->cpu0_read_event_index);
+
+    /* Notify if event_index is in [old_index, write_index), same as vring_need_event */
+    if (   (uint32_t)(peer->write_index - event_index - 1u) < (uint32_t)(peer->write_index - old_index)
+        && loopback_ring_doorbell(peer)) {
+        WRITE_ONCE(control->cpu1_notify_sent, ++peer->notify_sent);
+    }
+    else {
+        WRITE_ONCE(control->cpu1_notify_suppressed, ++peer->notify_suppressed);
+    }
 }
 
-static ssize_t dev_write(struct file* filep, const char __user* buffer, size_t len, loff_t* offset)
+static int loopback_echo(struct LoopbackPeer* peer)
 {
-    struct WritePacket write;
-    struct TunnelInstance* tunnel = (struct TunnelInstance*)filep->private_data;
+    const struct TunnelConfig* config = peer->tunnel->config;
+    struct ReadPacket in;
+    struct WritePacket out;
+    uint32_t size;
+    int moved = 0;
+
+    while (moved < LOOPBACK_BUDGET && loopback_try_read(peer, &in)) {
+        size = min_t(uint32_t, in.packet->packet_size, config->send_max_packet_size);
+        size = min_t(uint32_t, size, config->receive_max_packet_size);
+
+        if (!loopback_try_write(peer, size, &out)) {
+            /* Packet stays in the send ring until CPU0 reads the receive ring */
+            break;
+        }
 
-    if (len == 0) {
-        return 0;
+        out.packet->packet_size = size;
+        memcpy(out.packet->data, in.packet->data, size);
+        loopback_mark_read(peer, &in);
+        loopback_send(peer, &out);
+        ++moved;
     }
 
-    if (!tunnel) {
-        return -EBADFD;
-    }
+    return moved;
+}
 
-    if (len > tunnel->config->send_max_packet_size) {
-        /* Packet doesn't fit in the ring buffer */
-        return -EFBIG;
+static int loopback_sink(struct LoopbackPeer* peer)
+{
+    struct ReadPacket in;
+    int moved = 0;
+
+    while (moved < LOOPBACK_BUDGET && loopback_try_read(peer, &in)) {
+        loopback_mark_read(peer, &in);
+        ++moved;
     }
 
-    if (try_get_write_packet(tunnel, &write)) {
-        if (copy_from_user(write.packet->data, buffer, len) != 0) {
-            return -EFAULT;
+    return moved;
+}
+
+/* Sends the packets that are due. Rate is fixed so a packet that doesn't
+ * fit in the receive ring is dropped.
+ */
+static int loopback_source(struct LoopbackPeer* peer)
+{
+    struct LoopbackSourcePacket payload;
+    struct WritePacket out;
+    uint32_t size = min_t(uint32_t, loopback_packet_size, peer->tunnel->config->receive_max_packet_size);
+    ktime_t now = ktime_get();
+    int due = 0;
+
+    while (due < LOOPBACK_BUDGET && !ktime_before(now, peer->next_send)) {
+        peer->next_send = ktime_add_ns(peer->next_send, NSEC_PER_SEC / loopback_rate);
+        ++due;
+
+        if (!loopback_try_write(peer, size, &out)) {
+            ++peer->dropped;
+            continue;
         }
 
-        write.packet->packet_size = len;
+        payload.timestamp_ns = ktime_get_ns();
+        payload.sequence = peer->sequence++;
+        payload.reserved = 0;
 
-        send_packet(tunnel, &write);
-        return len;
+        out.packet->packet_size = size;
+        memcpy(out.packet->data, &payload, min_t(uint32_t, size, sizeof(payload)));
+        loopback_send(peer, &out);
     }
 
-    return 0;
+    return due;
 }
 
-static unsigned int dev_poll(struct file* file, poll_table* wait)
+static int loopback_thread_fn(void* data)
 {
-    struct TunnelInstance* tunnel = (struct TunnelInstance*)file->private_data;
-    poll_wait(file, &tunnel->read_queue, wait);
+    int work;
+    int i;
 
-    if (   get_cpu0_read_index(tunnel->control_header)
-        != get_cpu1_write_index(tunnel->control_header)) {
-        /* there is readable data in the queue */
-        return POLLIN | POLLRDNORM;
+    for (i = 0; i < tunnel_count; ++i) {
+        loopback_init_peer(&loopback_peers[i], &tunnels[i], i);
+    }
+
+    while (!kthread_should_stop()) {
+        work = 0;
+
+        for (i = 0; i < tunnel_count; ++i) {
+            switch (loopback_peer_mode) {
+            case LOOPBACK_ECHO:
+                work += loopback_echo(&loopback_peers[i]);
+                break;
+            case LOOPBACK_SINK:
+                work += loopback_sink(&loopback_peers[i]);
+                break;
+            case LOOPBACK_SOURCE:
+                work += loopback_sink(&loopback_peers[i]);
+                work += loopback_source(&loopback_peers[i]);
+                break;
+            }
+        }
+
+        if (work || loopback_poll_usecs == 0) {
+            cond_resched();
+        }
+        else {
+            usleep_range(loopback_poll_usecs, loopback_poll_usecs + loopback_poll_usecs / 2);
+        }
     }
 
     return 0;
 }
 
-static int dev_mmap(struct file* filep, struct vm_area_struct *vma)
+static int loopback_start(void)
 {
-    struct TunnelInstance* tunnel = (struct TunnelInstance*)filep->private_data;
-    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
-
-    unsigned long physical_base = tunnel->config->shared_buffer_address;
-    unsigned long physical_size = tunnel->config->shared_buffer_size;
-    unsigned long virtual_size = vma->vm_end - vma->vm_start;
-    unsigned long pfn = (physical_base + offset) >> PAGE_SHIFT;
+    int ret;
 
-    /* Memory should be marked as SHARED (no COW if process is forked) */
-    if ((vma->vm_flags & VM_SHARED) == 0) {
-        return -EINVAL;
+    loopback_thread = kthread_create(loopback_thread_fn, NULL, "ipc_tunnel_peer");
+    if (IS_ERR(loopback_thread)) {
+        ret = PTR_ERR(loopback_thread);
+        loopback_thread = NULL;
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: failed to start the loopback peer\n");
+        return ret;
     }
 
-    if (offset >= physical_size || physical_size - offset < virtual_size) {
-        return -EINVAL;
+    if (loopback_cpu >= 0) {
+        if (loopback_cpu < nr_cpu_ids && cpu_online(loopback_cpu)) {
+            kthread_bind(loopback_thread, loopback_cpu);
+        }
+        else {
+            printk(KERN_WARNING "CPU1_IPC_TUNNEL: CPU %d is not online, loopback peer is not bound\n", loopback_cpu);
+        }
     }
-    vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
-	
-#ifdef USE_CACHED_MEMORY
-    vma->vm_page_prot = __pgprot_modify(vma->vm_page_prot, L_PTE_MT_MASK, __PAGE_SHARED | L_PTE_MT_WRITEBACK);
-#else
-    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
-#endif
-    return remap_pfn_range(vma,
-                           vma->vm_start,
-                           pfn,
-                           virtual_size,
-                           vma->vm_page_prot);
-}
-
-static int dev_release(struct inode* inodep, struct file* filep)
-{
-    struct TunnelInstance *tunnel = (struct TunnelInstance*)filep->private_data;
-    tunnel->is_open = 0;
 
-    printk(KERN_INFO "CPU1_IPC_TUNNEL Released\n");
+    wake_up_process(loopback_thread);
     return 0;
 }
 
-static struct file_operations fops = {
-    .owner = THIS_MODULE,
-    .open = dev_open,
-    .read = dev_read,
-    .write = dev_write,
-    .release = dev_release,
-    .poll = dev_poll,
-    .mmap = dev_mmap
-};
-
-/* Called when software interrupt CPU0_NOTIFY_IRQ is triggered
- * set_ipi_handler doesn't allow adding any extra data so we
- * need a separate handler for each tunnel
-*/
-static void tunnel0_ipi_notify_handler(void)
+static void loopback_stop(void)
 {
-    wake_up_interruptible(&tunnels[0].read_queue);
-}
+    int i;
 
-static void tunnel1_ipi_notify_handler(void)
-{
-    wake_up_interruptible(&tunnels[1].read_queue);
-}
+    if (!loopback_thread) {
+        return;
+    }
 
-static void tunnel2_ipi_notify_handler(void)
-{
-    wake_up_interruptible(&tunnels[2].read_queue);
-}
+    kthread_stop(loopback_thread);
+    loopback_thread = NULL;
 
-static void tunnel3_ipi_notify_handler(void)
-{
-    wake_up_interruptible(&tunnels[3].read_queue);
+    for (i = 0; i < tunnel_count; ++i) {
+        if (loopback_peers[i].dropped) {
+            printk(KERN_INFO "CPU1_IPC_TUNNEL: loopback tunnel %d dropped %llu packets\n",
+                   i, (unsigned long long)loopback_peers[i].dropped);
+        }
+    }
 }
+#endif
 
-static void tunnel4_ipi_notify_handler(void)
+#ifndef USE_CACHED_MEMORY
+/* Rings of cache-maintained tunnels are cacheable, others write-combining */
+static uint8_t* map_ring(const struct TunnelConfig* config, uint32_t address, uint32_t size)
 {
-    wake_up_interruptible(&tunnels[4].read_queue);
+    if (config->cache_maintained) {
+        return (uint8_t*) memremap(address, size, MEMREMAP_WB);
+    }
+
+    return (uint8_t*) ioremap_wc(address, size);
 }
 
-static void tunnel5_ipi_notify_handler(void)
+static void unmap_ring(const struct TunnelConfig* config, uint8_t* ring)
 {
-    wake_up_interruptible(&tunnels[5].read_queue);
+    if (config->cache_maintained) {
+        memunmap(ring);
+    }
+    else {
+        iounmap(ring);
+    }
 }
+#endif
 
-
-static int __init ipc_tunnel_init(void)
+static int ipc_tunnel_probe(struct platform_device* pdev)
 {
     int i;
     int j;
     int ret = 0;
     struct device* dev_instance;
+    struct resource block_res;
+
+    if (tunnels) {
+        printk(KERN_ALERT "CPU1_IPC_TUNNEL: only one ipc-tunnel node is supported\n");
+        return -EBUSY;
+    }
+
+#ifdef IPC_TUNNEL_LOOPBACK
+    ret = loopback_read_topology(pdev, &block_res);
+#else
+    ret = read_device_tree(pdev, &block_res);
+#endif
+    if (ret) {
+        goto free_tunnels;
+    }
 
-    for (i = 0; i < DEVICE_COUNT; ++i)
+    for (i = 0; i < tunnel_count; ++i)
     {
         tunnels[i].dev = 0;
         tunnels[i].config = &tunnel_configs[i];
@@ -560,19 +3074,71 @@ static int __init ipc_tunnel_init(void)
         tunnels[i].receive_buffer = NULL;
         tunnels[i].send_packet_size = 0;
         tunnels[i].receive_packet_size = 0;
+        tunnels[i].peer_verified = 0;
+        tunnels[i].rings_mapped = 0;
+        tunnels[i].stats = NULL;
+        tunnels[i].notify_ticks = 0;
+        tunnels[i].notify_pending = 0;
+        tunnels[i].busy_poll_usecs = 0;
+        tunnels[i].busy_poll_hits = 0;
+        tunnels[i].busy_poll_misses = 0;
+        tunnels[i].busy_poll_spin_ns = 0;
+        tunnels[i].notify_eventfd = NULL;
+        spin_lock_init(&tunnels[i].notify_eventfd_lock);
+
+        tunnels[i].send_ring_size = 0;
+        tunnels[i].receive_ring_size = 0;
+
+        if (   !is_power_of_2(tunnel_configs[i].send_buffered_packet_count)
+            || !is_power_of_2(tunnel_configs[i].receive_buffered_packet_count)) {
+            printk(KERN_ALERT "CPU1_IPC_TUNNEL: tunnel %d packet counts must be powers of two\n", i);
+            ret = -EINVAL;
+            goto free_tunnels;
+        }
+
+        if (   !valid_stream_ring_size(tunnel_configs[i].send_stream_ring_size, tunnel_configs[i].send_max_packet_size)
+            || !valid_stream_ring_size(tunnel_configs[i].receive_stream_ring_size, tunnel_configs[i].receive_max_packet_size)) {
+            printk(KERN_ALERT "CPU1_IPC_TUNNEL: tunnel %d stream ring sizes must be powers of two and fit the largest packet\n", i);
+            ret = -EINVAL;
+            goto free_tunnels;
+        }
     }
 
 
     printk(KERN_INFO "CPU1_IPC_TUNNEL: Initializing the CPU1_IPC_TUNNEL LKM\n");
+
+    for (i = 0; i < tunnel_count; ++i)
+    {
+        tunnels[i].stats = alloc_percpu(struct TunnelStats);
+        if (!tunnels[i].stats) {
+            ret = -ENOMEM;
+            goto free_stats;
+        }
+    }
+
+#ifndef IPC_TUNNEL_LOOPBACK
+    /* Latency histograms are only collected if the global timer can be mapped */
+    global_timer = ioremap(GLOBAL_TIMER_ADDRESS, 8);
+    if (!global_timer) {
+        printk(KERN_WARNING "CPU1_IPC_TUNNEL: failed to map the global timer\n");
+    }
+
+    /* Only the software interrupt register is written */
+    gic_distributor = ioremap(GIC_DISTRIBUTOR_ADDRESS, GIC_DIST_SOFTINT + 4);
+    if (!gic_distributor) {
+        printk(KERN_WARNING "CPU1_IPC_TUNNEL: failed to map the GIC, cpu1-notify ignored\n");
+    }
+#endif
+
     ret = alloc_chrdev_region(
         &first_device_number,
         0,
-        DEVICE_COUNT,
+        tunnel_count,
         DEVICE_NAME);
 
     if (ret < 0) {
         printk(KERN_ALERT "CPU1_IPC_TUNNEL failed to register a major number\n");
-        return ret;
+        goto free_stats;
     }
     printk(KERN_INFO "CPU1_IPC_TUNNEL: registered correctly with major number %d\n", MAJOR(ret));
 
@@ -586,16 +3152,17 @@ static int __init ipc_tunnel_init(void)
 
     printk(KERN_INFO "CPU1_IPC_TUNNEL: device class registered correctly\n");
 
-    for (i = 0; i < DEVICE_COUNT; ++i) {
+    for (i = 0; i < tunnel_count; ++i) {
 
         dev_t dev_num = MKDEV(MAJOR(first_device_number),
                               MINOR(first_device_number) + i);
 
-        dev_instance = device_create(
+        dev_instance = device_create_with_groups(
             device_class,
             NULL,
             dev_num,
-            NULL,
+            &tunnels[i],
+            tunnel_groups,
             "ipc_tunnel%d",
             i);
 
@@ -607,7 +3174,7 @@ static int __init ipc_tunnel_init(void)
         tunnels[i].dev = dev_num;
     }
 
-    for (i = 0; i < DEVICE_COUNT; ++i)
+    for (i = 0; i < tunnel_count; ++i)
     {
         cdev_init(&tunnels[i].c_dev, &fops);
         if ((ret = cdev_add(&tunnels[i].c_dev, tunnels[i].dev, 1)) < 0)
@@ -622,7 +3189,7 @@ static int __init ipc_tunnel_init(void)
     }
 
     /* Map shared memory regions */
-    for (i = 0; i < DEVICE_COUNT; ++i)
+    for (i = 0; i < tunnel_count; ++i)
     {
         tunnels[i].control_header =
                 (struct ControlHeader*) memremap(
@@ -630,42 +3197,35 @@ static int __init ipc_tunnel_init(void)
                     sizeof(struct ControlHeader),
                     MEMREMAP_WB);
 
+        tunnels[i].send_packet_size = tunnel_slot_size(tunnel_configs[i].send_max_packet_size);
+        tunnels[i].send_ring_size = tunnel_ring_size(tunnel_configs[i].send_stream_ring_size,
+                                                     tunnels[i].send_packet_size,
+                                                     tunnel_configs[i].send_buffered_packet_count);
+        tunnels[i].receive_packet_size = tunnel_slot_size(tunnel_configs[i].receive_max_packet_size);
+        tunnels[i].receive_ring_size = tunnel_ring_size(tunnel_configs[i].receive_stream_ring_size,
+                                                        tunnels[i].receive_packet_size,
+                                                        tunnel_configs[i].receive_buffered_packet_count);
+
 #ifdef USE_CACHED_MEMORY
-        /* send buffer element size is aligned to 32 bytes (cache line size) */
-        tunnels[i].send_packet_size = (tunnel_configs[i].send_max_packet_size
-                                     + sizeof(struct PacketHeader) + 31) & ~31u;
-		tunnels[i].send_buffer =
-				(uint8_t*) memremap(
-					tunnel_configs[i].send_buffer_address,
-					tunnels[i].send_packet_size * tunnel_configs[i].send_buffered_packet_count,
-					MEMREMAP_WB);
-
-		/* receive buffer element size is aligned to 32 bytes (cache line size) */
-        tunnels[i].receive_packet_size = (tunnel_configs[i].receive_max_packet_size
-                                        + sizeof(struct PacketHeader) + 31) & ~31u;
-
-		tunnels[i].receive_buffer =
-				(uint8_t*) memremap(
-					tunnel_configs[i].receive_buffer_address,
-					tunnels[i].receive_packet_size * tunnel_configs[i].receive_buffered_packet_count,
-					MEMREMAP_WB);
-#else
-		/* send buffer element size is aligned to 64 bits */
-        tunnels[i].send_packet_size = (tunnel_configs[i].send_max_packet_size
-                                     + sizeof(struct PacketHeader) + 7) & ~7u;
         tunnels[i].send_buffer =
-                (uint8_t*) ioremap_wc(
+                (uint8_t*) memremap(
                     tunnel_configs[i].send_buffer_address,
-                    tunnels[i].send_packet_size * tunnel_configs[i].send_buffered_packet_count);
+                    tunnels[i].send_ring_size,
+                    MEMREMAP_WB);
 
-        /* receive buffer element size is aligned to 64 bits */
-        tunnels[i].receive_packet_size = (tunnel_configs[i].receive_max_packet_size
-                                        + sizeof(struct PacketHeader) + 7) & ~7u;
-		tunnels[i].receive_buffer =
-				(uint8_t*) ioremap_wc(
-					tunnel_configs[i].receive_buffer_address,
-					tunnels[i].receive_packet_size * tunnel_configs[i].receive_buffered_packet_count);
-#endif	
+        tunnels[i].receive_buffer =
+                (uint8_t*) memremap(
+                    tunnel_configs[i].receive_buffer_address,
+                    tunnels[i].receive_ring_size,
+                    MEMREMAP_WB);
+#else
+        tunnels[i].send_buffer = map_ring(&tunnel_configs[i],
+                                          tunnel_configs[i].send_buffer_address,
+                                          tunnels[i].send_ring_size);
+        tunnels[i].receive_buffer = map_ring(&tunnel_configs[i],
+                                             tunnel_configs[i].receive_buffer_address,
+                                             tunnels[i].receive_ring_size);
+#endif
 
         if (   !tunnels[i].control_header
             || !tunnels[i].send_buffer
@@ -676,20 +3236,51 @@ static int __init ipc_tunnel_init(void)
         }
     }
 
-    for (i = 0; i < DEVICE_COUNT; ++i)
+#ifdef USE_CACHED_MEMORY
+    descriptor_block = (struct DescriptorBlock*) memremap(block_res.start, resource_size(&block_res), MEMREMAP_WB);
+#else
+    descriptor_block = (struct DescriptorBlock*) ioremap(block_res.start, resource_size(&block_res));
+#endif
+    if (!descriptor_block) {
+        ret = -ENOMEM;
+        goto unmap_memory;
+    }
+
+    doorbell = &descriptor_block->doorbell;
+
+    /* Anything CPU1 raised before the module was loaded is stale */
+    doorbell_acked = get_doorbell_raised(doorbell);
+    set_doorbell_acked(doorbell, doorbell_acked);
+    cpu1_doorbell_raised = get_cpu1_doorbell_acked(doorbell);
+    set_cpu1_doorbell_raised(doorbell, cpu1_doorbell_raised);
+
+    for (i = 0; i < tunnel_count; ++i)
     {
         init_waitqueue_head(&tunnels[i].read_queue);
+    }
+
+#ifndef IPC_TUNNEL_LOOPBACK
+    set_ipi_handler(doorbell_sgi, (void*)&doorbell_ipi_handler, "IPC_TUNNEL_CPU0_NOTIFY");
+#endif
+
+    /* CPU1 may be waiting for the descriptors so they go out last */
+    publish_descriptors();
 
-        set_ipi_handler(tunnel_configs[i].cpu0_notify_ipi,
-                        (void*)tunnel_configs[i].cpu0_notify_ipi_handler,
-                        "IPC_TUNNEL_CPU0_NOTIFY");
+#ifdef IPC_TUNNEL_LOOPBACK
+    ret = loopback_start();
+    if (ret) {
+        memunmap(descriptor_block);
+        descriptor_block = NULL;
+        doorbell = NULL;
+        goto unmap_memory;
     }
+#endif
 
-    printk(KERN_INFO "CPU1_IPC_TUNNEL: device class created correctly\n");
+    printk(KERN_INFO "CPU1_IPC_TUNNEL: %u tunnels created\n", tunnel_count);
     return 0;
 
 unmap_memory:
-    for (i = 0; i < DEVICE_COUNT; ++i)
+    for (i = 0; i < tunnel_count; ++i)
     {
 #ifdef USE_CACHED_MEMORY
         if (tunnels[i].control_header)
@@ -714,23 +3305,23 @@ unmap_memory:
 
         if (tunnels[i].send_buffer)
         {
-            iounmap(tunnels[i].send_buffer);
+            unmap_ring(&tunnel_configs[i], tunnels[i].send_buffer);
         }
 
         if (tunnels[i].receive_buffer)
         {
-            iounmap(tunnels[i].receive_buffer);
+            unmap_ring(&tunnel_configs[i], tunnels[i].receive_buffer);
         }
 #endif
     }
 
-    for (i = 0; i < DEVICE_COUNT; ++i)
+    for (i = 0; i < tunnel_count; ++i)
     {
         cdev_del(&tunnels[i].c_dev);
     }
 
 destroy_devices:
-    for (i = 0; i < DEVICE_COUNT; ++i)
+    for (i = 0; i < tunnel_count; ++i)
     {
         if (tunnels[i].dev != 0)
         {
@@ -741,27 +3332,66 @@ destroy_devices:
     class_destroy(device_class);
 
 unregister_chrdevs:
-    unregister_chrdev_region(first_device_number, DEVICE_COUNT);
+    unregister_chrdev_region(first_device_number, tunnel_count);
+
+free_stats:
+    if (global_timer) {
+        iounmap(global_timer);
+        global_timer = NULL;
+    }
+
+    if (gic_distributor) {
+        iounmap(gic_distributor);
+        gic_distributor = NULL;
+    }
+
+    for (i = 0; i < tunnel_count; ++i)
+    {
+        free_percpu(tunnels[i].stats);
+        tunnels[i].stats = NULL;
+    }
+
+free_tunnels:
+#ifdef IPC_TUNNEL_LOOPBACK
+    loopback_free_memory();
+#endif
+    tunnels = NULL;
+    tunnel_configs = NULL;
+    tunnel_count = 0;
 
     return ret;
 }
 
-static void __exit ipc_tunnel_exit(void)
+static int ipc_tunnel_remove(struct platform_device* pdev)
 {
     int i;
 
-    for (i = 0; i < DEVICE_COUNT; ++i)
-    {
-        clear_ipi_handler(tunnel_configs[i].cpu0_notify_ipi);
+#ifdef IPC_TUNNEL_LOOPBACK
+    loopback_stop();
+#else
+    clear_ipi_handler(doorbell_sgi);
+#endif
+
+#ifdef USE_CACHED_MEMORY
+    smp_store_release(&descriptor_block->magic, 0);
+    memunmap(descriptor_block);
+#else
+    writel(0, &descriptor_block->magic);
+    iounmap(descriptor_block);
+#endif
+    descriptor_block = NULL;
+    doorbell = NULL;
 
+    for (i = 0; i < tunnel_count; ++i)
+    {
 #if USE_CACHED_MEMORY
         memunmap(tunnels[i].control_header);
         memunmap(tunnels[i].send_buffer);
         memunmap(tunnels[i].receive_buffer);
 #else
 		iounmap(tunnels[i].control_header);
-        iounmap(tunnels[i].send_buffer);
-        iounmap(tunnels[i].receive_buffer);
+        unmap_ring(&tunnel_configs[i], tunnels[i].send_buffer);
+        unmap_ring(&tunnel_configs[i], tunnels[i].receive_buffer);
 #endif
 
         cdev_del(&tunnels[i].c_dev);
@@ -770,10 +3400,76 @@ static void __exit ipc_tunnel_exit(void)
     }
 
     class_destroy(device_class);
-    unregister_chrdev_region(first_device_number, DEVICE_COUNT);
+    unregister_chrdev_region(first_device_number, tunnel_count);
+
+    if (global_timer) {
+        iounmap(global_timer);
+    }
+
+    if (gic_distributor) {
+        iounmap(gic_distributor);
+        gic_distributor = NULL;
+    }
+
+    for (i = 0; i < tunnel_count; ++i)
+    {
+        free_percpu(tunnels[i].stats);
+    }
+
+#ifdef IPC_TUNNEL_LOOPBACK
+    loopback_free_memory();
+#endif
+    tunnels = NULL;
+    tunnel_configs = NULL;
+    tunnel_count = 0;
 
     printk(KERN_INFO "CPU1_IPC_TUNNEL: Exit\n");
+    return 0;
+}
+
+static const struct of_device_id ipc_tunnel_of_match[] = {
+    { .compatible = "dippa,ipc-tunnel" },
+    { }
+};
+MODULE_DEVICE_TABLE(of, ipc_tunnel_of_match);
+
+static struct platform_driver ipc_tunnel_driver = {
+    .probe = ipc_tunnel_probe,
+    .remove = ipc_tunnel_remove,
+    .driver = {
+        .name = DEVICE_NAME,
+        .of_match_table = ipc_tunnel_of_match,
+    },
+};
+
+#ifdef IPC_TUNNEL_LOOPBACK
+/* There is no device tree node to bind to, the device is created here */
+static struct platform_device* loopback_device = NULL;
+
+static int __init ipc_tunnel_init(void)
+{
+    int ret = platform_driver_register(&ipc_tunnel_driver);
+    if (ret) {
+        return ret;
+    }
+
+    loopback_device = platform_device_register_simple(DEVICE_NAME, PLATFORM_DEVID_NONE, NULL, 0);
+    if (IS_ERR(loopback_device)) {
+        platform_driver_unregister(&ipc_tunnel_driver);
+        return PTR_ERR(loopback_device);
+    }
+
+    return 0;
+}
+
+static void __exit ipc_tunnel_exit(void)
+{
+    platform_device_unregister(loopback_device);
+    platform_driver_unregister(&ipc_tunnel_driver);
 }
 
 module_init(ipc_tunnel_init);
 module_exit(ipc_tunnel_exit);
+#else
+module_platform_driver(ipc_tunnel_driver);
+#endif
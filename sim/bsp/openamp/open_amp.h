@@ -0,0 +1,7 @@
+#ifndef SIM_OPEN_AMP_H_
+#define SIM_OPEN_AMP_H_
+
+/* Simulation only runs the ipc_tunnel variant */
+struct rpmsg_device;
+
+#endif  // SIM_OPEN_AMP_H_
@@ -0,0 +1,13 @@
+#ifndef SIM_PLATFORM_INFO_H_
+#define SIM_PLATFORM_INFO_H_
+
+/* Maps the shared memory segment created by the Linux application and pins
+ * the firmware to the simulated CPU1 core.
+ */
+int platform_init(int argc, char *argv[], void **platform);
+void platform_cleanup(void *platform);
+
+/* Pins the calling thread to the simulated CPU1 core */
+void platform_pin_thread(void);
+
+#endif  // SIM_PLATFORM_INFO_H_
@@ -0,0 +1,6 @@
+#ifndef SIM_SLEEP_H_
+#define SIM_SLEEP_H_
+
+#include <unistd.h>
+
+#endif  // SIM_SLEEP_H_
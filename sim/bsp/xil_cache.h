@@ -0,0 +1,19 @@
+#ifndef SIM_XIL_CACHE_H_
+#define SIM_XIL_CACHE_H_
+
+#include "xil_types.h"
+
+/* Host caches are coherent, nothing to maintain */
+static inline void Xil_DCacheFlushRange(uintptr_t address, u32 length)
+{
+    (void)address;
+    (void)length;
+}
+
+static inline void Xil_DCacheInvalidateRange(uintptr_t address, u32 length)
+{
+    (void)address;
+    (void)length;
+}
+
+#endif  // SIM_XIL_CACHE_H_
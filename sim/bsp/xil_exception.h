@@ -0,0 +1,15 @@
+#ifndef SIM_XIL_EXCEPTION_H_
+#define SIM_XIL_EXCEPTION_H_
+
+#include "xil_types.h"
+#include "xpseudo_asm.h"
+
+#define XIL_EXCEPTION_FIQ 0x40u
+#define XIL_EXCEPTION_IRQ 0x80u
+#define XIL_EXCEPTION_ALL (XIL_EXCEPTION_FIQ | XIL_EXCEPTION_IRQ)
+
+/* No-ops, scheduler of the simulation calls the tasks from a thread */
+void Xil_ExceptionEnable(void);
+void Xil_ExceptionDisable(void);
+
+#endif  // SIM_XIL_EXCEPTION_H_
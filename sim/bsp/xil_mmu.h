@@ -0,0 +1,15 @@
+#ifndef SIM_XIL_MMU_H_
+#define SIM_XIL_MMU_H_
+
+#include "xil_types.h"
+
+#define NORM_WB_CACHE 0x15de6u
+
+/* Host memory is always cached */
+static inline void Xil_SetTlbAttributes(uintptr_t address, u32 attributes)
+{
+    (void)address;
+    (void)attributes;
+}
+
+#endif  // SIM_XIL_MMU_H_
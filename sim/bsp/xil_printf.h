@@ -0,0 +1,9 @@
+#ifndef SIM_XIL_PRINTF_H_
+#define SIM_XIL_PRINTF_H_
+
+#include <stdio.h>
+#include "xil_types.h"
+
+#define xil_printf printf
+
+#endif  // SIM_XIL_PRINTF_H_
@@ -0,0 +1,24 @@
+#ifndef SIM_XIL_TYPES_H_
+#define SIM_XIL_TYPES_H_
+
+/* Host stand-ins for the parts of the Xilinx standalone BSP used by the
+ * firmware. Only what src/, unit_tests/ and variants/ipc-tunnel-v3 need.
+ */
+
+#include <stdint.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+
+#ifndef TRUE
+#define TRUE 1u
+#endif
+
+#ifndef FALSE
+#define FALSE 0u
+#endif
+
+#endif  // SIM_XIL_TYPES_H_
@@ -0,0 +1,9 @@
+#ifndef SIM_XPARAMETERS_H_
+#define SIM_XPARAMETERS_H_
+
+#include "xil_types.h"
+
+#define XPAR_CPU_ID 1u
+#define XPAR_CPU_CORTEXA9_CORE_CLOCK_FREQ_HZ 666666687u
+
+#endif  // SIM_XPARAMETERS_H_
@@ -0,0 +1 @@
+#include "xparameters.h"
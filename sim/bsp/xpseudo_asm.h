@@ -0,0 +1,16 @@
+#ifndef SIM_XPSEUDO_ASM_H_
+#define SIM_XPSEUDO_ASM_H_
+
+#include "xil_types.h"
+
+/* Simulated CPU1 has no interrupts, only the mask bits of CPSR are kept */
+extern u32 g_simCpsr;
+
+#define mfcpsr() (g_simCpsr)
+#define mtcpsr(v) (g_simCpsr = (v))
+
+#define dsb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define dmb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define isb() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+#endif  // SIM_XPSEUDO_ASM_H_
@@ -0,0 +1 @@
+#include "xpseudo_asm.h"
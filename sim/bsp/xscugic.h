@@ -0,0 +1,16 @@
+#ifndef SIM_XSCUGIC_H_
+#define SIM_XSCUGIC_H_
+
+#include "xil_types.h"
+#include "ipc_tunnel_sim.h"
+
+/* SGI writes go to the start of the shared memory segment. CPU0 side finds
+ * the pending tunnels from the doorbell instead.
+ */
+#define XPAR_PS7_SCUGIC_0_DIST_BASEADDR (IPC_TUNNEL_SIM_BASE + IPC_TUNNEL_SIM_GIC_OFFSET)
+
+#define XSCUGIC_SFI_TRIG_OFFSET 0x00000F00u
+#define XSCUGIC_SFI_TRIG_CPU_MASK 0x00FF0000u
+#define XSCUGIC_SFI_TRIG_INTID_MASK 0x0000000Fu
+
+#endif  // SIM_XSCUGIC_H_
@@ -0,0 +1,24 @@
+#ifndef SIM_XTIME_L_H_
+#define SIM_XTIME_L_H_
+
+#include <time.h>
+#include "xil_types.h"
+#include "xparameters.h"
+
+typedef u64 XTime;
+
+/* Same rate as the Zynq global timer so the timestamps can be compared with
+ * the global_timer clock of the Linux application, which uses the same
+ * CLOCK_MONOTONIC_RAW fallback outside Zynq.
+ */
+#define COUNTS_PER_SECOND (XPAR_CPU_CORTEXA9_CORE_CLOCK_FREQ_HZ / 2u)
+
+static inline void XTime_GetTime(XTime* xtime)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    *xtime = ((XTime)ts.tv_sec * XPAR_CPU_CORTEXA9_CORE_CLOCK_FREQ_HZ
+            + (XTime)ts.tv_nsec * XPAR_CPU_CORTEXA9_CORE_CLOCK_FREQ_HZ / 1000000000u) / 2u;
+}
+
+#endif  // SIM_XTIME_L_H_
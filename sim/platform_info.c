@@ -0,0 +1,140 @@
+#include "platform_info.h"
+#include "ipc_tunnel_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <xpseudo_asm.h>
+#include <xil_exception.h>
+
+u32 g_simCpsr = 0;
+
+void Xil_ExceptionEnable(void)
+{
+}
+
+void Xil_ExceptionDisable(void)
+{
+}
+
+static int f_simCpu = -1;
+
+/* Waits until the Linux application has created the segment and given it its size */
+static int OpenSegment(void)
+{
+    bool waiting = false;
+
+    for (;;) {
+        int fd = shm_open(IPC_TUNNEL_SIM_SHM_NAME, O_RDWR, 0);
+        if (fd >= 0) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size >= (off_t)IPC_TUNNEL_SIM_SIZE) {
+                return fd;
+            }
+            close(fd);
+        }
+        else if (errno != ENOENT) {
+            perror("shm_open failed");
+            return -1;
+        }
+
+        if (!waiting) {
+            printf("Waiting for the Linux application to create %s\r\n", IPC_TUNNEL_SIM_SHM_NAME);
+            waiting = true;
+        }
+        usleep(10000);
+    }
+}
+
+/* Descriptors hold 32 bit physical addresses, the segment must be mapped
+ * exactly where CPU0 says it is
+ */
+static void* MapSegment(int fd)
+{
+    void* address = (void*)(uintptr_t)IPC_TUNNEL_SIM_BASE;
+    int flags = MAP_SHARED;
+
+#ifdef MAP_FIXED_NOREPLACE
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+
+    void* ptr = mmap(address, IPC_TUNNEL_SIM_SIZE, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap failed");
+        return NULL;
+    }
+
+    if (ptr != address) {
+        fprintf(stderr, "Address 0x%x is in use, can't map the segment\r\n", IPC_TUNNEL_SIM_BASE);
+        munmap(ptr, IPC_TUNNEL_SIM_SIZE);
+        return NULL;
+    }
+
+    return ptr;
+}
+
+static int SelectCpu(void)
+{
+    const char* env = getenv(IPC_TUNNEL_SIM_CPU_ENV);
+    if (env) {
+        return atoi(env);
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 1 ? (int)cpus - 1 : 0;
+}
+
+void platform_pin_thread(void)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(f_simCpu, &set);
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        fprintf(stderr, "Pinning to CPU %d failed: %d\r\n", f_simCpu, ret);
+    }
+}
+
+int platform_init(int argc, char *argv[], void **platform)
+{
+    (void)argc;
+    (void)argv;
+
+    *platform = NULL;
+
+    f_simCpu = SelectCpu();
+    platform_pin_thread();
+
+    int fd = OpenSegment();
+    if (fd < 0) {
+        return -1;
+    }
+
+    void* segment = MapSegment(fd);
+    close(fd);
+    if (!segment) {
+        return -1;
+    }
+
+    printf("Simulated CPU1 on host CPU %d\r\n", f_simCpu);
+
+    *platform = segment;
+    return 0;
+}
+
+void platform_cleanup(void *platform)
+{
+    if (platform) {
+        munmap(platform, IPC_TUNNEL_SIM_SIZE);
+    }
+}
@@ -0,0 +1,128 @@
+#include "scheduler.h"
+#include "platform_info.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <xil_printf.h>
+
+/* Host version of the scheduler. A thread pinned next to the firmware runs
+ * T0 from an absolute clock_nanosleep period. T1 and T2 are run after T0 on
+ * the same thread instead of from nested SGI handlers, so they delay the next
+ * T0 instead of being preempted by it.
+ *
+ * Command SGIs aren't simulated: the Linux side of the simulation doesn't
+ * set cpu1-notify, so commandSGI and urgentCommandSGI stay -1.
+ */
+
+#define NS_PER_SECOND 1000000000L
+
+static pthread_t f_thread;
+static bool f_threadStarted = false;
+static volatile bool f_running = false;
+
+static SchedulerConfig_t f_config;
+
+static void AddNs(struct timespec* ts, long ns)
+{
+    ts->tv_nsec += ns;
+    while (ts->tv_nsec >= NS_PER_SECOND) {
+        ts->tv_nsec -= NS_PER_SECOND;
+        ts->tv_sec += 1;
+    }
+}
+
+static bool IsBefore(const struct timespec* a, const struct timespec* b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void* SchedulerThread(void* userData)
+{
+    uint32_t t1Counter = 0;
+    uint32_t t2Counter = 0;
+    long periodNs = NS_PER_SECOND / f_config.t0Frequency;
+    struct timespec next;
+    struct timespec now;
+
+    (void)userData;
+
+    platform_pin_thread();
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (f_running) {
+        AddNs(&next, periodNs);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        f_config.t0Task();
+
+        ++t1Counter;
+        ++t2Counter;
+        if (t1Counter == f_config.t1Multiplier) {
+            t1Counter = 0;
+            f_config.t1Task();
+        }
+
+        if (t2Counter == f_config.t2Multiplier) {
+            t2Counter = 0;
+            f_config.t2Task();
+        }
+
+        /* Timer interrupt stays pending only once, missed periods are dropped */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (IsBefore(&next, &now)) {
+            next = now;
+        }
+    }
+
+    return NULL;
+}
+
+void SCHEDULER_Init(const SchedulerConfig_t* conf)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    int ret;
+
+    f_config = *conf;
+    f_running = true;
+
+    /* Real-time priority keeps the background loop from delaying T0 like
+     * the interrupt priorities do on the board
+     */
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+    pthread_attr_setschedparam(&attr, &param);
+
+    ret = pthread_create(&f_thread, &attr, &SchedulerThread, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0) {
+        xil_printf("SCHED_FIFO not permitted, T0 timing will jitter\r\n");
+        ret = pthread_create(&f_thread, NULL, &SchedulerThread, NULL);
+    }
+
+    if (ret != 0) {
+        xil_printf("Creating the scheduler thread failed: %d\r\n", ret);
+        f_running = false;
+        return;
+    }
+
+    f_threadStarted = true;
+}
+
+void SCHEDULER_Stop(void)
+{
+    f_running = false;
+
+    if (f_threadStarted) {
+        pthread_join(f_thread, NULL);
+        f_threadStarted = false;
+    }
+}
@@ -8,26 +8,14 @@
 #include <xil_printf.h>
 
 #include "variant.h"
+#include "commands.h"
 #include "shared_state.h"
 
-static uint64_t GlobalTimer() {
-    uint32_t low, high;
-    
-    do {
-        high = *(volatile uint32_t*)(GLOBAL_TMR_BASEADDR + GTIMER_COUNTER_UPPER_OFFSET);
-        low = *(volatile uint32_t*)(GLOBAL_TMR_BASEADDR + GTIMER_COUNTER_LOWER_OFFSET);
-    } while (*(volatile uint32_t*)(GLOBAL_TMR_BASEADDR + GTIMER_COUNTER_UPPER_OFFSET) != high);
-    return (((uint64_t) high) << 32u) | (uint64_t) low;
-}
-
-uint8_t f_t0PacketBuffer[0x780] __attribute__ ((aligned (8)));
-uint8_t f_t1PacketBuffer[0x780] __attribute__ ((aligned (8)));
-uint8_t f_t2PacketBuffer[0x780] __attribute__ ((aligned (8)));
-
 static volatile bool f_running = true;
 
 
-static SharedState_T0DataPacket s_t0Packet;
+/* Sent in the T0 packet, which is built in the ring */
+static SharedState_TimeLevelStats s_t0Stats;
 static SharedState_T1DataPacket s_t1Packet;
 static SharedState_T2DataPacket s_t2Packet;
 
@@ -37,8 +25,8 @@ static void HandleT0Packet(uint8_t* data, uint32_t size, void* user)
 {
     uint64_t receiveTime = GlobalTimer();
     SharedState_T0CommandPacket* packet = (SharedState_T0CommandPacket*)data;
-    s_t0Packet.stats.commandPacketId = packet->packetId;
-    s_t0Packet.stats.commandPacketLatency = receiveTime - packet->timestamp;
+    s_t0Stats.commandPacketId = packet->packetId;
+    s_t0Stats.commandPacketLatency = receiveTime - packet->timestamp;
     s_variables.lastSetPacketId  = packet->packetId;
     s_variables.lastSetReceiveTimestamp = receiveTime;
     s_variables.lastSetSendTimestamp = packet->timestamp;
@@ -70,30 +58,14 @@ static void HandleT0Packet(uint8_t* data, uint32_t size, void* user)
     }
 }
 
-static void HandleT1Packet(uint8_t* data, uint32_t size, void* user)
-{
-    uint64_t receiveTime = GlobalTimer();
-    SharedState_T1CommandPacket* packet = (SharedState_T1CommandPacket*)data;
-    
-    s_t1Packet.stats.commandPacketId = packet->packetId;
-    s_t1Packet.stats.commandPacketLatency = receiveTime - packet->timestamp;
-}
-
-static void HandleT2Packet(uint8_t* data, uint32_t size, void* user)
-{
-    uint64_t receiveTime = GlobalTimer();
-    SharedState_T2CommandPacket* packet = (SharedState_T2CommandPacket*)data;
-    
-    s_t2Packet.stats.commandPacketId = packet->packetId;
-    s_t2Packet.stats.commandPacketLatency = receiveTime - packet->timestamp;
-}
-
 bool APPLICATION_Init(void)
 {
     xil_printf("WORKLOAD_Init\r\n");
-    memset(&s_t0Packet, 0, sizeof(s_t0Packet));
+    memset(&s_t0Stats, 0, sizeof(s_t0Stats));
     memset(&s_t1Packet, 0, sizeof(s_t1Packet));
     memset(&s_t2Packet, 0, sizeof(s_t2Packet));
+
+    COMMANDS_Init(&HandleT0Packet);
     return true;
 }
 
@@ -105,7 +77,7 @@ void APPLICATION_T0(void)
     s_t0StartTime = GlobalTimer();
     
     if (f_t0InitDone) {
-        VARIANT_ReadChan0(f_t0PacketBuffer, sizeof(f_t0PacketBuffer), &HandleT0Packet, NULL);
+        COMMANDS_ReadT0();
     }
     
     WORKLOAD_T0();
@@ -113,19 +85,29 @@ void APPLICATION_T0(void)
     // Skip actual work during the initial run because its timing may not be as precise
     if (f_t0InitDone) {
         
-        memmove(&s_t0Packet.stats.timeLevelStartTimes[1], &s_t0Packet.stats.timeLevelStartTimes[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
-        memmove(&s_t0Packet.stats.timeLevelDurations[1], &s_t0Packet.stats.timeLevelDurations[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
-        s_t0Packet.timestamp = GlobalTimer();
-        s_t0Packet.stats.timeLevelStartTimes[0] = s_t0StartTime;
-        s_t0Packet.stats.timeLevelDurations[0] = s_t0Packet.timestamp - s_t0StartTime;
-        s_t0Packet.variables = s_variables;
+        memmove(&s_t0Stats.timeLevelStartTimes[1], &s_t0Stats.timeLevelStartTimes[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
+        memmove(&s_t0Stats.timeLevelDurations[1], &s_t0Stats.timeLevelDurations[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
+        s_t0Stats.timeLevelStartTimes[0] = s_t0StartTime;
+        
+        /* Variables are copied once, straight to the ring */
+        SharedState_T0DataPacket* packet = (SharedState_T0DataPacket*)VARIANT_ReserveChan0(sizeof(SharedState_T0DataPacket));
+        if (packet) {
+            packet->variables = s_variables;
+        }
+        
+        uint64_t sendTime = GlobalTimer();
+        s_t0Stats.timeLevelDurations[0] = sendTime - s_t0StartTime;
+        if (packet) {
+            packet->timestamp = sendTime;
+            packet->stats = s_t0Stats;
+        }
         
-        if (!VARIANT_WriteChan0((const uint8_t*)&s_t0Packet, sizeof(s_t0Packet))) {
-            s_t0Packet.stats.totalDroppedPackets += 1;
+        if (!packet || !VARIANT_CommitChan0()) {
+            s_t0Stats.totalDroppedPackets += 1;
         }
     
-        s_t0Packet.stats.iterationNumber += 1;
-        s_t0Packet.stats.lastPacketSendTime = GlobalTimer() - s_t0Packet.timestamp;
+        s_t0Stats.iterationNumber += 1;
+        s_t0Stats.lastPacketSendTime = GlobalTimer() - sendTime;
     }
     else {
         f_t0InitDone = true;
@@ -137,7 +119,7 @@ void APPLICATION_T1(void)
     uint64_t startTime = GlobalTimer();
     WORKLOAD_T1();
     
-    VARIANT_ReadChan1(f_t1PacketBuffer, sizeof(f_t1PacketBuffer), &HandleT1Packet, NULL);
+    COMMANDS_UpdateStats(1, &s_t1Packet.stats);
     
     memmove(&s_t1Packet.stats.timeLevelStartTimes[1], &s_t1Packet.stats.timeLevelStartTimes[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
     memmove(&s_t1Packet.stats.timeLevelDurations[1], &s_t1Packet.stats.timeLevelDurations[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
@@ -158,7 +140,7 @@ void APPLICATION_T2(void)
     uint64_t startTime = GlobalTimer();
     WORKLOAD_T2();
     
-    VARIANT_ReadChan2(f_t2PacketBuffer, sizeof(f_t2PacketBuffer), &HandleT2Packet, NULL);
+    COMMANDS_UpdateStats(2, &s_t2Packet.stats);
     
     memmove(&s_t2Packet.stats.timeLevelStartTimes[1], &s_t2Packet.stats.timeLevelStartTimes[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
     memmove(&s_t2Packet.stats.timeLevelDurations[1], &s_t2Packet.stats.timeLevelDurations[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
@@ -174,6 +156,16 @@ void APPLICATION_T2(void)
     s_t2Packet.stats.lastPacketSendTime = GlobalTimer() - s_t2Packet.timestamp;
 }
 
+bool APPLICATION_Commands(void)
+{
+    return COMMANDS_Read(false);
+}
+
+bool APPLICATION_UrgentCommands(void)
+{
+    return COMMANDS_Read(true);
+}
+
 void APPLICATION_BG(void)
 {
 	WORKLOAD_BG();
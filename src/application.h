@@ -8,6 +8,13 @@ void APPLICATION_T0(void);
 void APPLICATION_T1(void);
 void APPLICATION_T2(void);
 
+/* Read the commands of the channels Linux interrupts CPU1 for, from the
+ * software interrupts of SchedulerConfig_t. Return true if a time or packet
+ * budget left commands in a channel.
+ */
+bool APPLICATION_Commands(void);
+bool APPLICATION_UrgentCommands(void);
+
 void APPLICATION_BG(void);
 
 bool APPLICATION_Running(void);
@@ -8,25 +8,21 @@
 #include <xil_printf.h>
 #include <xpseudo_asm_gcc.h>
 #include "variant.h"
+#include "commands.h"
 #include "shared_state.h"
+#include "ipc_snapshot.h"
 
-static uint64_t GlobalTimer() {
-    uint32_t low, high;
-    
-    do {
-        high = *(volatile uint32_t*)(GLOBAL_TMR_BASEADDR + GTIMER_COUNTER_UPPER_OFFSET);
-        low = *(volatile uint32_t*)(GLOBAL_TMR_BASEADDR + GTIMER_COUNTER_LOWER_OFFSET);
-    } while (*(volatile uint32_t*)(GLOBAL_TMR_BASEADDR + GTIMER_COUNTER_UPPER_OFFSET) != high);
-    return (((uint64_t) high) << 32u) | (uint64_t) low;
-}
-
-uint8_t f_t0PacketBuffer[0x780] __attribute__ ((aligned (8)));
-uint8_t f_t1PacketBuffer[0x780] __attribute__ ((aligned (8)));
-uint8_t f_t2PacketBuffer[0x780] __attribute__ ((aligned (8)));
+/* SHARED_STATE_SNAPSHOT publishes the T0 variables through the triple buffer
+ * of ipc_snapshot.h instead of the seqlock of SharedState_T0SharedMemory
+ */
+#ifndef SHARED_STATE_SNAPSHOT
+#define SHARED_STATE_SNAPSHOT 0
+#endif
 
 static volatile bool f_running = true;
 
-static SharedState_T0ShmDataPacket s_t0Packet;
+/* Sent in the T0 packet, which is built in the ring */
+static SharedState_TimeLevelStats s_t0Stats;
 static SharedState_T1DataPacket s_t1Packet;
 static SharedState_T2DataPacket s_t2Packet;
 
@@ -36,8 +32,8 @@ static void HandleT0Packet(uint8_t* data, uint32_t size, void* user)
 {
     uint64_t receiveTime = GlobalTimer();
     SharedState_T0CommandPacket* packet = (SharedState_T0CommandPacket*)data;
-    s_t0Packet.stats.commandPacketId = packet->packetId;
-    s_t0Packet.stats.commandPacketLatency = receiveTime - packet->timestamp;
+    s_t0Stats.commandPacketId = packet->packetId;
+    s_t0Stats.commandPacketLatency = receiveTime - packet->timestamp;
     s_variables.lastSetPacketId  = packet->packetId;
     s_variables.lastSetReceiveTimestamp = receiveTime;
     s_variables.lastSetSendTimestamp = packet->timestamp;
@@ -69,33 +65,30 @@ static void HandleT0Packet(uint8_t* data, uint32_t size, void* user)
     }
 }
 
-static void HandleT1Packet(uint8_t* data, uint32_t size, void* user)
-{
-    uint64_t receiveTime = GlobalTimer();
-    SharedState_T1CommandPacket* packet = (SharedState_T1CommandPacket*)data;
-    
-    s_t1Packet.stats.commandPacketId = packet->packetId;
-    s_t1Packet.stats.commandPacketLatency = receiveTime - packet->timestamp;
-}
-
-static void HandleT2Packet(uint8_t* data, uint32_t size, void* user)
-{
-    uint64_t receiveTime = GlobalTimer();
-    SharedState_T2CommandPacket* packet = (SharedState_T2CommandPacket*)data;
-    
-    s_t2Packet.stats.commandPacketId = packet->packetId;
-    s_t2Packet.stats.commandPacketLatency = receiveTime - packet->timestamp;
-}
-
+#if SHARED_STATE_SNAPSHOT
+static IpcSnapshot_t* f_snapshot = 0;
+#else
 static SharedState_T0SharedMemory* f_shm = 0;
+#endif
 
 bool APPLICATION_Init(void)
 {
     xil_printf("APPLICATION_Init\r\n");
-    memset(&s_t0Packet, 0, sizeof(s_t0Packet));
+    memset(&s_t0Stats, 0, sizeof(s_t0Stats));
     memset(&s_t1Packet, 0, sizeof(s_t1Packet));
     memset(&s_t2Packet, 0, sizeof(s_t2Packet));
+
+    COMMANDS_Init(&HandleT0Packet);
     
+#if SHARED_STATE_SNAPSHOT
+    f_snapshot = VARIANT_T0Snapshot(sizeof(SharedState_T0Snapshot));
+    if (!f_snapshot) {
+        xil_printf("SHARED MEMORY UNAVAILABLE\r\n");
+        return false;
+    }
+
+    IPC_SNAPSHOT_Init(f_snapshot, sizeof(SharedState_T0Snapshot));
+#else
     if (VARIANT_T0ShmSize() < sizeof(SharedState_T0SharedMemory) || VARIANT_T0Shm() == 0) {
         xil_printf("SHARED MEMORY UNAVAILABLE\r\n");
         return false;
@@ -104,6 +97,7 @@ bool APPLICATION_Init(void)
     f_shm = (SharedState_T0SharedMemory*)VARIANT_T0Shm();
     memset(f_shm, 0, sizeof(*f_shm));
     __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
     return true;
 }
 
@@ -128,7 +122,7 @@ void APPLICATION_T0(void)
     s_t0StartTime = GlobalTimer();
     
     if (f_t0InitDone) {
-        VARIANT_ReadChan0(f_t0PacketBuffer, sizeof(f_t0PacketBuffer), &HandleT0Packet, NULL);
+        COMMANDS_ReadT0();
     }
     
     WORKLOAD_T0();
@@ -136,32 +130,48 @@ void APPLICATION_T0(void)
     ++f_t0PacketSendCounter;
     // Skip actual work during the initial run because its timing may not be as precise
     if (f_t0InitDone) {
-        memmove(&s_t0Packet.stats.timeLevelStartTimes[1], &s_t0Packet.stats.timeLevelStartTimes[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
-        memmove(&s_t0Packet.stats.timeLevelDurations[1], &s_t0Packet.stats.timeLevelDurations[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
-        s_t0Packet.stats.timeLevelStartTimes[0] = s_t0StartTime;
+        memmove(&s_t0Stats.timeLevelStartTimes[1], &s_t0Stats.timeLevelStartTimes[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
+        memmove(&s_t0Stats.timeLevelDurations[1], &s_t0Stats.timeLevelDurations[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
+        s_t0Stats.timeLevelStartTimes[0] = s_t0StartTime;
 
         uint64_t shmUpdateStart = GlobalTimer();
+#if SHARED_STATE_SNAPSHOT
+        SharedState_T0Snapshot* snapshot = (SharedState_T0Snapshot*)IPC_SNAPSHOT_BeginWrite(f_snapshot);
+        snapshot->timestamp = shmUpdateStart;
+        snapshot->prevUpdateTime = f_prevShmCopyTime;
+        snapshot->vars = s_variables;
+        if (IPC_SNAPSHOT_EndWrite(f_snapshot)) {
+            /* Linux sleeps until this snapshot */
+            VARIANT_NotifyChan0();
+        }
+#else
         ATOMIC_INCREASE_COUNTER1;
         f_shm->timestamp = shmUpdateStart;
         f_shm->prevUpdateTime = f_prevShmCopyTime;
         f_shm->vars = s_variables;
         ATOMIC_INCREASE_COUNTER2;
+#endif
         uint64_t endTime = GlobalTimer();
 
         f_prevShmCopyTime = endTime - shmUpdateStart;
-        s_t0Packet.stats.timeLevelDurations[0] = endTime - s_t0StartTime;
+        s_t0Stats.timeLevelDurations[0] = endTime - s_t0StartTime;
 
         if (f_t0PacketSendCounter == T0_PACKET_SEND_DELAY) {
             f_t0PacketSendCounter = 0;
-            s_t0Packet.timestamp = endTime;
             
-            if (!VARIANT_WriteChan0((const uint8_t*)&s_t0Packet, sizeof(s_t0Packet))) {
-                s_t0Packet.stats.totalDroppedPackets += 1;
+            SharedState_T0ShmDataPacket* packet = (SharedState_T0ShmDataPacket*)VARIANT_ReserveChan0(sizeof(SharedState_T0ShmDataPacket));
+            if (packet) {
+                packet->timestamp = endTime;
+                packet->stats = s_t0Stats;
             }
-            s_t0Packet.stats.lastPacketSendTime = GlobalTimer() - s_t0Packet.timestamp;
+            
+            if (!packet || !VARIANT_CommitChan0()) {
+                s_t0Stats.totalDroppedPackets += 1;
+            }
+            s_t0Stats.lastPacketSendTime = GlobalTimer() - endTime;
         }
 
-        s_t0Packet.stats.iterationNumber += 1;
+        s_t0Stats.iterationNumber += 1;
     }
     else {
         f_t0InitDone = true;
@@ -173,7 +183,7 @@ void APPLICATION_T1(void)
     uint64_t startTime = GlobalTimer();
     WORKLOAD_T1();
     
-    VARIANT_ReadChan1(f_t1PacketBuffer, sizeof(f_t1PacketBuffer), &HandleT1Packet, NULL);
+    COMMANDS_UpdateStats(1, &s_t1Packet.stats);
     
     memmove(&s_t1Packet.stats.timeLevelStartTimes[1], &s_t1Packet.stats.timeLevelStartTimes[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
     memmove(&s_t1Packet.stats.timeLevelDurations[1], &s_t1Packet.stats.timeLevelDurations[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
@@ -194,7 +204,7 @@ void APPLICATION_T2(void)
     uint64_t startTime = GlobalTimer();
     WORKLOAD_T2();
     
-    VARIANT_ReadChan2(f_t2PacketBuffer, sizeof(f_t2PacketBuffer), &HandleT2Packet, NULL);
+    COMMANDS_UpdateStats(2, &s_t2Packet.stats);
     
     memmove(&s_t2Packet.stats.timeLevelStartTimes[1], &s_t2Packet.stats.timeLevelStartTimes[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
     memmove(&s_t2Packet.stats.timeLevelDurations[1], &s_t2Packet.stats.timeLevelDurations[0], sizeof(uint32_t) * (SHAREDSTATE_BACKLOG - 1));
@@ -210,6 +220,16 @@ void APPLICATION_T2(void)
     s_t2Packet.stats.lastPacketSendTime = GlobalTimer() - s_t2Packet.timestamp;
 }
 
+bool APPLICATION_Commands(void)
+{
+    return COMMANDS_Read(false);
+}
+
+bool APPLICATION_UrgentCommands(void)
+{
+    return COMMANDS_Read(true);
+}
+
 void APPLICATION_BG(void)
 {
 	WORKLOAD_BG();
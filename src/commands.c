@@ -0,0 +1,167 @@
+#include "commands.h"
+#include <stddef.h>
+#include <xpseudo_asm.h>
+#include <xil_exception.h>
+
+static uint8_t f_t1PacketBuffer[0x780] __attribute__ ((aligned (8)));
+static uint8_t f_t2PacketBuffer[0x780] __attribute__ ((aligned (8)));
+
+static VARIANT_ReadCallback f_t0Handler = 0;
+
+/* Channels Linux interrupts CPU1 for after writing commands. They are read
+ * by COMMANDS_Read instead of the tasks.
+ */
+static uint32_t f_commandChannels = 0;
+static uint32_t f_urgentCommandChannels = 0;
+
+/* Latest T1/T2 command read by a command interrupt. The interrupt can
+ * preempt the task while it sends its packet, so only the task writes the
+ * packet and takes these over with interrupts masked.
+ */
+typedef struct {
+    uint16_t packetId;
+    uint32_t latency;
+} CommandStats_t;
+
+static volatile CommandStats_t f_t1Command;
+static volatile CommandStats_t f_t2Command;
+
+static bool IsTaskChannel(uint32_t channel)
+{
+    return ((f_commandChannels | f_urgentCommandChannels) & (1u << channel)) == 0;
+}
+
+void COMMANDS_Init(VARIANT_ReadCallback t0Handler)
+{
+    int sgi;
+
+    f_t0Handler = t0Handler;
+    f_commandChannels = VARIANT_CommandChannels(false, &sgi);
+    f_urgentCommandChannels = VARIANT_CommandChannels(true, &sgi);
+}
+
+void COMMANDS_ReadT0(void)
+{
+    if (IsTaskChannel(0)) {
+        VARIANT_ReadBatchChan0(NULL, 0, f_t0Handler, NULL, T0_COMMAND_BATCH, T0_COMMAND_BUDGET_US);
+    }
+}
+
+/* Commands are handled with nested interrupts, T0 must not see half of one */
+static void HandleT0Command(uint8_t* data, uint32_t size, void* user)
+{
+    uint32_t cpsr = mfcpsr();
+    mtcpsr(cpsr | XIL_EXCEPTION_ALL);
+    f_t0Handler(data, size, user);
+    mtcpsr(cpsr);
+}
+
+static void HandleT1Packet(uint8_t* data, uint32_t size, void* user)
+{
+    uint64_t receiveTime = GlobalTimer();
+    SharedState_T1CommandPacket* packet = (SharedState_T1CommandPacket*)data;
+    SharedState_TimeLevelStats* stats = (SharedState_TimeLevelStats*)user;
+
+    stats->commandPacketId = packet->packetId;
+    stats->commandPacketLatency = receiveTime - packet->timestamp;
+}
+
+static void HandleT2Packet(uint8_t* data, uint32_t size, void* user)
+{
+    uint64_t receiveTime = GlobalTimer();
+    SharedState_T2CommandPacket* packet = (SharedState_T2CommandPacket*)data;
+    SharedState_TimeLevelStats* stats = (SharedState_TimeLevelStats*)user;
+
+    stats->commandPacketId = packet->packetId;
+    stats->commandPacketLatency = receiveTime - packet->timestamp;
+}
+
+static void HandleCommand(volatile CommandStats_t* command, uint16_t packetId, uint64_t timestamp)
+{
+    uint64_t receiveTime = GlobalTimer();
+    uint32_t cpsr = mfcpsr();
+    mtcpsr(cpsr | XIL_EXCEPTION_ALL);
+    command->packetId = packetId;
+    command->latency = receiveTime - timestamp;
+    mtcpsr(cpsr);
+}
+
+static void HandleT1Command(uint8_t* data, uint32_t size, void* user)
+{
+    const SharedState_T1CommandPacket* packet = (const SharedState_T1CommandPacket*)data;
+    HandleCommand(&f_t1Command, packet->packetId, packet->timestamp);
+}
+
+static void HandleT2Command(uint8_t* data, uint32_t size, void* user)
+{
+    const SharedState_T2CommandPacket* packet = (const SharedState_T2CommandPacket*)data;
+    HandleCommand(&f_t2Command, packet->packetId, packet->timestamp);
+}
+
+static void TakeCommand(volatile CommandStats_t* command, SharedState_TimeLevelStats* stats)
+{
+    uint32_t cpsr = mfcpsr();
+    mtcpsr(cpsr | XIL_EXCEPTION_ALL);
+    stats->commandPacketId = command->packetId;
+    stats->commandPacketLatency = command->latency;
+    mtcpsr(cpsr);
+}
+
+void COMMANDS_UpdateStats(uint32_t channel, SharedState_TimeLevelStats* stats)
+{
+    if (channel == 1) {
+        if (IsTaskChannel(1)) {
+            VARIANT_ReadChan1(f_t1PacketBuffer, sizeof(f_t1PacketBuffer), &HandleT1Packet, stats);
+        }
+        else {
+            TakeCommand(&f_t1Command, stats);
+        }
+    }
+    else if (channel == 2) {
+        if (IsTaskChannel(2)) {
+            VARIANT_ReadChan2(f_t2PacketBuffer, sizeof(f_t2PacketBuffer), &HandleT2Packet, stats);
+        }
+        else {
+            TakeCommand(&f_t2Command, stats);
+        }
+    }
+}
+
+/* Returns true if the batch or the time budget ran out before the ring did */
+static bool IsCommandBudgetUsed(uint32_t count, uint64_t startTime)
+{
+    return count == COMMAND_BATCH
+        || GlobalTimer() - startTime >= (uint64_t)COMMAND_BUDGET_US * (COUNTS_PER_SECOND / 1000000u);
+}
+
+/* Acknowledges before reading, commands written after the ack interrupt
+ * again. Returns true if commands may have been left in a channel.
+ */
+bool COMMANDS_Read(bool urgent)
+{
+    uint32_t channels = urgent ? f_urgentCommandChannels : f_commandChannels;
+    bool left = false;
+    uint64_t startTime;
+    uint32_t count;
+
+    if (channels & (1u << 0)) {
+        VARIANT_AckCommand(0);
+        startTime = GlobalTimer();
+        count = VARIANT_ReadBatchChan0(NULL, 0, &HandleT0Command, NULL, COMMAND_BATCH, COMMAND_BUDGET_US);
+        left |= IsCommandBudgetUsed(count, startTime);
+    }
+    if (channels & (1u << 1)) {
+        VARIANT_AckCommand(1);
+        startTime = GlobalTimer();
+        count = VARIANT_ReadBatchChan1(NULL, 0, &HandleT1Command, NULL, COMMAND_BATCH, COMMAND_BUDGET_US);
+        left |= IsCommandBudgetUsed(count, startTime);
+    }
+    if (channels & (1u << 2)) {
+        VARIANT_AckCommand(2);
+        startTime = GlobalTimer();
+        count = VARIANT_ReadBatchChan2(NULL, 0, &HandleT2Command, NULL, COMMAND_BATCH, COMMAND_BUDGET_US);
+        left |= IsCommandBudgetUsed(count, startTime);
+    }
+
+    return left;
+}
@@ -0,0 +1,51 @@
+#ifndef COMMANDS_H_
+#define COMMANDS_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include <xtime_l.h>
+
+#include "variant.h"
+#include "shared_state.h"
+
+/* Commands Linux sends to the time levels. Channels Linux interrupts CPU1
+ * for are read by the command interrupts, the rest by the tasks, so every
+ * channel has a single reader. Shared by the application entry points.
+ */
+
+/* T0 handles every pending command each cycle, within a part of the 50 us period */
+#define T0_COMMAND_BATCH 8u
+#define T0_COMMAND_BUDGET_US 10u
+
+/* Command interrupts read at most this much per channel, the rest is left
+ * for the next T0 tick to raise the interrupt again
+ */
+#define COMMAND_BATCH VARIANT_MAX_BATCH
+#define COMMAND_BUDGET_US 10u
+
+/* XTime_GetTime reads the global timer */
+static inline uint64_t GlobalTimer(void) {
+    XTime time;
+    XTime_GetTime(&time);
+    return time;
+}
+
+/* Reads the channels of the command interrupts from the variant. t0Handler
+ * applies one T0 command packet, the interrupts call it with interrupts
+ * masked so T0 never sees half of one.
+ */
+void COMMANDS_Init(VARIANT_ReadCallback t0Handler);
+
+/* From T0: reads the pending T0 commands unless an interrupt reads them */
+void COMMANDS_ReadT0(void);
+
+/* From T1/T2: sets the id and latency of the latest command of channel to
+ * stats. Reads one packet of the channel, or takes over what the command
+ * interrupt read with interrupts masked, so the packet is only written by
+ * the task.
+ */
+void COMMANDS_UpdateStats(uint32_t channel, SharedState_TimeLevelStats* stats);
+
+/* From the command interrupts, see APPLICATION_Commands */
+bool COMMANDS_Read(bool urgent);
+
+#endif  // COMMANDS_H_
@@ -70,10 +70,16 @@ typedef enum {
     /* Timer or PWM interrupt for T0 */
     INTERRUPT_PRIORITY_T0 = 1 << INTERRUPT_PRIORITY_SHIFT,
 
+    /* SGI raised by Linux for commands of cpu1-urgent tunnels, preempts T1 and T2 */
+    INTERRUPT_PRIORITY_URGENT_COMMAND = 2 << INTERRUPT_PRIORITY_SHIFT,
+
     /* SGI interrupt for T1*/
-    INTERRUPT_PRIORITY_T1 = 2 << INTERRUPT_PRIORITY_SHIFT,
+    INTERRUPT_PRIORITY_T1 = 3 << INTERRUPT_PRIORITY_SHIFT,
+
+    INTERRUPT_PRIORITY_T2 = 4 << INTERRUPT_PRIORITY_SHIFT,
 
-    INTERRUPT_PRIORITY_T2 = 3 << INTERRUPT_PRIORITY_SHIFT,
+    /* SGI raised by Linux for commands of cpu1-notify tunnels */
+    INTERRUPT_PRIORITY_COMMAND = 5 << INTERRUPT_PRIORITY_SHIFT,
 
     /* when timer is used to provide T0 scheduling, timer interrupt has this priority */
     INTERRUPT_PRIORITY_SCHEDULER_TIMER = 0,
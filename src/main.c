@@ -6,6 +6,7 @@
 #include "platform_info.h"
 #include <xil_printf.h>
 #include <xtime_l.h>
+#include <xil_exception.h>
 #include <sleep.h>
 
 #include "variant.h"
@@ -19,14 +20,20 @@
 static uint64_t totalReceiveTime = 0;
 
 
-static const SchedulerConfig_t f_schedulerConfig = {
+/* Command SGIs are filled from the variant in Execute */
+static SchedulerConfig_t f_schedulerConfig = {
     .t0Frequency = 20000,
     .t1Multiplier = 4,
     .t2Multiplier = 20,
     
     .t0Task = &APPLICATION_T0,
     .t1Task = &APPLICATION_T1,
-    .t2Task = &APPLICATION_T2
+    .t2Task = &APPLICATION_T2,
+
+    .commandSGI = -1,
+    .urgentCommandSGI = -1,
+    .commandTask = &APPLICATION_Commands,
+    .urgentCommandTask = &APPLICATION_UrgentCommands
 };
 
 static uint8_t f_packetBuffer[0x1000];
@@ -46,6 +53,9 @@ static void Execute(void) {
         VARIANT_ReadChan0(f_packetBuffer, sizeof(f_packetBuffer), &HandleInitialPacket, 0);
     }
     
+    VARIANT_CommandChannels(false, &f_schedulerConfig.commandSGI);
+    VARIANT_CommandChannels(true, &f_schedulerConfig.urgentCommandSGI);
+    
     xil_printf("Starting scheduling\r\n");
     
     SCHEDULER_Init(&f_schedulerConfig);
@@ -10,6 +10,8 @@ static void TimerT0Interrupt(void* userData);
 
 static void T1Interrupt(void* userData);
 static void T2Interrupt(void* userData);
+static void CommandInterrupt(void* userData);
+static void UrgentCommandInterrupt(void* userData);
 
 static XTtcPs f_timerT0;
 static uint32_t f_t1Multiplier = 4;
@@ -19,6 +21,13 @@ static uint32_t f_t2Multiplier = 16;
 static void(*f_t0Task)(void) = 0;
 static void(*f_t1Task)(void) = 0;
 static void(*f_t2Task)(void) = 0;
+static bool(*f_commandTask)(void) = 0;
+static bool(*f_urgentCommandTask)(void) = 0;
+
+static int f_commandSGI = -1;
+static int f_urgentCommandSGI = -1;
+static volatile bool f_commandsLeft = false;
+static volatile bool f_urgentCommandsLeft = false;
 
 
 static void ConfigureTTCTimer(
@@ -103,6 +112,27 @@ static void ConfigureScuTimer(uint32_t frequencyHz,
     XScuTimer_EnableInterrupt(&f_scuTimer);
 }
 
+static void ConfigureCommandSGI(int sgi,
+                                InterruptPriority_t interruptPriority,
+                                void (*interruptHandler)(void*))
+{
+    InterruptNumber_t interruptId = (InterruptNumber_t)sgi;
+
+    INTERRUPT_RegisterHandler(interruptId, interruptHandler, 0);
+
+    INTERRUPT_SetPriorityAndTriggerType(
+                interruptId,
+                interruptPriority,
+                INTERRUPT_TRIGGER_TYPE_HIGH);
+
+    INTERRUPT_Enable(interruptId);
+
+    /* Commands Linux sent before the handler was registered left the
+     * doorbell pending and it won't raise the SGI again until it is acked
+     */
+    INTERRUPT_TriggerLocalSGI(interruptId);
+}
+
 void SCHEDULER_Init(const SchedulerConfig_t* conf)
 {
     INTERRUPT_CriticalSection {
@@ -146,6 +176,19 @@ void SCHEDULER_Init(const SchedulerConfig_t* conf)
         
         INTERRUPT_Enable(INTERRUPT_SGI_T2);
         
+        f_commandTask = conf->commandTask;
+        f_urgentCommandTask = conf->urgentCommandTask;
+        f_commandSGI = conf->commandSGI;
+        f_urgentCommandSGI = conf->urgentCommandSGI;
+
+        if (conf->commandSGI >= 0) {
+            ConfigureCommandSGI(conf->commandSGI, INTERRUPT_PRIORITY_COMMAND, &CommandInterrupt);
+        }
+
+        if (conf->urgentCommandSGI >= 0) {
+            ConfigureCommandSGI(conf->urgentCommandSGI, INTERRUPT_PRIORITY_URGENT_COMMAND, &UrgentCommandInterrupt);
+        }
+        
         /*XTtcPs_ResetCounterValue(&f_timerT0);
         XTtcPs_Start(&f_timerT0);*/
     }
@@ -186,6 +229,17 @@ static void TimerT0Interrupt(void* userData)
         t2Counter = 0;
         INTERRUPT_TriggerLocalSGI(INTERRUPT_SGI_T2);
     }
+
+    /* Commands left by the budget of the last command interrupt */
+    if (f_commandsLeft) {
+        f_commandsLeft = false;
+        INTERRUPT_TriggerLocalSGI((InterruptNumber_t)f_commandSGI);
+    }
+
+    if (f_urgentCommandsLeft) {
+        f_urgentCommandsLeft = false;
+        INTERRUPT_TriggerLocalSGI((InterruptNumber_t)f_urgentCommandSGI);
+    }
 }
 
 static void T1Interrupt(void* userData)
@@ -201,3 +255,17 @@ static void T2Interrupt(void* userData)
     f_t2Task();
     Xil_DisableNestedInterrupts();
 }
+
+static void CommandInterrupt(void* userData)
+{
+    Xil_EnableNestedInterrupts();
+    f_commandsLeft = f_commandTask();
+    Xil_DisableNestedInterrupts();
+}
+
+static void UrgentCommandInterrupt(void* userData)
+{
+    Xil_EnableNestedInterrupts();
+    f_urgentCommandsLeft = f_urgentCommandTask();
+    Xil_DisableNestedInterrupts();
+}
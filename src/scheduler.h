@@ -1,6 +1,7 @@
 #ifndef WORKLOAD_SCHEDULER_H_
 #define WORKLOAD_SCHEDULER_H_
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct {
   uint32_t t0Frequency;
@@ -10,6 +11,18 @@ typedef struct {
   void(*t0Task)(void);
   void(*t1Task)(void);
   void(*t2Task)(void);
+
+  /* Software interrupts Linux raises on CPU1 after writing commands, -1 if
+   * not used. The urgent one runs above T1 and the other one below T2.
+   */
+  int commandSGI;
+  int urgentCommandSGI;
+
+  /* Return true if commands were left unread, the next T0 tick raises the
+   * interrupt again
+   */
+  bool(*commandTask)(void);
+  bool(*urgentCommandTask)(void);
 } SchedulerConfig_t;
 
 void SCHEDULER_Init(const SchedulerConfig_t* conf);
@@ -13,6 +13,33 @@ typedef void (*VARIANT_ReadCallback)(uint8_t* buf, uint32_t size, void* user);
 uint8_t* VARIANT_T0Shm(void);
 uint32_t VARIANT_T0ShmSize(void);
 
+struct IpcSnapshot_s;
+
+/* Latest-value channel of include/ipc_snapshot.h placed in the T0 shared
+ * memory, for payloads of payloadSize bytes. CPU1 is the writer and must
+ * IPC_SNAPSHOT_Init it. NULL if the variant has no T0 shared memory or it is
+ * too small.
+ */
+struct IpcSnapshot_s* VARIANT_T0Snapshot(uint32_t payloadSize);
+
+/* Interrupts CPU0 on channel 0 without writing a packet, e.g. when
+ * IPC_SNAPSHOT_EndWrite says CPU0 waits for the snapshot. Returns false if
+ * the variant can't do it or CPU0 hasn't handled the previous interrupt yet.
+ */
+bool VARIANT_NotifyChan0(void);
+
+/* Channels CPU0 interrupts CPU1 for after writing commands, bit N is channel
+ * N. urgent selects the urgent ones, which have their own software interrupt.
+ * *sgiOut is set to the software interrupt when the mask isn't 0.
+ * 0 if the variant doesn't interrupt CPU1.
+ */
+uint32_t VARIANT_CommandChannels(bool urgent, int* sgiOut);
+
+/* Acknowledges the interrupt of a channel of VARIANT_CommandChannels, call
+ * before reading its commands. Returns false if it wasn't pending.
+ */
+bool VARIANT_AckCommand(uint32_t channel);
+
 void VARIANT_ReadChan0(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user);
 void VARIANT_ReadChan1(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user);
 void VARIANT_ReadChan2(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user);
@@ -21,6 +48,44 @@ bool VARIANT_WriteChan0(const uint8_t* buffer, uint32_t size);
 bool VARIANT_WriteChan1(const uint8_t* buffer, uint32_t size);
 bool VARIANT_WriteChan2(const uint8_t* buffer, uint32_t size);
 
+/* Packet of a VARIANT_WriteBatchChanN call */
+typedef struct {
+    const uint8_t* data;
+    uint32_t size;
+} VARIANT_Packet;
+
+/* Maximum number of packets moved by a single VARIANT_WriteBatchChanN call */
+#define VARIANT_MAX_BATCH 16
+
+/* Call cb for every pending packet until maxPackets have been read or
+ * maxMicroseconds have passed (0 is no time limit). If buffer is NULL the
+ * packet isn't copied and is only valid until cb returns.
+ * Return the number of packets read.
+ */
+uint32_t VARIANT_ReadBatchChan0(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds);
+uint32_t VARIANT_ReadBatchChan1(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds);
+uint32_t VARIANT_ReadBatchChan2(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds);
+
+/* Write packets in order until one doesn't fit. ipc_tunnel publishes them
+ * together and interrupts CPU0 at most once.
+ * Return the number of packets written.
+ */
+uint32_t VARIANT_WriteBatchChan0(const VARIANT_Packet* packets, uint32_t count);
+uint32_t VARIANT_WriteBatchChan1(const VARIANT_Packet* packets, uint32_t count);
+uint32_t VARIANT_WriteBatchChan2(const VARIANT_Packet* packets, uint32_t count);
+
+/* Zero-copy write. Reserve returns space for a packet of size bytes in the
+ * channel or NULL if it is full, Commit sends it. Nothing else may be written
+ * to the channel in between. OpenAMP copies the packet in Commit.
+ */
+uint8_t* VARIANT_ReserveChan0(uint32_t size);
+uint8_t* VARIANT_ReserveChan1(uint32_t size);
+uint8_t* VARIANT_ReserveChan2(uint32_t size);
+
+bool VARIANT_CommitChan0(void);
+bool VARIANT_CommitChan1(void);
+bool VARIANT_CommitChan2(void);
+
 uint32_t VARIANT_PacketSizeChan0(void);
 uint32_t VARIANT_PacketSizeChan1(void);
 uint32_t VARIANT_PacketSizeChan2(void);
@@ -5,6 +5,11 @@
 #include <xil_mmu.h>
 #include <xil_printf.h>
 #include <xscugic.h>
+#include <xil_exception.h>
+#include <xpseudo_asm.h>
+#include <xtime_l.h>
+
+#include "ipc_copy.h"
 
 #if IPC_TUNNEL_CACHED
     #define USE_ATOMIC
@@ -17,7 +22,10 @@
 #define ATOMIC_WRITE(ptr, val) atomic_store_explicit((ptr), (val), memory_order_release)
 
 #define MEMORY_BARRIER()
+#define STORE_LOAD_BARRIER() atomic_thread_fence(memory_order_seq_cst)
+#define SEQUENCE_BARRIER() atomic_thread_fence(memory_order_seq_cst)
 #define PACKET_SIZE_ALIGNMENT 32u
+#define COPY_PACKET(dst, src, size) IPC_COPY_Cached((dst), (src), (size))
 
 #else
 #define ATOMIC_UINT32 uint32_t
@@ -25,83 +33,356 @@
 #define ATOMIC_WRITE(ptr, val) (*(ptr) = (val))
 
 #define MEMORY_BARRIER() dsb()
+#define STORE_LOAD_BARRIER() dsb()
+#define SEQUENCE_BARRIER() dsb()
 #define PACKET_SIZE_ALIGNMENT 8u
+/* Rings are normal non-cacheable memory, see IPC_TUNNEL_TLB_ATTRIBUTES in variant.c */
+#define COPY_PACKET(dst, src, size) IPC_COPY_WriteCombining((dst), (src), (size))
+#include <xil_cache.h>
 #endif
 
+/* Both sides stamp these into their own half of the control header.
+ * A side refuses to touch the rings until the other side has stamped
+ * a matching layout.
+ */
+#define IPC_TUNNEL_MAGIC 0x49504354u  /* "IPCT" */
+#define IPC_TUNNEL_LAYOUT_VERSION 7u
+
+/* Layout v7
+ *
+ * Indices are free running 32 bit packet counters. Slot of an index is
+ * index & (bufferedPacketCount - 1) so the counts must be powers of two.
+ * Ring is empty when write == read and full when write - read == count,
+ * so every slot is usable.
+ *
+ * In the stream ring mode indices are byte counters. Records are a packet
+ * header and the payload aligned to STREAM_RECORD_ALIGNMENT bytes. A record
+ * never wraps: the end of the ring is filled with a padding record instead.
+ *
+ * CPU0 is only notified when cpu1_write_index moves past
+ * cpu0_read_event_index, see NeedsNotify.
+ *
+ * Each side only writes its own cache line.
+ */
 typedef struct IpcTunnelControlHeader_s
 {
     volatile ATOMIC_UINT32 cpu0_write_index;
     volatile ATOMIC_UINT32 cpu0_read_index;
+    volatile ATOMIC_UINT32 cpu0_magic;
+    volatile ATOMIC_UINT32 cpu0_version;
+    volatile ATOMIC_UINT32 cpu0_read_event_index;
+    volatile ATOMIC_UINT32 cpu0_send_stream_ring_size;
+    volatile ATOMIC_UINT32 cpu0_receive_stream_ring_size;
 
-    uint32_t _padding1[6];
+    uint32_t _padding1[1];
 
     volatile ATOMIC_UINT32 cpu1_write_index;
     volatile ATOMIC_UINT32 cpu1_read_index;
-
-    uint32_t _padding2[6];
+    volatile ATOMIC_UINT32 cpu1_magic;
+    volatile ATOMIC_UINT32 cpu1_version;
+    volatile ATOMIC_UINT32 cpu1_notify_sent;
+    volatile ATOMIC_UINT32 cpu1_notify_suppressed;
+    volatile ATOMIC_UINT32 cpu1_send_stream_ring_size;
+    volatile ATOMIC_UINT32 cpu1_receive_stream_ring_size;
 } ControlHeader_t;
 
 
+/* Doorbell shared by all tunnels, same as struct Doorbell in the kernel module.
+ *
+ * Bits that differ between cpu1_raised and cpu0_acked are pending. CPU1
+ * toggles the bit of a tunnel only when it isn't already pending, so CPU0
+ * gets one interrupt for all tunnels that became ready before it ran.
+ *
+ * cpu0_raised and cpu1_acked are the same in the other direction, for the
+ * tunnels CPU0 notifies.
+ *
+ * cpu1_raised_ticks is the global timer when the doorbell was last rung for
+ * a trace tunnel.
+ */
+typedef struct IpcTunnelDoorbell_s
+{
+    volatile ATOMIC_UINT32 cpu0_acked;
+    volatile ATOMIC_UINT32 cpu0_raised;
+    uint32_t _padding1[6];
+
+    volatile ATOMIC_UINT32 cpu1_raised;
+    volatile ATOMIC_UINT32 cpu1_acked;
+    volatile ATOMIC_UINT32 cpu1_raised_ticks;
+    uint32_t _padding2[5];
+} Doorbell_t;
+
+/* Geometry of one tunnel, same as struct TunnelDescriptor in the kernel module */
+typedef struct TunnelDescriptor_s
+{
+    uint32_t control_header_address;
+    uint32_t send_buffer_address;
+    uint32_t receive_buffer_address;
+    uint32_t shared_buffer_address;
+    uint32_t shared_buffer_size;
+
+    uint32_t send_max_packet_size;
+    uint32_t send_buffered_packet_count;
+    uint32_t receive_max_packet_size;
+    uint32_t receive_buffered_packet_count;
+
+    uint32_t send_stream_ring_size;
+    uint32_t receive_stream_ring_size;
+
+    uint32_t flags;
+
+    uint32_t _reserved[4];
+} TunnelDescriptor_t;
+
+#define DESCRIPTOR_CACHE_MAINTAINED 1u
+#define DESCRIPTOR_SEND_OVERWRITE 2u
+#define DESCRIPTOR_RECEIVE_OVERWRITE 4u
+#define DESCRIPTOR_NOTIFY_CPU1 8u
+#define DESCRIPTOR_CPU1_URGENT 16u
+#define DESCRIPTOR_TRACE 32u
+
+/* Written by CPU0 when the kernel module is loaded, magic is stamped last */
+typedef struct DescriptorBlock_s
+{
+    Doorbell_t doorbell;
+
+    volatile ATOMIC_UINT32 magic;
+    uint32_t version;
+    uint32_t tunnel_count;
+    uint32_t doorbell_sgi;
+    uint32_t cpu1_doorbell_sgi;
+    uint32_t cpu1_urgent_sgi;
+    uint32_t _padding[2];
+
+    TunnelDescriptor_t tunnels[0];
+} DescriptorBlock_t;
+
+#define DESCRIPTOR_MAGIC 0x49504344u  /* "IPCD" */
+#define DESCRIPTOR_VERSION 4u
+
 typedef struct PacketHeader_s {
     uint32_t packetSize;
-    uint32_t reserved_;
+    /* Write index of the packet in overwrite rings, commit time of the
+     * packet in trace rings (see StampCommit), unused otherwise
+     */
+    volatile uint32_t sequence;
     uint64_t data[0];
 } PacketHeader_t;
 
-static void MarkPacketAsRead(IpcTunnel_t* tunnel, uint32_t previousReadIndex);
+#define STREAM_RECORD_ALIGNMENT 8u
+#define STREAM_PADDING 0xFFFFFFFFu
+
+static bool CheckPeerLayout(IpcTunnel_t* tunnel);
+static uint32_t StreamRecordSize(uint32_t packetSize);
+static bool TryGetReadPacket(IpcTunnel_t* tunnel, PacketHeader_t** packetOut, uint32_t* nextReadIndexOut);
+static bool HasSendSpace(IpcTunnel_t* tunnel, uint32_t amount, uint32_t capacity);
+static bool TryGetWritePacket(IpcTunnel_t* tunnel, uint16_t size, PacketHeader_t** packetOut, uint32_t* nextWriteIndexOut);
+static void MarkPacketAsRead(IpcTunnel_t* tunnel, uint32_t nextReadIndex);
 static void SendPacket(IpcTunnel_t* tunnel, uint32_t nextWriteIndex);
-static uint32_t GetNextWriteIndex(IpcTunnel_t* tunnel, uint32_t writeIndex);
+static void PublishWriteIndex(IpcTunnel_t* tunnel, uint32_t oldWriteIndex);
+static void KickCpu0(IpcTunnel_t* tunnel);
+static bool RingDoorbell(IpcTunnel_t* tunnel);
+static bool NeedsNotify(uint32_t eventIndex, uint32_t newIndex, uint32_t oldIndex);
 static PacketHeader_t* GetWriteBufferPacket(IpcTunnel_t* tunnel, uint32_t index);
 static PacketHeader_t* GetReadBufferPacket(IpcTunnel_t* tunnel, uint32_t index);
+static void CleanSendRange(IpcTunnel_t* tunnel, const void* start, uint32_t size);
+static void InvalidateReceiveRange(IpcTunnel_t* tunnel, const void* start, uint32_t size);
+static bool IsOverwriteSlotValid(IpcTunnel_t* tunnel, PacketHeader_t* packet, uint32_t readIndex);
+static bool PacketOverwritten(IpcTunnel_t* tunnel, PacketHeader_t* packet, uint32_t nextReadIndex);
+static void StampCommit(IpcTunnel_t* tunnel, PacketHeader_t* packet);
 
-void IPC_TUNNEL_Init(IpcTunnel_t* tunnel, const IpcTunnelConfig_t* config)
+bool IPC_TUNNEL_ReadConfig(uintptr_t descriptorBlockAddress, int index, IpcTunnelConfig_t* configOut)
+{
+    DescriptorBlock_t* block = (DescriptorBlock_t*)descriptorBlockAddress;
+
+    if (ATOMIC_READ(&block->magic) != DESCRIPTOR_MAGIC) {
+        return false;
+    }
+
+    if (block->version != DESCRIPTOR_VERSION) {
+        xil_printf("IPC_TUNNEL 0x%x: descriptor version %u, expected %u\r\n",
+                   (unsigned)descriptorBlockAddress, block->version, DESCRIPTOR_VERSION);
+        return false;
+    }
+
+    if (index < 0 || (uint32_t)index >= block->tunnel_count) {
+        xil_printf("IPC_TUNNEL 0x%x: tunnel %d not configured\r\n", (unsigned)descriptorBlockAddress, index);
+        return false;
+    }
+
+    const TunnelDescriptor_t* desc = &block->tunnels[index];
+
+    configOut->controlBlockAddress = desc->control_header_address;
+    configOut->sendBufferAddress = desc->send_buffer_address;
+    configOut->receiveBufferAddress = desc->receive_buffer_address;
+
+    configOut->sendPacketMaxSize = desc->send_max_packet_size;
+    configOut->sendBufferedPacketCount = desc->send_buffered_packet_count;
+    configOut->receivePacketMaxSize = desc->receive_max_packet_size;
+    configOut->receiveBufferedPacketCount = desc->receive_buffered_packet_count;
+
+    configOut->sendStreamRingSize = desc->send_stream_ring_size;
+    configOut->receiveStreamRingSize = desc->receive_stream_ring_size;
+
+    configOut->doorbellAddress = descriptorBlockAddress;
+    configOut->doorbellChannel = index;
+    configOut->cpu0KickSGI = block->doorbell_sgi;
+
+    configOut->sharedMemoryAddress = desc->shared_buffer_address;
+    configOut->sharedMemorySize = desc->shared_buffer_size;
+
+    configOut->cacheMaintained = (desc->flags & DESCRIPTOR_CACHE_MAINTAINED) != 0;
+    configOut->sendOverwrite = (desc->flags & DESCRIPTOR_SEND_OVERWRITE) != 0;
+    configOut->receiveOverwrite = (desc->flags & DESCRIPTOR_RECEIVE_OVERWRITE) != 0;
+
+    configOut->cpu1Urgent = (desc->flags & DESCRIPTOR_CPU1_URGENT) != 0;
+    configOut->trace = (desc->flags & DESCRIPTOR_TRACE) != 0;
+    if (configOut->cpu1Urgent) {
+        configOut->cpu1NotifySGI = block->cpu1_urgent_sgi;
+    }
+    else if (desc->flags & DESCRIPTOR_NOTIFY_CPU1) {
+        configOut->cpu1NotifySGI = block->cpu1_doorbell_sgi;
+    }
+    else {
+        configOut->cpu1NotifySGI = -1;
+    }
+
+    return true;
+}
+
+bool IPC_TUNNEL_Init(IpcTunnel_t* tunnel, const IpcTunnelConfig_t* config)
 {
     tunnel->config = config;
 
     tunnel->control = (ControlHeader_t*)config->controlBlockAddress;
+    tunnel->doorbell = (Doorbell_t*)config->doorbellAddress;
+    /* Config is from the CPU0 point of view: CPU1 sends to the receive
+     * ring of CPU0 and receives from its send ring
+     */
     tunnel->receiveRingBuffer = (uint8_t*)config->sendBufferAddress;
     tunnel->sendRingBuffer = (uint8_t*)config->receiveBufferAddress;
+    tunnel->sendPacketMaxSize = config->receivePacketMaxSize;
+    tunnel->receivePacketMaxSize = config->sendPacketMaxSize;
+    tunnel->sendBufferedPacketCount = config->receiveBufferedPacketCount;
+    tunnel->receiveBufferedPacketCount = config->sendBufferedPacketCount;
+    tunnel->sendStreamRingSize = config->receiveStreamRingSize;
+    tunnel->receiveStreamRingSize = config->sendStreamRingSize;
+    tunnel->sendOverwrite = config->receiveOverwrite;
+    tunnel->receiveOverwrite = config->sendOverwrite;
 
     /* Actual size of the packet should include the header and alignment to 32 bytes (cacheline) */
-    tunnel->sendPacketSize = ((config->sendPacketMaxSize + sizeof(PacketHeader_t)) + (PACKET_SIZE_ALIGNMENT - 1u)) & ~(PACKET_SIZE_ALIGNMENT - 1u);
-    tunnel->receivePacketSize = ((config->receivePacketMaxSize + sizeof(PacketHeader_t)) + (PACKET_SIZE_ALIGNMENT - 1u)) & ~(PACKET_SIZE_ALIGNMENT - 1u);
-
-    tunnel->directWriteIndex = 0;
-
-    memset(tunnel->control, 0, sizeof(ControlHeader_t));
+    tunnel->sendPacketSize = ((tunnel->sendPacketMaxSize + sizeof(PacketHeader_t)) + (PACKET_SIZE_ALIGNMENT - 1u)) & ~(PACKET_SIZE_ALIGNMENT - 1u);
+    tunnel->receivePacketSize = ((tunnel->receivePacketMaxSize + sizeof(PacketHeader_t)) + (PACKET_SIZE_ALIGNMENT - 1u)) & ~(PACKET_SIZE_ALIGNMENT - 1u);
+
+    tunnel->writeIndex = 0;
+    tunnel->readIndex = 0;
+    tunnel->cachedCpu0ReadIndex = 0;
+    tunnel->cachedCpu0WriteIndex = 0;
+    tunnel->peerVerified = false;
+    tunnel->notifySent = 0;
+    tunnel->notifySuppressed = 0;
+    tunnel->overwritten = 0;
+
+    tunnel->directNextWriteIndex = 0;
+    tunnel->directNextReadIndex = 0;
+
+    if (   (tunnel->sendBufferedPacketCount & (tunnel->sendBufferedPacketCount - 1u)) != 0
+        || (tunnel->receiveBufferedPacketCount & (tunnel->receiveBufferedPacketCount - 1u)) != 0) {
+        xil_printf("IPC_TUNNEL_Init 0x%x: packet counts must be powers of two\r\n", (unsigned)config->controlBlockAddress);
+        return false;
+    }
 
-    uint32_t sendBufSize = config->sendBufferedPacketCount * tunnel->sendPacketSize;
-    uint32_t recvBufSize = config->receiveBufferedPacketCount * tunnel->receivePacketSize;
+    if (   (tunnel->sendStreamRingSize & (tunnel->sendStreamRingSize - 1u)) != 0
+        || (tunnel->receiveStreamRingSize & (tunnel->receiveStreamRingSize - 1u)) != 0) {
+        xil_printf("IPC_TUNNEL_Init 0x%x: stream ring sizes must be powers of two\r\n", (unsigned)config->controlBlockAddress);
+        return false;
+    }
 
-    xil_printf("IPC_TUNNEL_Init 0x%x\r\n", config->controlBlockAddress);
+    /* Reset the indices but keep the layout CPU0 may have already stamped */
+    ATOMIC_WRITE(&tunnel->control->cpu0_write_index, 0);
+    ATOMIC_WRITE(&tunnel->control->cpu0_read_index, 0);
+    ATOMIC_WRITE(&tunnel->control->cpu0_read_event_index, 0);
+    ATOMIC_WRITE(&tunnel->control->cpu1_write_index, 0);
+    ATOMIC_WRITE(&tunnel->control->cpu1_read_index, 0);
+    ATOMIC_WRITE(&tunnel->control->cpu1_notify_sent, 0);
+    ATOMIC_WRITE(&tunnel->control->cpu1_notify_suppressed, 0);
+    /* Stamped in the CPU0 naming the kernel module compares against */
+    ATOMIC_WRITE(&tunnel->control->cpu1_send_stream_ring_size, config->sendStreamRingSize);
+    ATOMIC_WRITE(&tunnel->control->cpu1_receive_stream_ring_size, config->receiveStreamRingSize);
+    ATOMIC_WRITE(&tunnel->control->cpu1_version, IPC_TUNNEL_LAYOUT_VERSION);
+    MEMORY_BARRIER();
+    ATOMIC_WRITE(&tunnel->control->cpu1_magic, IPC_TUNNEL_MAGIC);
+
+    /* Drop a doorbell left pending by the previous run. CPU0's doorbell
+     * is dropped too, the indices it was raised for were just reset.
+     */
+    uint32_t bit = 1u << config->doorbellChannel;
+    uint32_t cpsr = mfcpsr();
+    mtcpsr(cpsr | XIL_EXCEPTION_ALL);
+    uint32_t raised = ATOMIC_READ(&tunnel->doorbell->cpu1_raised);
+    ATOMIC_WRITE(&tunnel->doorbell->cpu1_raised, (raised & ~bit) | (ATOMIC_READ(&tunnel->doorbell->cpu0_acked) & bit));
+    uint32_t acked = ATOMIC_READ(&tunnel->doorbell->cpu1_acked);
+    ATOMIC_WRITE(&tunnel->doorbell->cpu1_acked, (acked & ~bit) | (ATOMIC_READ(&tunnel->doorbell->cpu0_raised) & bit));
+    mtcpsr(cpsr);
+
+    uint32_t sendBufSize = tunnel->sendStreamRingSize ? tunnel->sendStreamRingSize : tunnel->sendBufferedPacketCount * tunnel->sendPacketSize;
+    uint32_t recvBufSize = tunnel->receiveStreamRingSize ? tunnel->receiveStreamRingSize : tunnel->receiveBufferedPacketCount * tunnel->receivePacketSize;
+
+    /* Printed from the CPU1 point of view */
+    xil_printf("IPC_TUNNEL_Init 0x%x\r\n", (unsigned)config->controlBlockAddress);
     xil_printf("\tSend: buffer 0x%x  0x%x    %u packets, max size %u\r\n",
-               config->sendBufferAddress,
+               (unsigned)(uintptr_t)tunnel->sendRingBuffer,
                sendBufSize,
-               (uint32_t)config->sendBufferedPacketCount,
-               (uint32_t)config->sendPacketMaxSize);
+               (uint32_t)tunnel->sendBufferedPacketCount,
+               (uint32_t)tunnel->sendPacketMaxSize);
     xil_printf("\tRecv: buffer 0x%x  0x%x    %u packets, max size %u\r\n",
-               config->receiveBufferAddress,
+               (unsigned)(uintptr_t)tunnel->receiveRingBuffer,
                recvBufSize,
-               (uint32_t)config->receiveBufferedPacketCount,
-               (uint32_t)config->receivePacketMaxSize);
+               (uint32_t)tunnel->receiveBufferedPacketCount,
+               (uint32_t)tunnel->receivePacketMaxSize);
+    if (config->cacheMaintained) {
+        xil_printf("\tRings are cache-maintained\r\n");
+    }
+    if (tunnel->sendOverwrite || tunnel->receiveOverwrite) {
+        xil_printf("\tOverwrite: send %u, recv %u\r\n",
+                   (uint32_t)tunnel->sendOverwrite,
+                   (uint32_t)tunnel->receiveOverwrite);
+    }
+    if (config->cpu1NotifySGI >= 0) {
+        xil_printf("\tCPU0 notifies with SGI %d%s\r\n",
+                   config->cpu1NotifySGI,
+                   config->cpu1Urgent ? " (urgent)" : "");
+    }
+    if (config->trace) {
+        xil_printf("\tPackets to CPU0 are traced\r\n");
+    }
+
+    /* Wake up a CPU0 reader that may be waiting for the tunnel to come up */
+    MEMORY_BARRIER();
+    KickCpu0(tunnel);
+    return true;
 }
 
 uint16_t IPC_TUNNEL_Read(IpcTunnel_t* tunnel, uint8_t* buffer, uint16_t size)
 {
     uint32_t rx = 0;
+    uint32_t nextReadIndex;
+    PacketHeader_t* packet;
 
-    uint32_t readIndex = ATOMIC_READ(&tunnel->control->cpu1_read_index);
-    uint32_t cpu0WriteIndex = ATOMIC_READ(&tunnel->control->cpu0_write_index);
-
-    if (readIndex != cpu0WriteIndex) {
-        PacketHeader_t* packet = GetReadBufferPacket(tunnel, readIndex);
-
+    while (TryGetReadPacket(tunnel, &packet, &nextReadIndex)) {
         rx = packet->packetSize;
         if (size < rx) rx = size;
 
-        memcpy(buffer, packet->data, rx);
+        InvalidateReceiveRange(tunnel, packet->data, rx);
+        COPY_PACKET(buffer, packet->data, rx);
 
-        MarkPacketAsRead(tunnel, readIndex);
+        if (!PacketOverwritten(tunnel, packet, nextReadIndex)) {
+            MarkPacketAsRead(tunnel, nextReadIndex);
+            return rx;
+        }
+
+        /* Torn copy, try the next packet */
+        tunnel->readIndex = nextReadIndex;
+        rx = 0;
     }
 
     return rx;
@@ -109,26 +390,26 @@ uint16_t IPC_TUNNEL_Read(IpcTunnel_t* tunnel, uint8_t* buffer, uint16_t size)
 
 bool IPC_TUNNEL_Write(IpcTunnel_t* tunnel, const uint8_t* buffer, uint16_t size)
 {
+    uint32_t nextWriteIndex;
+    PacketHeader_t* packet;
+
     if (size == 0)
     {
         return FALSE;
     }
 
-    if (size > tunnel->config->sendPacketMaxSize)
+    if (size > tunnel->sendPacketMaxSize)
     {
         /* Packet doesn't fit in the ring buffer */
         return FALSE;
     }
 
-    uint32_t writeIndex = ATOMIC_READ(&tunnel->control->cpu1_write_index);
-    uint32_t cpu0ReadIndex = ATOMIC_READ(&tunnel->control->cpu0_read_index);
-    uint32_t nextWriteIndex = GetNextWriteIndex(tunnel, writeIndex);
-
-    if (nextWriteIndex != cpu0ReadIndex)
+    if (TryGetWritePacket(tunnel, size, &packet, &nextWriteIndex))
     {
-        PacketHeader_t* packet = GetWriteBufferPacket(tunnel, writeIndex);
         packet->packetSize = size;
-        memcpy(packet->data, buffer, size);
+        COPY_PACKET(packet->data, buffer, size);
+        StampCommit(tunnel, packet);
+        CleanSendRange(tunnel, packet, sizeof(PacketHeader_t) + size);
 
         SendPacket(tunnel, nextWriteIndex);
         return TRUE;
@@ -140,26 +421,120 @@ bool IPC_TUNNEL_Write(IpcTunnel_t* tunnel, const uint8_t* buffer, uint16_t size)
     return FALSE;
 }
 
+uint32_t IPC_TUNNEL_ReadBatch(IpcTunnel_t* tunnel, uint8_t* buffer, uint16_t size, IpcTunnelReadCallback_t cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds)
+{
+    uint32_t count = 0;
+    uint32_t startReadIndex = tunnel->readIndex;
+    uint32_t nextReadIndex;
+    PacketHeader_t* packet;
+    XTime start;
+    XTime now;
+    XTime budget = (XTime)maxMicroseconds * (COUNTS_PER_SECOND / 1000000u);
+
+    XTime_GetTime(&start);
+
+    while (count < maxPackets && TryGetReadPacket(tunnel, &packet, &nextReadIndex)) {
+        uint32_t rx = packet->packetSize;
+        uint8_t* data = buffer;
+
+        if (buffer) {
+            if (size < rx) rx = size;
+            InvalidateReceiveRange(tunnel, packet->data, rx);
+            COPY_PACKET(buffer, packet->data, rx);
+        }
+        else {
+            if (rx > tunnel->receivePacketMaxSize) rx = tunnel->receivePacketMaxSize;
+            InvalidateReceiveRange(tunnel, packet->data, rx);
+            data = (uint8_t*)packet->data;
+        }
+
+        /* Slot can be reused by CPU0 only after the batch is published */
+        tunnel->readIndex = nextReadIndex;
+
+        if (buffer && PacketOverwritten(tunnel, packet, nextReadIndex)) {
+            /* Torn copy, skipped */
+            continue;
+        }
+
+        ++count;
+
+        cb(data, rx, user);
+
+        /* In place packets of an overwrite ring can only be checked
+         * afterwards, they are counted but already delivered
+         */
+        if (!buffer) {
+            PacketOverwritten(tunnel, packet, nextReadIndex);
+        }
+
+        if (maxMicroseconds) {
+            XTime_GetTime(&now);
+            if (now - start >= budget) {
+                break;
+            }
+        }
+    }
+
+    if (tunnel->readIndex != startReadIndex) {
+        MarkPacketAsRead(tunnel, tunnel->readIndex);
+    }
+
+    return count;
+}
+
+uint32_t IPC_TUNNEL_WriteBatch(IpcTunnel_t* tunnel, const IpcTunnelPacket_t* packets, uint32_t count)
+{
+    uint32_t written = 0;
+    uint32_t startWriteIndex = tunnel->writeIndex;
+    uint32_t nextWriteIndex;
+    PacketHeader_t* packet;
+
+    while (written < count) {
+        uint16_t size = packets[written].size;
+
+        if (size == 0 || size > tunnel->sendPacketMaxSize) {
+            break;
+        }
+
+        /* May publish a padding record together with the packets before it */
+        if (!TryGetWritePacket(tunnel, size, &packet, &nextWriteIndex)) {
+            break;
+        }
+
+        packet->packetSize = size;
+        COPY_PACKET(packet->data, packets[written].data, size);
+        StampCommit(tunnel, packet);
+        CleanSendRange(tunnel, packet, sizeof(PacketHeader_t) + size);
+
+        tunnel->writeIndex = nextWriteIndex;
+        ++written;
+    }
+
+    if (written > 0) {
+        PublishWriteIndex(tunnel, startWriteIndex);
+    }
+
+    return written;
+}
+
 uint8_t* IPC_TUNNEL_BeginDirectWrite(IpcTunnel_t* tunnel, uint16_t size)
 {
+    uint32_t nextWriteIndex;
+    PacketHeader_t* packet;
+
     if (size == 0) {
         return 0;
     }
 
-    if (size > tunnel->config->sendPacketMaxSize) {
+    if (size > tunnel->sendPacketMaxSize) {
         /* Packet doesn't fit in the ring buffer */
         return 0;
     }
 
-    uint32_t writeIndex = ATOMIC_READ(&tunnel->control->cpu1_write_index);
-    uint32_t nextWriteIndex = GetNextWriteIndex(tunnel, writeIndex);
-    uint32_t cpu0ReadIndex = ATOMIC_READ(&tunnel->control->cpu0_read_index);
-
-    if (nextWriteIndex != cpu0ReadIndex) {
-        PacketHeader_t* packet = GetWriteBufferPacket(tunnel, writeIndex);
+    if (TryGetWritePacket(tunnel, size, &packet, &nextWriteIndex)) {
         packet->packetSize = size;
 
-        tunnel->directWriteIndex = nextWriteIndex;
+        tunnel->directNextWriteIndex = nextWriteIndex;
 
         return (uint8_t*)packet->data;
     }
@@ -171,31 +546,80 @@ uint8_t* IPC_TUNNEL_BeginDirectWrite(IpcTunnel_t* tunnel, uint16_t size)
 
 void IPC_TUNNEL_EndDirectWrite(IpcTunnel_t* tunnel)
 {
-    SendPacket(tunnel, tunnel->directWriteIndex);
+    if (tunnel->config->cacheMaintained || tunnel->config->trace) {
+        PacketHeader_t* packet = GetWriteBufferPacket(tunnel, tunnel->writeIndex);
+        StampCommit(tunnel, packet);
+        CleanSendRange(tunnel, packet, sizeof(PacketHeader_t) + packet->packetSize);
+    }
+
+    SendPacket(tunnel, tunnel->directNextWriteIndex);
 }
 
 uint16_t IPC_TUNNEL_BeginDirectRead(IpcTunnel_t* tunnel, const uint8_t** dataPtrOut)
 {
     uint32_t rx = 0;
+    uint32_t nextReadIndex;
+    PacketHeader_t* packet;
 
-    uint32_t readIndex = ATOMIC_READ(&tunnel->control->cpu1_read_index);
-    uint32_t cpu0WriteIndex = ATOMIC_READ(&tunnel->control->cpu0_write_index);
-
-    if (readIndex != cpu0WriteIndex) {
-        PacketHeader_t* packet = GetReadBufferPacket(tunnel, readIndex);
-
+    if (TryGetReadPacket(tunnel, &packet, &nextReadIndex)) {
         *dataPtrOut = (uint8_t*)packet->data;
         rx = packet->packetSize;
+        InvalidateReceiveRange(tunnel, packet->data, rx);
 
-        tunnel->directReadIndex = readIndex;
+        tunnel->directNextReadIndex = nextReadIndex;
     }
 
     return rx;
 }
 
-void IPC_TUNNEL_EndDirectRead(IpcTunnel_t* tunnel)
+bool IPC_TUNNEL_EndDirectRead(IpcTunnel_t* tunnel)
+{
+    PacketHeader_t* packet = GetReadBufferPacket(tunnel, tunnel->directNextReadIndex - 1u);
+    bool intact = !PacketOverwritten(tunnel, packet, tunnel->directNextReadIndex);
+
+    MarkPacketAsRead(tunnel, tunnel->directNextReadIndex);
+    return intact;
+}
+
+uint32_t IPC_TUNNEL_GetOverwrittenCount(IpcTunnel_t* tunnel)
+{
+    return tunnel->overwritten;
+}
+
+bool IPC_TUNNEL_Notify(IpcTunnel_t* tunnel)
+{
+    if (RingDoorbell(tunnel)) {
+        ATOMIC_WRITE(&tunnel->control->cpu1_notify_sent, ++tunnel->notifySent);
+        return true;
+    }
+
+    ATOMIC_WRITE(&tunnel->control->cpu1_notify_suppressed, ++tunnel->notifySuppressed);
+    return false;
+}
+
+bool IPC_TUNNEL_AckNotify(IpcTunnel_t* tunnel)
 {
-    MarkPacketAsRead(tunnel, tunnel->directReadIndex);
+    uint32_t bit = 1u << tunnel->config->doorbellChannel;
+    bool pending;
+
+    /* cpu1_acked is shared by all tunnels like cpu1_raised */
+    uint32_t cpsr = mfcpsr();
+    mtcpsr(cpsr | XIL_EXCEPTION_ALL);
+
+    uint32_t acked = ATOMIC_READ(&tunnel->doorbell->cpu1_acked);
+    pending = ((acked ^ ATOMIC_READ(&tunnel->doorbell->cpu0_raised)) & bit) != 0;
+    if (pending) {
+        ATOMIC_WRITE(&tunnel->doorbell->cpu1_acked, acked ^ bit);
+    }
+
+    mtcpsr(cpsr);
+
+    /* Ack before reading the write index. CPU0 publishes the index before
+     * it checks the doorbell, so either the ring read sees the packet or
+     * CPU0 sees the ack and raises the SGI again.
+     */
+    STORE_LOAD_BARRIER();
+    return pending;
 }
 
 uint8_t* IPC_TUNNEL_GetSharedMemoryPointer(IpcTunnel_t* tunnel)
@@ -208,43 +632,361 @@ uint32_t IPC_TUNNEL_GetSharedMemorySize(IpcTunnel_t* tunnel)
     return tunnel->config->sharedMemorySize;
 }
 
-static void MarkPacketAsRead(IpcTunnel_t* tunnel, uint32_t previousReadIndex)
+/* Rings are only used after CPU0 has stamped a matching layout */
+static bool CheckPeerLayout(IpcTunnel_t* tunnel)
+{
+    if (tunnel->peerVerified) {
+        return true;
+    }
+
+    uint32_t magic = ATOMIC_READ(&tunnel->control->cpu0_magic);
+    if (magic != IPC_TUNNEL_MAGIC) {
+        return false;
+    }
+
+    uint32_t version = ATOMIC_READ(&tunnel->control->cpu0_version);
+    if (version != IPC_TUNNEL_LAYOUT_VERSION) {
+        xil_printf("IPC_TUNNEL 0x%x: CPU0 layout version %u, expected %u\r\n",
+                   (unsigned)tunnel->config->controlBlockAddress,
+                   version,
+                   (uint32_t)IPC_TUNNEL_LAYOUT_VERSION);
+        return false;
+    }
+
+    if (   ATOMIC_READ(&tunnel->control->cpu0_send_stream_ring_size) != tunnel->config->sendStreamRingSize
+        || ATOMIC_READ(&tunnel->control->cpu0_receive_stream_ring_size) != tunnel->config->receiveStreamRingSize) {
+        xil_printf("IPC_TUNNEL 0x%x: CPU0 stream ring sizes 0x%x/0x%x, expected 0x%x/0x%x\r\n",
+                   (unsigned)tunnel->config->controlBlockAddress,
+                   ATOMIC_READ(&tunnel->control->cpu0_send_stream_ring_size),
+                   ATOMIC_READ(&tunnel->control->cpu0_receive_stream_ring_size),
+                   tunnel->config->sendStreamRingSize,
+                   tunnel->config->receiveStreamRingSize);
+        return false;
+    }
+
+    tunnel->peerVerified = true;
+    return true;
+}
+
+static uint32_t StreamRecordSize(uint32_t packetSize)
+{
+    return (sizeof(PacketHeader_t) + packetSize + (STREAM_RECORD_ALIGNMENT - 1u)) & ~(STREAM_RECORD_ALIGNMENT - 1u);
+}
+
+static bool TryGetReadPacket(IpcTunnel_t* tunnel, PacketHeader_t** packetOut, uint32_t* nextReadIndexOut)
+{
+    uint32_t readIndex = tunnel->readIndex;
+    uint32_t ringSize = tunnel->receiveStreamRingSize;
+    PacketHeader_t* packet;
+
+    for (;;) {
+        if (readIndex == tunnel->cachedCpu0WriteIndex) {
+            /* Looks empty, check if CPU0 has written something since last time */
+            if (!CheckPeerLayout(tunnel)) {
+                return false;
+            }
+
+            tunnel->cachedCpu0WriteIndex = ATOMIC_READ(&tunnel->control->cpu0_write_index);
+
+            if (readIndex == tunnel->cachedCpu0WriteIndex) {
+                return false;
+            }
+        }
+
+        if (tunnel->receiveOverwrite) {
+            uint32_t count = tunnel->receiveBufferedPacketCount;
+
+            if (tunnel->cachedCpu0WriteIndex - readIndex > count) {
+                /* Oldest packets have already been overwritten */
+                tunnel->overwritten += tunnel->cachedCpu0WriteIndex - count - readIndex;
+                readIndex = tunnel->cachedCpu0WriteIndex - count;
+                tunnel->readIndex = readIndex;
+            }
+
+            packet = GetReadBufferPacket(tunnel, readIndex);
+            if (!IsOverwriteSlotValid(tunnel, packet, readIndex)) {
+                /* CPU0 is writing to the slot right now */
+                ++tunnel->overwritten;
+                tunnel->readIndex = ++readIndex;
+                tunnel->cachedCpu0WriteIndex = ATOMIC_READ(&tunnel->control->cpu0_write_index);
+                continue;
+            }
+
+            *nextReadIndexOut = readIndex + 1;
+            break;
+        }
+
+        packet = GetReadBufferPacket(tunnel, readIndex);
+        InvalidateReceiveRange(tunnel, packet, sizeof(PacketHeader_t));
+
+        if (ringSize == 0) {
+            *nextReadIndexOut = readIndex + 1;
+            break;
+        }
+
+        if (packet->packetSize != STREAM_PADDING) {
+            *nextReadIndexOut = readIndex + StreamRecordSize(packet->packetSize);
+            break;
+        }
+
+        /* Skip the padding at the end of the ring. Published right away
+         * because CPU0 may be waiting for the space.
+         */
+        readIndex += ringSize - (readIndex & (ringSize - 1u));
+        MarkPacketAsRead(tunnel, readIndex);
+    }
+
+    *packetOut = packet;
+    return true;
+}
+
+/* True if amount slots or bytes can be written to the send ring */
+static bool HasSendSpace(IpcTunnel_t* tunnel, uint32_t amount, uint32_t capacity)
+{
+    if (tunnel->writeIndex - tunnel->cachedCpu0ReadIndex + amount > capacity) {
+        /* Looks full, check if CPU0 has consumed something since last time */
+        tunnel->cachedCpu0ReadIndex = ATOMIC_READ(&tunnel->control->cpu0_read_index);
+
+        if (tunnel->writeIndex - tunnel->cachedCpu0ReadIndex + amount > capacity) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool TryGetWritePacket(IpcTunnel_t* tunnel, uint16_t size, PacketHeader_t** packetOut, uint32_t* nextWriteIndexOut)
+{
+    uint32_t ringSize = tunnel->sendStreamRingSize;
+
+    if (!CheckPeerLayout(tunnel)) {
+        return false;
+    }
+
+    if (ringSize == 0) {
+        /* Send ring of CPU1 is the receive ring of CPU0 */
+        bool overwrite = tunnel->sendOverwrite;
+
+        /* Overwrite rings are never full, the oldest unread packet is given up */
+        if (!overwrite && !HasSendSpace(tunnel, 1, tunnel->sendBufferedPacketCount)) {
+            return false;
+        }
+
+        *packetOut = GetWriteBufferPacket(tunnel, tunnel->writeIndex);
+        *nextWriteIndexOut = tunnel->writeIndex + 1;
+
+        if (overwrite) {
+            /* Sequence before the payload, see IsOverwriteSlotValid */
+            (*packetOut)->sequence = tunnel->writeIndex;
+            CleanSendRange(tunnel, *packetOut, sizeof(PacketHeader_t));
+            SEQUENCE_BARRIER();
+        }
+        return true;
+    }
+
+    uint32_t recordSize = StreamRecordSize(size);
+    uint32_t tail = ringSize - (tunnel->writeIndex & (ringSize - 1u));
+
+    if (recordSize > tail) {
+        /* Record doesn't fit before the end of the ring. Pad the end and
+         * publish the padding so CPU0 can skip it even if the record
+         * itself doesn't fit yet.
+         */
+        if (!HasSendSpace(tunnel, tail, ringSize)) {
+            return false;
+        }
+
+        PacketHeader_t* padding = GetWriteBufferPacket(tunnel, tunnel->writeIndex);
+        padding->packetSize = STREAM_PADDING;
+        CleanSendRange(tunnel, padding, sizeof(PacketHeader_t));
+        SendPacket(tunnel, tunnel->writeIndex + tail);
+    }
+
+    if (!HasSendSpace(tunnel, recordSize, ringSize)) {
+        return false;
+    }
+
+    *packetOut = GetWriteBufferPacket(tunnel, tunnel->writeIndex);
+    *nextWriteIndexOut = tunnel->writeIndex + recordSize;
+    return true;
+}
+
+/* Rings of a cache-maintained tunnel are cacheable but not coherent with
+ * CPU0. Packets are flushed after they are written and invalidated before
+ * they are read, only the bytes in use. Nothing to do when the whole tunnel
+ * is cached or non-cacheable.
+ */
+static void CleanSendRange(IpcTunnel_t* tunnel, const void* start, uint32_t size)
+{
+#ifndef USE_ATOMIC
+    if (tunnel->config->cacheMaintained) {
+        Xil_DCacheFlushRange((uintptr_t)start, size);
+    }
+#else
+    (void)tunnel;
+    (void)start;
+    (void)size;
+#endif
+}
+
+static void InvalidateReceiveRange(IpcTunnel_t* tunnel, const void* start, uint32_t size)
 {
-    if (++previousReadIndex == tunnel->config->receiveBufferedPacketCount) {
-        previousReadIndex = 0;
+#ifndef USE_ATOMIC
+    if (tunnel->config->cacheMaintained) {
+        Xil_DCacheInvalidateRange((uintptr_t)start, size);
     }
+#else
+    (void)tunnel;
+    (void)start;
+    (void)size;
+#endif
+}
+
+/* Overwrite rings work like a seqlock per slot: the writer stores the write
+ * index of the packet in the header before it touches the payload, and the
+ * reader checks it before and after using the payload. A slot whose sequence
+ * isn't the read index has been reused by the writer.
+ */
+static bool IsOverwriteSlotValid(IpcTunnel_t* tunnel, PacketHeader_t* packet, uint32_t readIndex)
+{
+    SEQUENCE_BARRIER();
+    InvalidateReceiveRange(tunnel, packet, sizeof(PacketHeader_t));
+    return packet->sequence == readIndex;
+}
+
+/* Called after the payload has been used. Counts the packet as overwritten
+ * if CPU0 reused the slot in the meantime.
+ */
+static bool PacketOverwritten(IpcTunnel_t* tunnel, PacketHeader_t* packet, uint32_t nextReadIndex)
+{
+    if (!tunnel->receiveOverwrite || IsOverwriteSlotValid(tunnel, packet, nextReadIndex - 1u)) {
+        return false;
+    }
+
+    ++tunnel->overwritten;
+    return true;
+}
+
+/* Stamps the commit time of a packet sent to CPU0, after its payload has
+ * been written. Overwrite rings use the sequence field for the write index.
+ */
+static void StampCommit(IpcTunnel_t* tunnel, PacketHeader_t* packet)
+{
+    if (tunnel->config->trace && !tunnel->sendOverwrite) {
+        XTime now;
+        XTime_GetTime(&now);
+        packet->sequence = (uint32_t)now;
+    }
+}
+
+static void MarkPacketAsRead(IpcTunnel_t* tunnel, uint32_t nextReadIndex)
+{
+    tunnel->readIndex = nextReadIndex;
     MEMORY_BARRIER();
-    ATOMIC_WRITE(&tunnel->control->cpu1_read_index, previousReadIndex);
+    ATOMIC_WRITE(&tunnel->control->cpu1_read_index, tunnel->readIndex);
 }
 
 static void SendPacket(IpcTunnel_t* tunnel, uint32_t nextWriteIndex)
+{
+    uint32_t writeIndex = tunnel->writeIndex;
+
+    tunnel->writeIndex = nextWriteIndex;
+    PublishWriteIndex(tunnel, writeIndex);
+}
+
+/* Publishes tunnel->writeIndex and notifies CPU0 if it waits for any of the
+ * packets written since oldWriteIndex
+ */
+static void PublishWriteIndex(IpcTunnel_t* tunnel, uint32_t oldWriteIndex)
 {
     MEMORY_BARRIER();
-    ATOMIC_WRITE(&tunnel->control->cpu1_write_index, nextWriteIndex);
+    ATOMIC_WRITE(&tunnel->control->cpu1_write_index, tunnel->writeIndex);
     
-    MEMORY_BARRIER();
-    /* Trigger software interrupt on the other CPU */
-    uint32_t mask = ((1 << 16U) | tunnel->config->cpu0KickSGI) & (XSCUGIC_SFI_TRIG_CPU_MASK | XSCUGIC_SFI_TRIG_INTID_MASK);
-    *(volatile uint32_t*)(XPAR_PS7_SCUGIC_0_DIST_BASEADDR + XSCUGIC_SFI_TRIG_OFFSET) = mask;
+    /* Write index must be visible before the event index is read.
+     * Pairs with publish_read_event_index in the kernel module.
+     */
+    STORE_LOAD_BARRIER();
+    uint32_t eventIndex = ATOMIC_READ(&tunnel->control->cpu0_read_event_index);
+
+    if (NeedsNotify(eventIndex, tunnel->writeIndex, oldWriteIndex) && RingDoorbell(tunnel)) {
+        ATOMIC_WRITE(&tunnel->control->cpu1_notify_sent, ++tunnel->notifySent);
+    }
+    else {
+        ATOMIC_WRITE(&tunnel->control->cpu1_notify_suppressed, ++tunnel->notifySuppressed);
+    }
 }
 
-static uint32_t GetNextWriteIndex(IpcTunnel_t* tunnel, uint32_t writeIndex)
+/* True if eventIndex is in [oldIndex, newIndex), same as vring_need_event */
+static bool NeedsNotify(uint32_t eventIndex, uint32_t newIndex, uint32_t oldIndex)
 {
-    if (++writeIndex == tunnel->config->sendBufferedPacketCount) {
-        writeIndex = 0;
+    return (uint32_t)(newIndex - eventIndex - 1u) < (uint32_t)(newIndex - oldIndex);
+}
+
+/* Marks the tunnel pending in the doorbell and interrupts CPU0. Returns false
+ * if the tunnel was already pending; CPU0 hasn't run the handler yet and will
+ * see this write too.
+ */
+static bool RingDoorbell(IpcTunnel_t* tunnel)
+{
+    uint32_t bit = 1u << tunnel->config->doorbellChannel;
+    bool pending;
+
+    /* cpu1_raised is shared by all tunnels and they may be written from
+     * different interrupt levels
+     */
+    uint32_t cpsr = mfcpsr();
+    mtcpsr(cpsr | XIL_EXCEPTION_ALL);
+
+    uint32_t raised = ATOMIC_READ(&tunnel->doorbell->cpu1_raised);
+    pending = ((raised ^ ATOMIC_READ(&tunnel->doorbell->cpu0_acked)) & bit) != 0;
+    if (!pending) {
+        if (tunnel->config->trace) {
+            /* Before the bit, CPU0 reads it after the bit */
+            XTime now;
+            XTime_GetTime(&now);
+            ATOMIC_WRITE(&tunnel->doorbell->cpu1_raised_ticks, (uint32_t)now);
+            MEMORY_BARRIER();
+        }
+        ATOMIC_WRITE(&tunnel->doorbell->cpu1_raised, raised ^ bit);
+    }
+
+    mtcpsr(cpsr);
+
+    if (pending) {
+        return false;
     }
 
-    return writeIndex;
+    /* Doorbell must be visible before the interrupt is raised */
+    dsb();
+    KickCpu0(tunnel);
+    return true;
+}
+
+/* Trigger software interrupt on the other CPU */
+static void KickCpu0(IpcTunnel_t* tunnel)
+{
+    uint32_t mask = ((1 << 16U) | tunnel->config->cpu0KickSGI) & (XSCUGIC_SFI_TRIG_CPU_MASK | XSCUGIC_SFI_TRIG_INTID_MASK);
+    *(volatile uint32_t*)(XPAR_PS7_SCUGIC_0_DIST_BASEADDR + XSCUGIC_SFI_TRIG_OFFSET) = mask;
 }
 
 static PacketHeader_t* GetWriteBufferPacket(IpcTunnel_t* tunnel, uint32_t index)
 {
+    if (tunnel->sendStreamRingSize) {
+        return (PacketHeader_t*)(tunnel->sendRingBuffer + (index & (tunnel->sendStreamRingSize - 1u)));
+    }
+
+    uint32_t slot = index & (tunnel->sendBufferedPacketCount - 1u);
     return (PacketHeader_t*)(tunnel->sendRingBuffer
-                             + index * tunnel->sendPacketSize);
+                             + slot * tunnel->sendPacketSize);
 }
 
 static PacketHeader_t* GetReadBufferPacket(IpcTunnel_t* tunnel, uint32_t index)
 {
+    if (tunnel->receiveStreamRingSize) {
+        return (PacketHeader_t*)(tunnel->receiveRingBuffer + (index & (tunnel->receiveStreamRingSize - 1u)));
+    }
+
+    uint32_t slot = index & (tunnel->receiveBufferedPacketCount - 1u);
     return (PacketHeader_t*)(tunnel->receiveRingBuffer
-                             + index * tunnel->receivePacketSize);
+                             + slot * tunnel->receivePacketSize);
 }
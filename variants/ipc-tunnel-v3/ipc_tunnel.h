@@ -10,36 +10,120 @@ typedef enum {
     IPC_TUNNEL_CONFIG_2 = 2
 } IpcTunnelConfigInstance_t;
 
+/* Filled from the descriptor block with IPC_TUNNEL_ReadConfig. Naming is
+ * from the CPU0 point of view: send is CPU0 -> CPU1.
+ */
 typedef struct IpcTunnelConfig_s {
     uintptr_t controlBlockAddress;
     uintptr_t sendBufferAddress;
     uintptr_t receiveBufferAddress;
 
     uint16_t sendPacketMaxSize;
+    /* Packet counts must be powers of two */
     uint16_t sendBufferedPacketCount;
     uint16_t receivePacketMaxSize;
     uint16_t receiveBufferedPacketCount;
 
+    /* Non-zero selects the stream ring mode with a ring of this many bytes */
+    uint32_t sendStreamRingSize;
+    uint32_t receiveStreamRingSize;
+
+    /* Doorbell shared by all tunnels and the bit of this tunnel in it.
+     * All tunnels use the same cpu0KickSGI.
+     */
+    uintptr_t doorbellAddress;
+    int doorbellChannel;
+
     int cpu0KickSGI;
 
     uintptr_t sharedMemoryAddress;
     uintptr_t sharedMemorySize;
+
+    /* Rings are cacheable and kept consistent with cache maintenance.
+     * Only used without IPC_TUNNEL_CACHED.
+     */
+    bool cacheMaintained;
+
+    /* Slot ring keeps only the latest packets: the writer overwrites the
+     * oldest unread packet instead of waiting for space.
+     */
+    bool sendOverwrite;
+    bool receiveOverwrite;
+
+    /* SGI CPU0 raises on CPU1 after writing to the tunnel, -1 if it
+     * doesn't. cpu1Urgent tunnels share the urgent SGI.
+     */
+    int cpu1NotifySGI;
+    bool cpu1Urgent;
+
+    /* Packets sent to CPU0 and the doorbells rung for them are stamped with
+     * the global timer, see IPC_TUNNEL_IOC_READ_TRACED of the kernel module
+     */
+    bool trace;
 } IpcTunnelConfig_t;
 
 typedef struct IpcTunnel_s {
     const IpcTunnelConfig_t* config;
 
     struct IpcTunnelControlHeader_s* control;
+    struct IpcTunnelDoorbell_s* doorbell;
+
+    /* Geometry of the rings from the CPU1 point of view: send is CPU1 -> CPU0.
+     * Swapped from the config, which is from the CPU0 point of view.
+     */
     uint8_t* sendRingBuffer;
     uint8_t* receiveRingBuffer;
+    /* Slot sizes, header and payload aligned to PACKET_SIZE_ALIGNMENT */
     uint16_t sendPacketSize;
     uint16_t receivePacketSize;
+    uint16_t sendPacketMaxSize;
+    uint16_t receivePacketMaxSize;
+    uint16_t sendBufferedPacketCount;
+    uint16_t receiveBufferedPacketCount;
+
+    /* Ring sizes in bytes of stream rings, 0 for slot rings */
+    uint32_t sendStreamRingSize;
+    uint32_t receiveStreamRingSize;
+
+    bool sendOverwrite;
+    bool receiveOverwrite;
 
-    uint32_t directWriteIndex;
-    uint32_t directReadIndex;
+    /* Free running ring indices owned by CPU1 */
+    uint32_t writeIndex;
+    uint32_t readIndex;
+
+    /* Shadow copies of CPU0's indices. Refreshed only when the send ring
+     * looks full or the receive ring looks empty.
+     */
+    uint32_t cachedCpu0ReadIndex;
+    uint32_t cachedCpu0WriteIndex;
+
+    bool peerVerified;
+
+    /* CPU0 notifications sent and skipped because the reader was awake */
+    uint32_t notifySent;
+    uint32_t notifySuppressed;
+
+    /* Packets of an overwrite receive ring that CPU0 reused before they were read */
+    uint32_t overwritten;
+
+    uint32_t directNextWriteIndex;
+    uint32_t directNextReadIndex;
 } IpcTunnel_t;
 
-void IPC_TUNNEL_Init(
+/* Reads the geometry of tunnel index from the descriptor block published by
+ * the kernel module. Returns false until CPU0 has published the block or if
+ * the index doesn't exist.
+ */
+bool IPC_TUNNEL_ReadConfig(
+        uintptr_t descriptorBlockAddress,
+        int index,
+        IpcTunnelConfig_t* configOut);
+
+/* Returns false if the packet counts or stream ring sizes aren't powers of
+ * two. The tunnel isn't brought up then and CPU0 keeps waiting for it.
+ */
+bool IPC_TUNNEL_Init(
         IpcTunnel_t* tunnel,
         const IpcTunnelConfig_t* config);
 
@@ -47,13 +131,59 @@ uint16_t IPC_TUNNEL_Read(IpcTunnel_t* tunnel, uint8_t *buffer, uint16_t size);
 
 bool IPC_TUNNEL_Write(IpcTunnel_t* tunnel, const uint8_t* buffer, uint16_t size);
 
+typedef void (*IpcTunnelReadCallback_t)(uint8_t* buffer, uint32_t size, void* user);
+
+typedef struct IpcTunnelPacket_s {
+    const uint8_t* data;
+    uint16_t size;
+} IpcTunnelPacket_t;
+
+/* Copies received packets to buffer one at a time and calls cb for each until
+ * the ring is empty, maxPackets have been read or maxMicroseconds have passed
+ * (0 is no time limit). Read index is published once at the end.
+ * If buffer is NULL cb gets the packet in the ring, valid until cb returns.
+ * With overwrite rings only copies are checked for overwrites before cb.
+ * Returns the number of packets read.
+ */
+uint32_t IPC_TUNNEL_ReadBatch(
+        IpcTunnel_t* tunnel,
+        uint8_t* buffer,
+        uint16_t size,
+        IpcTunnelReadCallback_t cb,
+        void* user,
+        uint32_t maxPackets,
+        uint32_t maxMicroseconds);
+
+/* Writes packets in order until one doesn't fit and publishes them with a
+ * single index store, CPU0 is interrupted at most once.
+ * Returns the number of packets written.
+ */
+uint32_t IPC_TUNNEL_WriteBatch(IpcTunnel_t* tunnel, const IpcTunnelPacket_t* packets, uint32_t count);
+
 uint8_t* IPC_TUNNEL_BeginDirectWrite(IpcTunnel_t* tunnel, uint16_t size);
 
 void IPC_TUNNEL_EndDirectWrite(IpcTunnel_t* tunnel);
 
 uint16_t IPC_TUNNEL_BeginDirectRead(IpcTunnel_t* tunnel, const uint8_t** dataPtrOut);
 
-void IPC_TUNNEL_EndDirectRead(IpcTunnel_t* tunnel);
+/* Returns false if the packet was overwritten by CPU0 while it was being
+ * read, which can only happen with overwrite rings
+ */
+bool IPC_TUNNEL_EndDirectRead(IpcTunnel_t* tunnel);
+
+uint32_t IPC_TUNNEL_GetOverwrittenCount(IpcTunnel_t* tunnel);
+
+/* Rings the doorbell of the tunnel without writing a packet, for data CPU0
+ * waits for outside the rings. Returns false if the doorbell was still
+ * pending; CPU0 sees the data when it handles that one.
+ */
+bool IPC_TUNNEL_Notify(IpcTunnel_t* tunnel);
+
+/* Acknowledges the doorbell CPU0 rang on CPU1 for the tunnel, call before
+ * reading the tunnel so that packets written after it raise a new
+ * interrupt. Returns false if nothing was pending.
+ */
+bool IPC_TUNNEL_AckNotify(IpcTunnel_t* tunnel);
 
 uint8_t* IPC_TUNNEL_GetSharedMemoryPointer(IpcTunnel_t* tunnel);
 uint32_t IPC_TUNNEL_GetSharedMemorySize(IpcTunnel_t* tunnel);
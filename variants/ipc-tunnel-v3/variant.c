@@ -1,101 +1,26 @@
 #include "variant.h"
 #include "ipc_tunnel.h"
+#include "ipc_snapshot.h"
 #include <xil_mmu.h>
+#include <xil_printf.h>
 
-static const IpcTunnelConfig_t f_configs[] = {
-    {
-        .controlBlockAddress = 0xFFFF0000,
-        .sendBufferAddress = 0xFFFF0040,
-        .receiveBufferAddress = 0xFFFF1100,
-
-        .sendPacketMaxSize = 0x780,
-        .sendBufferedPacketCount = 2,
-        .receivePacketMaxSize = 0x780,
-        .receiveBufferedPacketCount = 2,
-
-        .cpu0KickSGI = 14,
-
-        .sharedMemoryAddress = 0xFFFFE000,
-        .sharedMemorySize = 0x1000
-    },
-    {
-        .controlBlockAddress = 0xFFFF3000,
-        .sendBufferAddress = 0xFFFF3040,
-        .receiveBufferAddress = 0xFFFF5100,
-
-        .sendPacketMaxSize = 0x780,
-        .sendBufferedPacketCount = 4,
-        .receivePacketMaxSize = 0x780,
-        .receiveBufferedPacketCount = 4,
-
-        .cpu0KickSGI = 13,
-
-        .sharedMemoryAddress = 0,
-        .sharedMemorySize = 0
-    },
-    {
-        .controlBlockAddress = 0xFFFF7200,
-        .sendBufferAddress = 0xFFFF7240,
-        .receiveBufferAddress = 0xFFFF9800,
-
-        .sendPacketMaxSize = 0x1200,
-        .sendBufferedPacketCount = 2,
-        .receivePacketMaxSize = 0x1200,
-        .receiveBufferedPacketCount = 2,
-
-        .cpu0KickSGI = 12,
-
-        .sharedMemoryAddress = 0xFFFFC000,
-        .sharedMemorySize = 0x2000
-    },
-
-    {
-        .controlBlockAddress = 0x3FFF0000,
-        .sendBufferAddress = 0x3FFF0040,
-        .receiveBufferAddress = 0x3FFF1100,
-
-        .sendPacketMaxSize = 0x780,
-        .sendBufferedPacketCount = 2,
-        .receivePacketMaxSize = 0x780,
-        .receiveBufferedPacketCount = 2,
-
-        .cpu0KickSGI = 11,
-
-        .sharedMemoryAddress = 0x3FFFE000,
-        .sharedMemorySize = 0x1000
-    },
-    {
-        .controlBlockAddress = 0x3FFF3000,
-        .sendBufferAddress = 0x3FFF3040,
-        .receiveBufferAddress = 0x3FFF5100,
-
-        .sendPacketMaxSize = 0x780,
-        .sendBufferedPacketCount = 4,
-        .receivePacketMaxSize = 0x780,
-        .receiveBufferedPacketCount = 4,
-
-        .cpu0KickSGI = 10,
-
-        .sharedMemoryAddress = 0,
-        .sharedMemorySize = 0
-    },
-    {
-        .controlBlockAddress = 0x3FFF7200,
-        .sendBufferAddress = 0x3FFF7240,
-        .receiveBufferAddress = 0x3FFF9800,
-
-        .sendPacketMaxSize = 0x1200,
-        .sendBufferedPacketCount = 2,
-        .receivePacketMaxSize = 0x1200,
-        .receiveBufferedPacketCount = 2,
-
-        .cpu0KickSGI = 9,
-
-        .sharedMemoryAddress = 0x3FFFC000,
-        .sharedMemorySize = 0x2000
-    }
-};
+/* Must match the reg of the ipc-tunnel device tree node */
+#ifndef IPC_TUNNEL_DESCRIPTOR_ADDRESS
+#define IPC_TUNNEL_DESCRIPTOR_ADDRESS 0xFFFFF000
+#endif
+
+#ifdef IPC_TUNNEL_CACHED
+#define IPC_TUNNEL_TLB_ATTRIBUTES NORM_WB_CACHE
+#define IPC_TUNNEL_MAINTAINED_TLB_ATTRIBUTES NORM_WB_CACHE
+#else
+#define IPC_TUNNEL_TLB_ATTRIBUTES 0x04de2 // S=b0 TEX=b100 AP=b11, Domain=b1111, C=b0, B=b0
+/* Rings of cache-maintained tunnels, not shareable so the SCU stays out of it */
+#define IPC_TUNNEL_MAINTAINED_TLB_ATTRIBUTES 0x05de6 // S=b0 TEX=b101 AP=b11, Domain=b1111, C=b1, B=b1
+#endif
+
+#define SECTION_SIZE 0x100000u
 
+static IpcTunnelConfig_t f_configs[3];
 static IpcTunnel_t f_tunnels[3];
 
 #ifdef IPC_TUNNEL_OCM
@@ -104,21 +29,83 @@ static IpcTunnel_t f_tunnels[3];
 #define IPC_TUNNEL_CONFIG_OFFSET 3
 #endif
 
+/* Sets the attributes of every 1 MB section that contains part of the region */
+static void SetRegionAttributes(uintptr_t address, uint32_t size, uint32_t attributes)
+{
+    uintptr_t section;
+
+    if (size == 0) {
+        return;
+    }
+
+    for (section = address & ~(SECTION_SIZE - 1u); section < address + size; section += SECTION_SIZE) {
+        Xil_SetTlbAttributes(section, attributes);
+        if (section + SECTION_SIZE < section) {
+            break;
+        }
+    }
+}
+
+/* Slot header and alignment are less than 64 bytes, only the 1 MB sections matter */
+static uint32_t SendRingSize(const IpcTunnelConfig_t* config)
+{
+    return config->sendStreamRingSize ? config->sendStreamRingSize : (uint32_t)config->sendBufferedPacketCount * (config->sendPacketMaxSize + 64u);
+}
+
+static uint32_t ReceiveRingSize(const IpcTunnelConfig_t* config)
+{
+    return config->receiveStreamRingSize ? config->receiveStreamRingSize : (uint32_t)config->receiveBufferedPacketCount * (config->receivePacketMaxSize + 64u);
+}
+
 bool VARIANT_Initialize(void* platform)
 {
-#ifdef IPC_TUNNEL_CACHED
-    Xil_SetTlbAttributes( 0xFFFF0000, NORM_WB_CACHE );
-    Xil_SetTlbAttributes( 0x3FFF0000, NORM_WB_CACHE );
-#else
-    Xil_SetTlbAttributes( 0xFFFF0000, 0x04de2 ); // S=b0 TEX=b100 AP=b11, Domain=b1111, C=b0, B=b0
-    Xil_SetTlbAttributes( 0x3FFF0000, 0x04de2 ); // S=b0 TEX=b100 AP=b11, Domain=b1111, C=b0, B=b0
-#endif
+    int i;
+    bool waiting = false;
+
     (void)platform;
-    
-    IPC_TUNNEL_Init(&f_tunnels[0], &f_configs[IPC_TUNNEL_CONFIG_OFFSET]);
-    IPC_TUNNEL_Init(&f_tunnels[1], &f_configs[IPC_TUNNEL_CONFIG_OFFSET + 1]);
-    IPC_TUNNEL_Init(&f_tunnels[2], &f_configs[IPC_TUNNEL_CONFIG_OFFSET + 2]);
-    
+
+    /* Descriptor block is in OCM */
+    SetRegionAttributes(IPC_TUNNEL_DESCRIPTOR_ADDRESS, 1, IPC_TUNNEL_TLB_ATTRIBUTES);
+
+    for (i = 0; i < 3; ++i) {
+        while (!IPC_TUNNEL_ReadConfig(IPC_TUNNEL_DESCRIPTOR_ADDRESS, IPC_TUNNEL_CONFIG_OFFSET + i, &f_configs[i])) {
+            if (!waiting) {
+                xil_printf("Waiting for the ipc_tunnel module to publish the tunnels\r\n");
+                waiting = true;
+            }
+        }
+    }
+
+    /* The kernel module gives the rings of cache-maintained tunnels sections
+     * of their own. If they share one with other tunnel memory anyway, the
+     * second loop makes it non-cacheable, where the maintenance is harmless.
+     */
+    for (i = 0; i < 3; ++i) {
+        const IpcTunnelConfig_t* config = &f_configs[i];
+
+        if (config->cacheMaintained) {
+            SetRegionAttributes(config->sendBufferAddress, SendRingSize(config), IPC_TUNNEL_MAINTAINED_TLB_ATTRIBUTES);
+            SetRegionAttributes(config->receiveBufferAddress, ReceiveRingSize(config), IPC_TUNNEL_MAINTAINED_TLB_ATTRIBUTES);
+        }
+    }
+
+    for (i = 0; i < 3; ++i) {
+        const IpcTunnelConfig_t* config = &f_configs[i];
+
+        SetRegionAttributes(config->controlBlockAddress, 64, IPC_TUNNEL_TLB_ATTRIBUTES);
+        if (!config->cacheMaintained) {
+            SetRegionAttributes(config->sendBufferAddress, SendRingSize(config), IPC_TUNNEL_TLB_ATTRIBUTES);
+            SetRegionAttributes(config->receiveBufferAddress, ReceiveRingSize(config), IPC_TUNNEL_TLB_ATTRIBUTES);
+        }
+        SetRegionAttributes(config->sharedMemoryAddress, config->sharedMemorySize, IPC_TUNNEL_TLB_ATTRIBUTES);
+    }
+
+    for (i = 0; i < 3; ++i) {
+        if (!IPC_TUNNEL_Init(&f_tunnels[i], &f_configs[i])) {
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -161,20 +148,114 @@ bool VARIANT_WriteChan2(const uint8_t* buffer, uint32_t size)
     return IPC_TUNNEL_Write(&f_tunnels[2], buffer, size);
 }
 
+static uint32_t ReadBatch(IpcTunnel_t* tunnel, uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds)
+{
+    if (size > 0xFFFFu) size = 0xFFFFu;
+    return IPC_TUNNEL_ReadBatch(tunnel, buffer, (uint16_t)size, cb, user, maxPackets, maxMicroseconds);
+}
+
+uint32_t VARIANT_ReadBatchChan0(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds)
+{
+    return ReadBatch(&f_tunnels[0], buffer, size, cb, user, maxPackets, maxMicroseconds);
+}
+
+uint32_t VARIANT_ReadBatchChan1(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds)
+{
+    return ReadBatch(&f_tunnels[1], buffer, size, cb, user, maxPackets, maxMicroseconds);
+}
+
+uint32_t VARIANT_ReadBatchChan2(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds)
+{
+    return ReadBatch(&f_tunnels[2], buffer, size, cb, user, maxPackets, maxMicroseconds);
+}
+
+static uint32_t WriteBatch(IpcTunnel_t* tunnel, const VARIANT_Packet* packets, uint32_t count)
+{
+    IpcTunnelPacket_t batch[VARIANT_MAX_BATCH];
+    uint32_t i;
+
+    if (count > VARIANT_MAX_BATCH) count = VARIANT_MAX_BATCH;
+
+    for (i = 0; i < count; ++i) {
+        /* Too large packets stop the batch in IPC_TUNNEL_WriteBatch */
+        batch[i].data = packets[i].data;
+        batch[i].size = packets[i].size > 0xFFFFu ? 0 : (uint16_t)packets[i].size;
+    }
+
+    return IPC_TUNNEL_WriteBatch(tunnel, batch, count);
+}
+
+uint32_t VARIANT_WriteBatchChan0(const VARIANT_Packet* packets, uint32_t count)
+{
+    return WriteBatch(&f_tunnels[0], packets, count);
+}
+
+uint32_t VARIANT_WriteBatchChan1(const VARIANT_Packet* packets, uint32_t count)
+{
+    return WriteBatch(&f_tunnels[1], packets, count);
+}
+
+uint32_t VARIANT_WriteBatchChan2(const VARIANT_Packet* packets, uint32_t count)
+{
+    return WriteBatch(&f_tunnels[2], packets, count);
+}
+
+static uint8_t* Reserve(IpcTunnel_t* tunnel, uint32_t size)
+{
+    if (size > 0xFFFFu) {
+        return 0;
+    }
+
+    return IPC_TUNNEL_BeginDirectWrite(tunnel, (uint16_t)size);
+}
+
+uint8_t* VARIANT_ReserveChan0(uint32_t size)
+{
+    return Reserve(&f_tunnels[0], size);
+}
+
+uint8_t* VARIANT_ReserveChan1(uint32_t size)
+{
+    return Reserve(&f_tunnels[1], size);
+}
+
+uint8_t* VARIANT_ReserveChan2(uint32_t size)
+{
+    return Reserve(&f_tunnels[2], size);
+}
+
+bool VARIANT_CommitChan0(void)
+{
+    IPC_TUNNEL_EndDirectWrite(&f_tunnels[0]);
+    return true;
+}
+
+bool VARIANT_CommitChan1(void)
+{
+    IPC_TUNNEL_EndDirectWrite(&f_tunnels[1]);
+    return true;
+}
+
+bool VARIANT_CommitChan2(void)
+{
+    IPC_TUNNEL_EndDirectWrite(&f_tunnels[2]);
+    return true;
+}
+
 
 uint32_t VARIANT_PacketSizeChan0(void)
 {
-    return f_configs[0].sendPacketMaxSize;
+    return f_tunnels[0].sendPacketMaxSize;
 }
 
 uint32_t VARIANT_PacketSizeChan1(void)
 {
-    return f_configs[1].sendPacketMaxSize;
+    return f_tunnels[1].sendPacketMaxSize;
 }
 
 uint32_t VARIANT_PacketSizeChan2(void)
 {
-    return f_configs[2].sendPacketMaxSize;
+    return f_tunnels[2].sendPacketMaxSize;
 }
 
 uint8_t* VARIANT_T0Shm()
@@ -187,6 +268,39 @@ uint32_t VARIANT_T0ShmSize()
     return f_tunnels[0].config->sharedMemorySize;
 }
 
+IpcSnapshot_t* VARIANT_T0Snapshot(uint32_t payloadSize)
+{
+    if (VARIANT_T0Shm() == 0 || VARIANT_T0ShmSize() < IPC_SNAPSHOT_Size(payloadSize)) {
+        return 0;
+    }
+
+    return (IpcSnapshot_t*)VARIANT_T0Shm();
+}
+
+bool VARIANT_NotifyChan0(void)
+{
+    return IPC_TUNNEL_Notify(&f_tunnels[0]);
+}
+
+uint32_t VARIANT_CommandChannels(bool urgent, int* sgiOut)
+{
+    uint32_t channels = 0;
+
+    for (uint32_t i = 0; i < 3; ++i) {
+        if (f_configs[i].cpu1NotifySGI >= 0 && f_configs[i].cpu1Urgent == urgent) {
+            channels |= 1u << i;
+            *sgiOut = f_configs[i].cpu1NotifySGI;
+        }
+    }
+
+    return channels;
+}
+
+bool VARIANT_AckCommand(uint32_t channel)
+{
+    return IPC_TUNNEL_AckNotify(&f_tunnels[channel]);
+}
+
 
 void VARIANT_Destruct(void) {
     
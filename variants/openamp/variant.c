@@ -1,5 +1,6 @@
 #include "variant.h"
 #include <openamp/rpmsg.h>
+#include <xtime_l.h>
 #include "platform_info.h"
 
 #define SERVICE_NAME0 "dippa-channel0"
@@ -26,6 +27,9 @@ typedef struct {
     volatile VARIANT_ReadCallback cb;
     void* user;
     BufferedPacket packets[PACKET_BUFFER_SIZE];
+
+    /* Packet between VARIANT_ReserveChanN and VARIANT_CommitChanN */
+    BufferedPacket reserved;
 } Channel;
 
 Channel f_chans[3] = {
@@ -134,6 +138,21 @@ bool VARIANT_Initialize(void* platform)
     return TRUE;
 }
 
+/* Removes the oldest buffered packet of the channel, call only if there is one */
+static void PopBufferedPacket(Channel* chan)
+{
+    ++chan->packetsBegin;
+    if (chan->packetsBegin == PACKET_BUFFER_SIZE) {
+        chan->packetsBegin = 0;
+    }
+    if (chan->packetsEnd == PACKET_BUFFER_SIZE) {
+        chan->packetsEnd = chan->packetsBegin - 1;
+        if (chan->packetsEnd < 0) {
+            chan->packetsEnd = PACKET_BUFFER_SIZE - 1;
+        }
+    }
+}
+
 static void ReadChannel(int channelId, uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user) {
     Channel* chan = &f_chans[channelId];
 
@@ -141,16 +160,7 @@ static void ReadChannel(int channelId, uint8_t* buffer, uint32_t size, VARIANT_R
         BufferedPacket* packet = &chan->packets[chan->packetsBegin];
         cb(packet->buf, packet->packetSize, user);
         
-        ++chan->packetsBegin;
-        if (chan->packetsBegin == PACKET_BUFFER_SIZE) {
-            chan->packetsBegin = 0;
-        }
-        if (chan->packetsEnd == PACKET_BUFFER_SIZE) {
-            chan->packetsEnd = chan->packetsBegin - 1;
-            if (chan->packetsEnd < 0) {
-                chan->packetsEnd = PACKET_BUFFER_SIZE - 1;
-            }
-        }
+        PopBufferedPacket(chan);
     }
     
     chan->cb = cb;
@@ -161,6 +171,37 @@ static void ReadChannel(int channelId, uint8_t* buffer, uint32_t size, VARIANT_R
     chan->cb = NULL;
 }
 
+/* Packets received by the poll are buffered so the limits apply to them too */
+static uint32_t ReadChannelBatch(int channelId, VARIANT_ReadCallback cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds)
+{
+    Channel* chan = &f_chans[channelId];
+    uint32_t count = 0;
+    XTime start;
+    XTime now;
+    XTime budget = (XTime)maxMicroseconds * (COUNTS_PER_SECOND / 1000000u);
+
+    XTime_GetTime(&start);
+
+    f_packetsBuffered = 0;
+    platform_poll_noblock(f_platform);
+
+    while (count < maxPackets && chan->packetsBegin != chan->packetsEnd) {
+        BufferedPacket* packet = &chan->packets[chan->packetsBegin];
+        cb(packet->buf, packet->packetSize, user);
+
+        PopBufferedPacket(chan);
+        ++count;
+
+        if (maxMicroseconds) {
+            XTime_GetTime(&now);
+            if (now - start >= budget) {
+                break;
+            }
+        }
+    }
+
+    return count;
+}
 
 void VARIANT_ReadChan0(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user)
 {
@@ -190,6 +231,90 @@ bool VARIANT_WriteChan2(const uint8_t* buffer, uint32_t size)
     return rpmsg_send(&f_chans[2].lept, buffer, size) >= 0;
 }
 
+uint32_t VARIANT_ReadBatchChan0(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds)
+{
+    return ReadChannelBatch(0, cb, user, maxPackets, maxMicroseconds);
+}
+uint32_t VARIANT_ReadBatchChan1(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds)
+{
+    return ReadChannelBatch(1, cb, user, maxPackets, maxMicroseconds);
+}
+uint32_t VARIANT_ReadBatchChan2(uint8_t* buffer, uint32_t size, VARIANT_ReadCallback cb, void* user, uint32_t maxPackets, uint32_t maxMicroseconds)
+{
+    return ReadChannelBatch(2, cb, user, maxPackets, maxMicroseconds);
+}
+
+/* rpmsg has no batching, every packet kicks the other side */
+static uint32_t WriteChannelBatch(int channelId, const VARIANT_Packet* packets, uint32_t count)
+{
+    uint32_t written = 0;
+
+    if (count > VARIANT_MAX_BATCH) count = VARIANT_MAX_BATCH;
+
+    while (written < count && rpmsg_send(&f_chans[channelId].lept, packets[written].data, packets[written].size) >= 0) {
+        ++written;
+    }
+
+    return written;
+}
+
+uint32_t VARIANT_WriteBatchChan0(const VARIANT_Packet* packets, uint32_t count)
+{
+    return WriteChannelBatch(0, packets, count);
+}
+uint32_t VARIANT_WriteBatchChan1(const VARIANT_Packet* packets, uint32_t count)
+{
+    return WriteChannelBatch(1, packets, count);
+}
+uint32_t VARIANT_WriteBatchChan2(const VARIANT_Packet* packets, uint32_t count)
+{
+    return WriteChannelBatch(2, packets, count);
+}
+/* rpmsg_send copies the packet, reserved space is a buffer of the channel */
+static uint8_t* ReserveChannel(int channelId, uint32_t size)
+{
+    Channel* chan = &f_chans[channelId];
+
+    if (size == 0 || size > RPMSG_MAX_DATA_SIZE) {
+        return 0;
+    }
+
+    chan->reserved.packetSize = size;
+    return chan->reserved.buf;
+}
+
+static bool CommitChannel(int channelId)
+{
+    Channel* chan = &f_chans[channelId];
+    return rpmsg_send(&chan->lept, chan->reserved.buf, chan->reserved.packetSize) >= 0;
+}
+
+uint8_t* VARIANT_ReserveChan0(uint32_t size)
+{
+    return ReserveChannel(0, size);
+}
+uint8_t* VARIANT_ReserveChan1(uint32_t size)
+{
+    return ReserveChannel(1, size);
+}
+uint8_t* VARIANT_ReserveChan2(uint32_t size)
+{
+    return ReserveChannel(2, size);
+}
+
+bool VARIANT_CommitChan0(void)
+{
+    return CommitChannel(0);
+}
+bool VARIANT_CommitChan1(void)
+{
+    return CommitChannel(1);
+}
+bool VARIANT_CommitChan2(void)
+{
+    return CommitChannel(2);
+}
+
 uint32_t VARIANT_PacketSizeChan0(void)
 {
     return RPMSG_MAX_DATA_SIZE;
@@ -221,3 +346,23 @@ uint32_t VARIANT_T0ShmSize()
 {
     return 0;
 }
+
+struct IpcSnapshot_s* VARIANT_T0Snapshot(uint32_t payloadSize)
+{
+    return 0;
+}
+
+bool VARIANT_NotifyChan0(void)
+{
+    return false;
+}
+
+uint32_t VARIANT_CommandChannels(bool urgent, int* sgiOut)
+{
+    return 0;
+}
+
+bool VARIANT_AckCommand(uint32_t channel)
+{
+    return false;
+}